@@ -0,0 +1,767 @@
+/*
+ * Energy Monitor: benchmark of the pulse processing
+ *
+ * Description:
+ *   Part of emond-bench (make bench), the daemon built with simulated
+ *   GPIO pins and with the BENCH_STAGE()/BENCH_COUNT() probes along
+ *   the processing of a pulse (-DBENCH).
+ *
+ *   Once the daemon is set up, a driver thread toggles the pulse
+ *   input pin at increasing rates, doubling from rate_min to rate_max
+ *   pulses per second, each rate for step_time seconds (at least
+ *   BENCH_MIN_PULSES pulses). The pulses have the configured
+ *   pulse_length, so they pass the validation as long as the daemon
+ *   keeps up. Pulses which the driver itself could not time within
+ *   pulse_tolerance (e.g. on a busy host) are reported as mistimed
+ *   and do not count as lost.
+ *
+ *   For each rate the latency from the edge ending a pulse to each
+ *   stage is collected in a histogram with log2 buckets (in us, see
+ *   hist.c), and
+ *   the pulses are counted along the processing to show where they
+ *   get lost. The outputs are served within the process: the
+ *   benchmark acts as LCD server and as EmonCMS host, and connects a
+ *   live stream client. The CPU time of the process (except the
+ *   benchmark servers) and the heap allocations (counted by
+ *   interposing malloc() of glibc) are given per pulse.
+ *
+ *   The results are written as JSON to stdout, then the daemon is
+ *   terminated.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "hal.h"
+#include "hist.h"
+#include "bench.h"
+
+/* Max number of rates (doubling) */
+#define BENCH_MAX_STEPS 24
+
+/* Min pulses per rate */
+#define BENCH_MIN_PULSES 10
+
+/* Time for the outputs to catch up after each rate (in ms), longer
+ * than the LCD refresh and the min WebAPI update rate */
+#define BENCH_SETTLE_MS 1500
+
+/* Max time to wait for the LCD client to connect (in ms) */
+#define BENCH_WARMUP_MS 5000
+
+/* Pause between the pulses, on top of the pulse length (in us) */
+#define BENCH_GAP_US 500
+
+static const char *stage_names[BENCH_STAGES] =
+   { "isr", "loop", "counters", "lcd", "sse", "webapi" };
+
+typedef struct
+{
+   unsigned int pin;
+   unsigned int pulse_length;
+   unsigned int pulse_tolerance;
+   unsigned int lcd_port;
+   unsigned int sse_port;
+   unsigned int api_port;
+   unsigned int rate_min;
+   unsigned int rate_max;
+   unsigned int step_time;
+} bench_conf_t;
+
+/* Latencies of a stage, with the min and mean on top of the histogram */
+typedef struct
+{
+   unsigned long count;
+   unsigned long long sum_us;
+   unsigned long min_us;
+   hist_t hist;
+} bench_hist_t;
+
+typedef struct
+{
+   unsigned int rate;
+   unsigned long pulses;
+   unsigned long mistimed;
+   unsigned long count[BENCH_COUNTS];
+   double cpu_us;
+   unsigned long allocs;
+   unsigned long long alloc_bytes;
+   bench_hist_t hist[BENCH_STAGES];
+} bench_step_t;
+
+static bench_conf_t conf;
+
+/* Protects the histograms and counts of the current rate */
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static bench_hist_t hist[BENCH_STAGES];
+static unsigned long counts[BENCH_COUNTS];
+static struct timespec newest_ts;
+static unsigned long newest_seq = 0;
+static unsigned long newest_counted = 0;
+static unsigned long stage_seq[BENCH_STAGES];
+
+/* Heap allocations of the process */
+static unsigned long allocs = 0;
+static unsigned long long alloc_bytes = 0;
+
+/* Local servers for the outputs */
+static int lcd_listen_fd = -1;
+static int api_listen_fd = -1;
+static int sse_fd = -1;
+static volatile int lcd_ready = 0;
+static clockid_t server_clock;
+
+static bench_step_t steps[BENCH_MAX_STEPS];
+
+
+/* Interposed allocation functions of glibc */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+   __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+   return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+   __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&alloc_bytes, nmemb*size, __ATOMIC_RELAXED);
+   return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+   __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+   return __libc_realloc(ptr, size);
+}
+
+
+/**********************************************************
+ * Internal function: ts_add_us()
+ *
+ * Description:
+ *           Add a number of us to a time value
+ *
+ * Returns:  -
+ *********************************************************/
+static void ts_add_us(struct timespec *ts, unsigned long long us)
+{
+   ts->tv_sec += us/1000000;
+   ts->tv_nsec += (us%1000000)*1000;
+   if (ts->tv_nsec >= 1000000000L)
+   {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000L;
+   }
+}
+
+/**********************************************************
+ * Internal function: ts_diff_us()
+ *
+ * Description:
+ *           Calculate the time between two time values
+ *
+ * Returns:  time difference (in us)
+ *********************************************************/
+static long long ts_diff_us(struct timespec now, struct timespec then)
+{
+   return (long long)(now.tv_sec - then.tv_sec)*1000000 +
+          (now.tv_nsec - then.tv_nsec)/1000;
+}
+
+/**********************************************************
+ * Internal function: cpu_us()
+ *
+ * Description:
+ *           CPU time used by the process, except for the
+ *           benchmark servers
+ *
+ * Returns:  CPU time (in us)
+ *********************************************************/
+static double cpu_us(void)
+{
+   struct timespec proc;
+   struct timespec server;
+
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &proc);
+   if (clock_gettime(server_clock, &server) < 0)
+      memset(&server, 0, sizeof(server));
+   return (double)ts_diff_us(proc, server);
+}
+
+/**********************************************************
+ * Internal function: bench_hist_add()
+ *
+ * Description:
+ *           Add a latency to the latencies of a stage.
+ *           Caller must hold bench_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void bench_hist_add(bench_hist_t *h, long long us)
+{
+   unsigned long v = (us > 0) ? (unsigned long)us : 0;
+
+   hist_add(&h->hist, v);
+   if (h->count == 0 || v < h->min_us)
+      h->min_us = v;
+   h->sum_us += v;
+   h->count++;
+}
+
+/**********************************************************
+ * Internal function: bench_listen()
+ *
+ * Description:
+ *           Open a listening socket on the loopback interface
+ *
+ * Returns:  socket on success, <0 otherwise
+ *********************************************************/
+static int bench_listen(unsigned int port)
+{
+   struct sockaddr_in addr;
+   int on = 1;
+   int fd;
+
+   if (port == 0)
+      return -1;
+   if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+      return -1;
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Benchmark: unable to listen on port %u: %s\n", port, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/**********************************************************
+ * Internal function: bench_connect()
+ *
+ * Description:
+ *           Connect to the live stream of the daemon
+ *
+ * Returns:  socket on success, <0 otherwise
+ *********************************************************/
+static int bench_connect(unsigned int port)
+{
+   static const char req[] = "GET /events HTTP/1.1\r\nHost: localhost\r\n\r\n";
+   struct sockaddr_in addr;
+   int fd;
+
+   if (port == 0)
+      return -1;
+   if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+      return -1;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+       write(fd, req, sizeof(req)-1) != sizeof(req)-1)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Benchmark: unable to connect to the live stream: %s\n", strerror(errno));
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/**********************************************************
+ * Internal function: bench_http()
+ *
+ * Description:
+ *           Answer a WebAPI request like EmonCMS
+ *
+ * Returns:  -
+ *********************************************************/
+static void bench_http(int fd)
+{
+   static const char resp[] =
+      "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n"
+      "Connection: close\r\n\r\nok";
+   struct timeval tv = { 1, 0 };
+   char req[2048];
+   size_t len = 0;
+   ssize_t n;
+
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   while (len < sizeof(req)-1 && (n = read(fd, req+len, sizeof(req)-1-len)) > 0)
+   {
+      len += n;
+      req[len] = 0;
+      if (strstr(req, "\r\n\r\n") != NULL)
+         break;
+   }
+   if (write(fd, resp, sizeof(resp)-1) < 0)
+      syslog(LOG_DAEMON | LOG_WARNING, "Benchmark: unable to answer WebAPI request\n");
+   close(fd);
+}
+
+/**********************************************************
+ * Internal function: bench_lcd()
+ *
+ * Description:
+ *           Answer the lines of the LCD client like LCDd
+ *
+ * Returns:  0 on success, <0 if the client disconnected
+ *********************************************************/
+static int bench_lcd(int fd)
+{
+   static const char greeting[] =
+      "connect LCDproc 0.5.9 protocol 0.3 lcd wid 20 hgt 4 cellwid 5 cellhgt 8\n";
+   static char line[256];
+   static size_t len = 0;
+   const char *reply;
+   char buf[1024];
+   ssize_t n;
+   ssize_t i;
+
+   if ((n = read(fd, buf, sizeof(buf))) <= 0)
+   {
+      lcd_ready = 0;
+      len = 0;
+      return -1;
+   }
+   for (i = 0; i < n; i++)
+   {
+      if (buf[i] != '\n')
+      {
+         if (len < sizeof(line)-1)
+            line[len++] = buf[i];
+         continue;
+      }
+      line[len] = 0;
+      len = 0;
+
+      reply = strncmp(line, "hello", 5) ? "success\n" : greeting;
+      if (write(fd, reply, strlen(reply)) < 0)
+         return -1;
+      if (reply == greeting)
+         lcd_ready = 1;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: bench_server()
+ *
+ * Description:
+ *           Serves the outputs of the daemon: LCD server,
+ *           EmonCMS host and live stream client
+ *
+ * Returns:  NULL
+ *********************************************************/
+static void *bench_server(void *arg)
+{
+   enum { FD_LCD_LISTEN, FD_LCD, FD_API_LISTEN, FD_SSE, FD_NUM };
+   struct pollfd pfd[FD_NUM];
+   char buf[4096];
+   int fd;
+   int i;
+
+   for (i = 0; i < FD_NUM; i++)
+   {
+      pfd[i].fd = -1;
+      pfd[i].events = POLLIN;
+   }
+   pfd[FD_LCD_LISTEN].fd = lcd_listen_fd;
+   pfd[FD_API_LISTEN].fd = api_listen_fd;
+   pfd[FD_SSE].fd = sse_fd;
+
+   for (;;)
+   {
+      if (poll(pfd, FD_NUM, -1) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+
+      if (pfd[FD_LCD_LISTEN].revents & POLLIN)
+      {
+         if ((fd = accept(lcd_listen_fd, NULL, NULL)) >= 0)
+         {
+            if (pfd[FD_LCD].fd >= 0)
+               close(pfd[FD_LCD].fd);
+            pfd[FD_LCD].fd = fd;
+         }
+      }
+      if (pfd[FD_LCD].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+         if (bench_lcd(pfd[FD_LCD].fd) < 0)
+         {
+            close(pfd[FD_LCD].fd);
+            pfd[FD_LCD].fd = -1;
+         }
+      }
+      if (pfd[FD_API_LISTEN].revents & POLLIN)
+      {
+         if ((fd = accept(api_listen_fd, NULL, NULL)) >= 0)
+            bench_http(fd);
+      }
+      if (pfd[FD_SSE].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+         /* The events are only drained, their latency is probed */
+         if (read(pfd[FD_SSE].fd, buf, sizeof(buf)) <= 0)
+         {
+            syslog(LOG_DAEMON | LOG_WARNING, "Benchmark: live stream closed\n");
+            close(pfd[FD_SSE].fd);
+            pfd[FD_SSE].fd = -1;
+         }
+      }
+   }
+   return NULL;
+}
+
+/**********************************************************
+ * Internal function: bench_step()
+ *
+ * Description:
+ *           Drive the pulses of one rate and collect the
+ *           results
+ *
+ * Returns:  0 on success, <0 if the rate cannot be driven
+ *********************************************************/
+static int bench_step(unsigned int rate, bench_step_t *step)
+{
+   unsigned long long period_us = 1000000ULL/rate;
+   unsigned long long hold_us = conf.pulse_length*1000ULL + BENCH_GAP_US;
+   unsigned long delta = (conf.pulse_length*conf.pulse_tolerance)/100;
+   unsigned long length;
+   struct timespec start;
+   struct timespec at;
+   struct timespec t0;
+   struct timespec t1;
+   unsigned long k;
+   double cpu;
+   unsigned long a;
+   unsigned long long b;
+
+   if (period_us < hold_us + BENCH_GAP_US)
+      return -1;
+
+   memset(step, 0, sizeof(*step));
+   step->rate = rate;
+   step->pulses = (unsigned long)rate*conf.step_time;
+   if (step->pulses < BENCH_MIN_PULSES)
+      step->pulses = BENCH_MIN_PULSES;
+
+   pthread_mutex_lock(&bench_lock);
+   memset(hist, 0, sizeof(hist));
+   memset(counts, 0, sizeof(counts));
+   newest_counted = 0;
+   pthread_mutex_unlock(&bench_lock);
+   cpu = cpu_us();
+   a = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+   b = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ts_add_us(&start, 1000);
+   for (k = 0; k < step->pulses; k++)
+   {
+      /* Pulse starts (low) */
+      at = start;
+      ts_add_us(&at, k*period_us);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+         ;
+      clock_gettime(CLOCK_MONOTONIC, &at);
+      hal_mock_set(conf.pin, 0);
+
+      /* Pulse ends (high), which counts it */
+      ts_add_us(&at, hold_us);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+         ;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      hal_mock_set(conf.pin, 1);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+
+      /* Length seen by the validation (in whole ms) */
+      length = (unsigned long)((ts_diff_us(t0, at) + hold_us)/1000);
+      if (length <= conf.pulse_length-delta || length >= conf.pulse_length+delta)
+         step->mistimed++;
+
+      pthread_mutex_lock(&bench_lock);
+      bench_hist_add(&hist[BENCH_ISR], ts_diff_us(t1, t0));
+      pthread_mutex_unlock(&bench_lock);
+   }
+
+   /* Let the outputs catch up */
+   usleep(BENCH_SETTLE_MS*1000);
+
+   step->cpu_us = cpu_us() - cpu;
+   step->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - a;
+   step->alloc_bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - b;
+   pthread_mutex_lock(&bench_lock);
+   memcpy(step->hist, hist, sizeof(hist));
+   memcpy(step->count, counts, sizeof(counts));
+   pthread_mutex_unlock(&bench_lock);
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: bench_report()
+ *
+ * Description:
+ *           Write the results as JSON
+ *
+ * Returns:  -
+ *********************************************************/
+static void bench_report(FILE *f, const bench_step_t *s, unsigned int n)
+{
+   const bench_hist_t *h;
+   char json[512];
+   unsigned long good;
+   unsigned long done;
+   unsigned int max_rate = 0;
+   int lossless = 1;
+   unsigned int i;
+   unsigned int j;
+
+   fprintf(f, "{\"pulse_length_ms\":%u,\"step_time_s\":%u,\"steps\":[\n",
+           conf.pulse_length, conf.step_time);
+   for (i = 0; i < n; i++)
+   {
+      good = s[i].pulses - s[i].mistimed;
+      done = s[i].count[BENCH_COUNTED] + s[i].count[BENCH_FILTERED];
+      fprintf(f, " {\"rate\":%u,\"edges_per_s\":%u,\"pulses\":%lu,\"mistimed\":%lu,\"valid\":%lu,"
+              "\"delivered\":%lu,\"counted\":%lu,\"filtered\":%lu,\"lost\":%lu,\"cpu_us_per_pulse\":%.1f,"
+              "\"allocs_per_pulse\":%.2f,\"alloc_bytes_per_pulse\":%.1f,\"latency_us\":{",
+              s[i].rate, 2*s[i].rate, s[i].pulses, s[i].mistimed, s[i].count[BENCH_VALID],
+              s[i].count[BENCH_DELIVERED], s[i].count[BENCH_COUNTED], s[i].count[BENCH_FILTERED],
+              (done < good) ? good - done : 0,
+              s[i].cpu_us/s[i].pulses, (double)s[i].allocs/s[i].pulses,
+              (double)s[i].alloc_bytes/s[i].pulses);
+      for (j = 0; j < BENCH_STAGES; j++)
+      {
+         h = &s[i].hist[j];
+         if (hist_json(json, sizeof(json), &h->hist) < 0)
+            snprintf(json, sizeof(json), "\"count\":%lu", h->count);
+         fprintf(f, "%s\n  \"%s\":{\"min\":%lu,\"mean\":%.1f,%s}",
+                 j ? "," : "", stage_names[j], h->min_us,
+                 h->count ? (double)h->sum_us/h->count : 0.0, json);
+      }
+      fprintf(f, "}}%s\n", (i+1 < n) ? "," : "");
+
+      /* Max rate before the first loss, pulses rejected by the filters
+       * (e.g. min_pulse_period) are not lost by the processing */
+      if (lossless && done >= good)
+         max_rate = s[i].rate;
+      else
+         lossless = 0;
+   }
+   fprintf(f, "],\"max_sustainable\":{\"pulses_per_s\":%u,\"edges_per_s\":%u}}\n", max_rate, 2*max_rate);
+   fflush(f);
+}
+
+/**********************************************************
+ * Internal function: bench_driver()
+ *
+ * Description:
+ *           Runs the benchmark and terminates the daemon
+ *
+ * Returns:  NULL
+ *********************************************************/
+static void *bench_driver(void *arg)
+{
+   unsigned int waited = 0;
+   unsigned int rate;
+   unsigned int n = 0;
+
+   /* The LCD client retries to connect */
+   while (lcd_listen_fd >= 0 && !lcd_ready && waited < BENCH_WARMUP_MS)
+   {
+      usleep(100000);
+      waited += 100;
+   }
+   if (lcd_listen_fd >= 0 && !lcd_ready)
+      syslog(LOG_DAEMON | LOG_WARNING, "Benchmark: LCD client not connected\n");
+
+   for (rate = conf.rate_min; rate <= conf.rate_max && n < BENCH_MAX_STEPS; rate *= 2)
+   {
+      if (bench_step(rate, &steps[n]) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Benchmark: %u pulses/s cannot be driven with pulse_length %u\n",
+                rate, conf.pulse_length);
+         break;
+      }
+      syslog(LOG_DAEMON | LOG_INFO, "Benchmark: %u pulses/s, %lu of %lu counted\n",
+             rate, steps[n].count[BENCH_COUNTED], steps[n].pulses);
+      n++;
+   }
+
+   bench_report(stdout, steps, n);
+   syslog(LOG_DAEMON | LOG_NOTICE, "Benchmark done\n");
+   kill(getpid(), SIGTERM);
+   return NULL;
+}
+
+/**********************************************************
+ * Internal function: bench_config_cb()
+ *
+ * Description:
+ *           Callback function for the name=value pairs of
+ *           the daemon configuration file
+ *
+ * Returns:  1 (all parameters are accepted)
+ *********************************************************/
+static int bench_config_cb(void *user, const char *section, const char *name, const char *value)
+{
+   bench_conf_t *bc = (bench_conf_t*)user;
+   const char *p;
+
+   #define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
+   if (MATCH("counter", "pulse_input_pin"))
+      bc->pin = atoi(value);
+   else if (MATCH("counter", "pulse_length"))
+      bc->pulse_length = atoi(value);
+   else if (MATCH("counter", "pulse_tolerance"))
+      bc->pulse_tolerance = atoi(value);
+   else if (MATCH("lcd", "lcdproc_port"))
+      bc->lcd_port = atoi(value);
+   else if (MATCH("sse", "sse_port"))
+      bc->sse_port = atoi(value);
+   else if (MATCH("webapi", "api_base_uri") && (p = strrchr(value, ':')) != NULL)
+      bc->api_port = atoi(p+1);
+   else if (MATCH("bench", "rate_min"))
+      bc->rate_min = atoi(value);
+   else if (MATCH("bench", "rate_max"))
+      bc->rate_max = atoi(value);
+   else if (MATCH("bench", "step_time"))
+      bc->step_time = atoi(value);
+   return 1;
+}
+
+
+/**********************************************************
+ * Public function: bench_start()
+ *
+ * Description:
+ *           Start the benchmark with the parameters of the
+ *           daemon configuration file. Needs the inputs and
+ *           outputs set up.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int bench_start(const char *conf_file)
+{
+   pthread_t server;
+   pthread_t driver;
+
+   memset(&conf, 0, sizeof(conf));
+   conf.rate_min = 1;
+   conf.rate_max = 64;
+   conf.step_time = 2;
+   conf.pulse_tolerance = 5;
+   conf_parse(conf_file, bench_config_cb, &conf);
+   if (conf.pin == 0 || conf.pulse_length == 0 || conf.rate_min == 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Benchmark needs pulse_input_pin, pulse_length and rate_min\n");
+      return -1;
+   }
+
+   lcd_listen_fd = bench_listen(conf.lcd_port);
+   api_listen_fd = bench_listen(conf.api_port);
+   sse_fd = bench_connect(conf.sse_port);
+
+   if (pthread_create(&server, NULL, bench_server, NULL) != 0 ||
+       pthread_getcpuclockid(server, &server_clock) != 0 ||
+       pthread_create(&driver, NULL, bench_driver, NULL) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to start the benchmark\n");
+      return -2;
+   }
+   pthread_detach(server);
+   pthread_detach(driver);
+
+   syslog(LOG_DAEMON | LOG_NOTICE, "Benchmark: GPIO %u, %u to %u pulses/s\n",
+          conf.pin, conf.rate_min, conf.rate_max);
+   return 0;
+}
+
+/**********************************************************
+ * Public function: bench_stage()
+ *
+ * Description:
+ *           A pulse stamped ts (CLOCK_REALTIME) reached a
+ *           stage. Outputs pass NULL for the newest pulse
+ *           which was booked to the counters, it is recorded
+ *           only once per stage.
+ *
+ * Returns:  -
+ *********************************************************/
+void bench_stage(int stage, const struct timespec *ts)
+{
+   struct timespec now;
+
+   if (stage < 0 || stage >= BENCH_STAGES)
+      return;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+   pthread_mutex_lock(&bench_lock);
+   if (ts == NULL)
+   {
+      if (stage_seq[stage] == newest_seq)
+      {
+         pthread_mutex_unlock(&bench_lock);
+         return;
+      }
+      stage_seq[stage] = newest_seq;
+      ts = &newest_ts;
+   }
+   else if (stage == BENCH_COUNTERS && counts[BENCH_COUNTED] != newest_counted)
+   {
+      /* Only pulses booked to the counters reach the outputs */
+      newest_counted = counts[BENCH_COUNTED];
+      newest_ts = *ts;
+      newest_seq++;
+   }
+   bench_hist_add(&hist[stage], ts_diff_us(now, *ts));
+   pthread_mutex_unlock(&bench_lock);
+}
+
+/**********************************************************
+ * Public function: bench_count()
+ *
+ * Description:
+ *           n pulses reached a point of the processing
+ *
+ * Returns:  -
+ *********************************************************/
+void bench_count(int count, unsigned long n)
+{
+   if (count < 0 || count >= BENCH_COUNTS)
+      return;
+
+   pthread_mutex_lock(&bench_lock);
+   counts[count] += n;
+   pthread_mutex_unlock(&bench_lock);
+}
@@ -0,0 +1,79 @@
+/*
+ * Energy Monitor: benchmark of the pulse processing
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <time.h>
+
+/* Stages of the processing of a pulse, timed from its edge */
+enum
+{
+   BENCH_ISR,        /* edge handled by the input */
+   BENCH_LOOP,       /* reading passed to the event loop */
+   BENCH_COUNTERS,   /* counters and consumers updated */
+   BENCH_LCD,        /* frame sent to the LCD server */
+   BENCH_SSE,        /* event written to the live clients */
+   BENCH_WEBAPI,     /* data sent to EmonCMS */
+   BENCH_STAGES
+};
+
+/* Pulses counted along the processing */
+enum
+{
+   BENCH_VALID,      /* passed the pulse validation */
+   BENCH_DELIVERED,  /* passed to the event loop */
+   BENCH_COUNTED,    /* booked to the energy counters */
+   BENCH_FILTERED,   /* rejected as glitch or above max_power */
+   BENCH_COUNTS
+};
+
+/* The probes are only compiled into the benchmark (-DBENCH) */
+#ifdef BENCH
+#define BENCH_STAGE(stage, ts)  bench_stage(stage, ts)
+#define BENCH_COUNT(count, n)   bench_count(count, n)
+#else
+#define BENCH_STAGE(stage, ts)  do { } while (0)
+#define BENCH_COUNT(count, n)   do { } while (0)
+#endif
+
+/**********************************************************
+ * Public function: bench_start()
+ *
+ * Description:
+ *           Start the benchmark with the parameters of the
+ *           daemon configuration file. Needs the inputs and
+ *           outputs set up.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int bench_start(const char *conf_file);
+
+/**********************************************************
+ * Public function: bench_stage()
+ *
+ * Description:
+ *           A pulse stamped ts (CLOCK_REALTIME) reached a
+ *           stage. Outputs pass NULL for the newest pulse
+ *           which was booked to the counters, it is recorded
+ *           only once per stage.
+ *
+ * Returns:  -
+ *********************************************************/
+void bench_stage(int stage, const struct timespec *ts);
+
+/**********************************************************
+ * Public function: bench_count()
+ *
+ * Description:
+ *           n pulses reached a point of the processing
+ *
+ * Returns:  -
+ *********************************************************/
+void bench_count(int count, unsigned long n);
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,246 @@
+/*
+ * Energy Monitor: maximum demand alarm
+ *
+ * Description:
+ *   The utility bills the peak of the average power over fixed demand
+ *   intervals (typically 15 min, aligned to the full hour). The energy
+ *   of the current interval is accumulated pulse by pulse and the
+ *   demand at the end of the interval is projected assuming that the
+ *   current power is drawn for the rest of the interval:
+ *
+ *     demand = (E_interval + P * t_remaining) / t_interval
+ *
+ *   An alarm is raised as soon as the projection reaches the limit and
+ *   cleared when it falls below the limit minus the hysteresis. Alarms
+ *   are logged, streamed as "alarm" event to the SSE clients and passed
+ *   to an optional hook command (which can forward them to MQTT, an
+ *   HTTP callback, a relay, ...).
+ *
+ *   demand_init() and demand_update() are not reentrant, the caller
+ *   has to serialize them.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include "evloop.h"
+#include "period.h"
+#include "sse.h"
+#include "demand.h"
+
+#define HOOK_SIZE 128
+
+static unsigned int demand_limit = 0;
+static unsigned int demand_clear = 0;
+static time_t interval_len = DEMAND_INTERVAL*60;
+static char alarm_hook[HOOK_SIZE] = "";
+
+/* State of the current demand interval */
+static time_t interval_start = 0;
+static time_t interval_end = 0;
+static double interval_wh = 0;
+static int alarm_on = 0;
+
+
+/**********************************************************
+ * Internal function: demand_run_hook()
+ *
+ * Description:
+ *           Run the alarm hook command (in the event loop
+ *           thread). The alarm state and the demand are
+ *           packed into arg. The hook is not waited for. It
+ *           starts with the default signal handling, the
+ *           files of the daemon are closed on exec.
+ *
+ * Returns:  -
+ *********************************************************/
+static void demand_run_hook(void *arg)
+{
+   uintptr_t packed = (uintptr_t)arg;
+   char demand[16];
+   char limit[16];
+   pid_t pid;
+
+   if (alarm_hook[0] == '\0')
+      return;
+
+   snprintf(demand, sizeof(demand), "%u", (unsigned int)(packed >> 1));
+   snprintf(limit, sizeof(limit), "%u", demand_limit);
+
+   pid = fork();
+   if (pid == 0)
+   {
+      sigset_t none;
+
+      /* Undo the blocked signals of the event loop and the ignored
+       * SIGCHLD and SIGPIPE, which would break wait() in the hook */
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, NULL);
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGPIPE, SIG_DFL);
+
+      execl(alarm_hook, alarm_hook, (packed & 1) ? "raise" : "clear", demand, limit, (char *)NULL);
+      _exit(127);
+   }
+   else if (pid < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to run alarm hook %s: %s\n", alarm_hook, strerror(errno));
+   }
+}
+
+/**********************************************************
+ * Internal function: demand_alarm()
+ *
+ * Description:
+ *           Signal an alarm state change
+ *
+ * Returns:  -
+ *********************************************************/
+static void demand_alarm(struct timespec ts, int on, unsigned int demand)
+{
+   if (on)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Demand alarm: projected demand %u W reaches limit %u W\n",
+             demand, demand_limit);
+   }
+   else
+   {
+      syslog(LOG_DAEMON | LOG_NOTICE, "Demand alarm cleared: projected demand %u W\n", demand);
+   }
+
+   sse_publish("alarm", "{\"time\":%ld.%03ld,\"state\":\"%s\",\"demand\":%u,\"limit\":%u}",
+               (long)ts.tv_sec, ts.tv_nsec/1000000, on ? "raise" : "clear",
+               demand, demand_limit);
+
+   ev_post(demand_run_hook, (void *)(((uintptr_t)demand << 1) | (on ? 1 : 0)));
+}
+
+
+/**********************************************************
+ * Public function: demand_init()
+ *
+ * Description:
+ *           Set up (or change) the demand tracker. A limit
+ *           of 0 disables the alarm. The hook is an optional
+ *           command which is run on each alarm change as
+ *           "hook raise|clear <demand W> <limit W>".
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int demand_init(unsigned int limit, unsigned int interval_min,
+                unsigned int hysteresis, const char *hook)
+{
+   if (interval_min == 0)
+      interval_min = DEMAND_INTERVAL;
+   if (hysteresis == 0)
+      hysteresis = DEMAND_HYSTERESIS;
+
+   /* Intervals are aligned to the full hour */
+   if (interval_min > 60 || (60 % interval_min) != 0 || hysteresis >= 100)
+   {
+      return -1;
+   }
+
+   /* Restart the interval if its length changes */
+   if (interval_len != (time_t)interval_min*60)
+   {
+      interval_len = (time_t)interval_min*60;
+      interval_start = 0;
+      interval_end = 0;
+   }
+
+   /* A pending alarm is kept and checked against the new limit */
+   demand_limit = limit;
+   demand_clear = limit - (limit*hysteresis)/100;
+   if (limit == 0)
+      alarm_on = 0;
+
+   if (hook != NULL)
+   {
+      strncpy(alarm_hook, hook, HOOK_SIZE-1);
+      alarm_hook[HOOK_SIZE-1] = '\0';
+   }
+   else
+   {
+      alarm_hook[0] = '\0';
+   }
+
+   return 0;
+}
+
+/**********************************************************
+ * Public function: demand_update()
+ *
+ * Description:
+ *           Account the energy of a pulse to the demand
+ *           interval of its timestamp and check the
+ *           projected demand against the limit. A reading
+ *           time stamped before the current interval
+ *           (processed late) is booked to it.
+ *
+ * Returns:  projected demand of the current interval (in W)
+ *********************************************************/
+unsigned int demand_update(struct timespec ts, double wh, unsigned int power)
+{
+   double remaining;
+   unsigned int demand;
+
+   /* Start a new interval */
+   if (ts.tv_sec >= interval_end)
+   {
+      time_t hour = period_hour_start(ts.tv_sec);
+
+      interval_start = hour + ((ts.tv_sec - hour)/interval_len)*interval_len;
+      interval_end = interval_start + interval_len;
+      interval_wh = 0;
+   }
+
+   interval_wh += wh;
+
+   /* Project the demand at the end of the interval */
+   remaining = (double)(interval_end - ts.tv_sec) - ts.tv_nsec/1e9;
+   if (remaining > interval_len)
+      remaining = interval_len;
+   demand = (unsigned int)((interval_wh*3600.0 + power*remaining)/interval_len);
+
+   if (demand_limit > 0)
+   {
+      if (!alarm_on && demand >= demand_limit)
+      {
+         alarm_on = 1;
+         demand_alarm(ts, 1, demand);
+      }
+      else if (alarm_on && demand < demand_clear)
+      {
+         alarm_on = 0;
+         demand_alarm(ts, 0, demand);
+      }
+   }
+
+   return demand;
+}
+
+/**********************************************************
+ * Public function: demand_clock_set()
+ *
+ * Description:
+ *           Start a new interval with the next reading, after
+ *           the system clock was set back
+ *
+ * Returns:  -
+ *********************************************************/
+void demand_clock_set(void)
+{
+   interval_start = 0;
+   interval_end = 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Energy Monitor: maximum demand alarm
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __DEMAND_H__
+#define __DEMAND_H__
+
+#include <time.h>
+
+/* Default length of the demand interval (in min) */
+#define DEMAND_INTERVAL 15
+
+/* Default alarm hysteresis (in % of the limit) */
+#define DEMAND_HYSTERESIS 5
+
+/**********************************************************
+ * Public function: demand_init()
+ *
+ * Description:
+ *           Set up (or change) the demand tracker. A limit
+ *           of 0 disables the alarm. The hook is an optional
+ *           command which is run on each alarm change as
+ *           "hook raise|clear <demand W> <limit W>".
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int demand_init(unsigned int limit, unsigned int interval_min,
+                unsigned int hysteresis, const char *hook);
+
+/**********************************************************
+ * Public function: demand_update()
+ *
+ * Description:
+ *           Account the energy of a pulse to the demand
+ *           interval of its timestamp and check the
+ *           projected demand against the limit. A reading
+ *           time stamped before the current interval
+ *           (processed late) is booked to it.
+ *
+ * Returns:  projected demand of the current interval (in W)
+ *********************************************************/
+unsigned int demand_update(struct timespec ts, double wh, unsigned int power);
+
+/**********************************************************
+ * Public function: demand_clock_set()
+ *
+ * Description:
+ *           Start a new interval with the next reading, after
+ *           the system clock was set back
+ *
+ * Returns:  -
+ *********************************************************/
+void demand_clock_set(void);
+
+#endif /* __DEMAND_H__ */
@@ -11,15 +11,20 @@
  * which needs to be installed and running on the same machine.
  * (see http://lcdproc.omnipotent.net)
  *
- * Furthermore, the data is sent to a cloud storage via its WebAPI.
+ * Furthermore, the data is sent to a cloud storage via its WebAPI and
+ * streamed live to local clients via Server-Sent Events.
  *
  * GPIO handling is done using the wiringPi library, which needs to be installed.
- * (see http://wiringpi.com)
+ * (see http://wiringpi.com). It is hidden behind hal.h, the host build
+ * (make host) uses simulated pins instead (hal_mock.c).
  *
  * Build command:
  * gcc -o emond emond.c sockets.c lcdproc.c config.c webapi.c \
+ *  evloop.c sse.c period.c demand.c relay.c tariff.c meter.c steps.c \
+ *  quantile.c profile.c serial.c modbus.c telegram.c temp.c \
+ *  pulse.c replay.c source.c ratelog.c flight.c stats.c hist.c hal_pi.c \
  *  -I/usr/local/include -L/usr/local/lib \
- *  -lwiringPi -lrt -lcurl -lpthread
+ *  -lwiringPi -lrt -lcurl -lpthread -lm
  *
  * Author: Ondrej Wisniewski (ondrej.wisniewski at gmail.com)
  *
@@ -29,17 +34,33 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/time.h>
 #include <errno.h>
 #include <syslog.h>
 #include <unistd.h>
-#include <wiringPi.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "lcdproc.h"
 #include "webapi.h"
+#include "evloop.h"
+#include "sse.h"
+#include "period.h"
+#include "demand.h"
+#include "relay.h"
+#include "tariff.h"
+#include "meter.h"
+#include "steps.h"
+#include "quantile.h"
+#include "profile.h"
+#include "source.h"
+#include "temp.h"
+#include "ratelog.h"
+#include "flight.h"
+#include "stats.h"
+#include "bench.h"
 
 
 /* Uncomment this to enable debug mode */
@@ -52,37 +73,98 @@
 char DAEMON_NAME [BUFFER_SIZE];
 char CONFIG_FILE [BUFFER_SIZE];
 char NV_FILENAME [BUFFER_SIZE];
+char FLIGHT_FILE [BUFFER_SIZE+16];
 
+#ifdef BENCH
+/* The benchmark runs in the source tree */
+#define DAEMON_NAME_DEFAULT "emond-bench"
+#define CONFIG_FILE_DEFAULT "conf/emon-bench.conf"
+#else
 #define DAEMON_NAME_DEFAULT "emond"
 #define CONFIG_FILE_DEFAULT "/etc/emon.conf"
+#endif
 #define NV_FILENAME_DEFAULT  "emond.dat"
 
 #define DAEMON_NAME_TEMPLATE "emon-%s"
 #define CONFIG_FILE_TEMPLATE "/etc/emon-%s.conf"
 #define NV_FILENAME_TEMPLATE "emond-%s.dat"
 
-/* timer period (in sec) */
-#define TIMER_PERIOD 30
+/* Dump of the flight recorder (in RAM on the Pi), from the daemon name */
+#define FLIGHT_FILE_TEMPLATE "/tmp/%s.flight"
 
-/* min pulse period for glitch detection */
+/* default min pulse period for glitch detection (in ms) */
 #define MIN_PULSE_PERIOD_MS 200
 
 /* tolerance for pulse verification (in %) */
 #define PULSE_TOLERANCE 5
 
+/* max length of a line of the data file (the longest is a
+ * tagged profile line) */
+#define NV_PROFILE_TAG "profile "
+#define NV_QUANTILE_TAG "quantile "
+#define NV_TARIFF_TAG "tariff "
+#define NV_LINE_SIZE (sizeof(NV_PROFILE_TAG) + PROFILE_LINE_SIZE)
+
+/* sampling period of the power distribution (in s) and
+ * max number of samples taken from one pulse interval */
+#define QUANTILE_SAMPLE_PERIOD 10
+#define QUANTILE_MAX_SAMPLES 360
+
+/* Interval of the summary of rejected pulses and readings (in s) */
+#define STATS_INTERVAL 60
+
+/* Max magnitude of a value streamed in a meter event, larger ones
+ * are misdecoded and left out to keep the event within its size */
+#define STREAM_VALUE_MAX 1e10
+
 
 typedef struct
 {
     /* [counter] */
     unsigned int pulse_input_pin;
-    double wh_per_pulse;
+    double wh_per_pulse;          /* derived from meter, for power estimates only */
+    meter_const_t meter;          /* exact Wh per pulse, for energy counters */
     unsigned int pulse_length;
     unsigned int pulse_tolerance;
+    unsigned int min_pulse_period;
     unsigned int max_power;
     /* [storage] */
     const char* flash_dir;
     /* [lcd] */
+    const char* lcdproc_host;
     unsigned int lcdproc_port;
+    unsigned int lcd_refresh_rate;
+    /* [sse] */
+    unsigned int sse_port;
+    /* [alarm] */
+    unsigned int demand_limit;
+    unsigned int demand_interval;
+    unsigned int demand_hysteresis;
+    const char* alarm_hook;
+    /* [appliance] */
+    unsigned int step_min;
+    unsigned int step_sensitivity;
+    const char* step_history;
+    /* [profile] */
+    unsigned int profile_halflife;
+    /* [modbus] */
+    const char* modbus_device;
+    unsigned int modbus_timeout;
+    unsigned int modbus_pipeline;
+    /* [channel1] ... [channel8] */
+    channel_conf_t channel[SOURCE_MAX_CHANNELS];
+    /* [temperature] */
+    const char* w1_dir;
+    unsigned int temp_interval;
+    unsigned int num_temp_sensors;
+    temp_sensor_t temp_sensor[TEMP_MAX_SENSORS];
+    /* [relays], [relay1] ... [relay8] */
+    const char* relay_backend;
+    const char* relay_chip;
+    const char* relay_log;
+    relay_conf_t relay[RELAY_MAX];
+    /* [tariff] */
+    tariff_t tariff;
     /* [webapi] */
     const char* api_base_uri;
     const char* api_key;
@@ -91,12 +173,106 @@ typedef struct
 } config_t;
 
 /* Local variables */
-static struct itimerval timer;
 static config_t config;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static int is_instance = 0;
 static emon_data_t emon_data;
 static unsigned long pulse_count_daily=0;
 static unsigned long pulse_count_monthly=0;
+static unsigned long long pulse_count_total=0;
+/* Pulses and cost per tariff register */
+static unsigned long tariff_count_daily[TARIFF_MAX_REGS];
+static unsigned long tariff_count_monthly[TARIFF_MAX_REGS];
+static double tariff_cost_daily[TARIFF_MAX_REGS];
+static double tariff_cost_monthly[TARIFF_MAX_REGS];
+static int tariff_reg=-1;
+
+/* Power distribution of the day and month (baseload and peak quantiles) */
+static quantile_t power_p5_daily;
+static quantile_t power_p95_daily;
+static quantile_t power_p5_monthly;
+static quantile_t power_p95_monthly;
+static time_t power_sampled=0;
+
+/* Last power of each channel, the channels feeding the counters add up */
+static unsigned int channel_power[SOURCE_MAX_CHANNELS];
+/* Last pulse of each channel, and if its power is the pulse period */
+static struct timespec pulse_ts[SOURCE_MAX_CHANNELS];
+static int power_pulsed[SOURCE_MAX_CHANNELS];
+/* Boundaries of the periods the counters belong to */
+static time_t day_start=0;
+static time_t day_end=0;
+static time_t month_end=0;
+static time_t saved_time=0;
+
+/* The readings are not time stamped by the wall clock (replay in
+ * virtual time): the periods follow the readings only and the
+ * counters are neither loaded nor saved */
+static int source_clock=0;
+
+/* Current hour and projection of the daily and monthly energy */
+static time_t hour_start=0;
+static time_t hour_end=0;
+static int hour_complete=0;
+static time_t hour_observed=0;
+static unsigned long hour_pulses=0;
+static time_t month_observed=0;
+static double proj_rest_day=0;
+static double proj_rest_month=0;
+static double proj_hours_day=0;
+static double proj_hours_month=0;
+static unsigned int proj_day=0;
+static unsigned int proj_month=0;
+
+/* Rejected pulses and readings, logged at a limited rate */
+static ratelog_t glitch_log = RATELOG_INIT("glitch", "pulses too close (glitches)", "interval", "ms");
+static ratelog_t power_log = RATELOG_INIT("power_range", "readings out of power range", "power", "W");
+
+static void reading_handler(unsigned int channel, const reading_t *r, unsigned int count, void *arg);
+static void temp_handler(const temp_sample_t *s, void *arg);
+static int power_bound(struct timespec now, unsigned int *power);
+
+
+/**********************************************************
+ * Function: config_str()
+ *
+ * Description:
+ *           Set a string parameter, freeing its previous
+ *           value (e.g. of a repeated key)
+ *
+ * Returns:  -
+ *********************************************************/
+static void config_str(const char **param, const char *value)
+{
+   free((void*)*param);
+   *param = strdup(value);
+}
 
+/**********************************************************
+ * Function: config_free()
+ *
+ * Description:
+ *           Free the string parameters of a configuration
+ *
+ * Returns:  -
+ *********************************************************/
+static void config_free(config_t *pconfig)
+{
+   const char **str[] =
+   {
+      &pconfig->flash_dir, &pconfig->lcdproc_host, &pconfig->alarm_hook,
+      &pconfig->step_history, &pconfig->modbus_device, &pconfig->w1_dir,
+      &pconfig->relay_backend, &pconfig->relay_chip, &pconfig->relay_log,
+      &pconfig->api_base_uri, &pconfig->api_key
+   };
+   unsigned int i;
+
+   for (i = 0; i < sizeof(str)/sizeof(str[0]); i++)
+   {
+      free((void*)*str[i]);
+      *str[i] = NULL;
+   }
+}
 
 /**********************************************************
  * Function: config_cb()
@@ -118,7 +294,19 @@ static int config_cb(void* user, const char* section, const char* name, const ch
    }
    else if (MATCH("counter", "wh_per_pulse"))
    {
-      pconfig->wh_per_pulse = atof(value);
+      if (meter_parse_wh(&pconfig->meter, value) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Invalid config parameter wh_per_pulse: %s\n", value);
+         return -1;
+      }
+   }
+   else if (MATCH("counter", "impulses_per_kwh"))
+   {
+      if (meter_parse_imp(&pconfig->meter, value) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Invalid config parameter impulses_per_kwh: %s\n", value);
+         return -1;
+      }
    }
    else if (MATCH("counter", "pulse_length"))
    {
@@ -128,25 +316,147 @@ static int config_cb(void* user, const char* section, const char* name, const ch
    {
       pconfig->pulse_tolerance = atoi(value);
    }
+   else if (MATCH("counter", "min_pulse_period"))
+   {
+      pconfig->min_pulse_period = atoi(value);
+   }
    else if (MATCH("counter", "max_power"))
    {
       pconfig->max_power = atoi(value);
    }
    else if (MATCH("storage", "flash_dir"))
    {
-      pconfig->flash_dir = strdup(value);
+      config_str(&pconfig->flash_dir, value);
+   }
+   else if (MATCH("lcd", "lcdproc_host"))
+   {
+      config_str(&pconfig->lcdproc_host, value);
    }
    else if (MATCH("lcd", "lcdproc_port"))
    {
       pconfig->lcdproc_port = atoi(value);
    }
+   else if (MATCH("lcd", "lcd_refresh_rate"))
+   {
+      pconfig->lcd_refresh_rate = atoi(value);
+   }
+   else if (MATCH("sse", "sse_port"))
+   {
+      pconfig->sse_port = atoi(value);
+   }
+   else if (MATCH("alarm", "demand_limit"))
+   {
+      pconfig->demand_limit = atoi(value);
+   }
+   else if (MATCH("alarm", "demand_interval"))
+   {
+      pconfig->demand_interval = atoi(value);
+   }
+   else if (MATCH("alarm", "demand_hysteresis"))
+   {
+      pconfig->demand_hysteresis = atoi(value);
+   }
+   else if (MATCH("alarm", "alarm_hook"))
+   {
+      config_str(&pconfig->alarm_hook, value);
+   }
+   else if (MATCH("appliance", "step_min"))
+   {
+      pconfig->step_min = atoi(value);
+   }
+   else if (MATCH("appliance", "step_sensitivity"))
+   {
+      pconfig->step_sensitivity = atoi(value);
+   }
+   else if (MATCH("appliance", "step_history"))
+   {
+      config_str(&pconfig->step_history, value);
+   }
+   else if (MATCH("profile", "profile_halflife"))
+   {
+      pconfig->profile_halflife = atoi(value);
+   }
+   else if (MATCH("relays", "relay_backend"))
+   {
+      config_str(&pconfig->relay_backend, value);
+   }
+   else if (MATCH("relays", "relay_chip"))
+   {
+      config_str(&pconfig->relay_chip, value);
+   }
+   else if (MATCH("relays", "relay_log"))
+   {
+      config_str(&pconfig->relay_log, value);
+   }
+   else if (strncmp(section, "relay", 5) == 0 && isdigit((unsigned char)section[5]) &&
+            atoi(&section[5]) >= 1 && atoi(&section[5]) <= RELAY_MAX)
+   {
+      if (relay_config(&pconfig->relay[atoi(&section[5])-1], name, value) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "unknown config parameter %s/%s\n", section, name);
+         return -1;
+      }
+   }
+   else if (MATCH("modbus", "modbus_device"))
+   {
+      config_str(&pconfig->modbus_device, value);
+   }
+   else if (MATCH("modbus", "modbus_timeout"))
+   {
+      pconfig->modbus_timeout = atoi(value);
+   }
+   else if (MATCH("modbus", "modbus_pipeline"))
+   {
+      pconfig->modbus_pipeline = atoi(value);
+   }
+   else if (strncmp(section, "channel", 7) == 0 && isdigit((unsigned char)section[7]) &&
+            atoi(&section[7]) >= 1 && atoi(&section[7]) <= SOURCE_MAX_CHANNELS)
+   {
+      if (source_config(&pconfig->channel[atoi(&section[7])-1], name, value) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "invalid config parameter %s/%s\n", section, name);
+         return -1;
+      }
+
+      /* The channels feeding the counters add up, by default only channel1 does */
+      if (strcmp(name, "source") == 0)
+         pconfig->channel[atoi(&section[7])-1].feed_counters = (atoi(&section[7]) == 1);
+   }
+   else if (MATCH("temperature", "w1_dir"))
+   {
+      config_str(&pconfig->w1_dir, value);
+   }
+   else if (MATCH("temperature", "temp_interval"))
+   {
+      pconfig->temp_interval = atoi(value);
+   }
+   else if (MATCH("temperature", "sensor"))
+   {
+      temp_sensor_t *ts = &pconfig->temp_sensor[pconfig->num_temp_sensors];
+
+      if (pconfig->num_temp_sensors >= TEMP_MAX_SENSORS ||
+          sscanf(value, "%23s %31s", ts->id, ts->name) != 2)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "invalid config parameter %s/%s\n", section, name);
+         return -1;
+      }
+      pconfig->num_temp_sensors++;
+   }
+   else if (strcmp(section, "tariff") == 0)
+   {
+      if (tariff_config(&pconfig->tariff, name, value) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "invalid config parameter %s/%s\n", section, name);
+         return -1;
+      }
+   }
    else if (MATCH("webapi", "api_base_uri"))
    {
-      pconfig->api_base_uri = strdup(value);
+      config_str(&pconfig->api_base_uri, value);
    }
    else if (MATCH("webapi", "api_key"))
    {
-      pconfig->api_key = strdup(value);
+      config_str(&pconfig->api_key, value);
    }
    else if (MATCH("webapi", "api_update_rate"))
    {
@@ -156,6 +466,12 @@ static int config_cb(void* user, const char* section, const char* name, const ch
    {
       pconfig->node_number = atoi(value);
    }
+#ifdef BENCH
+   else if (strcmp(section, "bench") == 0)
+   {
+      /* Parameters of the benchmark, see bench.c */
+   }
+#endif
    else
    {
       syslog(LOG_DAEMON | LOG_WARNING, "unknown config parameter %s/%s\n", section, name);
@@ -164,6 +480,329 @@ static int config_cb(void* user, const char* section, const char* name, const ch
    return 0;
 }
 
+/**********************************************************
+ * Function: check_config()
+ *
+ * Description:
+ *           Apply default values and check the plausibility
+ *           of the configuration parameters
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int check_config(config_t* pconfig)
+{
+   channel_conf_t *ch;
+   unsigned int i;
+
+   if (pconfig->pulse_tolerance == 0)
+      pconfig->pulse_tolerance = PULSE_TOLERANCE;
+   if (pconfig->min_pulse_period == 0)
+      pconfig->min_pulse_period = MIN_PULSE_PERIOD_MS;
+   if (pconfig->demand_interval == 0)
+      pconfig->demand_interval = DEMAND_INTERVAL;
+   if (pconfig->demand_hysteresis == 0)
+      pconfig->demand_hysteresis = DEMAND_HYSTERESIS;
+   if (pconfig->step_sensitivity == 0)
+      pconfig->step_sensitivity = STEPS_SENSITIVITY;
+   if (pconfig->profile_halflife == 0)
+      pconfig->profile_halflife = PROFILE_HALFLIFE;
+   if (pconfig->modbus_timeout == 0)
+      pconfig->modbus_timeout = MODBUS_TIMEOUT;
+   if (pconfig->modbus_pipeline == 0)
+      pconfig->modbus_pipeline = MODBUS_PIPELINE;
+
+   /* Without channels the pulses on pulse_input_pin are counted */
+   for (i=0; i<SOURCE_MAX_CHANNELS && pconfig->channel[i].source == NULL; i++)
+      ;
+   if (i == SOURCE_MAX_CHANNELS && pconfig->pulse_input_pin > 0)
+   {
+      pconfig->channel[0].source = source_find("gpio");
+      pconfig->channel[0].feed_counters = 1;
+   }
+
+   /* The [counter] and [modbus] parameters apply to all channels */
+   for (i=0; i<SOURCE_MAX_CHANNELS; i++)
+   {
+      ch = &pconfig->channel[i];
+      if (ch->source == source_find("gpio"))
+      {
+         if (ch->conf.gpio.pin == 0)
+            ch->conf.gpio.pin = pconfig->pulse_input_pin;
+         if (ch->conf.gpio.pulse_length == 0)
+            ch->conf.gpio.pulse_length = pconfig->pulse_length;
+         if (ch->conf.gpio.pulse_tolerance == 0)
+            ch->conf.gpio.pulse_tolerance = pconfig->pulse_tolerance;
+      }
+      else if (ch->source == source_find("modbus"))
+      {
+         snprintf(ch->conf.modbus.device, sizeof(ch->conf.modbus.device), "%s",
+                  pconfig->modbus_device ? pconfig->modbus_device : "");
+         ch->conf.modbus.timeout = pconfig->modbus_timeout;
+         ch->conf.modbus.pipeline = pconfig->modbus_pipeline;
+      }
+   }
+
+   if (pconfig->meter.den == 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Missing config parameter wh_per_pulse or impulses_per_kwh\n");
+      return -1;
+   }
+   pconfig->wh_per_pulse = (double)pconfig->meter.num/pconfig->meter.den;
+   if (pconfig->pulse_tolerance >= 100)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid config parameter pulse_tolerance: %u\n", pconfig->pulse_tolerance);
+      return -2;
+   }
+   if (pconfig->max_power == 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid config parameter max_power: %u\n", pconfig->max_power);
+      return -3;
+   }
+   if (pconfig->demand_interval > 60 || (60 % pconfig->demand_interval) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid config parameter demand_interval: %u (must divide 60)\n",
+             pconfig->demand_interval);
+      return -4;
+   }
+   if (pconfig->demand_hysteresis >= 100)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid config parameter demand_hysteresis: %u\n", pconfig->demand_hysteresis);
+      return -5;
+   }
+   if (source_check(pconfig->channel) < 0)
+   {
+      return -6;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Function: str_changed()
+ *
+ * Description:
+ *           Compare two optional string parameters
+ *
+ * Returns:  1 if the strings differ, 0 otherwise
+ *********************************************************/
+static int str_changed(const char* a, const char* b)
+{
+   if (a == NULL || b == NULL)
+      return (a != b);
+   return (strcmp(a, b) != 0);
+}
+
+/**********************************************************
+ * Function: webapi_strings()
+ *
+ * Description:
+ *           Copy the WebAPI strings of the configuration to
+ *           the data of the WebAPI requests
+ *
+ * Returns:  -
+ *********************************************************/
+static void webapi_strings(void)
+{
+   snprintf(emon_data.api_base_uri, sizeof(emon_data.api_base_uri), "%s",
+            config.api_base_uri ? config.api_base_uri : "");
+   snprintf(emon_data.api_key, sizeof(emon_data.api_key), "%s",
+            config.api_key ? config.api_key : "");
+}
+
+/**********************************************************
+ * Internal function: tariff_rebase()
+ *
+ * Description:
+ *           Moves the tariff registers of a reloaded schedule
+ *           to their new positions, matched by name. Registers
+ *           which were removed are dropped, new ones start
+ *           from zero. Caller must hold config_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void tariff_rebase(const tariff_t *from, const tariff_t *to)
+{
+   unsigned long count_daily[TARIFF_MAX_REGS] = {0};
+   unsigned long count_monthly[TARIFF_MAX_REGS] = {0};
+   double cost_daily[TARIFF_MAX_REGS] = {0};
+   double cost_monthly[TARIFF_MAX_REGS] = {0};
+   unsigned int i;
+   int reg;
+
+   for (i=0; i<from->num_regs; i++)
+   {
+      if ((reg = tariff_find(to, from->name[i])) < 0)
+      {
+         if (tariff_count_monthly[i] > 0)
+            syslog(LOG_DAEMON | LOG_WARNING, "Tariff register %s removed, its counts are dropped\n", from->name[i]);
+         continue;
+      }
+      count_daily[reg] = tariff_count_daily[i];
+      count_monthly[reg] = tariff_count_monthly[i];
+      cost_daily[reg] = tariff_cost_daily[i];
+      cost_monthly[reg] = tariff_cost_monthly[i];
+   }
+   memcpy(tariff_count_daily, count_daily, sizeof(count_daily));
+   memcpy(tariff_count_monthly, count_monthly, sizeof(count_monthly));
+   memcpy(tariff_cost_daily, cost_daily, sizeof(cost_daily));
+   memcpy(tariff_cost_monthly, cost_monthly, sizeof(cost_monthly));
+   if (tariff_reg >= 0)
+      tariff_reg = tariff_find(to, from->name[tariff_reg]);
+}
+
+/**********************************************************
+ * Function: reload_handler()
+ *
+ * Description:
+ *           Handles the reception of the HUP signal.
+ *
+ *           The configuration file is parsed again and, if
+ *           valid, applied to the running daemon. Counters,
+ *           the auto-detected pulse length and the pulse
+ *           detection state are kept. Only the subsystems
+ *           and input sources whose parameters changed are
+ *           restarted.
+ *
+ * Returns:  -
+ *********************************************************/
+static void reload_handler(void *arg)
+{
+   config_t newconf;
+   config_t oldconf;
+   channel_conf_t old_channel[SOURCE_MAX_CHANNELS];
+   int restart_lcd;
+   int restart_sse;
+   int restart_relays;
+   int restart_steps;
+   int restart_temp;
+
+   syslog(LOG_DAEMON | LOG_NOTICE, "Reloading configuration from %s\n", CONFIG_FILE);
+
+   memset((void*)&newconf, 0, sizeof(newconf));
+   if (conf_parse(CONFIG_FILE, config_cb, &newconf) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Can't load %s, keeping current configuration\n", CONFIG_FILE);
+      config_free(&newconf);
+      return;
+   }
+   if (check_config(&newconf) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid configuration, keeping current configuration\n");
+      config_free(&newconf);
+      return;
+   }
+   if (source_wall_clock(newconf.channel) == source_clock)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Switching between wall clock and virtual time needs a restart, keeping current configuration\n");
+      config_free(&newconf);
+      return;
+   }
+   if (newconf.meter.num != config.meter.num || newconf.meter.den != config.meter.den)
+   {
+      /* Stored energy and pulse counts are in units of the old constant */
+      syslog(LOG_DAEMON | LOG_ERR, "Changing the meter constant needs a restart, keeping current configuration\n");
+      config_free(&newconf);
+      return;
+   }
+
+   #define LOG_CHANGE(n, fmt) \
+      if (newconf.n != config.n) \
+         syslog(LOG_DAEMON | LOG_NOTICE, #n ": " fmt " -> " fmt "\n", config.n, newconf.n)
+   #define LOG_CHANGE_STR(n) \
+      if (str_changed(newconf.n, config.n)) \
+         syslog(LOG_DAEMON | LOG_NOTICE, #n ": %s -> %s\n", \
+                config.n ? config.n : "", newconf.n ? newconf.n : "")
+
+   LOG_CHANGE(pulse_length, "%u");
+   LOG_CHANGE(pulse_tolerance, "%u");
+   LOG_CHANGE(min_pulse_period, "%u");
+   LOG_CHANGE(max_power, "%u");
+   LOG_CHANGE_STR(flash_dir);
+   LOG_CHANGE_STR(lcdproc_host);
+   LOG_CHANGE(lcdproc_port, "%u");
+   LOG_CHANGE(lcd_refresh_rate, "%u");
+   LOG_CHANGE(sse_port, "%u");
+   LOG_CHANGE(demand_limit, "%u");
+   LOG_CHANGE(demand_interval, "%u");
+   LOG_CHANGE(demand_hysteresis, "%u");
+   LOG_CHANGE_STR(alarm_hook);
+   LOG_CHANGE(step_min, "%u");
+   LOG_CHANGE(step_sensitivity, "%u");
+   LOG_CHANGE_STR(step_history);
+   LOG_CHANGE(profile_halflife, "%u");
+   LOG_CHANGE_STR(modbus_device);
+   LOG_CHANGE(modbus_timeout, "%u");
+   LOG_CHANGE(modbus_pipeline, "%u");
+   LOG_CHANGE_STR(w1_dir);
+   LOG_CHANGE(temp_interval, "%u");
+   LOG_CHANGE_STR(api_base_uri);
+   LOG_CHANGE_STR(api_key);
+   LOG_CHANGE(api_update_rate, "%u");
+   LOG_CHANGE(node_number, "%u");
+
+   restart_lcd = str_changed(newconf.lcdproc_host, config.lcdproc_host) ||
+                 newconf.lcdproc_port != config.lcdproc_port ||
+                 newconf.lcd_refresh_rate != config.lcd_refresh_rate;
+   restart_sse = newconf.sse_port != config.sse_port;
+   restart_steps = newconf.step_min != config.step_min ||
+                   newconf.step_sensitivity != config.step_sensitivity ||
+                   str_changed(newconf.step_history, config.step_history);
+   restart_relays = str_changed(newconf.relay_backend, config.relay_backend) ||
+                    str_changed(newconf.relay_chip, config.relay_chip) ||
+                    str_changed(newconf.relay_log, config.relay_log) ||
+                    memcmp(newconf.relay, config.relay, sizeof(config.relay)) != 0;
+   restart_temp = str_changed(newconf.w1_dir, config.w1_dir) ||
+                  newconf.temp_interval != config.temp_interval;
+   if (restart_relays)
+      syslog(LOG_DAEMON | LOG_NOTICE, "Relay configuration changed, reloading relays\n");
+   if (memcmp(&newconf.tariff, &config.tariff, sizeof(config.tariff)) != 0)
+      syslog(LOG_DAEMON | LOG_NOTICE, "Tariff schedule changed (%u registers)\n", newconf.tariff.num_regs);
+
+   /* Apply atomically with respect to the pulse handler. The
+    * subsystems keep copies of the strings, the old ones are freed
+    * at the end.
+    */
+   pthread_mutex_lock(&config_lock);
+   memcpy(old_channel, config.channel, sizeof(old_channel));
+   oldconf = config;
+   config = newconf;
+   webapi_strings();
+   emon_data.api_update_rate = config.api_update_rate;
+   emon_data.node_number = config.node_number;
+   demand_init(config.demand_limit, config.demand_interval, config.demand_hysteresis, config.alarm_hook);
+   tariff_rebase(&oldconf.tariff, &config.tariff);
+   tariff_init(&config.tariff);
+   if (restart_steps)
+      steps_init(config.step_min, config.step_sensitivity, config.step_history);
+   profile_init(config.profile_halflife);
+   pthread_mutex_unlock(&config_lock);
+
+   if (restart_lcd && !is_instance)
+   {
+      lcd_exit();
+      lcd_init(config.lcdproc_host, config.lcdproc_port, config.lcd_refresh_rate);
+   }
+   if (restart_sse)
+   {
+      sse_exit();
+      if (config.sse_port > 0)
+         sse_init(config.sse_port);
+   }
+   if (restart_relays)
+   {
+      relay_reload(config.relay_backend, config.relay_chip, config.relay_log,
+                   config.relay, power_bound);
+   }
+   source_reload(old_channel, config.channel, reading_handler, NULL);
+   if (restart_temp)
+   {
+      temp_exit();
+      temp_init(config.w1_dir, config.temp_interval, temp_handler, NULL);
+   }
+
+   config_free(&oldconf);
+   syslog(LOG_DAEMON | LOG_NOTICE, "Configuration reloaded\n");
+}
+
 /**********************************************************
  * Function: read_flash()
  *
@@ -181,11 +820,11 @@ int read_flash(const char *path, const char *filename)
    FILE *f;
    char file[40];
    char buf[BUFSIZE];
+   char line[NV_LINE_SIZE];
+   char name[16];
    int  rc=0;
-
-   /* TODO: check that the saved data is still useful,
-    * e.g. we didn't cross midnight since last saving data
-    */
+   int  pos;
+   int  i;
 
    sprintf(file, "%s/%s", path, filename);
    if ((f=fopen(file, "r")) != NULL)
@@ -201,6 +840,107 @@ int read_flash(const char *path, const char *filename)
             pulse_count_monthly=atoi(buf);
             syslog(LOG_DAEMON | LOG_INFO, "Load data from file: daily counter %lu, monthly counter %lu\n",
                                            pulse_count_daily, pulse_count_monthly);
+
+            /* Read time of saving and lifetime counter (missing in files of older versions) */
+            pulse_count_total=pulse_count_monthly;
+            if (fgets(line, sizeof(line), f) != NULL)
+            {
+               long long t;
+
+               if (sscanf(line, "%lld %llu", &t, &pulse_count_total) >= 1)
+                  saved_time=(time_t)t;
+            }
+            syslog(LOG_DAEMON | LOG_INFO, "Load data from file: lifetime counter %llu\n", pulse_count_total);
+
+            /* Read tariff registers, power quantile estimators and weekly
+             * profile (tagged lines). Files of older versions have one
+             * untagged line per tariff register, in configuration order.
+             */
+            for (i=0; fgets(line, sizeof(line), f) != NULL; )
+            {
+               if (strchr(line, '\n') == NULL && !feof(f))
+               {
+                  /* Drop the rest of an overlong line, it must not be taken for a line of its own */
+                  int c;
+
+                  while ((c = fgetc(f)) != EOF && c != '\n')
+                     ;
+                  syslog(LOG_DAEMON | LOG_ERR, "Line too long in data file, skipped\n");
+                  rc = -7;
+               }
+               else if (!strncmp(line, NV_PROFILE_TAG, strlen(NV_PROFILE_TAG)))
+               {
+                  if (profile_load(line+strlen(NV_PROFILE_TAG)) < 0)
+                  {
+                     syslog(LOG_DAEMON | LOG_ERR, "Error reading consumption profile from file\n");
+                     rc = -6;
+                  }
+               }
+               else if (!strncmp(line, NV_QUANTILE_TAG, strlen(NV_QUANTILE_TAG)))
+               {
+                  quantile_t *q = NULL;
+
+                  name[0] = '\0';
+                  pos = 0;
+                  sscanf(line+strlen(NV_QUANTILE_TAG), "%15s %n", name, &pos);
+
+                  if (!strcmp(name, "p5_daily"))
+                     q = &power_p5_daily;
+                  else if (!strcmp(name, "p95_daily"))
+                     q = &power_p95_daily;
+                  else if (!strcmp(name, "p5_monthly"))
+                     q = &power_p5_monthly;
+                  else if (!strcmp(name, "p95_monthly"))
+                     q = &power_p95_monthly;
+
+                  if (q == NULL || quantile_load(q, line+strlen(NV_QUANTILE_TAG)+pos) < 0)
+                  {
+                     syslog(LOG_DAEMON | LOG_ERR, "Error reading power quantile %s from file\n", name);
+                     rc = -5;
+                  }
+               }
+               else if (!strncmp(line, NV_TARIFF_TAG, strlen(NV_TARIFF_TAG)))
+               {
+                  unsigned long count_daily, count_monthly;
+                  double cost_daily, cost_monthly;
+                  int reg;
+
+                  name[0] = '\0';
+                  if (sscanf(line+strlen(NV_TARIFF_TAG), "%15s %lu %lu %lf %lf", name,
+                             &count_daily, &count_monthly, &cost_daily, &cost_monthly) != 5)
+                  {
+                     syslog(LOG_DAEMON | LOG_ERR, "Error reading tariff register %s from file\n", name);
+                     rc = -4;
+                  }
+                  else if ((reg = tariff_find(&config.tariff, name)) < 0)
+                  {
+                     syslog(LOG_DAEMON | LOG_WARNING, "Tariff register %s no longer configured, its counts are dropped\n", name);
+                  }
+                  else
+                  {
+                     tariff_count_daily[reg] = count_daily;
+                     tariff_count_monthly[reg] = count_monthly;
+                     tariff_cost_daily[reg] = cost_daily;
+                     tariff_cost_monthly[reg] = cost_monthly;
+                  }
+               }
+               else if (isalpha((unsigned char)line[0]))
+               {
+                  /* Tagged line of a newer version */
+                  syslog(LOG_DAEMON | LOG_WARNING, "Unknown line in data file skipped: %.16s\n", line);
+               }
+               else if (i < TARIFF_MAX_REGS)
+               {
+                  if (sscanf(line, "%lu %lu %lf %lf", &tariff_count_daily[i], &tariff_count_monthly[i],
+                             &tariff_cost_daily[i], &tariff_cost_monthly[i]) != 4)
+                  {
+                     syslog(LOG_DAEMON | LOG_ERR, "Error reading tariff register %d from file\n", i+1);
+                     rc = -4;
+                     break;
+                  }
+                  i++;
+               }
+            }
          }
          else
          {
@@ -247,18 +987,91 @@ int write_flash(const char *path, const char *filename)
    FILE *f;
    char file[40];
    int  rc=0;
+   unsigned long count_daily;
+   unsigned long count_monthly;
+   unsigned long long count_total;
+   unsigned long reg_daily[TARIFF_MAX_REGS];
+   unsigned long reg_monthly[TARIFF_MAX_REGS];
+   double cost_daily[TARIFF_MAX_REGS];
+   double cost_monthly[TARIFF_MAX_REGS];
+   char reg_name[TARIFF_MAX_REGS][TARIFF_NAME_SIZE];
+   quantile_t quantiles[4];
+   const char *quantile_names[4] = { "p5_daily", "p95_daily", "p5_monthly", "p95_monthly" };
+   char line[QUANTILE_LINE_SIZE];
+   char profile[PROFILE_DAYS][PROFILE_LINE_SIZE];
+   int  profile_len[PROFILE_DAYS];
+   unsigned int num_regs;
+   unsigned int i;
+   time_t now;
+
+   /* Take a consistent snapshot, the counters are updated by the pulse handler */
+   pthread_mutex_lock(&config_lock);
+   count_daily = pulse_count_daily;
+   count_monthly = pulse_count_monthly;
+   count_total = pulse_count_total;
+   memcpy(reg_daily, tariff_count_daily, sizeof(reg_daily));
+   memcpy(reg_monthly, tariff_count_monthly, sizeof(reg_monthly));
+   memcpy(cost_daily, tariff_cost_daily, sizeof(cost_daily));
+   memcpy(cost_monthly, tariff_cost_monthly, sizeof(cost_monthly));
+   memcpy(reg_name, config.tariff.name, sizeof(reg_name));
+   quantiles[0] = power_p5_daily;
+   quantiles[1] = power_p95_daily;
+   quantiles[2] = power_p5_monthly;
+   quantiles[3] = power_p95_monthly;
+   for (i=0; i<PROFILE_DAYS; i++)
+      profile_len[i] = profile_save(i, profile[i], sizeof(profile[i]));
+   num_regs = config.tariff.num_regs;
+   now = time(NULL);
+   pthread_mutex_unlock(&config_lock);
 
    sprintf(file, "%s/%s", path, filename);
    if ((f=fopen(file, "w")) != NULL)
    {
-      if (fprintf(f, "%lu\n", pulse_count_daily) > 0)
+      if (fprintf(f, "%lu\n", count_daily) > 0)
       {
-         if (fprintf(f, "%lu\n", pulse_count_monthly) > 0)
+         if (fprintf(f, "%lu\n%lld %llu\n", count_monthly, (long long)now, count_total) > 0)
          {
             rc = 0;
+            for (i=0; i<num_regs; i++)
+            {
+               if (fprintf(f, NV_TARIFF_TAG "%s %lu %lu %.6f %.6f\n", reg_name[i], reg_daily[i], reg_monthly[i],
+                           cost_daily[i], cost_monthly[i]) < 0)
+               {
+                  syslog(LOG_DAEMON | LOG_ERR, "Error writing tariff registers to file: %s\n", strerror(errno));
+                  rc = -4;
+                  break;
+               }
+            }
+            for (i=0; i<4 && rc==0; i++)
+            {
+               /* A state which cannot be saved is skipped, the estimator starts over after a restart */
+               if (quantile_save(&quantiles[i], line, sizeof(line)) < 0)
+               {
+                  syslog(LOG_DAEMON | LOG_WARNING, "Power quantile %s too long, not saved\n", quantile_names[i]);
+                  continue;
+               }
+               if (fprintf(f, NV_QUANTILE_TAG "%s %s\n", quantile_names[i], line) < 0)
+               {
+                  syslog(LOG_DAEMON | LOG_ERR, "Error writing power quantiles to file: %s\n", strerror(errno));
+                  rc = -5;
+               }
+            }
+            for (i=0; i<PROFILE_DAYS && rc==0; i++)
+            {
+               if (profile_len[i] < 0)
+               {
+                  syslog(LOG_DAEMON | LOG_WARNING, "Consumption profile of weekday %u too long, not saved\n", i);
+                  continue;
+               }
+               if (fprintf(f, NV_PROFILE_TAG "%s\n", profile[i]) < 0)
+               {
+                  syslog(LOG_DAEMON | LOG_ERR, "Error writing consumption profile to file: %s\n", strerror(errno));
+                  rc = -6;
+               }
+            }
 #ifdef DEBUG
             syslog(LOG_DAEMON | LOG_DEBUG, "Saved data to file: daily counter %lu, monthly counter %lu\n",
-                                            pulse_count_daily, pulse_count_monthly);
+                                            count_daily, count_monthly);
 #endif
          }
          else
@@ -316,304 +1129,904 @@ static unsigned long time_diff_ms(struct timespec now_ts, struct timespec prev_t
 }
 
 /**********************************************************
- * Function: exit_handler()
+ * Function: period_anchor()
  *
  * Description:
- *           Handles the cleanup at reception of the
- *           TERM signal.
+ *           Set the day and month the counters belong to
+ *           from the given time
  *
  * Returns:  -
  *********************************************************/
-static void exit_handler(int signum)
+static void period_anchor(time_t t)
 {
-   lcd_exit();
-   syslog(LOG_DAEMON | LOG_NOTICE, "Exit Energy Monitor\n");
-   exit(0);
+   day_start = period_day_start(t, 0);
+   day_end = period_day_start(t, 1);
+   month_end = period_month_start(t, 1);
 }
 
 /**********************************************************
- * Function: sigpipe_handler()
+ * Function: projection_prepare()
  *
  * Description:
- *           Handles the reception of the PIPE signal and
- *           restarts communication with the LCD daemon.
+ *           Calculates the expected energy from the end of
+ *           the current hour to the end of the day and month
+ *           from the weekly profile. The hours not covered
+ *           by the profile yet are counted separately and
+ *           added at the current rate for each projection.
+ *           Caller must hold config_lock.
  *
  * Returns:  -
  *********************************************************/
-void sigpipe_handler(int signum)
+static void projection_prepare(void)
 {
-   syslog(LOG_DAEMON | LOG_NOTICE, "Broken connection to LCDd, reinitializing ...\n");
-   lcd_init();
+   proj_rest_day = profile_expect(hour_end, day_end, &proj_hours_day);
+   proj_rest_month = profile_expect(hour_end, month_end, &proj_hours_month);
 }
 
 /**********************************************************
- * Function: gpio_handler()
+ * Function: hour_rollover()
  *
  * Description:
- *           Handles the event of the pulse detected on
- *           the GPIO pin.
- *
- *           First a validation of the pulse is performed
- *           to filter out wrong pulses. Then the time
- *           between the last two pulses and the resulting
- *           power consumption is calculated.
+ *           Starts a new hour if the given time lies beyond
+ *           the current hour. The energy of the finished
+ *           hour is learned by the weekly profile if the
+ *           hour was observed completely. Caller must hold
+ *           config_lock.
  *
  * Returns:  -
  *********************************************************/
-static void gpio_handler(void)
+static void hour_rollover(time_t t)
 {
-   static int first = 1;
-   static int pulse_started = 0;
-   static struct timespec prev_ts;
-   static struct timespec pulse_start_ts;
-   struct timespec now_ts;
-   struct timespec pulse_end_ts;
-
-   unsigned long t_diff;
-   unsigned long pulse_length;
-   unsigned long pulse_delta = (config.pulse_length*config.pulse_tolerance)/100;
-   unsigned int power;
-
+   if (t >= hour_start && t < hour_end)
+      return;
 
-   /* read current pin value */
-   if (digitalRead(config.pulse_input_pin) == LOW)
+   if (hour_complete && t >= hour_end && t < hour_end+3600)
    {
-      /* Pulse started, check validity */
-      if (pulse_started == 0)
-      {
-         pulse_started = 1;
-         clock_gettime(CLOCK_REALTIME, &pulse_start_ts);
-         //syslog(LOG_DAEMON | LOG_DEBUG, "Detected starting pulse");
-      }
-      else
-      {
-         syslog(LOG_DAEMON | LOG_WARNING, "Detected starting pulse out of sequence");
-      }
+      profile_learn(hour_start, hour_pulses*config.wh_per_pulse);
    }
-   else
+
+   /* The new hour is complete if it follows the tracked one */
+   hour_complete = (hour_end != 0 && t >= hour_end && t < hour_end+3600);
+   hour_start = period_hour_start(t);
+   hour_end = hour_start+3600;
+   hour_observed = hour_complete ? hour_start : t;
+   hour_pulses = 0;
+
+   projection_prepare();
+}
+
+/**********************************************************
+ * Function: period_rollover()
+ *
+ * Description:
+ *           Resets the daily and monthly counters if the
+ *           given time lies beyond the current day or
+ *           month. Called by whichever comes first, the
+ *           boundary timer or a pulse with a timestamp in
+ *           the new period, so that no pulse is booked to
+ *           the wrong day. A reading time stamped before the
+ *           current hour (processed after the boundary timer
+ *           fired) is booked to the current period. Caller
+ *           must hold config_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void period_rollover(time_t t)
+{
+   if (t < hour_start)
+      return;
+
+   if (t >= day_end)
    {
-      /* Pulse ended,  check validity */
-      if (pulse_started == 1)
+      /* Reset daily pulse counter */
+      syslog(LOG_DAEMON | LOG_NOTICE, "Resetting daily energy counter (current value %lu)\n",
+             pulse_count_daily);
+      pulse_count_daily=0;
+      memset(tariff_count_daily, 0, sizeof(tariff_count_daily));
+      memset(tariff_cost_daily, 0, sizeof(tariff_cost_daily));
+
+      /* Reset daily power distribution */
+      if (power_p5_daily.count > 0)
       {
-         pulse_started = 0;
-         clock_gettime(CLOCK_REALTIME, &pulse_end_ts);
-         pulse_length = time_diff_ms(pulse_end_ts, pulse_start_ts);
-#ifdef DEBUG
-         syslog(LOG_DAEMON | LOG_DEBUG, "Detected pulse with length %lu ms", pulse_length);
-#endif
-         /* If no reference pulse length was specified in the
-          * configuration file, we use the length of the first
-          * pulse as reference to validate the subsequent pulses
-          */
-         if (first && (config.pulse_length==0))
-         {
-             config.pulse_length = pulse_length;
-             pulse_delta = (config.pulse_length*config.pulse_tolerance)/100;
-             syslog(LOG_DAEMON | LOG_INFO, "Using pulse lenght %lu ms as reference", pulse_length);
-         }
+         syslog(LOG_DAEMON | LOG_NOTICE, "Daily power distribution: baseload (p5) %.0f W, p95 %.0f W\n",
+                quantile_get(&power_p5_daily), quantile_get(&power_p95_daily));
+      }
+      quantile_init(&power_p5_daily, 0.05);
+      quantile_init(&power_p95_daily, 0.95);
 
-         /* Check if pulse lenght is within expected limits
-          * (from energy meter data sheet), apply a tolerance
-          */
-         if (pulse_length > (config.pulse_length-pulse_delta) &&
-             pulse_length < (config.pulse_length+pulse_delta))
-         {
-            /* Pulse is valid, but more checks will be performed */
+      if (t >= month_end)
+      {
+         /* Reset monthly pulse counter */
+         syslog(LOG_DAEMON | LOG_NOTICE, "Resetting monthly energy counter (current value %lu)\n",
+                pulse_count_monthly);
+         pulse_count_monthly=0;
+         memset(tariff_count_monthly, 0, sizeof(tariff_count_monthly));
+         memset(tariff_cost_monthly, 0, sizeof(tariff_cost_monthly));
+         quantile_init(&power_p5_monthly, 0.05);
+         quantile_init(&power_p95_monthly, 0.95);
+         /* The first month of a replay in virtual time is partial */
+         month_observed = (month_end != 0) ? period_month_start(t, 0) : t;
+      }
 
-            now_ts = pulse_end_ts;
-            if (first)
-            {
-               first=0;
+      period_anchor(t);
+   }
 
-               syslog(LOG_DAEMON | LOG_INFO, "Detected first pulse with length %lu ms", pulse_length);
+   hour_rollover(t);
+}
 
-               /* Count pulses */
-               pulse_count_daily++;
-               pulse_count_monthly++;
+/**********************************************************
+ * Function: period_clock_set()
+ *
+ * Description:
+ *           Handles the system clock being set. If it was set
+ *           back before the current hour, counting goes on in
+ *           the current day and month (re-anchored to the
+ *           new time if it lies before them), with a new
+ *           hour and demand interval. Caller must hold
+ *           config_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void period_clock_set(time_t t)
+{
+   if (t >= hour_start)
+   {
+      period_rollover(t);
+      return;
+   }
 
-               /* Display updated measurements on LCD */
-               lcd_print(1, 0);
-               lcd_print(2, (unsigned int)(pulse_count_daily*config.wh_per_pulse));
-               lcd_print(3, (unsigned int)(pulse_count_monthly*config.wh_per_pulse));
-            }
-            else
-            {
-               /* Calculate elapsed time since last pulse occured */
-               t_diff = time_diff_ms(now_ts, prev_ts);
+   if (t < day_start)
+      period_anchor(t);
+   hour_rollover(t);
+   demand_clock_set();
+}
 
-               /* Filter pulses which occur very close to each other (possible glitches) */
-               if (t_diff > MIN_PULSE_PERIOD_MS)
-               {
-                  /* Calculate instant power (in Watt) and display it */
-                  power = (unsigned int)(config.wh_per_pulse*3600000.0/t_diff);
+/**********************************************************
+ * Function: energy_wh()
+ *
+ * Description:
+ *           Converts a pulse count to energy with the exact
+ *           meter constant, rounded once
+ *
+ * Returns:  energy (in Wh)
+ *********************************************************/
+static unsigned int energy_wh(unsigned long long pulses)
+{
+   return (unsigned int)meter_energy(&config.meter, pulses, 1);
+}
 
-                  /* Filter impossible high power values */
-                  if (power < config.max_power)
-                  {
-                     /* All filter checks passed, perform measurement/calculation */
-#ifdef DEBUG
-                     syslog(LOG_DAEMON | LOG_DEBUG, "Instant power is %u W\n", power);
-#endif
-                     /* Count pulses */
-                     pulse_count_daily++;
-                     pulse_count_monthly++;
-
-                     unsigned int energy_day = (unsigned int)(pulse_count_daily*config.wh_per_pulse);
-                     unsigned int energy_month = (unsigned int)(pulse_count_monthly*config.wh_per_pulse);
-
-                     /* Display updated measurements on LCD */
-                     lcd_print(1, power);
-                     lcd_print(2, energy_day);
-                     lcd_print(3, energy_month);
-
-                     /* Send data to EmonCMS via WebAPI */
-                     emon_data.inst_power = power;
-                     emon_data.energy_day = energy_day;
-                     emon_data.energy_month = energy_month;
-                     emoncms_send(&emon_data);
-                  }
-                  else
-                  {
-                     syslog(LOG_DAEMON | LOG_WARNING, "Instant power is out of range! (%u W)\n", power);
-                  }
-               }
-            }
-            prev_ts = now_ts;
-         }
-         else
-         {
-            syslog(LOG_DAEMON | LOG_WARNING, "Detected invalid pulse (length=%lu ms)\n", pulse_length);
-         }
-      }
-      else
+/**********************************************************
+ * Function: count_pulses()
+ *
+ * Description:
+ *           Counts valid pulses (or energy in units of the
+ *           meter constant) and books their energy and cost
+ *           to the tariff register active at the given time.
+ *           Caller must hold config_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void count_pulses(time_t t, unsigned long n)
+{
+   int reg;
+
+   BENCH_COUNT(BENCH_COUNTED, n);
+   flight_record(FLIGHT_COUNTED, 0, n);
+
+   pulse_count_daily += n;
+   pulse_count_monthly += n;
+   pulse_count_total += n;
+   hour_pulses += n;
+
+   if ((reg = tariff_lookup(t)) >= 0)
+   {
+      double cost = n*config.wh_per_pulse/1000.0*tariff_price(reg);
+
+      tariff_count_daily[reg] += n;
+      tariff_count_monthly[reg] += n;
+      tariff_cost_daily[reg] += cost;
+      tariff_cost_monthly[reg] += cost;
+   }
+   tariff_reg = reg;
+}
+
+/**********************************************************
+ * Function: sample_power()
+ *
+ * Description:
+ *           Adds the power of a pulse interval to the
+ *           daily and monthly power distribution. The power
+ *           is sampled on a fixed time grid, so that the
+ *           quantiles are weighted by time and not by the
+ *           number of pulses (which would favour high
+ *           loads). Caller must hold config_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void sample_power(struct timespec prev_ts, struct timespec now_ts, unsigned int power)
+{
+   time_t from = prev_ts.tv_sec;
+   long n;
+
+   /* Number of grid points within the pulse interval, not yet sampled
+    * for the interval of another channel */
+   if (from < power_sampled && power_sampled <= now_ts.tv_sec)
+      from = power_sampled;
+   n = now_ts.tv_sec/QUANTILE_SAMPLE_PERIOD - from/QUANTILE_SAMPLE_PERIOD;
+   power_sampled = now_ts.tv_sec;
+   if (n > QUANTILE_MAX_SAMPLES)
+      n = QUANTILE_MAX_SAMPLES;
+
+   for (; n > 0; n--)
+   {
+      quantile_add(&power_p5_daily, power);
+      quantile_add(&power_p95_daily, power);
+      quantile_add(&power_p5_monthly, power);
+      quantile_add(&power_p95_monthly, power);
+   }
+}
+
+/**********************************************************
+ * Function: projection_update()
+ *
+ * Description:
+ *           Projects the energy at the end of the day and
+ *           month: the energy so far, the rest of the current
+ *           hour at its rate so far and the remaining hours
+ *           as expected by the weekly profile, blended with
+ *           the average rate of the month so far. Caller
+ *           must hold config_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void projection_update(struct timespec ts, unsigned int power)
+{
+   double elapsed = (ts.tv_sec - hour_observed) + ts.tv_nsec/1e9;
+   double rate_hour;
+   double rate_month;
+   double rest;
+
+   /* Rate of the current hour (in Wh per hour) since it is
+    * observed, the instant power during the first minute */
+   if (elapsed >= 60)
+      rate_hour = hour_pulses*config.wh_per_pulse*3600.0/elapsed;
+   else
+      rate_hour = power;
+
+   /* Rate of the month since it is observed, the rate of the
+    * current hour during the first hour */
+   elapsed = ts.tv_sec - month_observed;
+   if (elapsed >= 3600)
+      rate_month = pulse_count_monthly*config.wh_per_pulse*3600.0/elapsed;
+   else
+      rate_month = rate_hour;
+
+   rest = profile_hour(hour_start, rate_hour)*(hour_end - ts.tv_sec)/3600.0;
+   if (rest < 0)
+      rest = 0;
+
+   proj_day = energy_wh(pulse_count_daily) +
+              (unsigned int)(rest + proj_rest_day + proj_hours_day*rate_month + 0.5);
+   proj_month = energy_wh(pulse_count_monthly) +
+                (unsigned int)(rest + proj_rest_month + proj_hours_month*rate_month + 0.5);
+}
+
+/**********************************************************
+ * Function: show_measurements()
+ *
+ * Description:
+ *           Displays the current measurements on the LCD
+ *           and streams them to the live clients. Caller
+ *           must hold config_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void show_measurements(struct timespec ts, unsigned int power)
+{
+   static time_t proj_minute = 0;
+   unsigned int energy_day = energy_wh(pulse_count_daily);
+   unsigned int energy_month = energy_wh(pulse_count_monthly);
+   unsigned long long energy_total = meter_energy(&config.meter, pulse_count_total, 1);
+   char tariff_json[96] = "";
+   double cost_day = 0;
+   double cost_month = 0;
+   unsigned int i;
+
+   lcd_print(1, power);
+   lcd_print(2, energy_day);
+   lcd_print(3, energy_month);
+
+   if (tariff_reg >= 0)
+   {
+      for (i=0; i<config.tariff.num_regs; i++)
       {
-         syslog(LOG_DAEMON | LOG_WARNING, "Detected ending pulse out of sequence");
+         cost_day += tariff_cost_daily[i];
+         cost_month += tariff_cost_monthly[i];
       }
+
+      /* Cost in cents, active register as T1 ... T4 */
+      lcd_print(4, (unsigned int)(cost_day*100+0.5));
+      lcd_print(5, (unsigned int)(cost_month*100+0.5));
+      lcd_print(6, tariff_reg+1);
+
+      snprintf(tariff_json, sizeof(tariff_json), ",\"tariff\":\"%s\",\"cost_day\":%.2f,\"cost_month\":%.2f",
+               tariff_name(tariff_reg), cost_day, cost_month);
+   }
+
+   sse_publish("pulse", "{\"time\":%ld.%03ld,\"power\":%u,\"energy_day\":%u,\"energy_month\":%u,\"energy_total\":%llu%s}",
+               (long)ts.tv_sec, ts.tv_nsec/1000000, power, energy_day, energy_month, energy_total, tariff_json);
+
+   /* Projected energy, streamed at most once per minute */
+   projection_update(ts, power);
+   lcd_print(7, proj_day);
+   lcd_print(8, proj_month);
+   if (ts.tv_sec/60 != proj_minute)
+   {
+      proj_minute = ts.tv_sec/60;
+      sse_publish("projection", "{\"time\":%ld,\"energy_day\":%u,\"energy_month\":%u}",
+                  (long)ts.tv_sec, proj_day, proj_month);
    }
 }
 
 /**********************************************************
- * Function: is_full_hour()
+ * Function: total_power()
  *
  * Description:
- *           Checks if the current time is the full hour.
+ *           Sums the last power of the channels feeding the
+ *           counters. Caller must hold config_lock.
  *
- * Returns:  1 if the current time is xx:00 min
- *           0 otherwise
+ * Returns:  power (in W)
  *********************************************************/
-static int is_full_hour(void)
+static unsigned int total_power(void)
 {
-   struct tm *now_tm;
-   time_t now = time(NULL);
+   unsigned int power = 0;
+   unsigned int i;
 
-   now_tm = localtime(&now);
-
-   return (now_tm->tm_min==0);
+   for (i=0; i<SOURCE_MAX_CHANNELS; i++)
+   {
+      if (config.channel[i].source != NULL && config.channel[i].feed_counters)
+         power += channel_power[i];
+   }
+   return power;
 }
 
 /**********************************************************
- * Function: is_midnight()
+ * Function: power_bound()
  *
  * Description:
- *           Checks if the current time is midnight.
+ *           Upper bound of the total power at the given time
+ *           for the relays between readings. A channel whose
+ *           power is the pulse period delivers at most one
+ *           pulse since its last one, the other channels
+ *           keep their last power. There is no bound for
+ *           readings in virtual time.
  *
- * Returns:  1 if the current time is 00:00 min
- *           0 otherwise
+ * Returns:  0 on success, <0 otherwise
  *********************************************************/
-static int is_midnight(void)
+static int power_bound(struct timespec now, unsigned int *power)
 {
-   struct tm *now_tm;
-   time_t now = time(NULL);
+   unsigned long t;
+   unsigned int p;
+   unsigned int i;
 
-   now_tm = localtime(&now);
+   if (source_clock)
+      return -1;
 
-   return ((now_tm->tm_hour==0) && (now_tm->tm_min==0));
+   *power = 0;
+   pthread_mutex_lock(&config_lock);
+   for (i=0; i<SOURCE_MAX_CHANNELS; i++)
+   {
+      if (config.channel[i].source == NULL || !config.channel[i].feed_counters)
+         continue;
+      p = channel_power[i];
+      if (power_pulsed[i] && now.tv_sec > pulse_ts[i].tv_sec &&
+          (t = time_diff_ms(now, pulse_ts[i])) > 0 && config.wh_per_pulse*3600000.0/t < p)
+         p = (unsigned int)(config.wh_per_pulse*3600000.0/t);
+      *power += p;
+   }
+   pthread_mutex_unlock(&config_lock);
+   return 0;
 }
 
 /**********************************************************
- * Function: is_first_dom()
+ * Function: process_measurement()
  *
  * Description:
- *           Checks if the current day is the first day
- *           of the month
+ *           Books the pulses measured up to ts on channel ch
+ *           (0 based) and passes its power since prev_ts to
+ *           the step detector of the channel and the total
+ *           power of all channels to the other consumers.
+ *           Caller must hold config_lock.
  *
- * Returns:  1 if the current day is 1
- *           0 otherwise
+ * Returns:  -
  *********************************************************/
-static int is_first_dom(void)
+static void process_measurement(unsigned int ch, struct timespec prev_ts, struct timespec ts,
+                                unsigned long pulses)
 {
-   struct tm *now_tm;
-   time_t now = time(NULL);
+   unsigned int power = total_power();
+   unsigned int demand;
+   unsigned int i;
+
+   /* Count pulses */
+   count_pulses(ts.tv_sec, pulses);
+
+   /* Track the demand and check the alarm limit */
+   demand = demand_update(ts, pulses*config.wh_per_pulse, power);
+
+   /* Shed or restore loads */
+   relay_update(ts, power, demand);
+
+   /* Detect appliances switching on and off */
+   steps_update(ch, ts, channel_power[ch]);
 
-   now_tm = localtime(&now);
+   /* Track the power distribution */
+   sample_power(prev_ts, ts, power);
 
-   return (now_tm->tm_mday == 1);
+   /* Display and stream updated measurements */
+   show_measurements(ts, power);
+
+   /* Send data to EmonCMS via WebAPI */
+   emon_data.inst_power = power;
+   emon_data.energy_day = energy_wh(pulse_count_daily);
+   emon_data.energy_month = energy_wh(pulse_count_monthly);
+   emon_data.energy_total = meter_energy(&config.meter, pulse_count_total, 1);
+   emon_data.num_regs = (tariff_reg >= 0) ? config.tariff.num_regs : 0;
+   for (i=0; i<emon_data.num_regs; i++)
+   {
+      emon_data.energy_day_reg[i] = energy_wh(tariff_count_daily[i]);
+      emon_data.energy_month_reg[i] = energy_wh(tariff_count_monthly[i]);
+      emon_data.cost_day_reg[i] = tariff_cost_daily[i];
+      emon_data.cost_month_reg[i] = tariff_cost_monthly[i];
+   }
+   emon_data.energy_day_proj = proj_day;
+   emon_data.energy_month_proj = proj_month;
+   emon_data.power_p5_day = (unsigned int)(quantile_get(&power_p5_daily)+0.5);
+   emon_data.power_p95_day = (unsigned int)(quantile_get(&power_p95_daily)+0.5);
+   emon_data.power_p5_month = (unsigned int)(quantile_get(&power_p5_monthly)+0.5);
+   emon_data.power_p95_month = (unsigned int)(quantile_get(&power_p95_monthly)+0.5);
+   emoncms_send(&emon_data);
 }
 
 /**********************************************************
- * Function: timer_handler()
+ * Function: exit_handler()
  *
  * Description:
- *           Handles the periodic timer event.
+ *           Handles the cleanup at reception of the
+ *           TERM or INT signal, in the event loop thread
+ *           (so no lock is held), and stops the loop.
  *
- *           It resets the daily and monthly energy counters
- *           at midnight and the first day of the month.
+ * Returns:  -
+ *********************************************************/
+static void exit_handler(void *arg)
+{
+   lcd_exit();
+   sse_exit();
+   relay_exit();
+   source_exit();
+   temp_exit();
+   syslog(LOG_DAEMON | LOG_NOTICE, "Exit Energy Monitor\n");
+   ev_stop();
+}
+
+/**********************************************************
+ * Function: process_reading()
+ *
+ * Description:
+ *           Handles a reading of a channel.
+ *
+ *           The values are streamed to the live clients.
+ *           If the channel feeds the counters, its pulses
+ *           and the increase of its import register (as
+ *           pulses, keeping the remainder) are counted and
+ *           its power is processed. Without a power value
+ *           the power is calculated from the time between
+ *           the last two pulses, filtering glitches and
+ *           impossible high values. Caller must hold
+ *           config_lock.
  *
  * Returns:  -
  *********************************************************/
-static void timer_handler(int signum)
+static void process_reading(unsigned int ch, const reading_t *r)
 {
-   static int reset_done=0;
-   static int save_done=0;
+   static const char *names[READING_VALUES] = READING_NAMES;
+   static struct timespec prev_ts[SOURCE_MAX_CHANNELS];
+   static struct timespec import_ts[SOURCE_MAX_CHANNELS];
+   static double last_import[SOURCE_MAX_CHANNELS];
+   static double rest_wh[SOURCE_MAX_CHANNELS];
+   static int have_power[SOURCE_MAX_CHANNELS];
+   static int have_pulse[SOURCE_MAX_CHANNELS];
+   static int have_total[SOURCE_MAX_CHANNELS];
+   static int have_import[SOURCE_MAX_CHANNELS];
+   const channel_conf_t *cc = &config.channel[ch];
+   struct timespec from;
+   unsigned long pulses = r->pulses;
+   unsigned long t_diff;
+   unsigned long max_wh;
+   double power = 0;
+   int power_valid = 1;
+   int pulsed = 0;
+   double delta;
+   char json[256];
+   size_t len;
+   int v;
+
+   if (cc->source == NULL)
+      return;
+   stats_count(ch, STATS_READINGS, 1);
 
-   /* Restart the timer */
-   if (setitimer(ITIMER_REAL, &timer, NULL) < 0)
+   /* Stream all values read (pulses are streamed as power) */
+   if (r->valid)
    {
-      syslog(LOG_DAEMON | LOG_ERR, "Unable to restart interval timer: %s\n", strerror (errno));
+      len = snprintf(json, sizeof(json), "{\"time\":%ld.%03ld,\"channel\":%u,\"source\":\"%s\"",
+                     (long)r->ts.tv_sec, r->ts.tv_nsec/1000000, ch+1, cc->source->name);
+      for (v=0; v<READING_VALUES && len<sizeof(json); v++)
+      {
+         /* e.g. a Modbus float read with the wrong word order */
+         if ((r->valid & (1 << v)) && r->value[v] > -STREAM_VALUE_MAX && r->value[v] < STREAM_VALUE_MAX)
+            len += snprintf(json+len, sizeof(json)-len, ",\"%s\":%.1f", names[v], r->value[v]);
+      }
+      sse_publish("meter", "%s}", json);
+   }
+
+   if (!cc->feed_counters)
       return;
+
+   flight_record(FLIGHT_READING, ch+1, r->pulses);
+
+   /* Book the values to the period of their timestamp */
+   period_rollover(r->ts.tv_sec);
+
+   from = have_power[ch] ? prev_ts[ch] : r->ts;
+
+   /* Total power, or the sum of the phases if the meter has no total
+    * (exported power counts as 0), or the power of the pulses
+    */
+   if (r->valid & (1 << READING_POWER))
+   {
+      power = r->value[READING_POWER];
+      have_total[ch] = 1;
+   }
+   else if ((r->valid & (7 << READING_POWER_L1)) == (7 << READING_POWER_L1) && !have_total[ch])
+   {
+      power = r->value[READING_POWER_L1] + r->value[READING_POWER_L2] + r->value[READING_POWER_L3];
+   }
+   else if (r->pulses > 0 && have_pulse[ch])
+   {
+      /* Calculate elapsed time since last pulse occured */
+      t_diff = time_diff_ms(r->ts, pulse_ts[ch]);
+      from = pulse_ts[ch];
+      pulse_ts[ch] = r->ts;
+
+      /* Filter pulses which occur very close to each other (possible glitches) */
+      if (t_diff <= config.min_pulse_period)
+      {
+         flight_record(FLIGHT_GLITCH, ch+1, t_diff);
+         stats_count(ch, STATS_GLITCH, r->pulses);
+         BENCH_COUNT(BENCH_FILTERED, r->pulses);
+         ratelog_event(&glitch_log, t_diff);
+         return;
+      }
+
+      /* Calculate instant power (in Watt) */
+      power = (unsigned int)(r->pulses*config.wh_per_pulse*3600000.0/t_diff);
+      pulsed = 1;
+
+      /* Filter impossible high power values */
+      if (power >= config.max_power)
+      {
+         flight_record(FLIGHT_POWER_RANGE, ch+1, power);
+         stats_count(ch, STATS_MAX_POWER, r->pulses);
+         BENCH_COUNT(BENCH_FILTERED, r->pulses);
+         if (ratelog_event(&power_log, power))
+            syslog(LOG_DAEMON | LOG_WARNING, "Instant power is out of range! (%.0f W)\n", power);
+         return;
+      }
+#ifdef DEBUG
+      syslog(LOG_DAEMON | LOG_DEBUG, "Instant power is %.0f W\n", power);
+#endif
+   }
+   else
+   {
+      /* No power value, or the first pulse */
+      power_valid = 0;
+   }
+   if (r->pulses > 0)
+   {
+      pulse_ts[ch] = r->ts;
+      have_pulse[ch] = 1;
+   }
+   if (power_valid && power >= config.max_power)
+   {
+      flight_record(FLIGHT_POWER_RANGE, ch+1, power);
+      stats_count(ch, STATS_MAX_POWER, 1);
+      if (ratelog_event(&power_log, power))
+         syslog(LOG_DAEMON | LOG_WARNING, "Channel %u: power is out of range! (%.0f W)\n", ch+1, power);
+      power_valid = 0;
+   }
+   if (power < 0)
+      power = 0;
+
+   if ((r->valid & (7 << READING_POWER_L1)) == (7 << READING_POWER_L1))
+   {
+      emon_data.num_phases = 3;
+      for (v=0; v<3; v++)
+         emon_data.power_phase[v] = (r->value[READING_POWER_L1+v] > 0) ? (unsigned int)(r->value[READING_POWER_L1+v]+0.5) : 0;
+   }
+   if (r->valid & (1 << READING_EXPORT))
+   {
+      emon_data.energy_export = (unsigned long long)r->value[READING_EXPORT];
    }
 
-   /* Check if it is midnight */
-   if (is_midnight())
+   /* Imported energy since the previous reading, as pulses */
+   if (r->valid & (1 << READING_IMPORT))
    {
-      if (!reset_done)
+      if (have_import[ch])
       {
-         /* Reset daily pulse counter */
-         syslog(LOG_DAEMON | LOG_NOTICE, "Resetting daily energy counter (current value %lu)\n",
-                pulse_count_daily);
-         pulse_count_daily=0;
-         reset_done=1;
+         delta = r->value[READING_IMPORT] - last_import[ch];
 
-         if(is_first_dom())
+         /* More than max_power could deliver: the meter was replaced or misread */
+         max_wh = config.max_power*(time_diff_ms(r->ts, import_ts[ch])/1000 + 1)/3600 + 1;
+         if (delta < 0 || delta > max_wh)
+         {
+            syslog(LOG_DAEMON | LOG_WARNING, "Channel %u: import register jumped by %.0f Wh, ignored\n",
+                   ch+1, delta);
+         }
+         else
          {
-            /* Reset monthly pulse counter */
-            syslog(LOG_DAEMON | LOG_NOTICE, "Resetting monthly energy counter (current value %lu)\n",
-                   pulse_count_monthly);
-            pulse_count_monthly=0;
+            rest_wh[ch] += delta;
+            pulses += (unsigned long)(rest_wh[ch]/config.wh_per_pulse);
+            rest_wh[ch] -= (pulses - r->pulses)*config.wh_per_pulse;
          }
       }
+      last_import[ch] = r->value[READING_IMPORT];
+      import_ts[ch] = r->ts;
+      have_import[ch] = 1;
    }
-   else
+
+   /* The outputs wait for the update from now. Pulses count one by
+    * one, readings of meters (without pulses) as one. */
+   if (power_valid || pulses > 0)
    {
-      reset_done=0;
+      stats_count(ch, STATS_ACCEPTED, (r->pulses > 0) ? r->pulses : 1);
+      stats_processed();
    }
 
-   /* Check if it is the full hour */
-   if (is_full_hour())
+   if (power_valid)
    {
-      if (!save_done)
+      channel_power[ch] = (unsigned int)(power+0.5);
+      power_pulsed[ch] = pulsed;
+      process_measurement(ch, from, r->ts, pulses);
+      prev_ts[ch] = r->ts;
+      have_power[ch] = 1;
+   }
+   else if (pulses > 0)
+   {
+      count_pulses(r->ts.tv_sec, pulses);
+      demand_update(r->ts, pulses*config.wh_per_pulse, total_power());
+      show_measurements(r->ts, total_power());
+   }
+}
+
+/**********************************************************
+ * Function: reading_handler()
+ *
+ * Description:
+ *           Handles a batch of readings delivered by the
+ *           input source of a channel
+ *
+ * Returns:  -
+ *********************************************************/
+static void reading_handler(unsigned int channel, const reading_t *r, unsigned int count, void *arg)
+{
+   unsigned int i;
+
+   if (channel < 1 || channel > SOURCE_MAX_CHANNELS)
+      return;
+
+   BENCH_COUNT(BENCH_DELIVERED, count);
+
+   pthread_mutex_lock(&config_lock);
+   for (i=0; i<count; i++)
+   {
+      BENCH_STAGE(BENCH_LOOP, &r[i].ts);
+      process_reading(channel-1, &r[i]);
+      BENCH_STAGE(BENCH_COUNTERS, &r[i].ts);
+      stats_since(STATS_EDGE_PROCESS, &r[i].ts);
+   }
+   pthread_mutex_unlock(&config_lock);
+}
+
+/**********************************************************
+ * Function: temp_handler()
+ *
+ * Description:
+ *           Handles the readings of the temperature sensors
+ *           of a 1-Wire bus. They are streamed to the live
+ *           clients and sent to EmonCMS with the next power
+ *           measurement, as temp_<name> (or temp_<id> for
+ *           sensors without a configured name).
+ *
+ * Returns:  -
+ *********************************************************/
+static void temp_handler(const temp_sample_t *s, void *arg)
+{
+   const char *name;
+   unsigned int i, j;
+
+   pthread_mutex_lock(&config_lock);
+
+   for (i=0; i<s->count; i++)
+   {
+      name = s->reading[i].id;
+      for (j=0; j<config.num_temp_sensors; j++)
       {
-         /* Save pulse counters to flash */
-         if (strlen(config.flash_dir) > 0)
+         if (strcmp(config.temp_sensor[j].id, name) == 0)
          {
-            write_flash(config.flash_dir, NV_FILENAME);
+            name = config.temp_sensor[j].name;
+            break;
          }
-         save_done=1;
       }
+
+      if (!s->reading[i].valid)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Invalid reading of temperature sensor %s\n", name);
+         continue;
+      }
+
+      sse_publish("temperature", "{\"time\":%ld,\"sensor\":\"%s\",\"name\":\"%s\",\"temp\":%.2f}",
+                  (long)s->ts.tv_sec, s->reading[i].id, name, s->reading[i].celsius);
+
+      /* Keep the latest reading of each sensor until it is sent */
+      for (j=0; j<emon_data.num_temps && strcmp(emon_data.temp_name[j], name) != 0; j++)
+         ;
+      if (j == TEMP_MAX_SENSORS)
+         continue;
+      if (j == emon_data.num_temps)
+      {
+         snprintf(emon_data.temp_name[j], TEMP_NAME_SIZE, "%s", name);
+         emon_data.num_temps++;
+      }
+      emon_data.temp[j] = s->reading[i].celsius;
    }
-   else
+
+   pthread_mutex_unlock(&config_lock);
+}
+
+/**********************************************************
+ * Function: profile_resource()
+ *
+ * Description:
+ *           Creates the weekly consumption profile document
+ *           for the local HTTP server
+ *
+ * Returns:  length of the document, <0 on error
+ *********************************************************/
+static int profile_resource(char *buf, size_t size)
+{
+   int len;
+
+   pthread_mutex_lock(&config_lock);
+   len = profile_json(buf, size);
+   pthread_mutex_unlock(&config_lock);
+
+   return len;
+}
+
+/**********************************************************
+ * Function: stats_resource()
+ *
+ * Description:
+ *           Creates the JSON document of the stats resource
+ *           with the rejected pulses and readings, the
+ *           counters per channel and the latencies
+ *
+ * Returns:  length of the document, <0 on error
+ *********************************************************/
+static int stats_resource(char *buf, size_t size)
+{
+   int len;
+   int n;
+
+   len = snprintf(buf, size, "{\"time\":%ld,\"rejected\":", (long)time(NULL));
+   if (len < 0 || (size_t)len >= size)
+      return -1;
+   if ((n = ratelog_json(buf+len, size-len)) < 0)
+      return -1;
+   len += n;
+   n = snprintf(buf+len, size-len, ",");
+   if (n < 0 || (size_t)n >= size-len)
+      return -1;
+   len += n;
+   if ((n = stats_json(buf+len, size-len)) < 0)
+      return -1;
+   len += n;
+   n = snprintf(buf+len, size-len, "}");
+   return ((size_t)n < size-len) ? len+n : -1;
+}
+
+/**********************************************************
+ * Function: stats_handler()
+ *
+ * Description:
+ *           Logs the summary of the rejected pulses and
+ *           readings, every STATS_INTERVAL s
+ *
+ * Returns:  -
+ *********************************************************/
+static void stats_handler(void *arg)
+{
+   ratelog_summary(STATS_INTERVAL);
+   ev_timer_add(STATS_INTERVAL*1000, stats_handler, NULL);
+}
+
+/**********************************************************
+ * Function: flight_handler()
+ *
+ * Description:
+ *           Handles the reception of the USR1 signal by
+ *           dumping the flight recorder to FLIGHT_FILE
+ *
+ * Returns:  -
+ *********************************************************/
+static void flight_handler(void *arg)
+{
+   int n;
+
+   if ((n = flight_dump(FLIGHT_FILE)) >= 0)
+      syslog(LOG_DAEMON | LOG_NOTICE, "Flight recorder: %d events dumped to %s\n", n, FLIGHT_FILE);
+}
+
+/**********************************************************
+ * Function: period_handler()
+ *
+ * Description:
+ *           Handles the full hour event of the period
+ *           scheduler (also called when the system clock
+ *           was set, the only case where the periods may go
+ *           back).
+ *
+ *           It resets the daily and monthly energy counters
+ *           at midnight and the first day of the month and
+ *           saves the counters once per hour. With readings
+ *           in virtual time both are left to the readings.
+ *
+ * Returns:  -
+ *********************************************************/
+static void period_handler(time_t now, int clock_set, void *arg)
+{
+   static time_t saved_hour=0;
+   time_t hour;
+   double p5_day, p95_day, p5_month, p95_month;
+   unsigned long samples;
+
+   pthread_mutex_lock(&config_lock);
+   if (!source_clock)
+   {
+      if (clock_set)
+         period_clock_set(now);
+      else
+         period_rollover(now);
+   }
+   p5_day = quantile_get(&power_p5_daily);
+   p95_day = quantile_get(&power_p95_daily);
+   p5_month = quantile_get(&power_p5_monthly);
+   p95_month = quantile_get(&power_p95_monthly);
+   samples = power_p5_daily.count;
+   pthread_mutex_unlock(&config_lock);
+
+   /* Stream the power distribution */
+   sse_publish("quantiles", "{\"time\":%ld,\"p5_day\":%.0f,\"p95_day\":%.0f,\"p5_month\":%.0f,\"p95_month\":%.0f,\"samples_day\":%lu}",
+               (long)now, p5_day, p95_day, p5_month, p95_month, samples);
+
+   /* Save pulse counters to flash */
+   hour = period_hour_start(now);
+   if (hour != saved_hour)
    {
-      save_done=0;
+      if (!source_clock && (config.flash_dir != NULL) && (strlen(config.flash_dir) > 0))
+      {
+         write_flash(config.flash_dir, NV_FILENAME);
+      }
+      saved_hour = hour;
    }
 }
 
@@ -626,6 +2039,8 @@ static void timer_handler(int signum)
  *********************************************************/
 int main(int argc, char **argv)
 {
+   unsigned int i;
+
    if (argc == 2)
    {
         const char* suffix = argv[1];
@@ -640,17 +2055,14 @@ int main(int argc, char **argv)
         strncpy(CONFIG_FILE, CONFIG_FILE_DEFAULT, BUFFER_SIZE);
         strncpy(NV_FILENAME, NV_FILENAME_DEFAULT, BUFFER_SIZE);
    }
+   snprintf(FLIGHT_FILE, sizeof(FLIGHT_FILE), FLIGHT_FILE_TEMPLATE, DAEMON_NAME);
 
    openlog(DAEMON_NAME, LOG_PID|LOG_CONS, LOG_USER);
    syslog(LOG_DAEMON | LOG_NOTICE, "Starting Energy Monitor (version %s)\n", VERSION);
 
-   /* Setup error handlers */
-   signal(SIGINT, exit_handler);   /* Ctrl-C */
-   signal(SIGTERM, exit_handler);  /* "regular" kill */
-   signal(SIGPIPE, sigpipe_handler);  /* write to closed socket */
-
-   /* Setup timer handler */
-   signal(SIGALRM, timer_handler);
+   /* Setup error handlers (TERM and INT are handled by the event loop) */
+   signal(SIGPIPE, SIG_IGN);       /* write to closed socket, handled by the clients */
+   signal(SIGCHLD, SIG_IGN);       /* alarm hooks are not waited for */
 
    /* Load configuration from .conf file */
    memset((void*)&config, 0, sizeof(config));
@@ -659,19 +2071,57 @@ int main(int argc, char **argv)
         syslog(LOG_DAEMON | LOG_ERR, "Can't load %s\n", CONFIG_FILE);
         return (1);
    }
-   if (config.pulse_tolerance == 0)
-        config.pulse_tolerance = PULSE_TOLERANCE;
+   if (check_config(&config) < 0)
+   {
+        syslog(LOG_DAEMON | LOG_ERR, "Invalid configuration, please check %s\n", CONFIG_FILE);
+        return (1);
+   }
 
    syslog(LOG_DAEMON | LOG_NOTICE, "Config parameters read from %s:\n", CONFIG_FILE);
    syslog(LOG_DAEMON | LOG_NOTICE, "***************************\n");
    syslog(LOG_DAEMON | LOG_NOTICE, "pulse_input_pin: %u\n", config.pulse_input_pin);
-   syslog(LOG_DAEMON | LOG_NOTICE, "wh_per_pulse: %f\n", config.wh_per_pulse);
+   syslog(LOG_DAEMON | LOG_NOTICE, "wh_per_pulse: %llu/%llu (%f)\n",
+          (unsigned long long)config.meter.num, (unsigned long long)config.meter.den, config.wh_per_pulse);
    syslog(LOG_DAEMON | LOG_NOTICE, "pulse_length: %u\n", config.pulse_length);
    syslog(LOG_DAEMON | LOG_NOTICE, "pulse_tolerance: %u\n", config.pulse_tolerance);
+   syslog(LOG_DAEMON | LOG_NOTICE, "min_pulse_period: %u\n", config.min_pulse_period);
    syslog(LOG_DAEMON | LOG_NOTICE, "max_power: %u\n", config.max_power);
    if (config.flash_dir != NULL)
       syslog(LOG_DAEMON | LOG_NOTICE, "flash_dir: %s\n", config.flash_dir);
+   if (config.lcdproc_host != NULL)
+      syslog(LOG_DAEMON | LOG_NOTICE, "lcdproc_host: %s\n", config.lcdproc_host);
    syslog(LOG_DAEMON | LOG_NOTICE, "lcdproc_port: %u\n", config.lcdproc_port);
+   syslog(LOG_DAEMON | LOG_NOTICE, "lcd_refresh_rate: %u\n", config.lcd_refresh_rate);
+   syslog(LOG_DAEMON | LOG_NOTICE, "sse_port: %u\n", config.sse_port);
+   syslog(LOG_DAEMON | LOG_NOTICE, "demand_limit: %u\n", config.demand_limit);
+   syslog(LOG_DAEMON | LOG_NOTICE, "demand_interval: %u\n", config.demand_interval);
+   syslog(LOG_DAEMON | LOG_NOTICE, "demand_hysteresis: %u\n", config.demand_hysteresis);
+   syslog(LOG_DAEMON | LOG_NOTICE, "step_min: %u\n", config.step_min);
+   syslog(LOG_DAEMON | LOG_NOTICE, "step_sensitivity: %u\n", config.step_sensitivity);
+   if (config.step_history != NULL)
+      syslog(LOG_DAEMON | LOG_NOTICE, "step_history: %s\n", config.step_history);
+   syslog(LOG_DAEMON | LOG_NOTICE, "profile_halflife: %u\n", config.profile_halflife);
+   if (config.modbus_device != NULL)
+   {
+      syslog(LOG_DAEMON | LOG_NOTICE, "modbus_device: %s\n", config.modbus_device);
+      syslog(LOG_DAEMON | LOG_NOTICE, "modbus_timeout: %u\n", config.modbus_timeout);
+      syslog(LOG_DAEMON | LOG_NOTICE, "modbus_pipeline: %u\n", config.modbus_pipeline);
+   }
+   for (i=0; i<SOURCE_MAX_CHANNELS; i++)
+   {
+      if (config.channel[i].source != NULL)
+         syslog(LOG_DAEMON | LOG_NOTICE, "channel%u: %s (feed_counters: %d)\n", i+1,
+                config.channel[i].source->name, config.channel[i].feed_counters);
+   }
+   if (config.temp_interval > 0)
+   {
+      syslog(LOG_DAEMON | LOG_NOTICE, "w1_dir: %s\n", config.w1_dir ? config.w1_dir : TEMP_W1_DIR);
+      syslog(LOG_DAEMON | LOG_NOTICE, "temp_interval: %u\n", config.temp_interval);
+      for (i=0; i<config.num_temp_sensors; i++)
+         syslog(LOG_DAEMON | LOG_NOTICE, "sensor: %s %s\n", config.temp_sensor[i].id, config.temp_sensor[i].name);
+   }
+   if (config.alarm_hook != NULL)
+      syslog(LOG_DAEMON | LOG_NOTICE, "alarm_hook: %s\n", config.alarm_hook);
    if (config.api_base_uri != NULL)
       syslog(LOG_DAEMON | LOG_NOTICE, "api_base_uri: %s\n", config.api_base_uri);
    if (config.api_key != NULL)
@@ -681,13 +2131,41 @@ int main(int argc, char **argv)
    syslog(LOG_DAEMON | LOG_NOTICE, "***************************\n");
 
    /* Fill in common data for WebAPI */
-   emon_data.api_base_uri = config.api_base_uri;
-   emon_data.api_key = config.api_key;
+   webapi_strings();
    emon_data.api_update_rate = config.api_update_rate;
    emon_data.node_number = config.node_number;
 
+   /* Setup the maximum demand alarm */
+   if (demand_init(config.demand_limit, config.demand_interval, config.demand_hysteresis, config.alarm_hook) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Invalid demand alarm parameters, alarm is disabled\n");
+   }
+
+   /* Setup the appliance detection */
+   steps_init(config.step_min, config.step_sensitivity, config.step_history);
+
+   /* Setup the weekly consumption profile */
+   profile_init(config.profile_halflife);
+
+   /* Activate the tariff schedule */
+   if (tariff_init(&config.tariff) > 0)
+   {
+      syslog(LOG_DAEMON | LOG_NOTICE, "tariff: %u registers\n", config.tariff.num_regs);
+   }
+
+   /* Set up the power distribution estimators */
+   quantile_init(&power_p5_daily, 0.05);
+   quantile_init(&power_p95_daily, 0.95);
+   quantile_init(&power_p5_monthly, 0.05);
+   quantile_init(&power_p95_monthly, 0.95);
+
    /* Load monthly and daily pulse counters from flash */
-   if (config.flash_dir != NULL)
+   source_clock = !source_wall_clock(config.channel);
+   if (source_clock)
+   {
+      syslog(LOG_DAEMON | LOG_NOTICE, "Readings in virtual time, the counters start from zero and are not saved\n");
+   }
+   else if (config.flash_dir != NULL)
    {
       read_flash(config.flash_dir, NV_FILENAME);
    }
@@ -696,60 +2174,111 @@ int main(int argc, char **argv)
       syslog(LOG_DAEMON | LOG_INFO, "No storage dir provided in config, disabling periodic storage of counter values");
    }
 
+   /* Discard the loaded counters if their day or month is over. In
+    * virtual time the first reading sets the periods. */
+   if (!source_clock)
+   {
+      period_anchor(saved_time > 0 ? saved_time : time(NULL));
+      period_rollover(time(NULL));
+
+      /* The monthly counter covers the whole month only if it was loaded */
+      if (saved_time >= period_month_start(time(NULL), 0))
+         month_observed = period_month_start(time(NULL), 0);
+      else
+         month_observed = time(NULL);
+   }
+
+   /* Create the event loop which multiplexes all sockets and timers */
+   if (ev_init() < 0)
+   {
+      return (5);
+   }
+
+   /* Clean up on TERM ("regular" kill) and INT (Ctrl-C), before any
+    * thread is created */
+   if (ev_add_signal(SIGTERM, exit_handler, NULL) < 0 ||
+       ev_add_signal(SIGINT, exit_handler, NULL) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Unable to setup TERM handler, the loads are not restored on exit\n");
+   }
+
+   /* Reload configuration on HUP (before any thread is created) */
+   if (ev_add_signal(SIGHUP, reload_handler, NULL) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Unable to setup HUP handler, reload is disabled\n");
+   }
+
+   /* Dump the flight recorder on USR1 */
+   if (ev_add_signal(SIGUSR1, flight_handler, NULL) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Unable to setup USR1 handler, flight recorder dump is disabled\n");
+   }
+
+   /* Start the live stream server, also serving the weekly profile
+    * and the stats */
+   sse_resource("/profile", profile_resource);
+   sse_resource("/stats", stats_resource);
+   if (config.sse_port > 0)
+   {
+      if (sse_init(config.sse_port) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Unable to start SSE server, live stream is disabled\n");
+      }
+   }
+
+   /* Setup the load shedding relays */
+   relay_init(config.relay_backend, config.relay_chip, config.relay_log,
+              config.relay, power_bound);
+
+   /* Start sampling the temperature sensors */
+   if (temp_init(config.w1_dir, config.temp_interval, temp_handler, NULL) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Unable to start temperature sampling\n");
+   }
+
    /* Init LCD screen */
    if (argc == 2)
    {
+      is_instance = 1;
       syslog(LOG_DAEMON | LOG_INFO, "Running as an instance, LCD will not be updated");
    }
-   else if (lcd_init() < 0)
+   else if (lcd_init(config.lcdproc_host, config.lcdproc_port, config.lcd_refresh_rate) < 0)
    {
       syslog(LOG_DAEMON | LOG_WARNING, "Unable to setup LCD screen, display is disabled\n");
    }
 
-   if (config.pulse_input_pin > 0)
+   /* Start the input sources of all channels */
+   if (source_init(config.channel, reading_handler, NULL) < 0)
    {
-      /* Initialise the GPIO lines */
-      if (wiringPiSetupGpio() < 0)
-      {
-         syslog(LOG_DAEMON | LOG_ERR, "Unable to setup GPIO: %s\n", strerror (errno));
-         return (2);
-      }
-      pinMode(config.pulse_input_pin, INPUT);
-      pullUpDnControl(config.pulse_input_pin, PUD_UP);
-      usleep(10000);
-
-      /* Generate interrupt on both edges on the inut pin */
-      if (wiringPiISR(config.pulse_input_pin, INT_EDGE_BOTH, gpio_handler) < 0)
-      {
-         syslog(LOG_DAEMON | LOG_ERR, "Unable to setup ISR for GPIO: %s\n", strerror (errno));
-         return (3);
-      }
+      syslog(LOG_DAEMON | LOG_WARNING, "Not all channels are measured, please check the configuration\n");
    }
 
-   /* Configure the timer period (one shot mode).
-    * Periodic interval timer is not reliable, it stops after some time.
-    * Therefore we restart the timer in the timer handler procedure.
-    */
-   timer.it_value.tv_sec = TIMER_PERIOD;
-   timer.it_value.tv_usec = 0;
-   timer.it_interval.tv_sec = 0; //TIMER_PERIOD;
-   timer.it_interval.tv_usec = 0;
+#ifdef BENCH
+   /* Drive the pulses of the benchmark */
+   if (bench_start(CONFIG_FILE) < 0)
+   {
+      return (7);
+   }
+#endif
 
-   /* Start an interval timer using the system clock */
-   if (setitimer(ITIMER_REAL, &timer, NULL) < 0)
+   /* Start the scheduler for the hour, day and month boundaries */
+   if (period_init(period_handler, NULL) < 0)
    {
-      syslog(LOG_DAEMON | LOG_ERR, "Unable to setup interval timer: %s\n", strerror (errno));
       return (4);
    }
 
+   /* Summarise the rejected pulses and readings */
+   ratelog_register(&glitch_log);
+   ratelog_register(&power_log);
+   ev_timer_add(STATS_INTERVAL*1000, stats_handler, NULL);
+
    /*
     * Initialization is done. All the other work will be done
-    * in the event handlers which are activated by the timer and
-    * GPIO interrupts.
+    * in the event loop, fed by the input sources.
     */
-   while (1)
+   if (ev_run() < 0)
    {
-      sleep(10);
+      return (6);
    }
 
    return (0);
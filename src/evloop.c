@@ -0,0 +1,598 @@
+/*
+ * Energy Monitor: event loop
+ *
+ * Description:
+ *   Single threaded epoll based event loop which multiplexes the
+ *   sockets and timers of the daemon. Work coming from other
+ *   threads (e.g. the GPIO interrupt thread) is handed over to
+ *   the loop thread with ev_post(), which wakes it up via an
+ *   eventfd.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+
+#include "evloop.h"
+#include "flight.h"
+
+/* Max number of watched file descriptors */
+#define EV_MAX_FDS 64
+
+/* Max number of pending timers */
+#define EV_MAX_TIMERS 32
+
+/* Max number of queued cross thread calls */
+#define EV_MAX_POSTS 256
+
+/* Max number of handled signals */
+#define EV_MAX_SIGNALS 8
+
+typedef struct
+{
+   int fd;
+   unsigned int events;
+   ev_io_cb cb;
+   void *arg;
+} ev_io_t;
+
+typedef struct
+{
+   int id;
+   unsigned long long deadline;
+   ev_cb cb;
+   void *arg;
+} ev_timer_t;
+
+typedef struct
+{
+   ev_cb cb;
+   void *arg;
+} ev_post_t;
+
+typedef struct
+{
+   int signum;
+   ev_cb cb;
+   void *arg;
+} ev_signal_t;
+
+static int epfd = -1;
+static int wakefd = -1;
+static int running = 0;
+static int next_timer_id = 1;
+
+static ev_io_t ios[EV_MAX_FDS];
+static ev_timer_t timers[EV_MAX_TIMERS];
+
+static ev_post_t posts[EV_MAX_POSTS];
+static unsigned int post_head = 0;
+static unsigned int post_tail = 0;
+static pthread_mutex_t post_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sigfd = -1;
+static sigset_t sigmask;
+static ev_signal_t signals[EV_MAX_SIGNALS];
+
+
+/**********************************************************
+ * Internal function: ev_find_fd()
+ *
+ * Description:
+ *           Find the watcher slot of a file descriptor
+ *
+ * Returns:  pointer to slot, NULL if not found
+ *********************************************************/
+static ev_io_t *ev_find_fd(int fd)
+{
+   int i;
+
+   for (i=0; i<EV_MAX_FDS; i++)
+   {
+      if (ios[i].fd == fd && ios[i].cb != NULL)
+         return &ios[i];
+   }
+   return NULL;
+}
+
+/**********************************************************
+ * Internal function: ev_to_epoll()
+ *
+ * Description:
+ *           Convert EV_xxx flags to epoll flags
+ *
+ * Returns:  epoll event mask
+ *********************************************************/
+static unsigned int ev_to_epoll(unsigned int events)
+{
+   unsigned int mask = 0;
+
+   if (events & EV_READ)  mask |= EPOLLIN;
+   if (events & EV_WRITE) mask |= EPOLLOUT;
+   return mask;
+}
+
+/**********************************************************
+ * Internal function: ev_run_posts()
+ *
+ * Description:
+ *           Execute the calls queued by ev_post()
+ *
+ * Returns:  -
+ *********************************************************/
+static void ev_run_posts(void)
+{
+   uint64_t val;
+   ev_post_t p;
+
+   /* Reset the wakeup counter */
+   if (read(wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Event loop wakeup read failed: %s\n", strerror(errno));
+   }
+
+   while (1)
+   {
+      pthread_mutex_lock(&post_lock);
+      if (post_tail == post_head)
+      {
+         pthread_mutex_unlock(&post_lock);
+         break;
+      }
+      p = posts[post_tail % EV_MAX_POSTS];
+      post_tail++;
+      pthread_mutex_unlock(&post_lock);
+
+      p.cb(p.arg);
+   }
+}
+
+/**********************************************************
+ * Internal function: ev_run_signals()
+ *
+ * Description:
+ *           Dispatch the signals received via the signalfd
+ *
+ * Returns:  -
+ *********************************************************/
+static void ev_run_signals(void)
+{
+   struct signalfd_siginfo si;
+   int i;
+
+   while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+   {
+      for (i=0; i<EV_MAX_SIGNALS; i++)
+      {
+         if (signals[i].cb != NULL && signals[i].signum == si.ssi_signo)
+            signals[i].cb(signals[i].arg);
+      }
+   }
+}
+
+/**********************************************************
+ * Internal function: ev_run_timers()
+ *
+ * Description:
+ *           Execute all expired timers and compute the time
+ *           until the next one expires
+ *
+ * Returns:  epoll_wait() timeout (in ms), -1 if no timer
+ *********************************************************/
+static int ev_run_timers(void)
+{
+   unsigned long long now = ev_now_ms();
+   unsigned long long next = 0;
+   ev_cb cb;
+   void *arg;
+   int i;
+
+   for (i=0; i<EV_MAX_TIMERS; i++)
+   {
+      if (timers[i].id && timers[i].deadline <= now)
+      {
+         /* Free the slot first, the callback may re-arm */
+         cb = timers[i].cb;
+         arg = timers[i].arg;
+         flight_record(FLIGHT_TIMER, 0, timers[i].id);
+         timers[i].id = 0;
+         cb(arg);
+      }
+   }
+
+   for (i=0; i<EV_MAX_TIMERS; i++)
+   {
+      if (timers[i].id && (next == 0 || timers[i].deadline < next))
+         next = timers[i].deadline;
+   }
+
+   if (next == 0)
+      return -1;
+
+   now = ev_now_ms();
+   return (next > now) ? (int)(next - now) : 0;
+}
+
+
+/**********************************************************
+ * Public function: ev_now_ms()
+ *
+ * Description:
+ *           Read the monotonic clock
+ *
+ * Returns:  current time (in ms)
+ *********************************************************/
+unsigned long long ev_now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/**********************************************************
+ * Public function: ev_init()
+ *
+ * Description:
+ *           Create the event loop. Must be called before
+ *           any other ev_xxx() function.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_init(void)
+{
+   struct epoll_event ev;
+   int i;
+
+   for (i=0; i<EV_MAX_FDS; i++)
+      ios[i].fd = -1;
+
+   if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to create event loop: %s\n", strerror(errno));
+      return -1;
+   }
+
+   if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to create event loop wakeup: %s\n", strerror(errno));
+      close(epfd);
+      epfd = -1;
+      return -2;
+   }
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.fd = wakefd;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to register event loop wakeup: %s\n", strerror(errno));
+      return -3;
+   }
+
+   return 0;
+}
+
+/**********************************************************
+ * Public function: ev_run()
+ *
+ * Description:
+ *           Run the event loop in the calling thread until
+ *           ev_stop() is called.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_run(void)
+{
+   struct epoll_event evs[16];
+   unsigned int events;
+   ev_io_t *io;
+   int timeout;
+   int n, i;
+
+   if (epfd < 0)
+      return -1;
+
+   running = 1;
+   while (running)
+   {
+      timeout = ev_run_timers();
+
+      n = epoll_wait(epfd, evs, sizeof(evs)/sizeof(evs[0]), timeout);
+      if (n < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         syslog(LOG_DAEMON | LOG_ERR, "Event loop wait failed: %s\n", strerror(errno));
+         return -2;
+      }
+
+      for (i=0; i<n; i++)
+      {
+         if (evs[i].data.fd == wakefd)
+         {
+            ev_run_posts();
+            continue;
+         }
+         if (evs[i].data.fd == sigfd)
+         {
+            ev_run_signals();
+            continue;
+         }
+
+         /* The watcher may have been removed by a previous callback */
+         if ((io = ev_find_fd(evs[i].data.fd)) == NULL)
+            continue;
+
+         events = 0;
+         if (evs[i].events & EPOLLIN)  events |= EV_READ;
+         if (evs[i].events & EPOLLOUT) events |= EV_WRITE;
+         if (evs[i].events & (EPOLLERR | EPOLLHUP)) events |= EV_ERROR;
+         io->cb(io->fd, events, io->arg);
+      }
+   }
+
+   return 0;
+}
+
+/**********************************************************
+ * Public function: ev_stop()
+ *
+ * Description:
+ *           Make ev_run() return after the current iteration
+ *
+ * Returns:  -
+ *********************************************************/
+void ev_stop(void)
+{
+   running = 0;
+}
+
+/**********************************************************
+ * Public function: ev_add_fd()
+ *
+ * Description:
+ *           Watch a (non-blocking) file descriptor for the
+ *           given EV_READ/EV_WRITE events
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_add_fd(int fd, unsigned int events, ev_io_cb cb, void *arg)
+{
+   struct epoll_event ev;
+   int i;
+
+   for (i=0; i<EV_MAX_FDS; i++)
+   {
+      if (ios[i].cb == NULL)
+         break;
+   }
+   if (i == EV_MAX_FDS)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Event loop: too many file descriptors\n");
+      return -1;
+   }
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = ev_to_epoll(events);
+   ev.data.fd = fd;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Event loop: unable to watch fd %d: %s\n", fd, strerror(errno));
+      return -2;
+   }
+
+   ios[i].fd = fd;
+   ios[i].events = events;
+   ios[i].cb = cb;
+   ios[i].arg = arg;
+   return 0;
+}
+
+/**********************************************************
+ * Public function: ev_mod_fd()
+ *
+ * Description:
+ *           Change the events watched on a file descriptor
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_mod_fd(int fd, unsigned int events)
+{
+   struct epoll_event ev;
+   ev_io_t *io;
+
+   if ((io = ev_find_fd(fd)) == NULL)
+      return -1;
+
+   /* Avoid the syscall if nothing changes */
+   if (io->events == events)
+      return 0;
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = ev_to_epoll(events);
+   ev.data.fd = fd;
+   if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+      return -2;
+
+   io->events = events;
+   return 0;
+}
+
+/**********************************************************
+ * Public function: ev_del_fd()
+ *
+ * Description:
+ *           Stop watching a file descriptor (call this
+ *           before closing it)
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_del_fd(int fd)
+{
+   ev_io_t *io;
+
+   if ((io = ev_find_fd(fd)) == NULL)
+      return -1;
+
+   epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+   io->fd = -1;
+   io->cb = NULL;
+   io->arg = NULL;
+   return 0;
+}
+
+/**********************************************************
+ * Public function: ev_timer_add()
+ *
+ * Description:
+ *           Arm a one shot timer which calls cb after the
+ *           given delay (in ms)
+ *
+ * Returns:  timer id (>0) on success, <0 otherwise
+ *********************************************************/
+int ev_timer_add(unsigned long delay_ms, ev_cb cb, void *arg)
+{
+   int i;
+
+   for (i=0; i<EV_MAX_TIMERS; i++)
+   {
+      if (timers[i].id == 0)
+      {
+         timers[i].id = next_timer_id++;
+         if (next_timer_id <= 0)
+            next_timer_id = 1;
+         timers[i].deadline = ev_now_ms() + delay_ms;
+         timers[i].cb = cb;
+         timers[i].arg = arg;
+         return timers[i].id;
+      }
+   }
+
+   syslog(LOG_DAEMON | LOG_WARNING, "Event loop: too many timers\n");
+   return -1;
+}
+
+/**********************************************************
+ * Public function: ev_timer_cancel()
+ *
+ * Description:
+ *           Cancel a pending timer
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_timer_cancel(int id)
+{
+   int i;
+
+   if (id <= 0)
+      return -1;
+
+   for (i=0; i<EV_MAX_TIMERS; i++)
+   {
+      if (timers[i].id == id)
+      {
+         timers[i].id = 0;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+/**********************************************************
+ * Public function: ev_post()
+ *
+ * Description:
+ *           Queue a call of cb in the event loop thread.
+ *           This is the only ev_xxx() function which may be
+ *           called from other threads.
+ *
+ * Returns:  0 on success, <0 otherwise (queue full)
+ *********************************************************/
+int ev_post(ev_cb cb, void *arg)
+{
+   uint64_t one = 1;
+
+   pthread_mutex_lock(&post_lock);
+   if (post_head - post_tail >= EV_MAX_POSTS)
+   {
+      pthread_mutex_unlock(&post_lock);
+      return -1;
+   }
+   posts[post_head % EV_MAX_POSTS].cb = cb;
+   posts[post_head % EV_MAX_POSTS].arg = arg;
+   post_head++;
+   pthread_mutex_unlock(&post_lock);
+
+   if (write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      return -2;
+
+   return 0;
+}
+
+/**********************************************************
+ * Public function: ev_add_signal()
+ *
+ * Description:
+ *           Handle a signal in the event loop thread instead
+ *           of an asynchronous signal handler. Must be called
+ *           before any other thread is created, so that all
+ *           threads inherit the blocked signal mask.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_add_signal(int signum, ev_cb cb, void *arg)
+{
+   struct epoll_event ev;
+   int i;
+
+   for (i=0; i<EV_MAX_SIGNALS; i++)
+   {
+      if (signals[i].cb == NULL)
+         break;
+   }
+   if (i == EV_MAX_SIGNALS)
+      return -1;
+
+   if (sigfd < 0)
+      sigemptyset(&sigmask);
+   sigaddset(&sigmask, signum);
+   if (pthread_sigmask(SIG_BLOCK, &sigmask, NULL) != 0)
+      return -2;
+
+   if (sigfd < 0)
+   {
+      if ((sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Unable to create signalfd: %s\n", strerror(errno));
+         return -3;
+      }
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.fd = sigfd;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+         return -4;
+   }
+   else if (signalfd(sigfd, &sigmask, 0) < 0)
+   {
+      return -3;
+   }
+
+   signals[i].signum = signum;
+   signals[i].cb = cb;
+   signals[i].arg = arg;
+   return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Energy Monitor: event loop
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+/* Event flags for ev_add_fd()/ev_mod_fd() */
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4
+
+/* Callback types */
+typedef void (*ev_io_cb)(int fd, unsigned int events, void *arg);
+typedef void (*ev_cb)(void *arg);
+
+/**********************************************************
+ * Public function: ev_init()
+ *
+ * Description:
+ *           Create the event loop. Must be called before
+ *           any other ev_xxx() function.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_init(void);
+
+/**********************************************************
+ * Public function: ev_run()
+ *
+ * Description:
+ *           Run the event loop in the calling thread until
+ *           ev_stop() is called.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_run(void);
+
+/**********************************************************
+ * Public function: ev_stop()
+ *
+ * Description:
+ *           Make ev_run() return after the current iteration
+ *
+ * Returns:  -
+ *********************************************************/
+void ev_stop(void);
+
+/**********************************************************
+ * Public function: ev_add_fd()
+ *
+ * Description:
+ *           Watch a (non-blocking) file descriptor for the
+ *           given EV_READ/EV_WRITE events
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_add_fd(int fd, unsigned int events, ev_io_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: ev_mod_fd()
+ *
+ * Description:
+ *           Change the events watched on a file descriptor
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_mod_fd(int fd, unsigned int events);
+
+/**********************************************************
+ * Public function: ev_del_fd()
+ *
+ * Description:
+ *           Stop watching a file descriptor (call this
+ *           before closing it)
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_del_fd(int fd);
+
+/**********************************************************
+ * Public function: ev_timer_add()
+ *
+ * Description:
+ *           Arm a one shot timer which calls cb after the
+ *           given delay (in ms)
+ *
+ * Returns:  timer id (>0) on success, <0 otherwise
+ *********************************************************/
+int ev_timer_add(unsigned long delay_ms, ev_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: ev_timer_cancel()
+ *
+ * Description:
+ *           Cancel a pending timer
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_timer_cancel(int id);
+
+/**********************************************************
+ * Public function: ev_post()
+ *
+ * Description:
+ *           Queue a call of cb in the event loop thread.
+ *           This is the only ev_xxx() function which may be
+ *           called from other threads.
+ *
+ * Returns:  0 on success, <0 otherwise (queue full)
+ *********************************************************/
+int ev_post(ev_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: ev_add_signal()
+ *
+ * Description:
+ *           Handle a signal in the event loop thread instead
+ *           of an asynchronous signal handler. Must be called
+ *           before any other thread is created, so that all
+ *           threads inherit the blocked signal mask.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int ev_add_signal(int signum, ev_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: ev_now_ms()
+ *
+ * Description:
+ *           Read the monotonic clock
+ *
+ * Returns:  current time (in ms)
+ *********************************************************/
+unsigned long long ev_now_ms(void);
+
+#endif /* __EVLOOP_H__ */
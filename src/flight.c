@@ -0,0 +1,159 @@
+/*
+ * Energy Monitor: flight recorder of recent events
+ *
+ * Description:
+ *   When the counters disagree with the utility meter, the debug log
+ *   (compile time only, and too expensive to leave on) is of no help.
+ *   Instead the edges, filter decisions, uploads and timers are always
+ *   recorded in a ring of FLIGHT_RECORDS binary records in RAM, each
+ *   costing a clock read and an atomic increment.
+ *
+ *   The ring is written to a file on SIGUSR1 and turned into text by
+ *   emond-flightdump (flightdump.c). A record is marked FLIGHT_NONE
+ *   while it is written, records being written while the ring is
+ *   dumped appear as incomplete.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "flight.h"
+
+/* Records copied at once by the dump */
+#define FLIGHT_CHUNK 256
+
+/* Ring of records, the index wraps consistently as FLIGHT_RECORDS
+ * is a power of 2 */
+static flight_rec_t ring[FLIGHT_RECORDS];
+static unsigned long head = 0;
+static int full = 0;
+
+
+/**********************************************************
+ * Internal function: flight_copy()
+ *
+ * Description:
+ *           Copy n records from the ring, starting at index
+ *           i. Records which are written meanwhile are
+ *           copied as FLIGHT_NONE.
+ *
+ * Returns:  -
+ *********************************************************/
+static void flight_copy(flight_rec_t *dst, unsigned long i, unsigned long n)
+{
+   uint16_t type;
+
+   for (; n > 0; n--, i++, dst++)
+   {
+      type = __atomic_load_n(&ring[i].type, __ATOMIC_ACQUIRE);
+      *dst = ring[i];
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&ring[i].type, __ATOMIC_RELAXED) != type)
+         type = FLIGHT_NONE;
+      dst->type = type;
+   }
+}
+
+
+/**********************************************************
+ * Public function: flight_record()
+ *
+ * Description:
+ *           Record an event with the current time. Lock
+ *           free, may be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void flight_record(unsigned int type, unsigned int ch, unsigned long value)
+{
+   struct timespec ts;
+   flight_rec_t *rec;
+   unsigned long i;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   i = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+   if (i == FLIGHT_RECORDS-1)
+      __atomic_store_n(&full, 1, __ATOMIC_RELAXED);
+
+   /* Invalidate the record before the fields change */
+   rec = &ring[i % FLIGHT_RECORDS];
+   __atomic_store_n(&rec->type, FLIGHT_NONE, __ATOMIC_RELEASE);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   rec->sec = (uint32_t)ts.tv_sec;
+   rec->nsec = (uint32_t)ts.tv_nsec;
+   rec->ch = (uint16_t)ch;
+   rec->value = (uint32_t)value;
+   __atomic_store_n(&rec->type, (uint16_t)type, __ATOMIC_RELEASE);
+}
+
+/**********************************************************
+ * Public function: flight_dump()
+ *
+ * Description:
+ *           Write the recorded events to a file, to be read
+ *           with emond-flightdump
+ *
+ * Returns:  number of records on success, <0 otherwise
+ *********************************************************/
+int flight_dump(const char *path)
+{
+   flight_rec_t chunk[FLIGHT_CHUNK];
+   flight_hdr_t hdr;
+   unsigned long end;
+   unsigned long k;
+   unsigned long n;
+   unsigned long first;
+   unsigned long i;
+   FILE *f;
+   int res = 0;
+
+   end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+   n = __atomic_load_n(&full, __ATOMIC_RELAXED) ? FLIGHT_RECORDS : end;
+   first = end - n;
+
+   if ((f = fopen(path, "w")) == NULL)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to create flight recorder dump %s: %s\n", path, strerror(errno));
+      return -1;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = FLIGHT_MAGIC;
+   hdr.version = FLIGHT_VERSION;
+   hdr.rec_size = sizeof(flight_rec_t);
+   hdr.records = n;
+   hdr.total = end;
+   if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+      res = -2;
+
+   /* Oldest first, in chunks which do not wrap */
+   i = first % FLIGHT_RECORDS;
+   while (res == 0 && n > 0)
+   {
+      k = (n < FLIGHT_CHUNK) ? n : FLIGHT_CHUNK;
+      if (k > FLIGHT_RECORDS - i)
+         k = FLIGHT_RECORDS - i;
+      flight_copy(chunk, i, k);
+      if (fwrite(chunk, sizeof(flight_rec_t), k, f) != k)
+         res = -2;
+      n -= k;
+      i = (i + k) % FLIGHT_RECORDS;
+   }
+
+   if (fclose(f) != 0)
+      res = -2;
+   if (res < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to write flight recorder dump %s\n", path);
+      return res;
+   }
+
+   flight_record(FLIGHT_DUMP, 0, hdr.records);
+   return hdr.records;
+}
@@ -0,0 +1,81 @@
+/*
+ * Energy Monitor: flight recorder of recent events
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stdint.h>
+
+/* Records kept in the ring (16 bytes each) */
+#define FLIGHT_RECORDS 16384
+
+/* Dump file format */
+#define FLIGHT_MAGIC 0x52464d45  /* "EMFR" */
+#define FLIGHT_VERSION 1
+
+/* Recorded events */
+enum
+{
+   FLIGHT_NONE,
+   FLIGHT_EDGE,         /* edge on the pulse input, ch: GPIO pin, value: level */
+   FLIGHT_PULSE,        /* valid pulse queued, value: length (ms) */
+   FLIGHT_INVALID,      /* pulse of invalid length, value: length (ms) */
+   FLIGHT_SEQUENCE,     /* edge out of sequence, value: level */
+   FLIGHT_QUEUE_FULL,   /* pulse queue full, value: pulses lost */
+   FLIGHT_READING,      /* reading processed, ch: channel, value: pulses */
+   FLIGHT_GLITCH,       /* pulse too close, ch: channel, value: interval (ms) */
+   FLIGHT_POWER_RANGE,  /* power out of range, ch: channel, value: power (W) */
+   FLIGHT_COUNTED,      /* pulses booked to the counters, value: pulses */
+   FLIGHT_UPLOAD,       /* data sent to EmonCMS, value: curl result (0 ok) */
+   FLIGHT_TIMER,        /* timer expired, value: timer id */
+   FLIGHT_DUMP,         /* recorder dumped, value: records */
+   FLIGHT_TYPES
+};
+
+/* Record, also the format of the dump file */
+typedef struct
+{
+   uint32_t sec;        /* CLOCK_REALTIME */
+   uint32_t nsec;
+   uint16_t type;
+   uint16_t ch;
+   uint32_t value;
+} flight_rec_t;
+
+/* Header of the dump file, followed by the records (oldest first) */
+typedef struct
+{
+   uint32_t magic;
+   uint16_t version;
+   uint16_t rec_size;
+   uint32_t records;    /* in the file */
+   uint32_t total;      /* recorded since the start (modulo 2^32) */
+} flight_hdr_t;
+
+/**********************************************************
+ * Public function: flight_record()
+ *
+ * Description:
+ *           Record an event with the current time. Lock
+ *           free, may be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void flight_record(unsigned int type, unsigned int ch, unsigned long value);
+
+/**********************************************************
+ * Public function: flight_dump()
+ *
+ * Description:
+ *           Write the recorded events to a file, to be read
+ *           with emond-flightdump
+ *
+ * Returns:  number of records on success, <0 otherwise
+ *********************************************************/
+int flight_dump(const char *path);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,108 @@
+/*
+ * Energy Monitor: decoder of the flight recorder dump
+ *
+ * Description:
+ *   Prints the events of a flight recorder dump (see flight.c) as
+ *   text, one line per event with its local time:
+ *
+ *     kill -USR1 $(pidof emond)
+ *     emond-flightdump /tmp/emond.flight
+ *
+ *   Build command:
+ *   gcc -o emond-flightdump flightdump.c
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "flight.h"
+
+/* Text of the events: name, label of the channel (NULL if none),
+ * label and unit of the value */
+static const struct
+{
+   const char *name;
+   const char *ch;
+   const char *value;
+   const char *unit;
+} events[FLIGHT_TYPES] =
+{
+   [FLIGHT_NONE]        = { "incomplete", NULL, "value", "" },
+   [FLIGHT_EDGE]        = { "edge", "GPIO", "level", "" },
+   [FLIGHT_PULSE]       = { "pulse", "GPIO", "length", " ms" },
+   [FLIGHT_INVALID]     = { "invalid", "GPIO", "length", " ms" },
+   [FLIGHT_SEQUENCE]    = { "sequence", "GPIO", "level", "" },
+   [FLIGHT_QUEUE_FULL]  = { "queue_full", "channel", "lost", "" },
+   [FLIGHT_READING]     = { "reading", "channel", "pulses", "" },
+   [FLIGHT_GLITCH]      = { "glitch", "channel", "interval", " ms" },
+   [FLIGHT_POWER_RANGE] = { "power_range", "channel", "power", " W" },
+   [FLIGHT_COUNTED]     = { "counted", NULL, "pulses", "" },
+   [FLIGHT_UPLOAD]      = { "upload", NULL, "result", "" },
+   [FLIGHT_TIMER]       = { "timer", NULL, "id", "" },
+   [FLIGHT_DUMP]        = { "dump", NULL, "events", "" },
+};
+
+
+int main(int argc, char **argv)
+{
+   const char *path = (argc > 1) ? argv[1] : "/tmp/emond.flight";
+   flight_hdr_t hdr;
+   flight_rec_t rec;
+   struct tm tm;
+   time_t t;
+   char date[32];
+   unsigned long n;
+   FILE *f;
+
+   if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
+   {
+      fprintf(stderr, "Usage: emond-flightdump [dump file]\n");
+      return 1;
+   }
+
+   if ((f = fopen(path, "r")) == NULL)
+   {
+      fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+      return 1;
+   }
+
+   if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != FLIGHT_MAGIC ||
+       hdr.version != FLIGHT_VERSION || hdr.rec_size != sizeof(rec))
+   {
+      fprintf(stderr, "%s is no flight recorder dump of this version\n", path);
+      fclose(f);
+      return 1;
+   }
+
+   printf("# %u events (of %u recorded)\n", hdr.records, hdr.total);
+   for (n = 0; n < hdr.records && fread(&rec, sizeof(rec), 1, f) == 1; n++)
+   {
+      t = rec.sec;
+      localtime_r(&t, &tm);
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+      printf("%s.%06u  ", date, rec.nsec/1000);
+      if (rec.type >= FLIGHT_TYPES || events[rec.type].name == NULL)
+      {
+         printf("unknown(%u) %u %lu\n", rec.type, rec.ch, (unsigned long)rec.value);
+         continue;
+      }
+      printf("%-12s", events[rec.type].name);
+      if (events[rec.type].ch != NULL)
+         printf(" %s %u", events[rec.type].ch, rec.ch);
+      printf(" %s %lu%s\n", events[rec.type].value, (unsigned long)rec.value, events[rec.type].unit);
+   }
+   fclose(f);
+
+   if (n < hdr.records)
+   {
+      fprintf(stderr, "%s is truncated after %lu events\n", path, n);
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Energy Monitor: hardware abstraction of the GPIO pins
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __HAL_H__
+#define __HAL_H__
+
+#include <time.h>
+
+/* Environment variable with the edge file of the mock backend */
+#define HAL_MOCK_ENV "EMOND_GPIO_MOCK"
+
+/* Max number of input pins with an edge callback */
+#define HAL_MAX_INPUTS 4
+
+/* Called on each edge of an input pin, in the interrupt thread */
+typedef void (*hal_edge_cb)(void);
+
+/**********************************************************
+ * Public function: hal_init()
+ *
+ * Description:
+ *           Initialise the GPIO backend (BCM pin numbers),
+ *           may be called more than once
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_init(void);
+
+/**********************************************************
+ * Public function: hal_name()
+ *
+ * Description:
+ *           Name of the GPIO backend
+ *
+ * Returns:  name
+ *********************************************************/
+const char *hal_name(void);
+
+/**********************************************************
+ * Public function: hal_input()
+ *
+ * Description:
+ *           Set up a pin as input with pull-up which calls
+ *           cb on both edges. The callback cannot be removed
+ *           again.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_input(unsigned int pin, hal_edge_cb cb);
+
+/**********************************************************
+ * Public function: hal_read()
+ *
+ * Description:
+ *           Read the level of an input pin
+ *
+ * Returns:  0 (low) or 1 (high)
+ *********************************************************/
+int hal_read(unsigned int pin);
+
+/**********************************************************
+ * Public function: hal_time()
+ *
+ * Description:
+ *           Time stamp (CLOCK_REALTIME) of the edge being
+ *           handled, to be called from the edge callback
+ *
+ * Returns:  -
+ *********************************************************/
+void hal_time(struct timespec *ts);
+
+/**********************************************************
+ * Public function: hal_virtual_time()
+ *
+ * Description:
+ *           Check if the edges are time stamped in virtual
+ *           time instead of the wall clock
+ *
+ * Returns:  1 for virtual time, 0 otherwise
+ *********************************************************/
+int hal_virtual_time(void);
+
+/**********************************************************
+ * Public function: hal_output()
+ *
+ * Description:
+ *           Request a line of a GPIO chip as output, set to
+ *           the given value
+ *
+ * Returns:  handle (>=0) on success, <0 otherwise
+ *********************************************************/
+int hal_output(const char *chip, unsigned int line, int active_low, const char *label, int value);
+
+/**********************************************************
+ * Public function: hal_write()
+ *
+ * Description:
+ *           Set an output line
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_write(int handle, int value);
+
+/**********************************************************
+ * Public function: hal_release()
+ *
+ * Description:
+ *           Release an output line
+ *
+ * Returns:  -
+ *********************************************************/
+void hal_release(int handle);
+
+/**********************************************************
+ * Public function: hal_mock_set()
+ *
+ * Description:
+ *           Set the level of a simulated input pin and call
+ *           its edge callback in the calling thread (mock
+ *           backend only)
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_mock_set(unsigned int pin, int lvl);
+
+#endif /* __HAL_H__ */
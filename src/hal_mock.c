@@ -0,0 +1,408 @@
+/*
+ * Energy Monitor: simulated GPIO pins
+ *
+ * Description:
+ *   Backend of the host build, which runs without any GPIO hardware.
+ *
+ *   The input levels are replayed from the edge file named by the
+ *   EMOND_GPIO_MOCK environment variable, with one edge per line:
+ *
+ *     <time> <pin> <level>
+ *
+ *   with the time (in s, with decimals) since the first input was
+ *   set up and the level 0 or 1. Lines starting with # are ignored.
+ *   A thread waits for the time of each edge, sets the level and
+ *   calls the edge callback of the pin, like the interrupt thread of
+ *   wiringPi. Without edge file the inputs stay high (pull-up).
+ *
+ *   An edge file starting with the line
+ *
+ *     start <unix time>
+ *
+ *   is replayed in virtual time: the edges are time stamped from the
+ *   start time plus their time, and replayed as fast as the event
+ *   loop keeps up (it is waited for every HAL_MOCK_SYNC edges, so no
+ *   queue overflows). Days of edges, e.g. from emond-loadgen, are
+ *   processed in seconds.
+ *
+ *   Outputs only keep their value. The levels can also be set by
+ *   the program itself with hal_mock_set() (e.g. by the benchmark).
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "evloop.h"
+#include "hal.h"
+
+/* Number of simulated pins and outputs */
+#define HAL_MOCK_PINS 64
+#define HAL_MOCK_OUTPUTS 16
+
+/* Edges replayed in virtual time between waiting for the event loop */
+#define HAL_MOCK_SYNC 64
+
+static volatile int level[HAL_MOCK_PINS];
+static hal_edge_cb edge_cb[HAL_MOCK_PINS];
+static int num_inputs = 0;
+static int thread_started = 0;
+static int setup_done = 0;
+
+static int output_used[HAL_MOCK_OUTPUTS];
+static int output_value[HAL_MOCK_OUTPUTS];
+
+/* Virtual time of the edge being replayed */
+static int virtual_time = 0;
+static struct timespec edge_ts;
+
+/* Signalled by the event loop */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static int sync_done = 0;
+
+
+/**********************************************************
+ * Internal function: hal_mock_synced()
+ *
+ * Description:
+ *           Event loop callback which wakes up the replay
+ *
+ * Returns:  -
+ *********************************************************/
+static void hal_mock_synced(void *arg)
+{
+   pthread_mutex_lock(&sync_lock);
+   sync_done = 1;
+   pthread_cond_signal(&sync_cond);
+   pthread_mutex_unlock(&sync_lock);
+}
+
+/**********************************************************
+ * Internal function: hal_mock_sync()
+ *
+ * Description:
+ *           Wait until the event loop handled everything
+ *           posted so far (e.g. the queued pulses)
+ *
+ * Returns:  -
+ *********************************************************/
+static void hal_mock_sync(void)
+{
+   pthread_mutex_lock(&sync_lock);
+   sync_done = 0;
+   pthread_mutex_unlock(&sync_lock);
+
+   while (ev_post(hal_mock_synced, NULL) < 0)
+      usleep(1000);
+
+   pthread_mutex_lock(&sync_lock);
+   while (!sync_done)
+      pthread_cond_wait(&sync_cond, &sync_lock);
+   pthread_mutex_unlock(&sync_lock);
+}
+
+
+/**********************************************************
+ * Internal function: hal_mock_thread()
+ *
+ * Description:
+ *           Replays the edges of the edge file
+ *
+ * Returns:  NULL
+ *********************************************************/
+static void *hal_mock_thread(void *arg)
+{
+   const char *path = (const char*)arg;
+   struct timespec wall;
+   struct timespec start;
+   struct timespec at;
+   struct timespec end;
+   char line[128];
+   unsigned long edges = 0;
+   unsigned int pin;
+   double vstart;
+   double t;
+   int lvl;
+   FILE *f;
+
+   if ((f = fopen(path, "re")) == NULL)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to open GPIO edge file %s: %s\n", path, strerror(errno));
+      return NULL;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &wall);
+   start = wall;
+   while (fgets(line, sizeof(line), f) != NULL)
+   {
+      if (edges == 0 && sscanf(line, "start %lf", &vstart) == 1)
+      {
+         /* Time stamps from the file instead of the clock */
+         start.tv_sec = (time_t)vstart;
+         start.tv_nsec = (long)((vstart - (time_t)vstart)*1e9);
+         virtual_time = 1;
+         syslog(LOG_DAEMON | LOG_INFO, "GPIO mock: virtual time from %ld\n", (long)start.tv_sec);
+         continue;
+      }
+      if (line[0] == '#' || sscanf(line, "%lf %u %d", &t, &pin, &lvl) != 3)
+         continue;
+      if (pin >= HAL_MOCK_PINS || t < 0)
+         continue;
+
+      at.tv_sec = start.tv_sec + (time_t)t;
+      at.tv_nsec = start.tv_nsec + (long)((t - (time_t)t)*1e9);
+      if (at.tv_nsec >= 1000000000L)
+      {
+         at.tv_sec++;
+         at.tv_nsec -= 1000000000L;
+      }
+      if (virtual_time)
+      {
+         edge_ts = at;
+         if (edges % HAL_MOCK_SYNC == 0)
+            hal_mock_sync();
+      }
+      else
+      {
+         while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+            ;
+      }
+
+      hal_mock_set(pin, lvl);
+      edges++;
+   }
+   fclose(f);
+
+   if (virtual_time)
+   {
+      hal_mock_sync();
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      syslog(LOG_DAEMON | LOG_INFO, "GPIO mock: %lu edges replayed from %s in %.1f s\n", edges, path,
+             (end.tv_sec - wall.tv_sec) + (end.tv_nsec - wall.tv_nsec)/1e9);
+   }
+   else
+   {
+      syslog(LOG_DAEMON | LOG_INFO, "GPIO mock: %lu edges replayed from %s\n", edges, path);
+   }
+   return NULL;
+}
+
+
+/**********************************************************
+ * Public function: hal_init()
+ *
+ * Description:
+ *           Initialise the GPIO backend (BCM pin numbers),
+ *           may be called more than once
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_init(void)
+{
+   int i;
+
+   if (setup_done)
+      return 0;
+
+   for (i = 0; i < HAL_MOCK_PINS; i++)
+      level[i] = 1;
+   setup_done = 1;
+
+   syslog(LOG_DAEMON | LOG_NOTICE, "Using simulated GPIO pins\n");
+   return 0;
+}
+
+/**********************************************************
+ * Public function: hal_name()
+ *
+ * Description:
+ *           Name of the GPIO backend
+ *
+ * Returns:  name
+ *********************************************************/
+const char *hal_name(void)
+{
+   return "mock";
+}
+
+/**********************************************************
+ * Public function: hal_input()
+ *
+ * Description:
+ *           Set up a pin as input with pull-up which calls
+ *           cb on both edges. The replay of the edge file
+ *           starts with the first input.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_input(unsigned int pin, hal_edge_cb cb)
+{
+   pthread_attr_t attr;
+   pthread_t tid;
+   const char *path;
+   int res = 0;
+
+   if (pin >= HAL_MOCK_PINS || num_inputs == HAL_MAX_INPUTS)
+      return -1;
+   edge_cb[pin] = cb;
+   num_inputs++;
+
+   if (thread_started || (path = getenv(HAL_MOCK_ENV)) == NULL || strlen(path) == 0)
+      return 0;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if (pthread_create(&tid, &attr, hal_mock_thread, (void*)path) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to start the GPIO edge replay\n");
+      res = -2;
+   }
+   else
+   {
+      thread_started = 1;
+      syslog(LOG_DAEMON | LOG_INFO, "GPIO mock: replaying edges from %s\n", path);
+   }
+   pthread_attr_destroy(&attr);
+   return res;
+}
+
+/**********************************************************
+ * Public function: hal_read()
+ *
+ * Description:
+ *           Read the level of an input pin
+ *
+ * Returns:  0 (low) or 1 (high)
+ *********************************************************/
+int hal_read(unsigned int pin)
+{
+   return (pin < HAL_MOCK_PINS) ? level[pin] : 1;
+}
+
+/**********************************************************
+ * Public function: hal_time()
+ *
+ * Description:
+ *           Time stamp (CLOCK_REALTIME) of the edge being
+ *           handled, the time of the edge file in virtual
+ *           time
+ *
+ * Returns:  -
+ *********************************************************/
+void hal_time(struct timespec *ts)
+{
+   if (virtual_time)
+      *ts = edge_ts;
+   else
+      clock_gettime(CLOCK_REALTIME, ts);
+}
+
+/**********************************************************
+ * Public function: hal_virtual_time()
+ *
+ * Description:
+ *           Check if the edges are time stamped in virtual
+ *           time instead of the wall clock, i.e. the edge
+ *           file starts with a "start" line (also before the
+ *           replay started)
+ *
+ * Returns:  1 for virtual time, 0 otherwise
+ *********************************************************/
+int hal_virtual_time(void)
+{
+   char line[128];
+   const char *path;
+   double vstart;
+   int res = 0;
+   FILE *f;
+
+   if (virtual_time)
+      return 1;
+   if ((path = getenv(HAL_MOCK_ENV)) == NULL || (f = fopen(path, "r")) == NULL)
+      return 0;
+   if (fgets(line, sizeof(line), f) != NULL && sscanf(line, "start %lf", &vstart) == 1)
+      res = 1;
+   fclose(f);
+   return res;
+}
+
+/**********************************************************
+ * Public function: hal_output()
+ *
+ * Description:
+ *           Request a simulated output line
+ *
+ * Returns:  handle (>=0) on success, <0 otherwise
+ *********************************************************/
+int hal_output(const char *chip, unsigned int line, int active_low, const char *label, int value)
+{
+   int i;
+
+   for (i = 0; i < HAL_MOCK_OUTPUTS && output_used[i]; i++)
+      ;
+   if (i == HAL_MOCK_OUTPUTS)
+      return -1;
+
+   output_used[i] = 1;
+   output_value[i] = value ? 1 : 0;
+   return i;
+}
+
+/**********************************************************
+ * Public function: hal_write()
+ *
+ * Description:
+ *           Set a simulated output line
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_write(int handle, int value)
+{
+   if (handle < 0 || handle >= HAL_MOCK_OUTPUTS || !output_used[handle])
+      return -1;
+   output_value[handle] = value ? 1 : 0;
+   return 0;
+}
+
+/**********************************************************
+ * Public function: hal_release()
+ *
+ * Description:
+ *           Release a simulated output line
+ *
+ * Returns:  -
+ *********************************************************/
+void hal_release(int handle)
+{
+   if (handle >= 0 && handle < HAL_MOCK_OUTPUTS)
+      output_used[handle] = 0;
+}
+
+/**********************************************************
+ * Public function: hal_mock_set()
+ *
+ * Description:
+ *           Set the level of a simulated input pin and call
+ *           its edge callback in the calling thread
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_mock_set(unsigned int pin, int lvl)
+{
+   if (pin >= HAL_MOCK_PINS)
+      return -1;
+
+   level[pin] = lvl ? 1 : 0;
+   if (edge_cb[pin] != NULL)
+      edge_cb[pin]();
+   return 0;
+}
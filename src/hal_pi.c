@@ -0,0 +1,203 @@
+/*
+ * Energy Monitor: GPIO pins of the Raspberry Pi
+ *
+ * Description:
+ *   Inputs and their edge interrupts are handled by the wiringPi
+ *   library, which needs to be installed (see http://wiringpi.com).
+ *   Outputs are requested from the GPIO character device of the
+ *   kernel.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <wiringPi.h>
+
+#include "hal.h"
+
+static int setup_done = 0;
+
+
+/**********************************************************
+ * Public function: hal_init()
+ *
+ * Description:
+ *           Initialise the GPIO backend (BCM pin numbers),
+ *           may be called more than once
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_init(void)
+{
+   if (setup_done)
+      return 0;
+
+   if (wiringPiSetupGpio() < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to setup GPIO: %s\n", strerror (errno));
+      return -1;
+   }
+   setup_done = 1;
+   return 0;
+}
+
+/**********************************************************
+ * Public function: hal_name()
+ *
+ * Description:
+ *           Name of the GPIO backend
+ *
+ * Returns:  name
+ *********************************************************/
+const char *hal_name(void)
+{
+   return "wiringPi";
+}
+
+/**********************************************************
+ * Public function: hal_input()
+ *
+ * Description:
+ *           Set up a pin as input with pull-up which calls
+ *           cb on both edges. The callback cannot be removed
+ *           again.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_input(unsigned int pin, hal_edge_cb cb)
+{
+   pinMode(pin, INPUT);
+   pullUpDnControl(pin, PUD_UP);
+   usleep(10000);
+
+   /* Generate interrupt on both edges on the inut pin */
+   if (wiringPiISR(pin, INT_EDGE_BOTH, cb) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to setup ISR for GPIO: %s\n", strerror (errno));
+      return -1;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Public function: hal_read()
+ *
+ * Description:
+ *           Read the level of an input pin
+ *
+ * Returns:  0 (low) or 1 (high)
+ *********************************************************/
+int hal_read(unsigned int pin)
+{
+   return (digitalRead(pin) == LOW) ? 0 : 1;
+}
+
+/**********************************************************
+ * Public function: hal_time()
+ *
+ * Description:
+ *           Time stamp (CLOCK_REALTIME) of the edge being
+ *           handled, to be called from the edge callback
+ *
+ * Returns:  -
+ *********************************************************/
+void hal_time(struct timespec *ts)
+{
+   clock_gettime(CLOCK_REALTIME, ts);
+}
+
+/**********************************************************
+ * Public function: hal_virtual_time()
+ *
+ * Description:
+ *           Check if the edges are time stamped in virtual
+ *           time instead of the wall clock
+ *
+ * Returns:  1 for virtual time, 0 otherwise
+ *********************************************************/
+int hal_virtual_time(void)
+{
+   return 0;
+}
+
+/**********************************************************
+ * Public function: hal_output()
+ *
+ * Description:
+ *           Request a line of a GPIO chip as output, set to
+ *           the given value
+ *
+ * Returns:  handle (>=0) on success, <0 otherwise
+ *********************************************************/
+int hal_output(const char *chip, unsigned int line, int active_low, const char *label, int value)
+{
+   struct gpiohandle_request req;
+   int fd;
+
+   if ((fd = open(chip, O_RDWR | O_CLOEXEC)) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to open GPIO chip %s: %s\n", chip, strerror(errno));
+      return -1;
+   }
+
+   memset(&req, 0, sizeof(req));
+   req.lineoffsets[0] = line;
+   req.lines = 1;
+   req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+   if (active_low)
+      req.flags |= GPIOHANDLE_REQUEST_ACTIVE_LOW;
+   req.default_values[0] = value ? 1 : 0;
+   snprintf(req.consumer_label, sizeof(req.consumer_label), "%s", label);
+
+   if (ioctl(fd, GPIO_GET_LINEHANDLE_IOCTL, &req) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to request GPIO line %u for %s: %s\n",
+             line, label, strerror(errno));
+      close(fd);
+      return -2;
+   }
+   close(fd);
+
+   return req.fd;
+}
+
+/**********************************************************
+ * Public function: hal_write()
+ *
+ * Description:
+ *           Set an output line
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int hal_write(int handle, int value)
+{
+   struct gpiohandle_data data;
+
+   memset(&data, 0, sizeof(data));
+   data.values[0] = value ? 1 : 0;
+   return (ioctl(handle, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0) ? -1 : 0;
+}
+
+/**********************************************************
+ * Public function: hal_release()
+ *
+ * Description:
+ *           Release an output line
+ *
+ * Returns:  -
+ *********************************************************/
+void hal_release(int handle)
+{
+   if (handle >= 0)
+      close(handle);
+}
@@ -0,0 +1,140 @@
+/*
+ * Energy Monitor: histograms of latencies with log2 buckets
+ *
+ * Description:
+ *   Used for the statistics of the daemon (stats.c) and by the
+ *   benchmark (bench.c). The buckets and the max are updated with
+ *   atomic operations of the native word size, so adding a value is
+ *   lock free and cheap enough to be always on.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdio.h>
+
+#include "hist.h"
+
+
+/**********************************************************
+ * Internal function: hist_bound()
+ *
+ * Description:
+ *           Upper bound of a bucket
+ *
+ * Returns:  time (in us)
+ *********************************************************/
+static unsigned long hist_bound(unsigned int b)
+{
+   return 1UL << b;
+}
+
+
+/**********************************************************
+ * Public function: hist_add()
+ *
+ * Description:
+ *           Add a latency (in us) to the histogram. Lock
+ *           free, may be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void hist_add(hist_t *h, unsigned long us)
+{
+   unsigned long max;
+   unsigned int b = 0;
+
+   while (b < HIST_BUCKETS-1 && us >= hist_bound(b))
+      b++;
+   __atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+
+   max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+   while (us > max &&
+          !__atomic_compare_exchange_n(&h->max, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+}
+
+/**********************************************************
+ * Public function: hist_copy()
+ *
+ * Description:
+ *           Take a copy of a histogram which may be updated
+ *           meanwhile
+ *
+ * Returns:  number of values in the copy
+ *********************************************************/
+unsigned long long hist_copy(hist_t *dst, const hist_t *h)
+{
+   unsigned long long count = 0;
+   unsigned int b;
+
+   for (b = 0; b < HIST_BUCKETS; b++)
+   {
+      dst->bucket[b] = __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+      count += dst->bucket[b];
+   }
+   dst->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+   return count;
+}
+
+/**********************************************************
+ * Public function: hist_percentile()
+ *
+ * Description:
+ *           Estimate a percentile of a histogram (not being
+ *           updated), as the upper bound of its bucket but
+ *           at most the max
+ *
+ * Returns:  latency (in us), 0 if empty
+ *********************************************************/
+unsigned long hist_percentile(const hist_t *h, unsigned int pct)
+{
+   unsigned long long count = 0;
+   unsigned long long sum = 0;
+   unsigned int b;
+
+   for (b = 0; b < HIST_BUCKETS; b++)
+      count += h->bucket[b];
+   if (count == 0)
+      return 0;
+
+   for (b = 0; b < HIST_BUCKETS-1; b++)
+   {
+      sum += h->bucket[b];
+      if (sum*100 >= count*pct)
+         break;
+   }
+   return (hist_bound(b) < h->max) ? hist_bound(b) : h->max;
+}
+
+/**********************************************************
+ * Public function: hist_json()
+ *
+ * Description:
+ *           Format a histogram (not being updated) as JSON
+ *           members "count", "max", "p50", "p90", "p99" and
+ *           "buckets"
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int hist_json(char *buf, size_t size, const hist_t *h)
+{
+   static const unsigned int pct[] = { 50, 90, 99 };
+   unsigned long long count = 0;
+   unsigned int b;
+   unsigned int p;
+   size_t len;
+
+   for (b = 0; b < HIST_BUCKETS; b++)
+      count += h->bucket[b];
+
+   len = snprintf(buf, size, "\"count\":%llu,\"max\":%lu", count, h->max);
+   for (p = 0; p < sizeof(pct)/sizeof(pct[0]) && len < size; p++)
+      len += snprintf(buf+len, size-len, ",\"p%u\":%lu", pct[p], hist_percentile(h, pct[p]));
+   for (b = 0; b < HIST_BUCKETS && len < size; b++)
+      len += snprintf(buf+len, size-len, "%s%lu", b ? "," : ",\"buckets\":[", h->bucket[b]);
+   if (len < size)
+      len += snprintf(buf+len, size-len, "]");
+
+   return (len < size) ? (int)len : -1;
+}
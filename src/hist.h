@@ -0,0 +1,69 @@
+/*
+ * Energy Monitor: histograms of latencies with log2 buckets
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stddef.h>
+
+/* Log2 buckets, in us: bucket 0 holds 0, bucket b > 0 holds
+ * [2^(b-1), 2^b), the last one up to 33 s and more */
+#define HIST_BUCKETS 26
+
+typedef struct
+{
+   unsigned long max;
+   unsigned long bucket[HIST_BUCKETS];
+} hist_t;
+
+/**********************************************************
+ * Public function: hist_add()
+ *
+ * Description:
+ *           Add a latency (in us) to the histogram. Lock
+ *           free, may be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void hist_add(hist_t *h, unsigned long us);
+
+/**********************************************************
+ * Public function: hist_copy()
+ *
+ * Description:
+ *           Take a copy of a histogram which may be updated
+ *           meanwhile
+ *
+ * Returns:  number of values in the copy
+ *********************************************************/
+unsigned long long hist_copy(hist_t *dst, const hist_t *h);
+
+/**********************************************************
+ * Public function: hist_percentile()
+ *
+ * Description:
+ *           Estimate a percentile of a histogram (not being
+ *           updated), as the upper bound of its bucket but
+ *           at most the max
+ *
+ * Returns:  latency (in us), 0 if empty
+ *********************************************************/
+unsigned long hist_percentile(const hist_t *h, unsigned int pct);
+
+/**********************************************************
+ * Public function: hist_json()
+ *
+ * Description:
+ *           Format a histogram (not being updated) as JSON
+ *           members "count", "max", "p50", "p90", "p99" and
+ *           "buckets"
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int hist_json(char *buf, size_t size, const hist_t *h);
+
+#endif /* __HIST_H__ */
@@ -1,131 +1,626 @@
-/* 
+/*
  * Energy Monitor: build-in lcdproc client
- * 
+ *
  * Author: Ondrej Wisniewski
- * 
+ *
+ * The client runs as a non-blocking state machine in the event loop:
+ *
+ *   DISCONNECTED --> CONNECTING --> HELLO --> READY
+ *        ^                |           |         |
+ *        +----------------+-----------+---------+  (error, with backoff)
+ *
+ * lcd_print() only records the new values and wakes up the event
+ * loop, so the pulse handling never waits for the display. The
+ * screen is rendered as a frame of widget texts; only widgets whose
+ * text changed are sent, batched into one write and at most
+ * refresh_rate times per second. Server responses are read and
+ * discarded continuously so the socket never fills up.
+ *
+ * Lines 1-3 (power and energy) are shown on the "emon" screen.
+ * Lines 4-6 (energy cost and tariff) are shown on a second "cost"
+ * screen and lines 7-8 (projected energy) on a third "proj" screen.
+ * These are only added once one of their values is printed. LCDd
+ * rotates between the screens.
+ *
  */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "sockets.h"
+#include "evloop.h"
+#include "bench.h"
+#include "stats.h"
+#include "lcdproc.h"
 
+/* Uncomment this to enable debug mode */
+//#define DEBUG
+
+#ifdef DEBUG
+#define _debug(x, args...)  syslog(LOG_DAEMON | LOG_DEBUG, "" x, ##args)
+#else
+#define _debug(x, args...)
+#endif
+
+#define LCD_SERVER "localhost"
+
+/* Reconnect backoff limits (in ms) */
+#define LCD_BACKOFF_MIN 1000
+#define LCD_BACKOFF_MAX 60000
+
+/* Max time to wait for the connection and the server greeting (in ms) */
+#define LCD_CONNECT_TIMEOUT 5000
+
+/* Number of value lines, lines per screen and number of screens */
+#define LCD_LINES 8
+#define LCD_SCREEN_LINES 3
+#define LCD_SCREENS ((LCD_LINES+LCD_SCREEN_LINES-1)/LCD_SCREEN_LINES)
+
+/* Max length of the text of one line */
+#define LCD_TEXT_SIZE 48
+
+/* Default max number of screen updates per second */
+#define LCD_REFRESH_RATE 2
+
+typedef enum
+{
+   LCD_DISABLED,
+   LCD_DISCONNECTED,
+   LCD_CONNECTING,
+   LCD_HELLO,
+   LCD_READY
+} lcd_state_t;
+
+static lcd_state_t state = LCD_DISABLED;
+static sock_conn_t conn = { .fd = -1, .state = SOCK_ST_CLOSED };
+static char server[SOCK_HOST_SIZE] = LCD_SERVER;
+static unsigned short port = LCDPORT;
+static unsigned long backoff = LCD_BACKOFF_MIN;
+static int timer = 0;
+
+/* Display geometry as reported by the server */
+static int lcd_wid = 0;
+static int lcd_hgt = 0;
+
+/* Latest values, written by lcd_print() from any thread */
+static unsigned int values[LCD_LINES];
+static unsigned int valid = 0;
+static int flush_pending = 0;
+static pthread_mutex_t values_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Text of the value lines as last sent to the server */
+static char sent[LCD_LINES][LCD_TEXT_SIZE];
+
+/* Screens (name and title) and mask of those added to the server */
+static const char *screen_name[LCD_SCREENS] = { "emon", "cost", "proj" };
+static const char *screen_title[LCD_SCREENS] = { "Energy Monitor", "Energy Cost", "Energy Forecast" };
+static unsigned int screens = 0;
+static unsigned long long last_refresh = 0;
+static unsigned long refresh_ms = 1000/LCD_REFRESH_RATE;
+static int refresh_timer = 0;
+
+static void lcd_connect(void *arg);
 
-static int sock = -1;
 
 /**********************************************************
- * Public function: lcd_init()
- * 
+ * Internal function: lcd_disconnect()
+ *
  * Description:
- *           Perform the initialization and configuration
- *           of the LCD display
- * 
- * Returns:  0 on success, <0 otherwise
+ *           Close the connection and schedule a reconnect
+ *           with exponential backoff
+ *
+ * Returns:  -
+ *********************************************************/
+static void lcd_disconnect(const char *reason)
+{
+   sock_conn_close(&conn);
+   ev_timer_cancel(timer);
+   ev_timer_cancel(refresh_timer);
+   refresh_timer = 0;
+
+   syslog(LOG_DAEMON | LOG_NOTICE, "LCD server %s on port %d: %s, retrying in %lu s\n",
+          server, port, reason, backoff/1000);
+
+   state = LCD_DISCONNECTED;
+   timer = ev_timer_add(backoff, lcd_connect, NULL);
+   backoff *= 2;
+   if (backoff > LCD_BACKOFF_MAX)
+      backoff = LCD_BACKOFF_MAX;
+}
+
+/**********************************************************
+ * Internal function: lcd_timeout()
+ *
+ * Description:
+ *           Timer callback when connection setup takes
+ *           too long
+ *
+ * Returns:  -
  *********************************************************/
-int lcd_init(void)
+static void lcd_timeout(void *arg)
 {
-   char server[16];
-   unsigned short port=LCDPORT;
-   unsigned short retry=5;
+   timer = 0;
+   lcd_disconnect("no answer");
+}
 
-   strcpy(server, "localhost");
-   
-   /* Connect to the server, with retry */
-   do 
+/**********************************************************
+ * Internal function: lcd_render_line()
+ *
+ * Description:
+ *           Render the text of one value line
+ *
+ * Returns:  -
+ *********************************************************/
+static void lcd_render_line(int line, unsigned int value, char *text, size_t size)
+{
+   switch (line)
    {
-      if ((sock = sock_connect(server, port)) < 0)
+      case 1:
+         snprintf(text, size, "Power now: %uW", value);
+      break;
+      case 2:
+         snprintf(text, size, "Energy day: %.1fkWh", value/1000.0);
+      break;
+      case 3:
+         snprintf(text, size, "Energy mon: %.1fkWh", value/1000.0);
+      break;
+      case 4:
+         snprintf(text, size, "Cost day: %.2f", value/100.0);
+      break;
+      case 5:
+         snprintf(text, size, "Cost mon: %.2f", value/100.0);
+      break;
+      case 6:
+         snprintf(text, size, "Tariff: T%u", value);
+      break;
+      case 7:
+         snprintf(text, size, "Proj day: %.1fkWh", value/1000.0);
+      break;
+      case 8:
+         snprintf(text, size, "Proj mon: %.1fkWh", value/1000.0);
+      break;
+      default:
+         text[0] = '\0';
+   }
+}
+
+/**********************************************************
+ * Internal function: lcd_append()
+ *
+ * Description:
+ *           Append printf-like formatted commands to the
+ *           batch of length len, only if they fit completely
+ *
+ * Returns:  0 on success, <0 if the batch is full
+ *********************************************************/
+static int lcd_append(char *batch, size_t size, int *len, const char *format, ...)
+   __attribute__ ((format (printf, 4, 5)));
+
+static int lcd_append(char *batch, size_t size, int *len, const char *format, ...)
+{
+   va_list ap;
+   int n;
+
+   if ((size_t)*len >= size)
+      return -1;
+
+   va_start(ap, format);
+   n = vsnprintf(batch+*len, size-*len, format, ap);
+   va_end(ap);
+
+   if (n < 0 || (size_t)n >= size-*len)
+   {
+      /* Drop the partial command */
+      batch[*len] = '\0';
+      return -1;
+   }
+   *len += n;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: lcd_send_frame()
+ *
+ * Description:
+ *           Render the current frame and send the widgets
+ *           whose text differs from what was last sent, all
+ *           batched into a single write
+ *
+ * Returns:  0 on success, 1 if deferred, <0 otherwise
+ *********************************************************/
+static int lcd_send_frame(void)
+{
+   char batch[LCD_SCREENS*192 + LCD_LINES*(LCD_TEXT_SIZE+48)];
+   char text[LCD_LINES][LCD_TEXT_SIZE];
+   unsigned int changed = 0;
+   unsigned int added = 0;
+   unsigned int v[LCD_LINES];
+   unsigned int mask;
+   const char *name;
+   int screen_len;
+   int full = 0;
+   int len = 0;
+   int i, s;
+
+   pthread_mutex_lock(&values_lock);
+   mask = valid;
+   memcpy(v, values, sizeof(v));
+   pthread_mutex_unlock(&values_lock);
+
+   /* Add the further screens with their first value */
+   for (s=1; s<LCD_SCREENS; s++)
+   {
+      if ((screens & (1<<s)) || ((mask >> s*LCD_SCREEN_LINES) & ((1<<LCD_SCREEN_LINES)-1)) == 0)
+         continue;
+
+      name = screen_name[s];
+      screen_len = len;
+      full = lcd_append(batch, sizeof(batch), &len,
+                        "screen_add %s\n"
+                        "screen_set %s -name %s\n"
+                        "screen_set %s -priority foreground\n"
+                        "screen_set %s -heartbeat off\n"
+                        "widget_add %s title title\n"
+                        "widget_set %s title {%s}\n",
+                        name, name, name, name, name, name, name, screen_title[s]);
+      for (i=s*LCD_SCREEN_LINES; i<(s+1)*LCD_SCREEN_LINES && i<LCD_LINES && !full; i++)
       {
-         syslog(LOG_DAEMON | LOG_WARNING, "LCD server %s on port %d not available, retrying (%d more)...\n", server, port, retry);
-         sleep(5);
+         full = lcd_append(batch, sizeof(batch), &len, "widget_add %s line%d string\n", name, i+1);
       }
-      else
+      if (full)
+      {
+         /* Add the whole screen with the next frame */
+         len = screen_len;
          break;
+      }
+      added |= 1<<s;
    }
-   while (--retry);
 
-   if (sock < 0)
+   for (i=0; i<LCD_LINES && !full; i++)
    {
-      syslog(LOG_DAEMON | LOG_ERR, "Error connecting to LCD server %s on port %d.\n", server, port);
-      return (-1);
+      /* Lines of screens not added yet wait for the next frame */
+      if (!(mask & (1<<i)) || (i >= LCD_SCREEN_LINES && !((screens|added) & (1<<(i/LCD_SCREEN_LINES)))))
+         continue;
+
+      lcd_render_line(i+1, v[i], text[i], sizeof(text[i]));
+      if (strcmp(text[i], sent[i]) != 0)
+      {
+         if (lcd_append(batch, sizeof(batch), &len, "widget_set %s line%d 1 %d {%s}\n",
+                        screen_name[i / LCD_SCREEN_LINES],
+                        i+1, (i % LCD_SCREEN_LINES)+2, text[i]) < 0)
+            break;
+         changed |= 1<<i;
+      }
+   }
+
+   last_refresh = ev_now_ms();
+
+   if (len == 0)
+      return 0;
+
+   _debug("LCD frame update (%d bytes)", len);
+   switch (sock_conn_send(&conn, batch, len))
+   {
+      case 0:
+         break;
+      case -1:
+         /* Server is not reading, try again with the next frame */
+         return 1;
+      default:
+         return -1;
+   }
+
+   for (i=0; i<LCD_LINES; i++)
+   {
+      if (changed & (1<<i))
+         strcpy(sent[i], text[i]);
+   }
+   screens |= added;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: lcd_refresh()
+ *
+ * Description:
+ *           Timer callback which sends the pending frame
+ *
+ * Returns:  -
+ *********************************************************/
+static void lcd_refresh(void *arg)
+{
+   int rc;
+
+   refresh_timer = 0;
+   if (state != LCD_READY)
+      return;
+
+   rc = lcd_send_frame();
+   if (rc < 0)
+   {
+      lcd_disconnect("write error");
+   }
+   else if (rc > 0)
+   {
+      refresh_timer = ev_timer_add(refresh_ms, lcd_refresh, NULL);
+   }
+   else
+   {
+      BENCH_STAGE(BENCH_LCD, NULL);
+      stats_output(STATS_PROCESS_LCD);
+   }
+}
+
+/**********************************************************
+ * Internal function: lcd_flush()
+ *
+ * Description:
+ *           Event loop callback posted by lcd_print(). The
+ *           frame is sent at most refresh_ms after the last
+ *           one, further changes until then are coalesced.
+ *
+ * Returns:  -
+ *********************************************************/
+static void lcd_flush(void *arg)
+{
+   unsigned long long now;
+
+   pthread_mutex_lock(&values_lock);
+   flush_pending = 0;
+   pthread_mutex_unlock(&values_lock);
+
+   /* While disconnected the frame is sent once connected */
+   if (state != LCD_READY || refresh_timer > 0)
+      return;
+
+   now = ev_now_ms();
+   if (now - last_refresh < refresh_ms)
+   {
+      refresh_timer = ev_timer_add(refresh_ms - (now - last_refresh), lcd_refresh, NULL);
+      return;
+   }
+   lcd_refresh(NULL);
+}
+
+/**********************************************************
+ * Internal function: lcd_setup_screen()
+ *
+ * Description:
+ *           Set up our screen after the server greeting
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int lcd_setup_screen(void)
+{
+   static const char setup[] =
+      /* Set up our basic screen properties */
+      "screen_add emon\n"
+      "screen_set emon -name emon\n"
+      "screen_set emon -priority foreground\n"
+      "screen_set emon -heartbeat off\n"
+      /* Add widgets with default content to the screen */
+      "widget_add emon title title\n"
+      "widget_set emon title {Energy Monitor}\n"
+      "widget_add emon line1 string\n"
+      "widget_add emon line2 string\n"
+      "widget_add emon line3 string\n"
+      "widget_set emon line1 1 2 {Power now: }\n"
+      "widget_set emon line2 1 3 {Energy day: }\n"
+      "widget_set emon line3 1 4 {Energy mon: }\n";
+
+   return sock_conn_send(&conn, setup, sizeof(setup)-1);
+}
+
+/**********************************************************
+ * Internal function: lcd_handle_line()
+ *
+ * Description:
+ *           Handle one line received from the server
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int lcd_handle_line(char *line)
+{
+   char *p;
+   int rc;
+
+   _debug("LCD server: %s", line);
+
+   if (state == LCD_HELLO)
+   {
+      /* Expected: connect LCDproc 0.5.x protocol 0.3 lcd wid 20 hgt 4 ... */
+      if (strncmp(line, "connect ", 8) != 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Unexpected LCD server greeting: %s\n", line);
+         return -1;
+      }
+      if ((p = strstr(line, " wid ")) != NULL)
+         lcd_wid = atoi(p+5);
+      if ((p = strstr(line, " hgt ")) != NULL)
+         lcd_hgt = atoi(p+5);
+      if (lcd_hgt > 0 && lcd_hgt < LCD_SCREEN_LINES+1)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "LCD has only %d lines, some values are not shown\n", lcd_hgt);
+      }
+
+      ev_timer_cancel(timer);
+      timer = 0;
+      if (lcd_setup_screen() < 0)
+         return -1;
+
+      syslog(LOG_DAEMON | LOG_INFO, "Connected to LCD server (%dx%d display)\n", lcd_wid, lcd_hgt);
+      state = LCD_READY;
+      backoff = LCD_BACKOFF_MIN;
+
+      /* Show the latest values, retried on the refresh timer if deferred */
+      memset(sent, 0, sizeof(sent));
+      screens = 1;
+      rc = lcd_send_frame();
+      if (rc > 0)
+         refresh_timer = ev_timer_add(refresh_ms, lcd_refresh, NULL);
+      return (rc < 0) ? -1 : 0;
+   }
+   else if (!strncmp(line, "huh?", 4))
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "LCD server error: %s\n", line);
    }
-   
-   /* Be polite, say "hello" */
-   sock_send_string(sock, "hello\n");
-   usleep(500000);         /* wait for the server to respond */
-
-   /* Set up our basic screen properties */
-   sock_send_string(sock, "screen_add emon\n");
-   sock_send_string(sock, "screen_set emon -name emon\n");
-   sock_send_string(sock, "screen_set emon -priority foreground\n");
-   sock_send_string(sock, "screen_set emon -heartbeat off\n");
- 
-   /* Add widgets with default content to the screen */
-   sock_send_string(sock, "widget_add emon title title\n");
-   sock_send_string(sock, "widget_set emon title {Energy Monitor}\n");
-   sock_send_string(sock, "widget_add emon line1 string\n");
-   sock_send_string(sock, "widget_add emon line2 string\n");
-   sock_send_string(sock, "widget_add emon line3 string\n");
-   sock_printf(sock, "widget_set emon line1 1 2 {Power now: }\n");
-   sock_printf(sock, "widget_set emon line2 1 3 {Energy day: }\n");
-   sock_printf(sock, "widget_set emon line3 1 4 {Energy mon: }\n");
-   
+   /* "success", "listen" and "ignore" messages need no action */
+
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: lcd_line_cb()
+ *
+ * Description:
+ *           Connection callback for lines sent by the server
+ *
+ * Returns:  -
+ *********************************************************/
+static void lcd_line_cb(sock_conn_t *c, char *line, void *arg)
+{
+   if (lcd_handle_line(line) < 0)
+   {
+      lcd_disconnect("protocol error");
+   }
+}
+
+/**********************************************************
+ * Internal function: lcd_event_cb()
+ *
+ * Description:
+ *           Connection callback for state changes
+ *
+ * Returns:  -
+ *********************************************************/
+static void lcd_event_cb(sock_conn_t *c, int event, int err, void *arg)
+{
+   if (event == SOCK_EV_CONNECTED)
+   {
+      /* Be polite, say "hello" and wait for the answer */
+      state = LCD_HELLO;
+      if (sock_conn_send(&conn, "hello\n", 6) < 0)
+      {
+         lcd_disconnect("write error");
+      }
+   }
+   else
+   {
+      lcd_disconnect(err ? strerror(err) : "connection closed");
+   }
+}
+
+/**********************************************************
+ * Internal function: lcd_connect()
+ *
+ * Description:
+ *           Start a non-blocking connection attempt
+ *
+ * Returns:  -
+ *********************************************************/
+static void lcd_connect(void *arg)
+{
+   /* The connection callback may already run inside sock_conn_open() */
+   state = LCD_CONNECTING;
+   timer = ev_timer_add(LCD_CONNECT_TIMEOUT, lcd_timeout, NULL);
+
+   if (sock_conn_open(&conn, server, port, lcd_line_cb, lcd_event_cb, NULL) < 0)
+   {
+      lcd_disconnect("not available");
+   }
+}
+
+
+/**********************************************************
+ * Public function: lcd_init()
+ *
+ * Description:
+ *           Start the connection to the LCDd daemon. The
+ *           screen is set up as soon as the server answers,
+ *           reconnection is handled automatically.
+ *           (host NULL selects localhost, port 0 the default
+ *           lcdproc port, refresh_rate 0 the default max
+ *           updates/s)
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int lcd_init(const char *host, unsigned short lcdport, unsigned int refresh_rate)
+{
+   snprintf(server, sizeof(server), "%s", (host != NULL && host[0] != '\0') ? host : LCD_SERVER);
+   port = (lcdport > 0) ? lcdport : LCDPORT;
+   refresh_ms = 1000/((refresh_rate > 0) ? refresh_rate : LCD_REFRESH_RATE);
+   backoff = LCD_BACKOFF_MIN;
+
+   lcd_connect(NULL);
+
    return (0);
 }
 
 /**********************************************************
  * Public function: lcd_exit()
- * 
+ *
  * Description:
  *           Close the connection to the LCDd daemon
- * 
+ *
  * Returns:  0 on success, <0 otherwise
  *********************************************************/
 int lcd_exit(void)
 {
-   if (sock == -1)
-   {
-      return (-1);
-   }
-   
-   sock_close(sock);
-   return (0);
+   int rc = (conn.state == SOCK_ST_CLOSED) ? -1 : 0;
+
+   ev_timer_cancel(timer);
+   ev_timer_cancel(refresh_timer);
+   timer = 0;
+   refresh_timer = 0;
+
+   sock_conn_close(&conn);
+   state = LCD_DISABLED;
+   return (rc);
 }
 
 /**********************************************************
  * Public function: lcd_print()
- * 
+ *
  * Description:
- *           Print data on the LCD display
- * 
+ *           Print data on the LCD display. The data is sent
+ *           asynchronously by the event loop.
+ *
  * Returns:  0 on success, <0 otherwise
  *********************************************************/
 int lcd_print(int line, unsigned int value)
 {
-   if (sock == -1)
+   int wake;
+
+   if (state == LCD_DISABLED)
    {
       return (-1);
    }
-   
-   switch (line)
+   if (line < 1 || line > LCD_LINES)
    {
-      case 1:
-         sock_printf(sock, "widget_set emon line1 1 2 {Power now: %uW}\n", value);
-      break;
-      case 2:
-         sock_printf(sock, "widget_set emon line2 1 3 {Energy day: %.1fkWh}\n", value/1000.0);
-      break;
-      case 3:
-         sock_printf(sock, "widget_set emon line3 1 4 {Energy mon: %.1fkWh}\n", value/1000.0);
-      break;
-      
-      default:
-         return (-1);
+      return (-1);
    }
-   
+
+   pthread_mutex_lock(&values_lock);
+   values[line-1] = value;
+   valid |= 1<<(line-1);
+   wake = !flush_pending;
+   flush_pending = 1;
+   pthread_mutex_unlock(&values_lock);
+
+   if (wake && ev_post(lcd_flush, NULL) < 0)
+   {
+      pthread_mutex_lock(&values_lock);
+      flush_pending = 0;
+      pthread_mutex_unlock(&values_lock);
+      return (-2);
+   }
+
    return (0);
-}
\ No newline at end of file
+}
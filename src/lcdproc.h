@@ -12,12 +12,16 @@
  * Public function: lcd_init()
  * 
  * Description:
- *           Perform the initialization and configuration
- *           of the LCD display
+ *           Start the connection to the LCDd daemon. The
+ *           screen is set up as soon as the server answers,
+ *           reconnection is handled automatically.
+ *           (host NULL selects localhost, port 0 the default
+ *           lcdproc port, refresh_rate 0 the default max
+ *           updates/s)
  * 
  * Returns:  0 on success, <0 otherwise
  *********************************************************/
-int lcd_init(void);
+int lcd_init(const char *host, unsigned short lcdport, unsigned int refresh_rate);
 
 /**********************************************************
  * Public function: lcd_exit()
@@ -33,7 +37,8 @@ int lcd_exit(void);
  * Public function: lcd_print()
  * 
  * Description:
- *           Print data on the LCD display
+ *           Print data on the LCD display. The data is sent
+ *           asynchronously by the event loop.
  * 
  * Returns:  0 on success, <0 otherwise
  *********************************************************/
@@ -0,0 +1,619 @@
+/*
+ * Energy Monitor: synthetic load generator
+ *
+ * Description:
+ *   Produces the S0 pulses of an energy meter for a synthetic load
+ *   profile, as edge file of the simulated GPIO pins (see hal_mock.c)
+ *   on stdout:
+ *
+ *     emond-loadgen [options] <segment> ...
+ *     EMOND_GPIO_MOCK=<edge file> emond-host test
+ *
+ *   The load profile is a sequence of segments:
+ *
+ *     zero:<time>                       no load
+ *     const:<time>:<W>                  constant load
+ *     ramp:<time>:<W>:<W>               load changing linearly
+ *     house:<time>[:<W>]                household (base load, fridge
+ *                                       and random appliances)
+ *     storm:<time>:<glitches/s>[:<W>]   glitch storm on a constant load
+ *
+ *   with the time in s, or with suffix m, h or d. A pulse is generated
+ *   each time the load used the energy per pulse, the pulses can be
+ *   disturbed with timing jitter, load noise, contact bounce on both
+ *   edges and glitches (short pulses) while the line is idle. Pulses
+ *   closer than the pulse length are shortened, like on a real meter
+ *   at its limit.
+ *
+ *   With -t the edge file is replayed in virtual time from the given
+ *   start (unix time or local YYYY-MM-DDTHH:MM, e.g. the night of a
+ *   DST change), as fast as the daemon can process it. Otherwise it
+ *   is replayed in real time.
+ *
+ *   A summary of what was generated (pulses, energy, disturbances) is
+ *   written as JSON to stderr, to be compared with the counters of
+ *   the daemon.
+ *
+ *   Build command:
+ *   gcc -o emond-loadgen loadgen.c -lm
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+/* Max length of a load profile piece (in s), also the period of the load noise */
+#define PIECE_MAX 60.0
+
+/* Min idle time around a glitch (in s) */
+#define GLITCH_MARGIN 0.002
+
+typedef struct
+{
+   double start;        /* since the begin (in s) */
+   double dur;          /* duration (in s) */
+   double w0;           /* load at the start (in W) */
+   double w1;           /* load at the end (in W) */
+   double glitch_rate;  /* glitches per s */
+} piece_t;
+
+typedef struct
+{
+   unsigned int pin;
+   double wh_per_pulse;
+   double pulse_length;  /* in s */
+   double jitter;        /* in s */
+   double noise;         /* relative */
+   unsigned int bounces;
+   double bounce_time;   /* in s */
+   double glitch_rate;   /* per s */
+   unsigned long long seed;
+   int virtual_time;
+   time_t start;
+} gen_conf_t;
+
+static gen_conf_t conf;
+
+static piece_t *pieces = NULL;
+static unsigned int num_pieces = 0;
+static unsigned int max_pieces = 0;
+static double total_time = 0;
+
+/* Generated edges */
+static double last_edge = 0;
+static unsigned long edges = 0;
+static unsigned long pulses = 0;
+static unsigned long shortened = 0;
+static unsigned long glitches = 0;
+static unsigned long bounces = 0;
+
+/* Glitch stream */
+static unsigned int glitch_piece = 0;
+static double next_glitch = -1;
+
+
+/**********************************************************
+ * Internal function: rnd()
+ *
+ * Description:
+ *           Pseudo random number (xorshift64*), the same on
+ *           all systems for a seed
+ *
+ * Returns:  number in [0, 1)
+ *********************************************************/
+static double rnd(void)
+{
+   conf.seed ^= conf.seed >> 12;
+   conf.seed ^= conf.seed << 25;
+   conf.seed ^= conf.seed >> 27;
+   return ((conf.seed * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+/**********************************************************
+ * Internal function: add_piece()
+ *
+ * Description:
+ *           Append a piece to the load profile, split into
+ *           pieces of at most PIECE_MAX s with load noise
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int add_piece(double dur, double w0, double w1, double glitch_rate)
+{
+   piece_t *p;
+   double d;
+   double f;
+
+   if (dur <= 0 || w0 < 0 || w1 < 0 || glitch_rate < 0)
+      return -1;
+
+   while (dur > 0)
+   {
+      if (num_pieces == max_pieces)
+      {
+         max_pieces = max_pieces ? 2*max_pieces : 1024;
+         if ((p = realloc(pieces, max_pieces*sizeof(piece_t))) == NULL)
+            return -2;
+         pieces = p;
+      }
+
+      d = (dur > PIECE_MAX) ? PIECE_MAX : dur;
+      f = 1 + conf.noise*(2*rnd() - 1);
+      p = &pieces[num_pieces++];
+      p->start = total_time;
+      p->dur = d;
+      p->w0 = w0*f;
+      p->w1 = (w0 + (w1 - w0)*d/dur)*f;
+      p->glitch_rate = glitch_rate + conf.glitch_rate;
+
+      w0 += (w1 - w0)*d/dur;
+      total_time += d;
+      dur -= d;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: add_house()
+ *
+ * Description:
+ *           Append a household load: base load, a fridge
+ *           cycling 20 of 60 min and appliances switched on
+ *           at random
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int add_house(double dur, double base)
+{
+   /* power (W), minutes on, probability to start per minute */
+   static const struct { double power; unsigned int minutes; double p; } appliances[] =
+   {
+      { 2000,  3, 0.005 },   /* kettle */
+      { 2500, 40, 0.001 },   /* oven */
+      { 2000, 15, 0.0005 },  /* washing machine heating */
+      { 1200, 10, 0.002 },   /* microwave, hair dryer */
+   };
+   unsigned int on[sizeof(appliances)/sizeof(appliances[0])] = { 0 };
+   unsigned int phase = (unsigned int)(rnd()*60);
+   unsigned int minute;
+   unsigned int i;
+   double w;
+   double d;
+
+   for (minute = 0; dur > 0; minute++)
+   {
+      w = base;
+      if ((minute + phase) % 60 < 20)
+         w += 90;
+      for (i = 0; i < sizeof(appliances)/sizeof(appliances[0]); i++)
+      {
+         if (on[i] == 0 && rnd() < appliances[i].p)
+            on[i] = appliances[i].minutes;
+         if (on[i] > 0)
+         {
+            w += appliances[i].power;
+            on[i]--;
+         }
+      }
+      d = (dur > 60) ? 60 : dur;
+      if (add_piece(d, w, w, 0) < 0)
+         return -1;
+      dur -= d;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: parse_time()
+ *
+ * Description:
+ *           Parse a duration with optional suffix s, m, h
+ *           or d
+ *
+ * Returns:  duration (in s), <0 if invalid
+ *********************************************************/
+static double parse_time(const char *s)
+{
+   char *end;
+   double t = strtod(s, &end);
+
+   switch (*end)
+   {
+      case 'd': t *= 24;  /* fall through */
+      case 'h': t *= 60;  /* fall through */
+      case 'm': t *= 60;  /* fall through */
+      case 's': end++;    /* fall through */
+      case 0:
+      case ':':
+         break;
+      default:
+         return -1;
+   }
+   return (end != s && (*end == 0 || *end == ':')) ? t : -1;
+}
+
+/**********************************************************
+ * Internal function: parse_segment()
+ *
+ * Description:
+ *           Parse a segment of the load profile and append
+ *           it
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int parse_segment(const char *seg)
+{
+   const char *arg = strchr(seg, ':');
+   double v[3] = { 0, 0, 0 };
+   double dur;
+   int n;
+
+   if (arg == NULL || (dur = parse_time(arg+1)) <= 0)
+      return -1;
+
+   /* Values after the time */
+   arg = strchr(arg+1, ':');
+   n = arg ? sscanf(arg, ":%lf:%lf:%lf", &v[0], &v[1], &v[2]) : 0;
+
+   if (!strncmp(seg, "zero:", 5) && n == 0)
+      return add_piece(dur, 0, 0, 0);
+   if (!strncmp(seg, "const:", 6) && n == 1)
+      return add_piece(dur, v[0], v[0], 0);
+   if (!strncmp(seg, "ramp:", 5) && n == 2)
+      return add_piece(dur, v[0], v[1], 0);
+   if (!strncmp(seg, "house:", 6) && n <= 1)
+      return add_house(dur, (n == 1) ? v[0] : 150);
+   if (!strncmp(seg, "storm:", 6) && (n == 1 || n == 2))
+      return add_piece(dur, v[1], v[1], v[0]);
+   return -1;
+}
+
+/**********************************************************
+ * Internal function: piece_time()
+ *
+ * Description:
+ *           Find the time within a piece at which the load
+ *           used the given energy since time x
+ *
+ * Returns:  time since the piece start (in s), <0 if the
+ *           energy is not used within the piece
+ *********************************************************/
+static double piece_time(const piece_t *p, double x, double wh)
+{
+   double k = (p->w1 - p->w0)/p->dur;
+   double c = p->w0*x + k*x*x/2 + wh*3600;
+   double d;
+   double t;
+
+   if (k == 0)
+   {
+      if (p->w0 <= 0)
+         return -1;
+      t = c/p->w0;
+   }
+   else
+   {
+      d = p->w0*p->w0 + 2*k*c;
+      if (d < 0)
+         return -1;
+      t = (-p->w0 + sqrt(d))/k;
+   }
+   return (t <= p->dur) ? t : -1;
+}
+
+/**********************************************************
+ * Internal function: piece_energy()
+ *
+ * Description:
+ *           Energy used within a piece from time x to its
+ *           end
+ *
+ * Returns:  energy (in Wh)
+ *********************************************************/
+static double piece_energy(const piece_t *p, double x)
+{
+   double k = (p->w1 - p->w0)/p->dur;
+
+   return (p->w0*(p->dur - x) + k*(p->dur*p->dur - x*x)/2)/3600;
+}
+
+/**********************************************************
+ * Internal function: edge()
+ *
+ * Description:
+ *           Output an edge, keeping the edges in order
+ *
+ * Returns:  -
+ *********************************************************/
+static void edge(double t, int level)
+{
+   if (t < last_edge)
+      t = last_edge;
+   last_edge = t;
+   printf("%.6f %u %d\n", t, conf.pin, level);
+   edges++;
+}
+
+/**********************************************************
+ * Internal function: bounce_edge()
+ *
+ * Description:
+ *           Output an edge followed by the configured contact
+ *           bounces, ending at the level of the edge
+ *
+ * Returns:  time of the last edge
+ *********************************************************/
+static double bounce_edge(double t, int level)
+{
+   double step = conf.bounce_time/(2*conf.bounces + 1);
+   unsigned int i;
+
+   edge(t, level);
+   for (i = 1; i <= 2*conf.bounces; i++)
+      edge(t + i*step, (i % 2) ? !level : level);
+   bounces += conf.bounces;
+   return (conf.bounces > 0) ? t + 2*conf.bounces*step : t;
+}
+
+/**********************************************************
+ * Internal function: glitch_next()
+ *
+ * Description:
+ *           Draw the time of the next glitch after time t
+ *           (Poisson process with the rate of the pieces)
+ *
+ * Returns:  time (in s), <0 if none before the end
+ *********************************************************/
+static double glitch_next(double t)
+{
+   const piece_t *p;
+   double g;
+
+   while (glitch_piece < num_pieces)
+   {
+      p = &pieces[glitch_piece];
+      if (t < p->start)
+         t = p->start;
+      if (p->glitch_rate > 0)
+      {
+         g = t - log(1 - rnd())/p->glitch_rate;
+         if (g < p->start + p->dur)
+            return g;
+      }
+      /* No glitch within the piece, the process has no memory */
+      t = p->start + p->dur;
+      glitch_piece++;
+   }
+   return -1;
+}
+
+/**********************************************************
+ * Internal function: glitches_until()
+ *
+ * Description:
+ *           Output the glitches while the line is idle,
+ *           from time idle up to time t
+ *
+ * Returns:  -
+ *********************************************************/
+static void glitches_until(double idle, double t)
+{
+   double len;
+
+   while (next_glitch >= 0 && next_glitch < t)
+   {
+      len = 0.0002 + rnd()*0.0018;
+      if (next_glitch > idle + GLITCH_MARGIN && next_glitch + len + GLITCH_MARGIN < t)
+      {
+         edge(next_glitch, 0);
+         edge(next_glitch + len, 1);
+         glitches++;
+      }
+      next_glitch = glitch_next(next_glitch);
+   }
+}
+
+/**********************************************************
+ * Internal function: pulse()
+ *
+ * Description:
+ *           Output a pulse starting at time t, shortened if
+ *           the next pulse starts earlier
+ *
+ * Returns:  end of the pulse
+ *********************************************************/
+static double pulse(double idle, double t, double next)
+{
+   double len = conf.pulse_length;
+
+   if (next >= 0 && t + len + GLITCH_MARGIN > next)
+   {
+      len = (next - t)/2;
+      shortened++;
+   }
+   glitches_until(idle, t);
+   bounce_edge(t, 0);
+   pulses++;
+   return bounce_edge(t + len, 1);
+}
+
+/**********************************************************
+ * Internal function: generate()
+ *
+ * Description:
+ *           Generate the pulses of the load profile
+ *
+ * Returns:  energy of the pulses (in Wh)
+ *********************************************************/
+static double generate(void)
+{
+   double pending = -1;
+   double idle = 0;
+   double need = conf.wh_per_pulse;
+   double x;
+   double t;
+   double j;
+   unsigned int i;
+
+   next_glitch = glitch_next(0);
+   for (i = 0; i < num_pieces; i++)
+   {
+      x = 0;
+      while ((t = piece_time(&pieces[i], x, need)) >= 0)
+      {
+         /* Jitter of the meter output, the energy is not affected */
+         j = pieces[i].start + t + conf.jitter*(2*rnd() - 1);
+         if (j < 0)
+            j = 0;
+         if (pending >= 0)
+         {
+            if (j <= pending)
+               j = pending + 0.000001;
+            idle = pulse(idle, pending, j);
+         }
+         pending = j;
+         x = t;
+         need = conf.wh_per_pulse;
+      }
+      need -= piece_energy(&pieces[i], x);
+   }
+   if (pending >= 0)
+      idle = pulse(idle, pending, -1);
+   glitches_until(idle, total_time);
+
+   return pulses*conf.wh_per_pulse;
+}
+
+/**********************************************************
+ * Internal function: parse_start()
+ *
+ * Description:
+ *           Parse the start of the virtual time, as unix time
+ *           or local time YYYY-MM-DDTHH:MM[:SS]
+ *
+ * Returns:  unix time, <0 if invalid
+ *********************************************************/
+static time_t parse_start(const char *s)
+{
+   struct tm tm;
+   char *end;
+   long t;
+
+   memset(&tm, 0, sizeof(tm));
+   if (sscanf(s, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+              &tm.tm_hour, &tm.tm_min, &tm.tm_sec) >= 5)
+   {
+      tm.tm_year -= 1900;
+      tm.tm_mon -= 1;
+      tm.tm_isdst = -1;
+      return mktime(&tm);
+   }
+   t = strtol(s, &end, 10);
+   return (*end == 0 && end != s) ? (time_t)t : -1;
+}
+
+/**********************************************************
+ * Internal function: usage()
+ *
+ * Description:
+ *           Print the command line help
+ *
+ * Returns:  -
+ *********************************************************/
+static void usage(void)
+{
+   fprintf(stderr,
+      "Usage: emond-loadgen [options] <segment> ...\n"
+      "Segments (time in s, or with suffix m, h, d):\n"
+      "  zero:<time>  const:<time>:<W>  ramp:<time>:<W>:<W>\n"
+      "  house:<time>[:<base W>]  storm:<time>:<glitches/s>[:<W>]\n"
+      "Options:\n"
+      "  -p <pin>        GPIO pin (25)\n"
+      "  -w <Wh>         energy per pulse (1), or\n"
+      "  -i <imp/kWh>    meter constant\n"
+      "  -l <ms>         pulse length (100)\n"
+      "  -j <ms>         timing jitter of the pulses (0)\n"
+      "  -n <%%>          load noise per minute (0)\n"
+      "  -b <n>          contact bounces per edge (0)\n"
+      "  -B <ms>         duration of the bounces (1)\n"
+      "  -g <n>          glitches per hour (0)\n"
+      "  -s <seed>       random seed (1)\n"
+      "  -t <start>      virtual time from unix time or YYYY-MM-DDTHH:MM\n");
+}
+
+
+int main(int argc, char **argv)
+{
+   double energy;
+   int opt;
+   int i;
+
+   conf.pin = 25;
+   conf.wh_per_pulse = 1;
+   conf.pulse_length = 0.1;
+   conf.bounce_time = 0.001;
+   conf.seed = 1;
+
+   while ((opt = getopt(argc, argv, "p:w:i:l:j:n:b:B:g:s:t:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'p': conf.pin = atoi(optarg); break;
+         case 'w': conf.wh_per_pulse = atof(optarg); break;
+         case 'i': conf.wh_per_pulse = 1000/atof(optarg); break;
+         case 'l': conf.pulse_length = atof(optarg)/1000; break;
+         case 'j': conf.jitter = atof(optarg)/1000; break;
+         case 'n': conf.noise = atof(optarg)/100; break;
+         case 'b': conf.bounces = atoi(optarg); break;
+         case 'B': conf.bounce_time = atof(optarg)/1000; break;
+         case 'g': conf.glitch_rate = atof(optarg)/3600; break;
+         case 's': conf.seed = strtoull(optarg, NULL, 0); break;
+         case 't':
+            conf.virtual_time = 1;
+            if ((conf.start = parse_start(optarg)) < 0)
+            {
+               fprintf(stderr, "Invalid start time %s\n", optarg);
+               return 1;
+            }
+            break;
+         default:
+            usage();
+            return 1;
+      }
+   }
+   if (optind == argc || !(conf.wh_per_pulse > 0) || !(conf.pulse_length > 0) ||
+       conf.noise < 0 || conf.noise >= 1)
+   {
+      usage();
+      return 1;
+   }
+   if (conf.seed == 0)
+      conf.seed = 1;
+
+   for (i = optind; i < argc; i++)
+   {
+      if (parse_segment(argv[i]) < 0)
+      {
+         fprintf(stderr, "Invalid segment %s\n", argv[i]);
+         return 1;
+      }
+   }
+
+   printf("# emond-loadgen: %d segments, %.0f s, %g Wh per pulse\n", argc-optind, total_time, conf.wh_per_pulse);
+   if (conf.virtual_time)
+      printf("start %ld\n", (long)conf.start);
+   energy = generate();
+
+   fprintf(stderr, "{\"duration_s\":%.0f,\"start\":%ld,\"pulses\":%lu,\"energy_wh\":%.1f,\"edges\":%lu,"
+           "\"shortened\":%lu,\"glitches\":%lu,\"bounces\":%lu}\n",
+           total_time, conf.virtual_time ? (long)conf.start : 0L, pulses, energy, edges,
+           shortened, glitches, bounces);
+   free(pieces);
+   return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Energy Monitor: exact meter constant arithmetic
+ *
+ * Description:
+ *   The energy counters are kept as pulse counts. The meter constant is
+ *   parsed from its decimal representation into an exact fraction
+ *   (no floating point), so fractional constants like 0.8 Wh per pulse
+ *   or 1333.333 impulses per kWh don't accumulate errors. A pulse count
+ *   is converted to energy in 64-bit integer arithmetic and rounded
+ *   only once, so daily, monthly and lifetime totals stay consistent
+ *   with the meter display.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "meter.h"
+
+/* Limit for numerator*denominator, keeps meter_energy() far from overflow */
+#define METER_MAX_PRODUCT (1ULL << 44)
+
+/* Max number of significant digits of a decimal constant */
+#define METER_MAX_DIGITS 12
+
+
+/**********************************************************
+ * Internal function: gcd()
+ *
+ * Description:
+ *           Greatest common divisor
+ *
+ * Returns:  gcd of a and b
+ *********************************************************/
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+   while (b != 0)
+   {
+      uint64_t t = a % b;
+      a = b;
+      b = t;
+   }
+   return a;
+}
+
+/**********************************************************
+ * Internal function: parse_decimal()
+ *
+ * Description:
+ *           Parse a positive decimal number into an exact
+ *           fraction num/den (den is a power of 10)
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int parse_decimal(const char *s, uint64_t *num, uint64_t *den)
+{
+   int digits = 0;
+   int point = 0;
+
+   *num = 0;
+   *den = 1;
+
+   while (isspace((unsigned char)*s))
+      s++;
+
+   for (; *s != '\0' && !isspace((unsigned char)*s); s++)
+   {
+      if (*s == '.' && !point)
+      {
+         point = 1;
+      }
+      else if (isdigit((unsigned char)*s))
+      {
+         if (++digits > METER_MAX_DIGITS)
+            return -1;
+         *num = *num*10 + (*s - '0');
+         if (point)
+            *den *= 10;
+      }
+      else
+      {
+         return -1;
+      }
+   }
+
+   return (*num > 0) ? 0 : -2;
+}
+
+/**********************************************************
+ * Internal function: meter_set()
+ *
+ * Description:
+ *           Reduce and check a fraction
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int meter_set(meter_const_t *m, uint64_t num, uint64_t den)
+{
+   uint64_t g = gcd(num, den);
+
+   num /= g;
+   den /= g;
+   if (num == 0 || den == 0 || num >= METER_MAX_PRODUCT/den)
+      return -1;
+
+   m->num = num;
+   m->den = den;
+   return 0;
+}
+
+
+/**********************************************************
+ * Public function: meter_parse_wh()
+ *
+ * Description:
+ *           Set the meter constant from a decimal number of
+ *           Wh per pulse, e.g. "0.8"
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int meter_parse_wh(meter_const_t *m, const char *wh_per_pulse)
+{
+   uint64_t num, den;
+
+   if (parse_decimal(wh_per_pulse, &num, &den) < 0)
+      return -1;
+
+   return meter_set(m, num, den);
+}
+
+/**********************************************************
+ * Public function: meter_parse_imp()
+ *
+ * Description:
+ *           Set the meter constant from a decimal number of
+ *           impulses per kWh (as printed on the meter),
+ *           e.g. "1250"
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int meter_parse_imp(meter_const_t *m, const char *imp_per_kwh)
+{
+   uint64_t num, den;
+
+   if (parse_decimal(imp_per_kwh, &num, &den) < 0)
+      return -1;
+
+   /* Wh per pulse = 1000 / (num/den) */
+   return meter_set(m, 1000*den, num);
+}
+
+/**********************************************************
+ * Public function: meter_energy()
+ *
+ * Description:
+ *           Convert a pulse count to energy, exact up to a
+ *           single rounding to the given unit (1 for Wh,
+ *           1000 for mWh)
+ *
+ * Returns:  energy (in Wh/unit)
+ *********************************************************/
+uint64_t meter_energy(const meter_const_t *m, uint64_t pulses, unsigned int unit)
+{
+   uint64_t k, q, r;
+
+   if (m->den == 0)
+      return 0;
+
+   /* pulses*k/den, split to avoid overflow: q*den + r pulses */
+   k = m->num*unit;
+   q = pulses / m->den;
+   r = pulses % m->den;
+
+   return q*k + (r*k + m->den/2) / m->den;
+}
@@ -0,0 +1,55 @@
+/*
+ * Energy Monitor: exact meter constant arithmetic
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __METER_H__
+#define __METER_H__
+
+#include <stdint.h>
+
+/* Meter constant as exact fraction: Wh per pulse = num/den */
+typedef struct
+{
+   uint64_t num;
+   uint64_t den;
+} meter_const_t;
+
+/**********************************************************
+ * Public function: meter_parse_wh()
+ *
+ * Description:
+ *           Set the meter constant from a decimal number of
+ *           Wh per pulse, e.g. "0.8"
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int meter_parse_wh(meter_const_t *m, const char *wh_per_pulse);
+
+/**********************************************************
+ * Public function: meter_parse_imp()
+ *
+ * Description:
+ *           Set the meter constant from a decimal number of
+ *           impulses per kWh (as printed on the meter),
+ *           e.g. "1250"
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int meter_parse_imp(meter_const_t *m, const char *imp_per_kwh);
+
+/**********************************************************
+ * Public function: meter_energy()
+ *
+ * Description:
+ *           Convert a pulse count to energy, exact up to a
+ *           single rounding to the given unit (1 for Wh,
+ *           1000 for mWh)
+ *
+ * Returns:  energy (in Wh/unit)
+ *********************************************************/
+uint64_t meter_energy(const meter_const_t *m, uint64_t pulses, unsigned int unit);
+
+#endif /* __METER_H__ */
@@ -0,0 +1,935 @@
+/*
+ * Energy Monitor: Modbus RTU/TCP meter input
+ *
+ * Description:
+ *   Polls energy meters with a Modbus interface (e.g. SDM630) on an
+ *   RS-485 bus (RTU) or through a Modbus TCP gateway. Everything runs
+ *   non-blocking in the event loop.
+ *
+ *   The registers of a meter are grouped by poll interval and merged
+ *   into contiguous blocks (bridging small gaps), so each block is
+ *   read with a single request. Due blocks of all meters are sent in
+ *   order of their due time:
+ *
+ *   - Modbus TCP: up to "pipeline" requests are outstanding at a time,
+ *     matched to their responses by the transaction id, so the round
+ *     trip times of the gateway and the meters overlap.
+ *   - Modbus RTU: the bus is half duplex, so there is one request at a
+ *     time, but the next one is sent right after the inter-frame gap
+ *     following the previous response, without any polling delay.
+ *
+ *   Each response is decoded to W and Wh and passed to the callback.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "sockets.h"
+#include "evloop.h"
+#include "serial.h"
+#include "modbus.h"
+
+/* Max number of registers per request (protocol limit) */
+#define MODBUS_MAX_REGS 125
+
+/* Max number of unused registers read to merge two blocks */
+#define MODBUS_MAX_GAP 8
+
+#define MODBUS_MAX_BLOCKS (MODBUS_MAX_METERS*READING_VALUES)
+#define MODBUS_MAX_PIPELINE 16
+
+/* Max size of an RTU frame */
+#define MODBUS_RTU_SIZE 256
+
+/* Reconnect backoff limits (in ms) */
+#define MODBUS_BACKOFF_MIN 1000
+#define MODBUS_BACKOFF_MAX 60000
+
+/* A contiguous register block read with one request */
+typedef struct
+{
+   unsigned int meter;          /* index in conf */
+   unsigned int start;
+   unsigned int count;
+   unsigned int interval;
+   unsigned int values;         /* mask of values in the block */
+   unsigned long long due;
+   int in_flight;
+} mb_block_t;
+
+/* An outstanding request */
+typedef struct
+{
+   int used;
+   int block;
+   unsigned short tid;
+   int timer;
+} mb_request_t;
+
+/* Registers per data type */
+static const unsigned int type_regs[] = { 2, 1, 1, 2, 2 };
+
+static const char *value_names[READING_VALUES] = READING_NAMES;
+
+static int running = 0;
+static int is_tcp = 0;
+static char device_spec[MODBUS_DEVICE_SIZE];
+static modbus_conf_t meters[MODBUS_MAX_METERS];
+static int online[MODBUS_MAX_METERS];
+static reading_cb callback = NULL;
+static void *callback_arg = NULL;
+static unsigned int timeout_ms = MODBUS_TIMEOUT;
+static unsigned int pipeline = MODBUS_PIPELINE;
+
+static mb_block_t blocks[MODBUS_MAX_BLOCKS];
+static int num_blocks = 0;
+static mb_request_t requests[MODBUS_MAX_PIPELINE];
+static unsigned int outstanding = 0;
+static unsigned short next_tid = 0;
+static int poll_timer = 0;
+
+/* Modbus TCP */
+static sock_conn_t conn = { .fd = -1, .state = SOCK_ST_CLOSED };
+static char tcp_host[SOCK_HOST_SIZE];
+static unsigned short tcp_port = MODBUS_TCP_PORT;
+static unsigned long backoff = MODBUS_BACKOFF_MIN;
+static int reconnect_timer = 0;
+
+/* Modbus RTU */
+static int rtu_fd = -1;
+static unsigned char rtu_buf[MODBUS_RTU_SIZE];
+static size_t rtu_len = 0;
+static unsigned long rtu_gap_ms = 2;
+static unsigned long long rtu_idle_at = 0;
+
+static void modbus_schedule(void);
+static void modbus_reconnect(void *arg);
+
+
+/**********************************************************
+ * Internal function: modbus_crc()
+ *
+ * Description:
+ *           CRC-16 of an RTU frame (polynomial 0xA001)
+ *
+ * Returns:  CRC
+ *********************************************************/
+static uint16_t modbus_crc(const unsigned char *data, size_t len)
+{
+   uint16_t crc = 0xFFFF;
+   int i;
+
+   while (len--)
+   {
+      crc ^= *data++;
+      for (i = 0; i < 8; i++)
+         crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+   }
+   return crc;
+}
+
+/**********************************************************
+ * Internal function: modbus_decode()
+ *
+ * Description:
+ *           Decode a register value
+ *
+ * Returns:  value
+ *********************************************************/
+static double modbus_decode(const unsigned char *p, modbus_type_t type)
+{
+   uint32_t u = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                ((uint32_t)p[2] << 8) | p[3];
+   uint16_t w = ((uint16_t)p[0] << 8) | p[1];
+   float f;
+
+   switch (type)
+   {
+      case MODBUS_FLOAT:
+         memcpy(&f, &u, sizeof(f));
+         return f;
+      case MODBUS_INT16:
+         return (int16_t)w;
+      case MODBUS_UINT16:
+         return w;
+      case MODBUS_INT32:
+         return (int32_t)u;
+      default:
+         return u;
+   }
+}
+
+/**********************************************************
+ * Internal function: modbus_state()
+ *
+ * Description:
+ *           Log when a meter starts or stops answering
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_state(unsigned int meter, int ok, const char *reason)
+{
+   if (ok && !online[meter])
+   {
+      syslog(LOG_DAEMON | LOG_INFO, "Modbus meter of channel %u (unit %u) is answering\n",
+             meters[meter].channel, meters[meter].unit);
+   }
+   else if (!ok && online[meter])
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Modbus meter of channel %u (unit %u) is not answering: %s\n",
+             meters[meter].channel, meters[meter].unit, reason);
+   }
+   online[meter] = ok;
+}
+
+/**********************************************************
+ * Internal function: modbus_release()
+ *
+ * Description:
+ *           Free an outstanding request
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_release(mb_request_t *r)
+{
+   if (r->timer > 0)
+      ev_timer_cancel(r->timer);
+   blocks[r->block].in_flight = 0;
+   memset(r, 0, sizeof(*r));
+   outstanding--;
+
+   if (!is_tcp)
+   {
+      /* Keep the bus silent for the inter-frame gap */
+      rtu_len = 0;
+      rtu_idle_at = ev_now_ms() + rtu_gap_ms;
+   }
+}
+
+/**********************************************************
+ * Internal function: modbus_release_all()
+ *
+ * Description:
+ *           Free all outstanding requests
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_release_all(void)
+{
+   int i;
+
+   for (i = 0; i < MODBUS_MAX_PIPELINE; i++)
+   {
+      if (requests[i].used)
+         modbus_release(&requests[i]);
+   }
+}
+
+/**********************************************************
+ * Internal function: modbus_response()
+ *
+ * Description:
+ *           Handle the PDU of a response
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_response(mb_request_t *r, unsigned int unit, const unsigned char *pdu, size_t len)
+{
+   mb_block_t *b = &blocks[r->block];
+   modbus_conf_t *mc = &meters[b->meter];
+   reading_t sample;
+   const modbus_reg_t *reg;
+   char reason[32];
+   int v;
+
+   if (unit != mc->unit || len < 2 || (pdu[0] & 0x7F) != mc->function)
+   {
+      /* Not the answer to this request, wait for the timeout */
+      return;
+   }
+
+   if (pdu[0] & 0x80)
+   {
+      snprintf(reason, sizeof(reason), "exception %u", pdu[1]);
+      modbus_state(b->meter, 0, reason);
+      modbus_release(r);
+      modbus_schedule();
+      return;
+   }
+
+   if (pdu[1] != b->count*2 || len != 2 + b->count*2)
+   {
+      modbus_state(b->meter, 0, "invalid response");
+      modbus_release(r);
+      modbus_schedule();
+      return;
+   }
+
+   memset(&sample, 0, sizeof(sample));
+   clock_gettime(CLOCK_REALTIME, &sample.ts);
+   for (v = 0; v < READING_VALUES; v++)
+   {
+      if (!(b->values & (1 << v)))
+         continue;
+      reg = &mc->reg[v];
+      sample.value[v] = modbus_decode(pdu + 2 + 2*(reg->address - b->start), reg->type)*reg->scale;
+      sample.valid |= 1 << v;
+   }
+
+   modbus_state(b->meter, 1, NULL);
+   modbus_release(r);
+   callback(mc->channel, &sample, 1, callback_arg);
+   modbus_schedule();
+}
+
+/**********************************************************
+ * Internal function: modbus_timeout()
+ *
+ * Description:
+ *           Timer callback of a request without response
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_timeout(void *arg)
+{
+   mb_request_t *r = (mb_request_t*)arg;
+
+   r->timer = 0;
+   modbus_state(blocks[r->block].meter, 0, "timeout");
+   modbus_release(r);
+   modbus_schedule();
+}
+
+/**********************************************************
+ * Internal function: modbus_send()
+ *
+ * Description:
+ *           Send the request for a block
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int modbus_send(int block)
+{
+   mb_block_t *b = &blocks[block];
+   modbus_conf_t *mc = &meters[b->meter];
+   unsigned char frame[16];
+   unsigned char *pdu;
+   uint16_t crc;
+   int i, len;
+
+   for (i = 0; i < MODBUS_MAX_PIPELINE && requests[i].used; i++)
+      ;
+   if (i == MODBUS_MAX_PIPELINE)
+      return -1;
+
+   /* MBAP header (TCP) or slave address (RTU) in front of the PDU */
+   pdu = frame + (is_tcp ? 7 : 1);
+   pdu[0] = mc->function;
+   pdu[1] = b->start >> 8;
+   pdu[2] = b->start & 0xFF;
+   pdu[3] = b->count >> 8;
+   pdu[4] = b->count & 0xFF;
+
+   if (is_tcp)
+   {
+      next_tid++;
+      frame[0] = next_tid >> 8;
+      frame[1] = next_tid & 0xFF;
+      frame[2] = 0;
+      frame[3] = 0;
+      frame[4] = 0;
+      frame[5] = 6;
+      frame[6] = mc->unit;
+      len = 12;
+      if (sock_conn_send(&conn, frame, len) < 0)
+         return -1;
+   }
+   else
+   {
+      frame[0] = mc->unit;
+      crc = modbus_crc(frame, 6);
+      frame[6] = crc & 0xFF;
+      frame[7] = crc >> 8;
+      len = 8;
+      rtu_len = 0;
+      if (write(rtu_fd, frame, len) != len)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Modbus RTU write error: %s\n", strerror(errno));
+         return -1;
+      }
+   }
+
+   requests[i].used = 1;
+   requests[i].block = block;
+   requests[i].tid = next_tid;
+   requests[i].timer = ev_timer_add(timeout_ms, modbus_timeout, &requests[i]);
+   b->in_flight = 1;
+   outstanding++;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: modbus_poll()
+ *
+ * Description:
+ *           Send due requests as far as the pipeline allows
+ *           and set the timer for the next due block
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_poll(void *arg)
+{
+   poll_timer = 0;
+   modbus_schedule();
+}
+
+/**********************************************************
+ * Internal function: modbus_schedule()
+ *
+ * Description:
+ *           Send the due blocks (most overdue first) and
+ *           arm the timer for the next one
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_schedule(void)
+{
+   unsigned long long now = ev_now_ms();
+   unsigned long long next = 0;
+   int i, best;
+
+   if (!running)
+      return;
+   if (is_tcp && conn.state != SOCK_ST_CONNECTED)
+      return;
+
+   while (outstanding < pipeline)
+   {
+      if (!is_tcp && now < rtu_idle_at)
+      {
+         next = rtu_idle_at;
+         break;
+      }
+
+      best = -1;
+      for (i = 0; i < num_blocks; i++)
+      {
+         if (!blocks[i].in_flight && (best < 0 || blocks[i].due < blocks[best].due))
+            best = i;
+      }
+      if (best < 0)
+         break;
+      if (blocks[best].due > now)
+      {
+         next = blocks[best].due;
+         break;
+      }
+
+      /* Keep the poll rate, skip missed polls */
+      blocks[best].due += blocks[best].interval;
+      if (blocks[best].due <= now)
+         blocks[best].due = now + blocks[best].interval;
+
+      if (modbus_send(best) < 0)
+         break;
+   }
+
+   if (poll_timer > 0)
+   {
+      ev_timer_cancel(poll_timer);
+      poll_timer = 0;
+   }
+   if (next > 0)
+   {
+      poll_timer = ev_timer_add(next - now, modbus_poll, NULL);
+   }
+}
+
+/**********************************************************
+ * Internal function: modbus_tcp_data()
+ *
+ * Description:
+ *           Handle data received from the TCP gateway
+ *
+ * Returns:  number of bytes consumed
+ *********************************************************/
+static size_t modbus_tcp_data(sock_conn_t *c, const unsigned char *data, size_t len, void *arg)
+{
+   size_t used = 0;
+   size_t frame_len;
+   unsigned short tid;
+   int i;
+
+   while (len - used >= 7)
+   {
+      frame_len = 6 + ((data[used+4] << 8) | data[used+5]);
+      if (frame_len < 9 || frame_len > 7 + 2 + 2*MODBUS_MAX_REGS)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Invalid Modbus TCP frame, reconnecting\n");
+         sock_conn_close(&conn);
+         modbus_release_all();
+         reconnect_timer = ev_timer_add(backoff, modbus_reconnect, NULL);
+         return len;
+      }
+      if (len - used < frame_len)
+         break;
+
+      tid = (data[used] << 8) | data[used+1];
+      for (i = 0; i < MODBUS_MAX_PIPELINE; i++)
+      {
+         if (requests[i].used && requests[i].tid == tid)
+         {
+            modbus_response(&requests[i], data[used+6], data+used+7, frame_len-7);
+            break;
+         }
+      }
+      used += frame_len;
+
+      if (conn.fd < 0)
+         return len;
+   }
+
+   return used;
+}
+
+/**********************************************************
+ * Internal function: modbus_tcp_event()
+ *
+ * Description:
+ *           Connection state changes of the TCP gateway
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_tcp_event(sock_conn_t *c, int event, int err, void *arg)
+{
+   if (event == SOCK_EV_CONNECTED)
+   {
+      syslog(LOG_DAEMON | LOG_INFO, "Connected to Modbus gateway %s:%u\n", tcp_host, tcp_port);
+      backoff = MODBUS_BACKOFF_MIN;
+      modbus_schedule();
+      return;
+   }
+
+   syslog(LOG_DAEMON | LOG_WARNING, "Modbus gateway %s:%u disconnected: %s\n", tcp_host, tcp_port,
+          err ? strerror(err) : "closed by peer");
+   modbus_release_all();
+   reconnect_timer = ev_timer_add(backoff, modbus_reconnect, NULL);
+   backoff = (backoff*2 > MODBUS_BACKOFF_MAX) ? MODBUS_BACKOFF_MAX : backoff*2;
+}
+
+/**********************************************************
+ * Internal function: modbus_rtu_read()
+ *
+ * Description:
+ *           Event loop callback of the serial port
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_rtu_read(int fd, unsigned int events, void *arg)
+{
+   mb_request_t *r = NULL;
+   size_t frame_len;
+   ssize_t n;
+   int i;
+
+   n = read(fd, rtu_buf + rtu_len, sizeof(rtu_buf) - rtu_len);
+   if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+   if (n <= 0)
+   {
+      /* Serial adapter removed, try to open it again */
+      syslog(LOG_DAEMON | LOG_WARNING, "Modbus RTU device %s failed: %s\n", device_spec,
+             (n < 0) ? strerror(errno) : "hangup");
+      ev_del_fd(rtu_fd);
+      close(rtu_fd);
+      rtu_fd = -1;
+      modbus_release_all();
+      reconnect_timer = ev_timer_add(backoff, modbus_reconnect, NULL);
+      backoff = (backoff*2 > MODBUS_BACKOFF_MAX) ? MODBUS_BACKOFF_MAX : backoff*2;
+      return;
+   }
+   rtu_len += n;
+
+   for (i = 0; i < MODBUS_MAX_PIPELINE; i++)
+   {
+      if (requests[i].used)
+         r = &requests[i];
+   }
+   if (r == NULL)
+   {
+      /* Nothing expected (late answer or noise) */
+      rtu_len = 0;
+      return;
+   }
+
+   /* Address, function and exception code or byte count */
+   if (rtu_len < 3)
+      return;
+   frame_len = (rtu_buf[1] & 0x80) ? 5 : 5 + rtu_buf[2];
+   if (rtu_len < frame_len)
+      return;
+
+   if (modbus_crc(rtu_buf, frame_len) != 0)
+   {
+      /* Wait for the timeout, the request is repeated with the next poll */
+      rtu_len = 0;
+      return;
+   }
+
+   modbus_response(r, rtu_buf[0], rtu_buf+1, frame_len-3);
+   rtu_len = 0;
+}
+
+/**********************************************************
+ * Internal function: modbus_rtu_open()
+ *
+ * Description:
+ *           Open and set up the serial port,
+ *           "<tty>[:<baud>[:<8N1|8E1|8O1|8N2>]]"
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int modbus_rtu_open(const char *spec)
+{
+   unsigned long baud = 9600;
+
+   if ((rtu_fd = serial_open(spec, &baud)) < 0)
+      return -1;
+
+   /* 3.5 characters of 11 bits, fixed 1.75 ms above 19200 baud */
+   rtu_gap_ms = (baud > 19200) ? 2 : (3500*11 + baud - 1)/baud + 1;
+
+   if (ev_add_fd(rtu_fd, EV_READ, modbus_rtu_read, NULL) < 0)
+   {
+      close(rtu_fd);
+      rtu_fd = -1;
+      return -1;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: modbus_reconnect()
+ *
+ * Description:
+ *           Timer callback which connects to the gateway or
+ *           opens the serial port
+ *
+ * Returns:  -
+ *********************************************************/
+static void modbus_reconnect(void *arg)
+{
+   reconnect_timer = 0;
+
+   if (is_tcp)
+   {
+      if (sock_conn_open(&conn, tcp_host, tcp_port, NULL, modbus_tcp_event, NULL) == 0)
+      {
+         sock_conn_set_raw(&conn, modbus_tcp_data);
+         return;
+      }
+   }
+   else if (modbus_rtu_open(device_spec+4) == 0)
+   {
+      backoff = MODBUS_BACKOFF_MIN;
+      modbus_schedule();
+      return;
+   }
+
+   reconnect_timer = ev_timer_add(backoff, modbus_reconnect, NULL);
+   backoff = (backoff*2 > MODBUS_BACKOFF_MAX) ? MODBUS_BACKOFF_MAX : backoff*2;
+}
+
+/**********************************************************
+ * Internal function: modbus_add_block()
+ *
+ * Description:
+ *           Add a register to the blocks, merging it with a
+ *           block of the same meter and interval if the gap
+ *           is small
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int modbus_add_block(unsigned int meter, int value)
+{
+   const modbus_reg_t *reg = &meters[meter].reg[value];
+   unsigned int start = reg->address;
+   unsigned int end = reg->address + type_regs[reg->type];
+   mb_block_t *b;
+   int i;
+
+   for (i = 0; i < num_blocks; i++)
+   {
+      unsigned int s, e;
+
+      b = &blocks[i];
+      if (b->meter != meter || b->interval != reg->interval)
+         continue;
+
+      s = (start < b->start) ? start : b->start;
+      e = (end > b->start + b->count) ? end : b->start + b->count;
+      if (start <= b->start + b->count + MODBUS_MAX_GAP &&
+          b->start <= end + MODBUS_MAX_GAP && e - s <= MODBUS_MAX_REGS)
+      {
+         b->start = s;
+         b->count = e - s;
+         b->values |= 1 << value;
+         return 0;
+      }
+   }
+
+   if (num_blocks == MODBUS_MAX_BLOCKS)
+      return -1;
+
+   b = &blocks[num_blocks++];
+   memset(b, 0, sizeof(*b));
+   b->meter = meter;
+   b->start = start;
+   b->count = end - start;
+   b->interval = reg->interval;
+   b->values = 1 << value;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: modbus_layout()
+ *
+ * Description:
+ *           Set the registers of a known meter type
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int modbus_layout(modbus_conf_t *mc, const char *layout)
+{
+   static const modbus_reg_t sdm[READING_VALUES] =
+   {
+      { 1, 0x0034, MODBUS_FLOAT, MODBUS_INTERVAL, 1 },
+      { 1, 0x000C, MODBUS_FLOAT, MODBUS_INTERVAL, 1 },
+      { 1, 0x000E, MODBUS_FLOAT, MODBUS_INTERVAL, 1 },
+      { 1, 0x0010, MODBUS_FLOAT, MODBUS_INTERVAL, 1 },
+      { 1, 0x0048, MODBUS_FLOAT, 10*MODBUS_INTERVAL, 1000 },
+      { 1, 0x004A, MODBUS_FLOAT, 10*MODBUS_INTERVAL, 1000 }
+   };
+
+   mc->function = 4;
+   if (strcmp(layout, "sdm630") == 0)
+   {
+      memcpy(mc->reg, sdm, sizeof(sdm));
+   }
+   else if (strcmp(layout, "sdm120") == 0)
+   {
+      /* Single phase, the total power is the phase 1 power */
+      memset(mc->reg, 0, sizeof(mc->reg));
+      mc->reg[READING_POWER] = sdm[READING_POWER_L1];
+      mc->reg[READING_IMPORT] = sdm[READING_IMPORT];
+      mc->reg[READING_EXPORT] = sdm[READING_EXPORT];
+   }
+   else
+   {
+      return -1;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Public function: modbus_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a meter
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int modbus_config(modbus_conf_t *mc, const char *name, const char *value)
+{
+   static const char *type_names[] = { "float", "int16", "uint16", "int32", "uint32" };
+   modbus_reg_t reg;
+   char type[16] = "float";
+   unsigned int i;
+   int address;
+   int v;
+
+   if (!mc->enabled)
+   {
+      mc->enabled = 1;
+      mc->unit = 1;
+      mc->function = 4;
+   }
+
+   if (strcmp(name, "unit") == 0)
+   {
+      mc->unit = atoi(value);
+      return (mc->unit >= 1 && mc->unit <= 247) ? 0 : -1;
+   }
+   if (strcmp(name, "function") == 0)
+   {
+      mc->function = atoi(value);
+      return (mc->function == 3 || mc->function == 4) ? 0 : -1;
+   }
+   if (strcmp(name, "layout") == 0)
+   {
+      return modbus_layout(mc, value);
+   }
+
+   /* <value> = <address> [<type> [<interval ms> [<scale>]]] */
+   for (v = 0; v < READING_VALUES && strcmp(name, value_names[v]) != 0; v++)
+      ;
+   if (v == READING_VALUES)
+      return -1;
+
+   memset(&reg, 0, sizeof(reg));
+   reg.interval = MODBUS_INTERVAL;
+   reg.scale = 1;
+   if (sscanf(value, "%i %15s %u %lf", &address, type, &reg.interval, &reg.scale) < 1)
+      return -1;
+   for (i = 0; i < sizeof(type_names)/sizeof(type_names[0]) && strcmp(type, type_names[i]) != 0; i++)
+      ;
+   if (i == sizeof(type_names)/sizeof(type_names[0]) || address < 0 || address > 0xFFFF || reg.interval == 0)
+      return -1;
+
+   reg.address = address;
+   reg.type = i;
+   reg.used = 1;
+   mc->reg[v] = reg;
+   return 0;
+}
+
+/**********************************************************
+ * Public function: modbus_init()
+ *
+ * Description:
+ *           Start polling the enabled meters over their
+ *           device, "tcp:<host>[:<port>]" or
+ *           "rtu:<tty>[:<baud>[:<8N1|8E1|8O1|8N2>]]". All
+ *           meters share the bus of the first one. Needs the
+ *           event loop. A timeout or pipeline of 0 selects
+ *           the default.
+ *
+ * Returns:  0 on success (or nothing configured), <0 otherwise
+ *********************************************************/
+int modbus_init(const modbus_conf_t conf[MODBUS_MAX_METERS], reading_cb cb, void *arg)
+{
+   unsigned long long now = ev_now_ms();
+   const char *device;
+   const char *p;
+   unsigned int m;
+   int v;
+
+   modbus_exit();
+
+   memcpy(meters, conf, sizeof(meters));
+   callback = cb;
+   callback_arg = arg;
+   for (m = 0; m < MODBUS_MAX_METERS && !meters[m].enabled; m++)
+      ;
+   if (m == MODBUS_MAX_METERS)
+      return 0;
+   device = meters[m].device;
+   timeout_ms = (meters[m].timeout > 0) ? meters[m].timeout : MODBUS_TIMEOUT;
+   pipeline = (meters[m].pipeline > 0) ? meters[m].pipeline : MODBUS_PIPELINE;
+   if (pipeline > MODBUS_MAX_PIPELINE)
+      pipeline = MODBUS_MAX_PIPELINE;
+
+   /* Group the registers into blocks, first poll right away */
+   num_blocks = 0;
+   for (m = 0; m < MODBUS_MAX_METERS; m++)
+   {
+      online[m] = 1;
+      if (!meters[m].enabled)
+         continue;
+      for (v = 0; v < READING_VALUES; v++)
+      {
+         if (meters[m].reg[v].used && modbus_add_block(m, v) < 0)
+            return -1;
+      }
+   }
+   for (v = 0; v < num_blocks; v++)
+      blocks[v].due = now;
+
+   if (num_blocks == 0)
+      return 0;
+
+   if (strlen(device) == 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Missing config parameter modbus_device\n");
+      return -1;
+   }
+
+   snprintf(device_spec, sizeof(device_spec), "%s", device);
+   backoff = MODBUS_BACKOFF_MIN;
+   running = 1;
+
+   if (strncmp(device, "tcp:", 4) == 0)
+   {
+      is_tcp = 1;
+      p = strrchr(device+4, ':');
+      snprintf(tcp_host, sizeof(tcp_host), "%.*s", p ? (int)(p - device - 4) : (int)strlen(device+4), device+4);
+      tcp_port = p ? atoi(p+1) : MODBUS_TCP_PORT;
+      modbus_reconnect(NULL);
+   }
+   else if (strncmp(device, "rtu:", 4) == 0)
+   {
+      is_tcp = 0;
+      pipeline = 1;
+      if (modbus_rtu_open(device+4) < 0)
+      {
+         running = 0;
+         return -1;
+      }
+   }
+   else
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid config parameter modbus_device: %s\n", device);
+      running = 0;
+      return -1;
+   }
+
+   syslog(LOG_DAEMON | LOG_INFO, "Polling Modbus meters via %s (%d register blocks)\n", device, num_blocks);
+   modbus_schedule();
+   return 0;
+}
+
+/**********************************************************
+ * Public function: modbus_exit()
+ *
+ * Description:
+ *           Stop polling and close the device
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int modbus_exit(void)
+{
+   running = 0;
+
+   modbus_release_all();
+   if (poll_timer > 0)
+   {
+      ev_timer_cancel(poll_timer);
+      poll_timer = 0;
+   }
+   if (reconnect_timer > 0)
+   {
+      ev_timer_cancel(reconnect_timer);
+      reconnect_timer = 0;
+   }
+   sock_conn_close(&conn);
+   if (rtu_fd >= 0)
+   {
+      ev_del_fd(rtu_fd);
+      close(rtu_fd);
+      rtu_fd = -1;
+   }
+   rtu_len = 0;
+   rtu_idle_at = 0;
+   return 0;
+}
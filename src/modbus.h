@@ -0,0 +1,100 @@
+/*
+ * Energy Monitor: Modbus RTU/TCP meter input
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __MODBUS_H__
+#define __MODBUS_H__
+
+#include "reading.h"
+
+/* Max number of meters on the bus */
+#define MODBUS_MAX_METERS 8
+
+/* Default response timeout (in ms) */
+#define MODBUS_TIMEOUT 1000
+
+/* Default max number of outstanding requests (Modbus TCP only) */
+#define MODBUS_PIPELINE 4
+
+/* Default poll interval of a register (in ms) */
+#define MODBUS_INTERVAL 1000
+
+/* Default TCP port */
+#define MODBUS_TCP_PORT 502
+
+/* Register data types (32 bit types are big endian, high word first) */
+typedef enum
+{
+   MODBUS_FLOAT,
+   MODBUS_INT16,
+   MODBUS_UINT16,
+   MODBUS_INT32,
+   MODBUS_UINT32
+} modbus_type_t;
+
+/* Register of a measured value */
+typedef struct
+{
+   int used;
+   unsigned int address;
+   modbus_type_t type;
+   unsigned int interval;  /* poll interval (in ms) */
+   double scale;           /* factor to W or Wh */
+} modbus_reg_t;
+
+/* Max length of the device */
+#define MODBUS_DEVICE_SIZE 128
+
+/* Configuration of one meter (channel with "source = modbus") */
+typedef struct
+{
+   int enabled;
+   unsigned int channel;          /* channel the readings are passed to */
+   unsigned int unit;             /* slave address */
+   unsigned int function;         /* 3 (holding) or 4 (input registers) */
+   modbus_reg_t reg[READING_VALUES];
+   /* Bus of the meter ([modbus]) */
+   char device[MODBUS_DEVICE_SIZE];
+   unsigned int timeout;
+   unsigned int pipeline;
+} modbus_conf_t;
+
+/**********************************************************
+ * Public function: modbus_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a meter
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int modbus_config(modbus_conf_t *mc, const char *name, const char *value);
+
+/**********************************************************
+ * Public function: modbus_init()
+ *
+ * Description:
+ *           Start polling the enabled meters over their
+ *           device, "tcp:<host>[:<port>]" or
+ *           "rtu:<tty>[:<baud>[:<8N1|8E1|8O1|8N2>]]". All
+ *           meters share the bus of the first one. Needs the
+ *           event loop. A timeout or pipeline of 0 selects
+ *           the default.
+ *
+ * Returns:  0 on success (or nothing configured), <0 otherwise
+ *********************************************************/
+int modbus_init(const modbus_conf_t conf[MODBUS_MAX_METERS], reading_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: modbus_exit()
+ *
+ * Description:
+ *           Stop polling and close the device
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int modbus_exit(void);
+
+#endif /* __MODBUS_H__ */
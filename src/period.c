@@ -0,0 +1,194 @@
+/*
+ * Energy Monitor: calendar period scheduler
+ *
+ * Description:
+ *   Arms an absolute timer (timerfd on CLOCK_REALTIME) for the next
+ *   full hour in local time instead of polling the clock. Day and
+ *   month boundaries are always full hours, so the owner can detect
+ *   them in the callback. Boundaries are computed with mktime(), which
+ *   takes care of DST changes. If the system clock is set (e.g. by
+ *   NTP after boot) the timer is cancelled by the kernel
+ *   (TFD_TIMER_CANCEL_ON_SET), the callback is invoked and the next
+ *   boundary is computed again from the new time.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+#include "period.h"
+
+#ifndef TFD_TIMER_CANCEL_ON_SET
+#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
+
+static int tfd = -1;
+static period_cb user_cb = NULL;
+static void *user_arg = NULL;
+
+
+/**********************************************************
+ * Internal function: period_arm()
+ *
+ * Description:
+ *           Arm the timer for the next full hour
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int period_arm(void)
+{
+   struct itimerspec its;
+   time_t now = time(NULL);
+   time_t next;
+
+   /* Never arm in the past, the hour could be shortened by a DST change */
+   next = period_hour_start(now) + 3600;
+   if (next <= now)
+      next = now + 1;
+
+   memset(&its, 0, sizeof(its));
+   its.it_value.tv_sec = next;
+   if (timerfd_settime(tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to arm period timer: %s\n", strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: period_io_cb()
+ *
+ * Description:
+ *           Event loop callback for the timerfd
+ *
+ * Returns:  -
+ *********************************************************/
+static void period_io_cb(int fd, unsigned int events, void *arg)
+{
+   uint64_t expirations;
+   int clock_set = 0;
+
+   if (read(tfd, &expirations, sizeof(expirations)) < 0)
+   {
+      if (errno == ECANCELED)
+      {
+         syslog(LOG_DAEMON | LOG_NOTICE, "System clock was set, recomputing period boundaries\n");
+         clock_set = 1;
+      }
+      else if (errno == EAGAIN)
+      {
+         return;
+      }
+   }
+
+   period_arm();
+   user_cb(time(NULL), clock_set, user_arg);
+}
+
+
+/**********************************************************
+ * Public function: period_init()
+ *
+ * Description:
+ *           Start calling cb at every full hour (local time)
+ *           and whenever the system clock is set
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int period_init(period_cb cb, void *arg)
+{
+   user_cb = cb;
+   user_arg = arg;
+
+   if ((tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to create period timer: %s\n", strerror(errno));
+      return -1;
+   }
+
+   if (period_arm() < 0 || ev_add_fd(tfd, EV_READ, period_io_cb, NULL) < 0)
+   {
+      close(tfd);
+      tfd = -1;
+      return -2;
+   }
+
+   return 0;
+}
+
+/**********************************************************
+ * Public function: period_hour_start()
+ *
+ * Description:
+ *           Compute the start of the hour containing t
+ *
+ * Returns:  start time of the hour
+ *********************************************************/
+time_t period_hour_start(time_t t)
+{
+   struct tm tm;
+
+   /* Keep tm_isdst from localtime, so that the repeated
+    * hour at the end of DST is resolved correctly */
+   localtime_r(&t, &tm);
+   tm.tm_min = 0;
+   tm.tm_sec = 0;
+   return mktime(&tm);
+}
+
+/**********************************************************
+ * Public function: period_day_start()
+ *
+ * Description:
+ *           Compute the start (local midnight) of the day
+ *           containing t, offset by the given number of days
+ *
+ * Returns:  start time of the day
+ *********************************************************/
+time_t period_day_start(time_t t, int offset)
+{
+   struct tm tm;
+
+   localtime_r(&t, &tm);
+   tm.tm_mday += offset;
+   tm.tm_hour = 0;
+   tm.tm_min = 0;
+   tm.tm_sec = 0;
+   tm.tm_isdst = -1;
+   return mktime(&tm);
+}
+
+/**********************************************************
+ * Public function: period_month_start()
+ *
+ * Description:
+ *           Compute the start (local midnight of the 1st) of
+ *           the month containing t, offset by the given
+ *           number of months
+ *
+ * Returns:  start time of the month
+ *********************************************************/
+time_t period_month_start(time_t t, int offset)
+{
+   struct tm tm;
+
+   localtime_r(&t, &tm);
+   tm.tm_mon += offset;
+   tm.tm_mday = 1;
+   tm.tm_hour = 0;
+   tm.tm_min = 0;
+   tm.tm_sec = 0;
+   tm.tm_isdst = -1;
+   return mktime(&tm);
+}
@@ -0,0 +1,61 @@
+/*
+ * Energy Monitor: calendar period scheduler
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __PERIOD_H__
+#define __PERIOD_H__
+
+#include <time.h>
+
+/* Callback type, called at each boundary with the current time, and
+ * with clock_set 1 when the system clock was set */
+typedef void (*period_cb)(time_t now, int clock_set, void *arg);
+
+/**********************************************************
+ * Public function: period_init()
+ *
+ * Description:
+ *           Start calling cb at every full hour (local time)
+ *           and whenever the system clock is set
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int period_init(period_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: period_hour_start()
+ *
+ * Description:
+ *           Compute the start of the hour containing t
+ *
+ * Returns:  start time of the hour
+ *********************************************************/
+time_t period_hour_start(time_t t);
+
+/**********************************************************
+ * Public function: period_day_start()
+ *
+ * Description:
+ *           Compute the start (local midnight) of the day
+ *           containing t, offset by the given number of days
+ *
+ * Returns:  start time of the day
+ *********************************************************/
+time_t period_day_start(time_t t, int offset);
+
+/**********************************************************
+ * Public function: period_month_start()
+ *
+ * Description:
+ *           Compute the start (local midnight of the 1st) of
+ *           the month containing t, offset by the given
+ *           number of months
+ *
+ * Returns:  start time of the month
+ *********************************************************/
+time_t period_month_start(time_t t, int offset);
+
+#endif /* __PERIOD_H__ */
@@ -0,0 +1,292 @@
+/*
+ * Energy Monitor: hour-of-week consumption profile
+ *
+ * Description:
+ *   Keeps the average energy of each hour of the week (7x24 cells),
+ *   learned from the energy of every complete hour. The energy of an
+ *   hour is also its average power, so the cells form the weekly
+ *   power matrix ("heatmap") of the installation.
+ *
+ *   Each cell is an exponentially weighted average: a new week gets
+ *   the weight alpha = 1 - 2^(-1/halflife), so the profile follows
+ *   seasonal changes. Until a cell has seen 1/alpha weeks it is a
+ *   plain mean, which avoids the bias of a zero start value.
+ *
+ *   The profile is used to project the energy up to the end of the
+ *   day or month: each remaining hour is expected to use the learned
+ *   energy of its cell, blended with the rate observed so far while
+ *   the cell has been learned for less than PROFILE_WARMUP weeks.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "profile.h"
+
+/* Weight of a new week */
+static double alpha = 0;
+
+/* Average energy (in Wh) and number of learned weeks per cell */
+static double cell_wh[PROFILE_DAYS][PROFILE_HOURS];
+static unsigned int cell_n[PROFILE_DAYS][PROFILE_HOURS];
+
+
+/**********************************************************
+ * Internal function: profile_cell()
+ *
+ * Description:
+ *           Get the weekday and hour of a time
+ *
+ * Returns:  -
+ *********************************************************/
+static void profile_cell(time_t t, int *wday, int *hour)
+{
+   struct tm tm;
+
+   localtime_r(&t, &tm);
+   *wday = tm.tm_wday;
+   *hour = tm.tm_hour;
+}
+
+/**********************************************************
+ * Internal function: profile_weight()
+ *
+ * Description:
+ *           Trust in a cell, growing with the number of
+ *           learned weeks
+ *
+ * Returns:  weight (0...1)
+ *********************************************************/
+static double profile_weight(int wday, int hour)
+{
+   if (cell_n[wday][hour] >= PROFILE_WARMUP)
+      return 1.0;
+
+   return (double)cell_n[wday][hour]/PROFILE_WARMUP;
+}
+
+
+/**********************************************************
+ * Public function: profile_init()
+ *
+ * Description:
+ *           Set the half-life (in weeks) after which a week
+ *           has lost half of its weight in the average, 0
+ *           selects the default. The learned profile is
+ *           kept.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int profile_init(unsigned int halflife)
+{
+   if (halflife == 0)
+      halflife = PROFILE_HALFLIFE;
+
+   alpha = 1.0 - exp2(-1.0/halflife);
+   return 0;
+}
+
+/**********************************************************
+ * Public function: profile_learn()
+ *
+ * Description:
+ *           Add the energy of a complete hour (starting at
+ *           hour_start) to the profile. Not reentrant, the
+ *           caller has to serialize calls to this module.
+ *
+ * Returns:  -
+ *********************************************************/
+void profile_learn(time_t hour_start, double wh)
+{
+   double w;
+   int d, h;
+
+   if (alpha == 0)
+      profile_init(0);
+
+   profile_cell(hour_start, &d, &h);
+
+   if (cell_n[d][h] < PROFILE_WEEKS_MAX)
+      cell_n[d][h]++;
+
+   w = 1.0/cell_n[d][h];
+   if (w < alpha)
+      w = alpha;
+   if (wh > PROFILE_WH_MAX)
+      wh = PROFILE_WH_MAX;
+   cell_wh[d][h] += w*(wh - cell_wh[d][h]);
+}
+
+/**********************************************************
+ * Public function: profile_hour()
+ *
+ * Description:
+ *           Expected energy of the hour starting at
+ *           hour_start, blended from the learned profile and
+ *           the given rate (in Wh per hour) by the number of
+ *           weeks learned for this hour
+ *
+ * Returns:  expected energy (in Wh)
+ *********************************************************/
+double profile_hour(time_t hour_start, double rate)
+{
+   double w;
+   int d, h;
+
+   profile_cell(hour_start, &d, &h);
+
+   w = profile_weight(d, h);
+   return w*cell_wh[d][h] + (1-w)*rate;
+}
+
+/**********************************************************
+ * Public function: profile_expect()
+ *
+ * Description:
+ *           Expected energy of the full hours from from
+ *           (start of an hour) up to to, as far as learned.
+ *           The number of hours not covered by the profile
+ *           (fractional, see profile_hour()) is returned in
+ *           unlearned, so the caller can add them at its
+ *           current rate.
+ *
+ * Returns:  expected energy (in Wh)
+ *********************************************************/
+double profile_expect(time_t from, time_t to, double *unlearned)
+{
+   double wh = 0;
+   double w;
+   time_t t;
+   int d, h;
+
+   *unlearned = 0;
+   for (t = from; t < to; t += 3600)
+   {
+      profile_cell(t, &d, &h);
+      w = profile_weight(d, h);
+      wh += w*cell_wh[d][h];
+      *unlearned += 1-w;
+   }
+
+   return wh;
+}
+
+/**********************************************************
+ * Public function: profile_save()
+ *
+ * Description:
+ *           Format the profile of one weekday (0=Sunday) as
+ *           a text line (without newline)
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int profile_save(int wday, char *buf, size_t size)
+{
+   size_t len;
+   int h;
+
+   if (wday < 0 || wday >= PROFILE_DAYS)
+      return -1;
+
+   len = snprintf(buf, size, "%d", wday);
+   for (h = 0; h < PROFILE_HOURS && len < size; h++)
+   {
+      len += snprintf(buf+len, size-len, " %.1f:%u", cell_wh[wday][h], cell_n[wday][h]);
+   }
+
+   return (len < size) ? (int)len : -1;
+}
+
+/**********************************************************
+ * Public function: profile_load()
+ *
+ * Description:
+ *           Restore the profile of one weekday from a text
+ *           line created by profile_save()
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int profile_load(const char *buf)
+{
+   double wh[PROFILE_HOURS];
+   unsigned long n[PROFILE_HOURS];
+   char *p;
+   long d;
+   int h;
+
+   d = strtol(buf, &p, 10);
+   if (p == buf || d < 0 || d >= PROFILE_DAYS)
+      return -1;
+
+   for (h = 0; h < PROFILE_HOURS; h++)
+   {
+      buf = p;
+      wh[h] = strtod(buf, &p);
+      if (p == buf || *p != ':' || wh[h] < 0 || wh[h] > PROFILE_WH_MAX)
+         return -1;
+      buf = p+1;
+      n[h] = strtoul(buf, &p, 10);
+      if (p == buf)
+         return -1;
+      if (n[h] > PROFILE_WEEKS_MAX)
+         n[h] = PROFILE_WEEKS_MAX;
+   }
+
+   for (h = 0; h < PROFILE_HOURS; h++)
+   {
+      cell_wh[d][h] = wh[h];
+      cell_n[d][h] = n[h];
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Public function: profile_json()
+ *
+ * Description:
+ *           Format the profile as JSON object with the
+ *           average power (in W) and the number of learned
+ *           weeks of each hour of the week (rows Sunday to
+ *           Saturday, columns hours 0 to 23)
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int profile_json(char *buf, size_t size)
+{
+   size_t len;
+   int d, h;
+
+   len = snprintf(buf, size, "{\"power\":[");
+   for (d = 0; d < PROFILE_DAYS && len < size; d++)
+   {
+      for (h = 0; h < PROFILE_HOURS && len < size; h++)
+      {
+         len += snprintf(buf+len, size-len, "%s%.0f", (h == 0) ? (d == 0 ? "[" : ",[") : ",",
+                         cell_wh[d][h]);
+      }
+      if (len < size)
+         len += snprintf(buf+len, size-len, "]");
+   }
+   if (len < size)
+      len += snprintf(buf+len, size-len, "],\"weeks\":[");
+   for (d = 0; d < PROFILE_DAYS && len < size; d++)
+   {
+      for (h = 0; h < PROFILE_HOURS && len < size; h++)
+      {
+         len += snprintf(buf+len, size-len, "%s%u", (h == 0) ? (d == 0 ? "[" : ",[") : ",",
+                         cell_n[d][h]);
+      }
+      if (len < size)
+         len += snprintf(buf+len, size-len, "]");
+   }
+   if (len < size)
+      len += snprintf(buf+len, size-len, "]}");
+
+   return (len < size) ? (int)len : -1;
+}
@@ -0,0 +1,121 @@
+/*
+ * Energy Monitor: hour-of-week consumption profile
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#define PROFILE_DAYS 7
+#define PROFILE_HOURS 24
+
+/* Number of learned weeks until a cell is fully trusted */
+#define PROFILE_WARMUP 4
+
+/* Default half-life of the history (in weeks) */
+#define PROFILE_HALFLIFE 4
+
+/* Max number of learned weeks counted per cell */
+#define PROFILE_WEEKS_MAX 255
+
+/* Max energy of a cell (in Wh), limits the length of a saved line */
+#define PROFILE_WH_MAX 999999999.0
+
+/* Size of a line of profile_save(): weekday and per hour
+ * " <Wh>:<weeks>" with at most 12 and 3 digits */
+#define PROFILE_LINE_SIZE (2 + PROFILE_HOURS*(1+12+1+3) + 1)
+
+/**********************************************************
+ * Public function: profile_init()
+ *
+ * Description:
+ *           Set the half-life (in weeks) after which a week
+ *           has lost half of its weight in the average, 0
+ *           selects the default. The learned profile is
+ *           kept.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int profile_init(unsigned int halflife);
+
+/**********************************************************
+ * Public function: profile_learn()
+ *
+ * Description:
+ *           Add the energy of a complete hour (starting at
+ *           hour_start) to the profile. Not reentrant, the
+ *           caller has to serialize calls to this module.
+ *
+ * Returns:  -
+ *********************************************************/
+void profile_learn(time_t hour_start, double wh);
+
+/**********************************************************
+ * Public function: profile_hour()
+ *
+ * Description:
+ *           Expected energy of the hour starting at
+ *           hour_start, blended from the learned profile and
+ *           the given rate (in Wh per hour) by the number of
+ *           weeks learned for this hour
+ *
+ * Returns:  expected energy (in Wh)
+ *********************************************************/
+double profile_hour(time_t hour_start, double rate);
+
+/**********************************************************
+ * Public function: profile_expect()
+ *
+ * Description:
+ *           Expected energy of the full hours from from
+ *           (start of an hour) up to to, as far as learned.
+ *           The number of hours not covered by the profile
+ *           (fractional, see profile_hour()) is returned in
+ *           unlearned, so the caller can add them at its
+ *           current rate.
+ *
+ * Returns:  expected energy (in Wh)
+ *********************************************************/
+double profile_expect(time_t from, time_t to, double *unlearned);
+
+/**********************************************************
+ * Public function: profile_save()
+ *
+ * Description:
+ *           Format the profile of one weekday (0=Sunday) as
+ *           a text line (without newline)
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int profile_save(int wday, char *buf, size_t size);
+
+/**********************************************************
+ * Public function: profile_load()
+ *
+ * Description:
+ *           Restore the profile of one weekday from a text
+ *           line created by profile_save()
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int profile_load(const char *buf);
+
+/**********************************************************
+ * Public function: profile_json()
+ *
+ * Description:
+ *           Format the profile as JSON object with the
+ *           average power (in W) and the number of learned
+ *           weeks of each hour of the week (rows Sunday to
+ *           Saturday, columns hours 0 to 23)
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int profile_json(char *buf, size_t size);
+
+#endif /* __PROFILE_H__ */
@@ -0,0 +1,357 @@
+/*
+ * Energy Monitor: S0 pulse input on a GPIO pin
+ *
+ * Description:
+ *   The pin generates an interrupt on both edges, handled in the
+ *   interrupt thread of the GPIO backend. There the pulse is validated
+ *   against the reference pulse length (detected from the first
+ *   pulse if not configured) and its end is time stamped.
+ *
+ *   Valid pulses are queued and passed to the callback in the event
+ *   loop thread. All pulses queued by the time the loop gets to run
+ *   are passed as one batch, so a burst of pulses wakes the loop only
+ *   once.
+ *
+ *   Invalid pulses and edges out of sequence are counted, and logged
+ *   at a limited rate (see ratelog.c).
+ *
+ *   A restart (on reload) keeps the queued pulses and the pulse in
+ *   progress, so no pulse is lost or rejected by a reload.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "evloop.h"
+#include "hal.h"
+#include "bench.h"
+#include "ratelog.h"
+#include "flight.h"
+#include "stats.h"
+#include "pulse.h"
+
+/* Protects the configuration, the detection state and the queue */
+static pthread_mutex_t pulse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int running = 0;
+static pulse_conf_t conf;
+static unsigned int channel = 0;
+static reading_cb callback = NULL;
+static void *callback_arg = NULL;
+
+/* The interrupt cannot be moved to another pin at runtime */
+static unsigned int isr_pin = 0;
+
+/* Detection state */
+static int first = 1;
+static int pulse_started = 0;
+static struct timespec pulse_start_ts;
+
+/* Pulses waiting for the event loop */
+static struct timespec queue[PULSE_QUEUE];
+static unsigned int queued = 0;
+static unsigned long dropped = 0;
+static int flush_posted = 0;
+
+/* Rejected edges, logged at a limited rate */
+static ratelog_t invalid_log = RATELOG_INIT("invalid_pulse", "invalid pulses", "length", "ms");
+static ratelog_t sequence_log = RATELOG_INIT("out_of_sequence", "edges out of sequence", NULL, NULL);
+
+
+/**********************************************************
+ * Internal function: pulse_ms()
+ *
+ * Description:
+ *           Calculate the time between two time values
+ *
+ * Returns:  time difference (in ms)
+ *********************************************************/
+static unsigned long pulse_ms(struct timespec now, struct timespec then)
+{
+   return (unsigned long)((now.tv_sec - then.tv_sec)*1000 +
+                          (now.tv_nsec - then.tv_nsec)/1000000);
+}
+
+/**********************************************************
+ * Internal function: pulse_flush()
+ *
+ * Description:
+ *           Passes the queued pulses to the callback (in the
+ *           event loop thread), also after pulse_exit()
+ *
+ * Returns:  -
+ *********************************************************/
+static void pulse_flush(void *arg)
+{
+   static reading_t batch[PULSE_QUEUE];
+   unsigned long lost;
+   unsigned int n;
+   unsigned int i;
+
+   pthread_mutex_lock(&pulse_lock);
+   n = queued;
+   for (i = 0; i < n; i++)
+   {
+      memset(&batch[i], 0, sizeof(batch[i]));
+      batch[i].ts = queue[i];
+      batch[i].pulses = 1;
+   }
+   queued = 0;
+   lost = dropped;
+   dropped = 0;
+   flush_posted = 0;
+   pthread_mutex_unlock(&pulse_lock);
+
+   if (lost > 0)
+   {
+      flight_record(FLIGHT_QUEUE_FULL, channel, lost);
+      syslog(LOG_DAEMON | LOG_WARNING, "Pulse queue full, %lu pulses lost\n", lost);
+   }
+
+   if (n > 0 && callback != NULL)
+      callback(channel, batch, n, callback_arg);
+}
+
+/**********************************************************
+ * Internal function: pulse_queue()
+ *
+ * Description:
+ *           Queue a valid pulse and wake up the event loop,
+ *           unless it was already woken up for a previous
+ *           pulse. Caller must hold pulse_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void pulse_queue(struct timespec ts)
+{
+   BENCH_COUNT(BENCH_VALID, 1);
+   if (queued == PULSE_QUEUE)
+   {
+      dropped++;
+      return;
+   }
+   queue[queued++] = ts;
+
+   if (!flush_posted && ev_post(pulse_flush, NULL) == 0)
+      flush_posted = 1;
+}
+
+/**********************************************************
+ * Internal function: pulse_isr()
+ *
+ * Description:
+ *           Handles the event of the pulse detected on
+ *           the GPIO pin.
+ *
+ *           A validation of the pulse is performed to filter
+ *           out wrong pulses, valid pulses are queued for
+ *           the event loop.
+ *
+ * Returns:  -
+ *********************************************************/
+static void pulse_isr(void)
+{
+   struct timespec pulse_end_ts;
+   unsigned long pulse_length;
+   unsigned long pulse_delta;
+   int level;
+
+   pthread_mutex_lock(&pulse_lock);
+   if (!running)
+   {
+      pthread_mutex_unlock(&pulse_lock);
+      return;
+   }
+   pulse_delta = (conf.pulse_length*conf.pulse_tolerance)/100;
+
+   /* read current pin value */
+   level = hal_read(isr_pin);
+   flight_record(FLIGHT_EDGE, isr_pin, level);
+   stats_count(channel-1, STATS_EDGES, 1);
+   if (level == 0)
+   {
+      /* Pulse started, check validity */
+      if (pulse_started == 0)
+      {
+         pulse_started = 1;
+         hal_time(&pulse_start_ts);
+      }
+      else
+      {
+         flight_record(FLIGHT_SEQUENCE, isr_pin, level);
+         if (ratelog_event(&sequence_log, 0))
+            syslog(LOG_DAEMON | LOG_WARNING, "Detected starting pulse out of sequence\n");
+      }
+   }
+   else
+   {
+      /* Pulse ended,  check validity */
+      if (pulse_started == 1)
+      {
+         pulse_started = 0;
+         hal_time(&pulse_end_ts);
+         pulse_length = pulse_ms(pulse_end_ts, pulse_start_ts);
+#ifdef DEBUG
+         syslog(LOG_DAEMON | LOG_DEBUG, "Detected pulse with length %lu ms", pulse_length);
+#endif
+         /* If no reference pulse length was specified in the
+          * configuration file, we use the length of the first
+          * pulse as reference to validate the subsequent pulses
+          */
+         if (first && (conf.pulse_length==0))
+         {
+             conf.pulse_length = pulse_length;
+             pulse_delta = (conf.pulse_length*conf.pulse_tolerance)/100;
+             syslog(LOG_DAEMON | LOG_INFO, "Using pulse lenght %lu ms as reference", pulse_length);
+         }
+
+         /* Check if pulse lenght is within expected limits
+          * (from energy meter data sheet), apply a tolerance
+          */
+         if (pulse_length > (conf.pulse_length-pulse_delta) &&
+             pulse_length < (conf.pulse_length+pulse_delta))
+         {
+            if (first)
+            {
+               first = 0;
+               syslog(LOG_DAEMON | LOG_INFO, "Detected first pulse with length %lu ms", pulse_length);
+            }
+            flight_record(FLIGHT_PULSE, isr_pin, pulse_length);
+            pulse_queue(pulse_end_ts);
+         }
+         else
+         {
+            flight_record(FLIGHT_INVALID, isr_pin, pulse_length);
+            stats_count(channel-1, STATS_LENGTH, 1);
+            if (ratelog_event(&invalid_log, pulse_length))
+               syslog(LOG_DAEMON | LOG_WARNING, "Detected invalid pulse (length=%lu ms)\n", pulse_length);
+         }
+      }
+      else
+      {
+         flight_record(FLIGHT_SEQUENCE, isr_pin, level);
+         if (ratelog_event(&sequence_log, 0))
+            syslog(LOG_DAEMON | LOG_WARNING, "Detected ending pulse out of sequence\n");
+      }
+   }
+
+   pthread_mutex_unlock(&pulse_lock);
+}
+
+
+/**********************************************************
+ * Public function: pulse_config()
+ *
+ * Description:
+ *           Parse a name=value pair of the input
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int pulse_config(pulse_conf_t *pc, const char *name, const char *value)
+{
+   if (strcmp(name, "pulse_input_pin") == 0)
+   {
+      pc->pin = atoi(value);
+      return 0;
+   }
+   if (strcmp(name, "pulse_length") == 0)
+   {
+      pc->pulse_length = atoi(value);
+      return 0;
+   }
+   if (strcmp(name, "pulse_tolerance") == 0)
+   {
+      pc->pulse_tolerance = atoi(value);
+      return (pc->pulse_tolerance < 100) ? 0 : -1;
+   }
+   return -1;
+}
+
+/**********************************************************
+ * Public function: pulse_init()
+ *
+ * Description:
+ *           Start detecting the pulses on the input pin.
+ *           Each valid pulse is passed to the callback as
+ *           reading of the channel with one pulse, time
+ *           stamped at its end. Needs the event loop.
+ *
+ * Returns:  0 on success (or no pin), <0 otherwise
+ *********************************************************/
+int pulse_init(const pulse_conf_t *pc, unsigned int ch, reading_cb cb, void *arg)
+{
+   if (pc->pin == 0)
+      return pulse_exit();
+
+   pthread_mutex_lock(&pulse_lock);
+
+   /* Keep the detected reference pulse length if detection is selected */
+   if (pc->pulse_length > 0 || first)
+      conf.pulse_length = pc->pulse_length;
+   conf.pulse_tolerance = pc->pulse_tolerance;
+   conf.pin = pc->pin;
+   channel = ch;
+   callback = cb;
+   callback_arg = arg;
+
+   if (isr_pin > 0 && conf.pin != isr_pin)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Changing pulse_input_pin needs a restart, keeping pin %u\n",
+             isr_pin);
+      conf.pin = isr_pin;
+   }
+   pthread_mutex_unlock(&pulse_lock);
+
+   ratelog_register(&invalid_log);
+   ratelog_register(&sequence_log);
+
+   if (isr_pin == 0)
+   {
+      /* Initialise the GPIO lines */
+      if (hal_init() < 0)
+         return -1;
+
+      /* Generate interrupt on both edges on the input pin */
+      isr_pin = conf.pin;
+      if (hal_input(conf.pin, pulse_isr) < 0)
+      {
+         isr_pin = 0;
+         return -2;
+      }
+   }
+
+   pthread_mutex_lock(&pulse_lock);
+   running = 1;
+   pthread_mutex_unlock(&pulse_lock);
+
+   syslog(LOG_DAEMON | LOG_INFO, "Counting pulses on GPIO %u (%s)\n", conf.pin, hal_name());
+   return 0;
+}
+
+/**********************************************************
+ * Public function: pulse_exit()
+ *
+ * Description:
+ *           Stop detecting pulses. The pulses queued so far
+ *           are still passed to the callback, and the pulse
+ *           in progress is kept for a restart (the pin stays
+ *           the same).
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int pulse_exit(void)
+{
+   pthread_mutex_lock(&pulse_lock);
+   running = 0;
+   pthread_mutex_unlock(&pulse_lock);
+   return 0;
+}
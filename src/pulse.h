@@ -0,0 +1,60 @@
+/*
+ * Energy Monitor: S0 pulse input on a GPIO pin
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __PULSE_H__
+#define __PULSE_H__
+
+#include "reading.h"
+
+/* Max number of pulses queued for the event loop */
+#define PULSE_QUEUE 64
+
+/* Configuration of the input (channel with "source = gpio") */
+typedef struct
+{
+   unsigned int pin;              /* BCM number of the input pin */
+   unsigned int pulse_length;     /* reference pulse length (in ms), 0 to detect */
+   unsigned int pulse_tolerance;  /* tolerance of the pulse length (in %) */
+} pulse_conf_t;
+
+/**********************************************************
+ * Public function: pulse_config()
+ *
+ * Description:
+ *           Parse a name=value pair of the input
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int pulse_config(pulse_conf_t *pc, const char *name, const char *value);
+
+/**********************************************************
+ * Public function: pulse_init()
+ *
+ * Description:
+ *           Start detecting the pulses on the input pin.
+ *           Each valid pulse is passed to the callback as
+ *           reading of the channel with one pulse, time
+ *           stamped at its end. Needs the event loop.
+ *
+ * Returns:  0 on success (or no pin), <0 otherwise
+ *********************************************************/
+int pulse_init(const pulse_conf_t *conf, unsigned int channel, reading_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: pulse_exit()
+ *
+ * Description:
+ *           Stop detecting pulses. The pulses queued so far
+ *           are still passed to the callback, and the pulse
+ *           in progress is kept for a restart (the pin stays
+ *           the same).
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int pulse_exit(void);
+
+#endif /* __PULSE_H__ */
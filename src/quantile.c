@@ -0,0 +1,217 @@
+/*
+ * Energy Monitor: streaming quantile estimation
+ *
+ * Description:
+ *   Implements the P-square algorithm (R. Jain and I. Chlamtac, 1985),
+ *   which estimates a quantile from a stream with five markers whose
+ *   heights are adjusted with a piecewise parabolic formula. Memory is
+ *   constant and no observations are stored, so the state is small
+ *   enough to be persisted as one text line.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "quantile.h"
+
+
+/**********************************************************
+ * Internal function: desired()
+ *
+ * Description:
+ *           Desired position of a marker after count
+ *           observations
+ *
+ * Returns:  marker position
+ *********************************************************/
+static double desired(const quantile_t *e, int i)
+{
+   const double m = e->count - 1;
+
+   switch (i)
+   {
+      case 0:  return 1;
+      case 1:  return 1 + m*e->p/2;
+      case 2:  return 1 + m*e->p;
+      case 3:  return 1 + m*(1+e->p)/2;
+      default: return 1 + m;
+   }
+}
+
+/**********************************************************
+ * Internal function: cmp_double()
+ *
+ * Description:
+ *           qsort() comparison for doubles
+ *
+ * Returns:  <0, 0, >0
+ *********************************************************/
+static int cmp_double(const void *a, const void *b)
+{
+   double x = *(const double *)a;
+   double y = *(const double *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+/**********************************************************
+ * Public function: quantile_init()
+ *
+ * Description:
+ *           Reset an estimator for the quantile p (0 < p < 1)
+ *
+ * Returns:  -
+ *********************************************************/
+void quantile_init(quantile_t *e, double p)
+{
+   memset(e, 0, sizeof(*e));
+   e->p = p;
+}
+
+/**********************************************************
+ * Public function: quantile_add()
+ *
+ * Description:
+ *           Add an observation
+ *
+ * Returns:  -
+ *********************************************************/
+void quantile_add(quantile_t *e, double x)
+{
+   int i, k;
+
+   /* Collect the first five observations */
+   if (e->count < 5)
+   {
+      e->q[e->count++] = x;
+      if (e->count == 5)
+      {
+         qsort(e->q, 5, sizeof(double), cmp_double);
+         for (i = 0; i < 5; i++)
+            e->n[i] = i+1;
+      }
+      return;
+   }
+
+   /* Find the cell of x and update the extreme markers */
+   if (x < e->q[0])
+   {
+      e->q[0] = x;
+      k = 0;
+   }
+   else if (x >= e->q[4])
+   {
+      e->q[4] = x;
+      k = 3;
+   }
+   else
+   {
+      for (k = 0; k < 3 && x >= e->q[k+1]; k++)
+         ;
+   }
+
+   for (i = k+1; i < 5; i++)
+      e->n[i]++;
+   e->count++;
+
+   /* Adjust the heights of the middle markers if necessary */
+   for (i = 1; i < 4; i++)
+   {
+      double d = desired(e, i) - e->n[i];
+
+      if ((d >= 1 && e->n[i+1] - e->n[i] > 1) ||
+          (d <= -1 && e->n[i-1] - e->n[i] < -1))
+      {
+         int s = (d > 0) ? 1 : -1;
+         double qp;
+
+         /* Parabolic prediction */
+         qp = e->q[i] + s/(e->n[i+1] - e->n[i-1]) *
+              ((e->n[i] - e->n[i-1] + s)*(e->q[i+1] - e->q[i])/(e->n[i+1] - e->n[i]) +
+               (e->n[i+1] - e->n[i] - s)*(e->q[i] - e->q[i-1])/(e->n[i] - e->n[i-1]));
+
+         /* Linear prediction if the parabola is not monotonic */
+         if (qp <= e->q[i-1] || qp >= e->q[i+1])
+            qp = e->q[i] + s*(e->q[i+s] - e->q[i])/(e->n[i+s] - e->n[i]);
+
+         e->q[i] = qp;
+         e->n[i] += s;
+      }
+   }
+}
+
+/**********************************************************
+ * Public function: quantile_get()
+ *
+ * Description:
+ *           Get the current estimate
+ *
+ * Returns:  estimated quantile, 0 without observations
+ *********************************************************/
+double quantile_get(const quantile_t *e)
+{
+   double q[5];
+   int i;
+
+   if (e->count == 0)
+      return 0;
+
+   if (e->count < 5)
+   {
+      /* Exact quantile of the few observations */
+      memcpy(q, e->q, sizeof(q));
+      qsort(q, e->count, sizeof(double), cmp_double);
+      i = (int)(e->p*(e->count-1) + 0.5);
+      return q[i];
+   }
+
+   return e->q[2];
+}
+
+/**********************************************************
+ * Public function: quantile_save()
+ *
+ * Description:
+ *           Format the estimator state as a text line
+ *           (without newline)
+ *
+ * Returns:  length of the text, <0 on error (also if
+ *           the text does not fit)
+ *********************************************************/
+int quantile_save(const quantile_t *e, char *buf, size_t size)
+{
+   int len;
+
+   len = snprintf(buf, size, "%lu %.3f %.3f %.3f %.3f %.3f %.0f %.0f %.0f %.0f %.0f",
+                  e->count, e->q[0], e->q[1], e->q[2], e->q[3], e->q[4],
+                  e->n[0], e->n[1], e->n[2], e->n[3], e->n[4]);
+   return (len >= 0 && (size_t)len < size) ? len : -1;
+}
+
+/**********************************************************
+ * Public function: quantile_load()
+ *
+ * Description:
+ *           Restore the estimator state from a text line
+ *           created by quantile_save(). The quantile p is
+ *           kept from quantile_init().
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int quantile_load(quantile_t *e, const char *buf)
+{
+   quantile_t t = *e;
+
+   if (sscanf(buf, "%lu %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf",
+              &t.count, &t.q[0], &t.q[1], &t.q[2], &t.q[3], &t.q[4],
+              &t.n[0], &t.n[1], &t.n[2], &t.n[3], &t.n[4]) != 11)
+      return -1;
+
+   *e = t;
+   return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Energy Monitor: streaming quantile estimation
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __QUANTILE_H__
+#define __QUANTILE_H__
+
+#include <stddef.h>
+
+/* P-square estimator of a single quantile (5 markers) */
+typedef struct
+{
+   double p;               /* quantile, e.g. 0.05 */
+   unsigned long count;    /* number of observations */
+   double q[5];            /* marker heights */
+   double n[5];            /* marker positions */
+} quantile_t;
+
+/* Size of a line of quantile_save() (values below 1e15) */
+#define QUANTILE_LINE_SIZE 256
+
+/**********************************************************
+ * Public function: quantile_init()
+ *
+ * Description:
+ *           Reset an estimator for the quantile p (0 < p < 1)
+ *
+ * Returns:  -
+ *********************************************************/
+void quantile_init(quantile_t *e, double p);
+
+/**********************************************************
+ * Public function: quantile_add()
+ *
+ * Description:
+ *           Add an observation
+ *
+ * Returns:  -
+ *********************************************************/
+void quantile_add(quantile_t *e, double x);
+
+/**********************************************************
+ * Public function: quantile_get()
+ *
+ * Description:
+ *           Get the current estimate
+ *
+ * Returns:  estimated quantile, 0 without observations
+ *********************************************************/
+double quantile_get(const quantile_t *e);
+
+/**********************************************************
+ * Public function: quantile_save()
+ *
+ * Description:
+ *           Format the estimator state as a text line
+ *           (without newline)
+ *
+ * Returns:  length of the text, <0 on error (also if
+ *           the text does not fit)
+ *********************************************************/
+int quantile_save(const quantile_t *e, char *buf, size_t size);
+
+/**********************************************************
+ * Public function: quantile_load()
+ *
+ * Description:
+ *           Restore the estimator state from a text line
+ *           created by quantile_save(). The quantile p is
+ *           kept from quantile_init().
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int quantile_load(quantile_t *e, const char *buf);
+
+#endif /* __QUANTILE_H__ */
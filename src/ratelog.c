@@ -0,0 +1,163 @@
+/*
+ * Energy Monitor: rate limited logging of repeated events
+ *
+ * Description:
+ *   A noisy input line can produce thousands of invalid pulses per
+ *   second. Logging each of them would load the CPU and the syslog
+ *   daemon and wear the SD card, right when the system is stressed.
+ *
+ *   Each kind of event has a token bucket: up to RATELOG_BURST
+ *   messages are logged at once, then RATELOG_PER_MIN per minute.
+ *   All events are counted, and a summary line with the number of
+ *   events and the range of their values is logged per interval.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ratelog.h"
+
+/* Protects all events, they are counted in different threads */
+static pthread_mutex_t ratelog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ratelog_t *first = NULL;
+static ratelog_t *last = NULL;
+
+
+/**********************************************************
+ * Public function: ratelog_register()
+ *
+ * Description:
+ *           Add the events to the summary and the stats, may
+ *           be called more than once
+ *
+ * Returns:  -
+ *********************************************************/
+void ratelog_register(ratelog_t *rl)
+{
+   pthread_mutex_lock(&ratelog_lock);
+   if (!rl->registered)
+   {
+      rl->registered = 1;
+      rl->tokens = RATELOG_BURST;
+      clock_gettime(CLOCK_MONOTONIC, &rl->refill);
+      if (last != NULL)
+         last->next = rl;
+      else
+         first = rl;
+      last = rl;
+   }
+   pthread_mutex_unlock(&ratelog_lock);
+}
+
+/**********************************************************
+ * Public function: ratelog_event()
+ *
+ * Description:
+ *           Count an event with its value (e.g. the pulse
+ *           length). May be called from any thread.
+ *
+ * Returns:  1 if the event may be logged, 0 otherwise
+ *********************************************************/
+int ratelog_event(ratelog_t *rl, double value)
+{
+   struct timespec now;
+   double elapsed;
+   int res = 0;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   pthread_mutex_lock(&ratelog_lock);
+   if (rl->count == 0 || value < rl->min)
+      rl->min = value;
+   if (rl->count == 0 || value > rl->max)
+      rl->max = value;
+   rl->count++;
+   rl->total++;
+
+   /* Refill the bucket for the time elapsed */
+   elapsed = (now.tv_sec - rl->refill.tv_sec) + (now.tv_nsec - rl->refill.tv_nsec)/1e9;
+   rl->refill = now;
+   rl->tokens += elapsed*RATELOG_PER_MIN/60;
+   if (rl->tokens > RATELOG_BURST)
+      rl->tokens = RATELOG_BURST;
+
+   if (rl->tokens >= 1)
+   {
+      rl->tokens -= 1;
+      res = 1;
+   }
+   else
+   {
+      rl->suppressed++;
+   }
+   pthread_mutex_unlock(&ratelog_lock);
+
+   return res;
+}
+
+/**********************************************************
+ * Public function: ratelog_summary()
+ *
+ * Description:
+ *           Log one line per kind of events which occurred
+ *           in the interval (in s) since the last summary
+ *
+ * Returns:  -
+ *********************************************************/
+void ratelog_summary(unsigned int interval)
+{
+   ratelog_t copy;
+   ratelog_t *rl;
+   char range[64];
+
+   for (rl = first; rl != NULL; rl = rl->next)
+   {
+      pthread_mutex_lock(&ratelog_lock);
+      copy = *rl;
+      rl->count = 0;
+      rl->suppressed = 0;
+      pthread_mutex_unlock(&ratelog_lock);
+
+      if (copy.count == 0)
+         continue;
+
+      range[0] = 0;
+      if (copy.value != NULL)
+         snprintf(range, sizeof(range), ", %s %.0f..%.0f %s", copy.value, copy.min, copy.max, copy.unit);
+
+      syslog(LOG_DAEMON | LOG_WARNING, "%lu %s in last %u s (%lu not logged)%s\n",
+             copy.count, copy.what, interval, copy.suppressed, range);
+   }
+}
+
+/**********************************************************
+ * Public function: ratelog_json()
+ *
+ * Description:
+ *           Format the events since the start as JSON
+ *           object, e.g. {"invalid_pulse":12}
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int ratelog_json(char *buf, size_t size)
+{
+   ratelog_t *rl;
+   size_t len;
+
+   len = snprintf(buf, size, "{");
+   pthread_mutex_lock(&ratelog_lock);
+   for (rl = first; rl != NULL && len < size; rl = rl->next)
+      len += snprintf(buf+len, size-len, "%s\"%s\":%lu", (rl == first) ? "" : ",", rl->name, rl->total);
+   pthread_mutex_unlock(&ratelog_lock);
+   if (len < size)
+      len += snprintf(buf+len, size-len, "}");
+
+   return (len < size) ? (int)len : -1;
+}
@@ -0,0 +1,83 @@
+/*
+ * Energy Monitor: rate limited logging of repeated events
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __RATELOG_H__
+#define __RATELOG_H__
+
+#include <stddef.h>
+#include <time.h>
+
+/* Messages logged in a burst, and then per minute */
+#define RATELOG_BURST 10
+#define RATELOG_PER_MIN 10
+
+/* Events of one kind (e.g. invalid pulses), counted and logged
+ * individually only while the token bucket allows it */
+typedef struct ratelog
+{
+   const char *name;          /* key in the stats */
+   const char *what;          /* in the summary, e.g. "invalid pulses" */
+   const char *value;         /* in the summary, e.g. "length", NULL if none */
+   const char *unit;          /* of the values */
+   unsigned long total;       /* events since the start */
+   unsigned long count;       /* events in the summary interval */
+   unsigned long suppressed;  /* messages not logged in the summary interval */
+   double min;                /* values in the summary interval */
+   double max;
+   double tokens;
+   struct timespec refill;
+   struct ratelog *next;
+   int registered;
+} ratelog_t;
+
+#define RATELOG_INIT(name, what, value, unit) { name, what, value, unit }
+
+/**********************************************************
+ * Public function: ratelog_register()
+ *
+ * Description:
+ *           Add the events to the summary and the stats, may
+ *           be called more than once
+ *
+ * Returns:  -
+ *********************************************************/
+void ratelog_register(ratelog_t *rl);
+
+/**********************************************************
+ * Public function: ratelog_event()
+ *
+ * Description:
+ *           Count an event with its value (e.g. the pulse
+ *           length). May be called from any thread.
+ *
+ * Returns:  1 if the event may be logged, 0 otherwise
+ *********************************************************/
+int ratelog_event(ratelog_t *rl, double value);
+
+/**********************************************************
+ * Public function: ratelog_summary()
+ *
+ * Description:
+ *           Log one line per kind of events which occurred
+ *           in the interval (in s) since the last summary
+ *
+ * Returns:  -
+ *********************************************************/
+void ratelog_summary(unsigned int interval);
+
+/**********************************************************
+ * Public function: ratelog_json()
+ *
+ * Description:
+ *           Format the events since the start as JSON
+ *           object, e.g. {"invalid_pulse":12}
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int ratelog_json(char *buf, size_t size);
+
+#endif /* __RATELOG_H__ */
@@ -0,0 +1,43 @@
+/*
+ * Energy Monitor: measurements of the input sources
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __READING_H__
+#define __READING_H__
+
+#include <time.h>
+
+/* Measured values of a meter */
+typedef enum
+{
+   READING_POWER,           /* total active power (W) */
+   READING_POWER_L1,        /* active power per phase (W) */
+   READING_POWER_L2,
+   READING_POWER_L3,
+   READING_IMPORT,          /* imported energy (Wh) */
+   READING_EXPORT,          /* exported energy (Wh) */
+   READING_VALUES
+} reading_value_t;
+
+/* Names of the values, as used in the configuration and the live stream */
+#define READING_NAMES \
+   { "power", "power_l1", "power_l2", "power_l3", "energy_import", "energy_export" }
+
+/* Values of a meter measured at one time */
+typedef struct
+{
+   struct timespec ts;
+   unsigned long pulses;          /* S0 pulses since the previous reading */
+   unsigned int valid;            /* mask of (1 << reading_value_t) */
+   double value[READING_VALUES];
+} reading_t;
+
+/* Called in the event loop thread with a batch of readings of a
+ * channel (1 ... SOURCE_MAX_CHANNELS), oldest first
+ */
+typedef void (*reading_cb)(unsigned int channel, const reading_t *reading, unsigned int count, void *arg);
+
+#endif /* __READING_H__ */
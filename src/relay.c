@@ -0,0 +1,671 @@
+/*
+ * Energy Monitor: load shedding relay outputs
+ *
+ * Description:
+ *   Deferrable loads (water heater, EV charger, ...) are switched off
+ *   when the instant power (or the projected demand) reaches the shed
+ *   threshold of their relay and switched on again when it falls below
+ *   the restore threshold. The relays are evaluated directly in the
+ *   pulse handler, so a load is shed within one pulse.
+ *
+ *   Relays are grouped in priority tiers. Lower tiers are shed first
+ *   and restored last, and only one tier is switched per evaluation.
+ *   The min_on and min_off times protect the loads from fast
+ *   switching.
+ *
+ *   Without pulses the power is only known to be below the power of
+ *   the last pulse period, so a timer re-evaluates the relays with
+ *   this decaying upper bound (of the daemon, which knows the
+ *   channels) to restore the loads. The min_on and min_off times are
+ *   measured on the time stamps of the readings.
+ *
+ *   Each switching decision is logged with its latency (pulse edge to
+ *   output set), after relay_lock is released so that the pulse
+ *   handler never waits for the log. The "mock" backend does not touch
+ *   any hardware and appends the decisions to a log file, for testing.
+ *
+ *   A reload of the configuration keeps the state of the relays whose
+ *   output did not change, so shed loads stay off and the min_on and
+ *   min_off times go on.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "evloop.h"
+#include "hal.h"
+#include "relay.h"
+
+/* State of a relay output */
+typedef struct
+{
+   relay_conf_t conf;
+   int num;                 /* N of [relayN] */
+   int fd;                  /* GPIO line handle of the HAL */
+   int on;                  /* load is switched on */
+   struct timespec changed; /* reading time of last switching, 0 before the first */
+} relay_t;
+
+/* Switching decision, logged after relay_lock is released */
+typedef struct
+{
+   int num;
+   unsigned int priority;
+   int on;
+   unsigned int value;
+   long latency_us;
+   struct timespec done;
+   int err;                 /* errno of a failed switching, 0 on success */
+} relay_event_t;
+
+/* Output backend */
+typedef struct
+{
+   const char *name;
+   int  (*open)(relay_t *r, const char *chip);
+   int  (*set)(relay_t *r, int on);
+   void (*close)(relay_t *r);
+} relay_backend_t;
+
+static pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
+static const relay_backend_t *backend = NULL;
+static char chip_name[RELAY_CHIP_SIZE];
+static relay_t relays[RELAY_MAX];
+static int num_relays = 0;
+
+/* Protects the log file, apart from relay_lock */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *relay_log = NULL;
+static int tick_timer = 0;
+static relay_bound_cb power_bound = NULL;
+
+/* Last reading, for the evaluation between readings */
+static unsigned int last_power = 0;
+static unsigned int last_demand = 0;
+
+
+/**********************************************************
+ * Internal function: gpio_open()
+ *
+ * Description:
+ *           Request the relay line as output from the GPIO
+ *           chip, in the state of the relay
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int gpio_open(relay_t *r, const char *chip)
+{
+   char label[32];
+
+   snprintf(label, sizeof(label), "emond-relay%d", r->num);
+   if ((r->fd = hal_output(chip, r->conf.gpio_line, r->conf.active_low, label, r->on)) < 0)
+   {
+      r->fd = -1;
+      return -1;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: gpio_set()
+ *
+ * Description:
+ *           Set the relay line
+ *
+ * Returns:  0 on success, <0 otherwise (errno set)
+ *********************************************************/
+static int gpio_set(relay_t *r, int on)
+{
+   return hal_write(r->fd, on);
+}
+
+/**********************************************************
+ * Internal function: gpio_close()
+ *
+ * Description:
+ *           Release the relay line
+ *
+ * Returns:  -
+ *********************************************************/
+static void gpio_close(relay_t *r)
+{
+   if (r->fd >= 0)
+   {
+      hal_release(r->fd);
+      r->fd = -1;
+   }
+}
+
+/**********************************************************
+ * Internal function: mock_open()
+ *
+ * Description:
+ *           Open a simulated relay
+ *
+ * Returns:  0
+ *********************************************************/
+static int mock_open(relay_t *r, const char *chip)
+{
+   r->fd = -1;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: mock_set()
+ *
+ * Description:
+ *           Set a simulated relay (nothing to do, the
+ *           decision is recorded by the caller)
+ *
+ * Returns:  0
+ *********************************************************/
+static int mock_set(relay_t *r, int on)
+{
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: mock_close()
+ *
+ * Description:
+ *           Close a simulated relay
+ *
+ * Returns:  -
+ *********************************************************/
+static void mock_close(relay_t *r)
+{
+}
+
+static const relay_backend_t backends[] =
+{
+   { "gpio", gpio_open, gpio_set, gpio_close },
+   { "mock", mock_open, mock_set, mock_close },
+};
+
+/**********************************************************
+ * Internal function: elapsed_ms()
+ *
+ * Description:
+ *           Calculate the time between two time values
+ *
+ * Returns:  time difference (in ms), 0 if negative
+ *********************************************************/
+static long long elapsed_ms(struct timespec now, struct timespec then)
+{
+   long long ms = (long long)(now.tv_sec - then.tv_sec)*1000 +
+                  (now.tv_nsec - then.tv_nsec)/1000000;
+   return (ms > 0) ? ms : 0;
+}
+
+/**********************************************************
+ * Internal function: relay_switch()
+ *
+ * Description:
+ *           Switch a relay and record the decision with its
+ *           latency from the triggering event in ev, to be
+ *           logged by relay_report(). Caller must hold
+ *           relay_lock.
+ *
+ * Returns:  -
+ *********************************************************/
+static void relay_switch(relay_t *r, int on, struct timespec ts, unsigned int value, relay_event_t *ev)
+{
+   memset(ev, 0, sizeof(*ev));
+   ev->num = r->num;
+   ev->priority = r->conf.priority;
+   ev->on = on;
+   ev->value = value;
+
+   if (backend->set(r, on) < 0)
+   {
+      ev->err = errno ? errno : EIO;
+      return;
+   }
+
+   clock_gettime(CLOCK_REALTIME, &ev->done);
+   ev->latency_us = (long)(ev->done.tv_sec - ts.tv_sec)*1000000 + (ev->done.tv_nsec - ts.tv_nsec)/1000;
+
+   r->on = on;
+   r->changed = ts;
+}
+
+/**********************************************************
+ * Internal function: relay_report()
+ *
+ * Description:
+ *           Log the switching decisions, without holding
+ *           relay_lock
+ *
+ * Returns:  -
+ *********************************************************/
+static void relay_report(const relay_event_t *ev, int n)
+{
+   int i;
+
+   for (i = 0; i < n; i++, ev++)
+   {
+      if (ev->err != 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Unable to set relay%d: %s\n", ev->num, strerror(ev->err));
+         continue;
+      }
+
+      syslog(LOG_DAEMON | LOG_NOTICE, "Relay%d (tier %u) switched %s at %u W (latency %ld us)\n",
+             ev->num, ev->priority, ev->on ? "on" : "off", ev->value, ev->latency_us);
+
+      pthread_mutex_lock(&log_lock);
+      if (relay_log != NULL)
+      {
+         fprintf(relay_log, "%ld.%06ld relay%d %s value=%u latency_us=%ld\n",
+                 (long)ev->done.tv_sec, ev->done.tv_nsec/1000, ev->num, ev->on ? "on" : "off",
+                 ev->value, ev->latency_us);
+      }
+      pthread_mutex_unlock(&log_lock);
+   }
+}
+
+/**********************************************************
+ * Internal function: relay_evaluate()
+ *
+ * Description:
+ *           Apply thresholds, tiers and min on/off times to
+ *           all relays. At most one tier is switched per
+ *           evaluation, so that the effect on the power is
+ *           measured before the next tier is switched. The
+ *           min times of the relays start with the first
+ *           evaluation. Caller must hold relay_lock.
+ *
+ * Returns:  number of decisions recorded in ev (up to
+ *           RELAY_MAX)
+ *********************************************************/
+static int relay_evaluate(struct timespec ts, unsigned int power, unsigned int demand, relay_event_t *ev)
+{
+   int n = 0;
+   int tier_found = 0;
+   unsigned int tier = 0;
+   int i;
+
+   for (i = 0; i < num_relays; i++)
+   {
+      if (relays[i].changed.tv_sec == 0)
+         relays[i].changed = ts;
+   }
+
+   /* Shed, lowest tier first (relays are sorted by tier) */
+   for (i = 0; i < num_relays; i++)
+   {
+      relay_t *r = &relays[i];
+      unsigned int value = r->conf.use_demand ? demand : power;
+
+      if (tier_found && r->conf.priority != tier)
+         break;
+      if (r->on && value >= r->conf.shed_power &&
+          elapsed_ms(ts, r->changed) >= (long long)r->conf.min_on*1000)
+      {
+         relay_switch(r, 0, ts, value, &ev[n++]);
+         tier_found = 1;
+         tier = r->conf.priority;
+      }
+   }
+   if (tier_found)
+      return n;
+
+   /* Restore, highest tier first */
+   for (i = num_relays-1; i >= 0; i--)
+   {
+      relay_t *r = &relays[i];
+      unsigned int value = r->conf.use_demand ? demand : power;
+
+      if (tier_found && r->conf.priority != tier)
+         break;
+      if (!r->on && value < r->conf.restore_power &&
+          elapsed_ms(ts, r->changed) >= (long long)r->conf.min_off*1000)
+      {
+         relay_switch(r, 1, ts, value, &ev[n++]);
+         tier_found = 1;
+         tier = r->conf.priority;
+      }
+   }
+   return n;
+}
+
+/**********************************************************
+ * Internal function: relay_tick()
+ *
+ * Description:
+ *           Re-evaluate the relays between readings with the
+ *           max power possible by now, if the callback has a
+ *           bound (not in virtual time)
+ *
+ * Returns:  -
+ *********************************************************/
+static void relay_tick(void *arg)
+{
+   relay_event_t ev[RELAY_MAX];
+   struct timespec now;
+   unsigned int power;
+   int n = 0;
+
+   tick_timer = ev_timer_add(RELAY_TICK_MS, relay_tick, NULL);
+
+   /* Without relay_lock, the callback takes the lock of the daemon */
+   clock_gettime(CLOCK_REALTIME, &now);
+   if (power_bound == NULL || power_bound(now, &power) < 0)
+      return;
+
+   pthread_mutex_lock(&relay_lock);
+   if (power < last_power)
+   {
+      n = relay_evaluate(now, power, last_demand, ev);
+   }
+   pthread_mutex_unlock(&relay_lock);
+   relay_report(ev, n);
+}
+
+
+/**********************************************************
+ * Public function: relay_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a [relayN] section
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int relay_config(relay_conf_t *rc, const char *name, const char *value)
+{
+   rc->enabled = 1;
+
+   if (strcmp(name, "gpio_line") == 0)
+      rc->gpio_line = atoi(value);
+   else if (strcmp(name, "active_low") == 0)
+      rc->active_low = atoi(value);
+   else if (strcmp(name, "priority") == 0)
+      rc->priority = atoi(value);
+   else if (strcmp(name, "shed_power") == 0)
+      rc->shed_power = atoi(value);
+   else if (strcmp(name, "restore_power") == 0)
+      rc->restore_power = atoi(value);
+   else if (strcmp(name, "min_on") == 0)
+      rc->min_on = atoi(value);
+   else if (strcmp(name, "min_off") == 0)
+      rc->min_off = atoi(value);
+   else if (strcmp(name, "source") == 0)
+      rc->use_demand = (strcmp(value, "demand") == 0);
+   else
+      return -1;
+
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: relay_backend()
+ *
+ * Description:
+ *           Find an output backend by name
+ *
+ * Returns:  backend, NULL if unknown
+ *********************************************************/
+static const relay_backend_t *relay_backend(const char *name)
+{
+   unsigned int i;
+
+   for (i = 0; i < sizeof(backends)/sizeof(backends[0]); i++)
+   {
+      if (strcmp(backends[i].name, name) == 0)
+         return &backends[i];
+   }
+   syslog(LOG_DAEMON | LOG_ERR, "Unknown relay backend %s\n", name);
+   return NULL;
+}
+
+/**********************************************************
+ * Internal function: relay_open()
+ *
+ * Description:
+ *           Open the relay outputs of the configuration.
+ *           The relays found in kept take over their state
+ *           and time of last switching, all others start
+ *           with the load switched on.
+ *
+ * Returns:  number of relays
+ *********************************************************/
+static int relay_open(const relay_backend_t *b, const char *chip, const char *log,
+                      const relay_conf_t *conf, relay_bound_cb bound,
+                      const relay_t *kept, int num_kept)
+{
+   unsigned int i;
+   int j;
+
+   if (log != NULL && strlen(log) > 0)
+   {
+      pthread_mutex_lock(&log_lock);
+      if ((relay_log = fopen(log, "ae")) == NULL)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Unable to open relay log %s: %s\n", log, strerror(errno));
+      }
+      else
+      {
+         setvbuf(relay_log, NULL, _IOLBF, 0);
+      }
+      pthread_mutex_unlock(&log_lock);
+   }
+
+   pthread_mutex_lock(&relay_lock);
+   backend = b;
+   snprintf(chip_name, sizeof(chip_name), "%s", chip);
+   power_bound = bound;
+   num_relays = 0;
+   for (i = 0; i < RELAY_MAX; i++)
+   {
+      relay_t r;
+
+      if (!conf[i].enabled)
+         continue;
+
+      if (conf[i].restore_power >= conf[i].shed_power)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Invalid thresholds for relay%u: restore_power must be below shed_power\n", i+1);
+         continue;
+      }
+
+      memset(&r, 0, sizeof(r));
+      r.conf = conf[i];
+      r.num = i+1;
+      r.fd = -1;
+      r.on = 1;
+      for (j = 0; j < num_kept; j++)
+      {
+         if (kept[j].num == r.num)
+         {
+            r.on = kept[j].on;
+            r.changed = kept[j].changed;
+         }
+      }
+      if (backend->open(&r, chip) < 0)
+         continue;
+
+      /* Insert sorted by tier */
+      for (j = num_relays; j > 0 && relays[j-1].conf.priority > r.conf.priority; j--)
+         relays[j] = relays[j-1];
+      relays[j] = r;
+      num_relays++;
+
+      syslog(LOG_DAEMON | LOG_INFO, "Relay%u (%s line %u, tier %u): off at %u W, on below %u W (%s)%s\n",
+             i+1, backend->name, r.conf.gpio_line, r.conf.priority,
+             r.conf.shed_power, r.conf.restore_power, r.conf.use_demand ? "demand" : "power",
+             r.on ? "" : ", load kept off");
+   }
+   pthread_mutex_unlock(&relay_lock);
+
+   if (num_relays > 0)
+   {
+      tick_timer = ev_timer_add(RELAY_TICK_MS, relay_tick, NULL);
+   }
+
+   return num_relays;
+}
+
+/**********************************************************
+ * Internal function: relay_close()
+ *
+ * Description:
+ *           Release the outputs. The relays which keep their
+ *           output (backend, chip, line and polarity) in the
+ *           new configuration conf are copied to kept in
+ *           their state, all others switch their load on.
+ *           Without conf all loads are switched on.
+ *
+ * Returns:  number of relays copied to kept
+ *********************************************************/
+static int relay_close(const relay_backend_t *b, const char *chip, const relay_conf_t *conf, relay_t *kept)
+{
+   relay_event_t ev[RELAY_MAX];
+   struct timespec now;
+   const relay_conf_t *c;
+   int num_kept = 0;
+   int n = 0;
+   int i;
+
+   if (tick_timer > 0)
+   {
+      ev_timer_cancel(tick_timer);
+      tick_timer = 0;
+   }
+
+   pthread_mutex_lock(&relay_lock);
+   clock_gettime(CLOCK_REALTIME, &now);
+   for (i = 0; i < num_relays; i++)
+   {
+      c = (conf != NULL) ? &conf[relays[i].num-1] : NULL;
+      if (c != NULL && c->enabled && b == backend && strcmp(chip, chip_name) == 0 &&
+          c->gpio_line == relays[i].conf.gpio_line && c->active_low == relays[i].conf.active_low)
+         kept[num_kept++] = relays[i];
+      else if (!relays[i].on)
+         relay_switch(&relays[i], 1, now, 0, &ev[n++]);
+      backend->close(&relays[i]);
+   }
+   num_relays = 0;
+   pthread_mutex_unlock(&relay_lock);
+
+   relay_report(ev, n);
+
+   pthread_mutex_lock(&log_lock);
+   if (relay_log != NULL)
+   {
+      fclose(relay_log);
+      relay_log = NULL;
+   }
+   pthread_mutex_unlock(&log_lock);
+
+   return num_kept;
+}
+
+
+/**********************************************************
+ * Public function: relay_init()
+ *
+ * Description:
+ *           Open the relay outputs with the given backend
+ *           ("gpio" for the GPIO character device or "mock"
+ *           which only records the switching decisions in
+ *           the log file). All loads start switched on.
+ *           Between the readings the relays are evaluated
+ *           with the power bound of the callback.
+ *
+ * Returns:  number of relays on success, <0 otherwise
+ *********************************************************/
+int relay_init(const char *backend_name, const char *chip, const char *log,
+               const relay_conf_t *conf, relay_bound_cb bound)
+{
+   const relay_backend_t *b;
+
+   if (backend_name == NULL || strlen(backend_name) == 0)
+      backend_name = "gpio";
+   if (chip == NULL || strlen(chip) == 0)
+      chip = RELAY_CHIP;
+
+   if ((b = relay_backend(backend_name)) == NULL)
+      return -1;
+
+   return relay_open(b, chip, log, conf, bound, NULL, 0);
+}
+
+/**********************************************************
+ * Public function: relay_reload()
+ *
+ * Description:
+ *           Apply a new configuration to the relay outputs
+ *           opened by relay_init(). Relays which keep their
+ *           output keep their state and time of last
+ *           switching (so min_on and min_off still apply),
+ *           relays removed switch their load on.
+ *
+ * Returns:  number of relays on success, <0 otherwise
+ *********************************************************/
+int relay_reload(const char *backend_name, const char *chip, const char *log,
+                 const relay_conf_t *conf, relay_bound_cb bound)
+{
+   const relay_backend_t *b;
+   relay_t kept[RELAY_MAX];
+   int num_kept;
+
+   if (backend_name == NULL || strlen(backend_name) == 0)
+      backend_name = "gpio";
+   if (chip == NULL || strlen(chip) == 0)
+      chip = RELAY_CHIP;
+
+   if ((b = relay_backend(backend_name)) == NULL)
+   {
+      relay_close(NULL, NULL, NULL, NULL);
+      return -1;
+   }
+
+   num_kept = relay_close(b, chip, conf, kept);
+   return relay_open(b, chip, log, conf, bound, kept, num_kept);
+}
+
+/**********************************************************
+ * Public function: relay_exit()
+ *
+ * Description:
+ *           Switch all loads on and release the outputs
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int relay_exit(void)
+{
+   relay_close(NULL, NULL, NULL, NULL);
+   return 0;
+}
+
+/**********************************************************
+ * Public function: relay_update()
+ *
+ * Description:
+ *           Evaluate all relays for a processed pulse. May
+ *           be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void relay_update(struct timespec ts, unsigned int power, unsigned int demand)
+{
+   relay_event_t ev[RELAY_MAX];
+   int n = 0;
+
+   pthread_mutex_lock(&relay_lock);
+   last_power = power;
+   last_demand = demand;
+   if (num_relays > 0)
+      n = relay_evaluate(ts, power, demand, ev);
+   pthread_mutex_unlock(&relay_lock);
+   relay_report(ev, n);
+}
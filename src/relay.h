@@ -0,0 +1,103 @@
+/*
+ * Energy Monitor: load shedding relay outputs
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <time.h>
+
+/* Max number of relay outputs ([relay1] ... [relay8]) */
+#define RELAY_MAX 8
+
+/* Period (in ms) for re-evaluating the relays between pulses */
+#define RELAY_TICK_MS 1000
+
+/* Upper bound of the power (in W) at the given time, for the
+ * evaluation between readings, <0 if there is none */
+typedef int (*relay_bound_cb)(struct timespec now, unsigned int *power);
+
+/* Default GPIO chip and max length of its path */
+#define RELAY_CHIP "/dev/gpiochip0"
+#define RELAY_CHIP_SIZE 64
+
+/* Configuration of a single relay output */
+typedef struct
+{
+   int enabled;
+   unsigned int gpio_line;      /* line offset on the GPIO chip */
+   unsigned int active_low;     /* relay energized by a low level */
+   unsigned int priority;       /* tier, lower tiers are shed first */
+   unsigned int shed_power;     /* switch the load off at or above (in W) */
+   unsigned int restore_power;  /* switch the load on again below (in W) */
+   unsigned int min_on;         /* min time (in s) before switching off */
+   unsigned int min_off;        /* min time (in s) before switching on */
+   unsigned int use_demand;     /* compare the projected demand instead of the power */
+} relay_conf_t;
+
+/**********************************************************
+ * Public function: relay_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a [relayN] section
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int relay_config(relay_conf_t *rc, const char *name, const char *value);
+
+/**********************************************************
+ * Public function: relay_init()
+ *
+ * Description:
+ *           Open the relay outputs with the given backend
+ *           ("gpio" for the GPIO character device or "mock"
+ *           which only records the switching decisions in
+ *           the log file). All loads start switched on.
+ *           Between the readings the relays are evaluated
+ *           with the power bound of the callback.
+ *
+ * Returns:  number of relays on success, <0 otherwise
+ *********************************************************/
+int relay_init(const char *backend, const char *chip, const char *log,
+               const relay_conf_t *conf, relay_bound_cb bound);
+
+/**********************************************************
+ * Public function: relay_reload()
+ *
+ * Description:
+ *           Apply a new configuration to the relay outputs
+ *           opened by relay_init(). Relays which keep their
+ *           output keep their state and time of last
+ *           switching (so min_on and min_off still apply),
+ *           relays removed switch their load on.
+ *
+ * Returns:  number of relays on success, <0 otherwise
+ *********************************************************/
+int relay_reload(const char *backend, const char *chip, const char *log,
+                 const relay_conf_t *conf, relay_bound_cb bound);
+
+/**********************************************************
+ * Public function: relay_exit()
+ *
+ * Description:
+ *           Switch all loads on and release the outputs
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int relay_exit(void);
+
+/**********************************************************
+ * Public function: relay_update()
+ *
+ * Description:
+ *           Evaluate all relays for a processed pulse. May
+ *           be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void relay_update(struct timespec ts, unsigned int power, unsigned int demand);
+
+#endif /* __RELAY_H__ */
@@ -0,0 +1,373 @@
+/*
+ * Energy Monitor: replay of recorded measurements
+ *
+ * Description:
+ *   Reads the measurements of a meter from a file and passes them to
+ *   the callback as if they were measured now, e.g. to reproduce a
+ *   problem, to compare settings on the same data or to run the
+ *   daemon without meter hardware.
+ *
+ *   The file is read ahead by one line only. A timer of the event
+ *   loop fires when the next reading is due and all readings due by
+ *   then are passed as one batch. When replaying as fast as possible
+ *   the batches are limited to REPLAY_BATCH readings, so the other
+ *   inputs of the event loop are served in between.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "evloop.h"
+#include "replay.h"
+
+#define REPLAY_LINE_SIZE 512
+
+/* State of a replayed channel */
+typedef struct
+{
+   int running;
+   unsigned int channel;
+   replay_conf_t conf;
+   FILE *f;
+   unsigned long line;
+   unsigned long count;
+   int timer;
+   reading_t next;
+   int have_next;
+   struct timespec first_ts;      /* recorded time of the first reading */
+   struct timespec start_ts;      /* time of the replay start */
+   unsigned long long start_ms;   /* monotonic time of the replay start */
+   reading_cb cb;
+   void *arg;
+} replay_t;
+
+static const char *value_names[READING_VALUES] = READING_NAMES;
+
+static replay_t replays[REPLAY_MAX];
+
+
+/**********************************************************
+ * Internal function: replay_ms()
+ *
+ * Description:
+ *           Calculate the time between two time values
+ *
+ * Returns:  time difference (in ms)
+ *********************************************************/
+static unsigned long long replay_ms(struct timespec ts, struct timespec then)
+{
+   return (unsigned long long)((ts.tv_sec - then.tv_sec)*1000LL +
+                               (ts.tv_nsec - then.tv_nsec)/1000000);
+}
+
+/**********************************************************
+ * Internal function: replay_parse()
+ *
+ * Description:
+ *           Parse a line of the file
+ *
+ * Returns:  1 if a reading was parsed, 0 for an empty
+ *           line, <0 on error
+ *********************************************************/
+static int replay_parse(char *line, reading_t *r)
+{
+   char *p = line;
+   char *name;
+   char *end;
+   long ns;
+   int digits;
+   int v;
+
+   while (isspace((unsigned char)*p))
+      p++;
+   if (*p == 0 || *p == '#')
+      return 0;
+
+   memset(r, 0, sizeof(*r));
+
+   /* Time stamp, seconds and decimals */
+   r->ts.tv_sec = strtoll(p, &end, 10);
+   if (end == p)
+      return -1;
+   p = end;
+   if (*p == '.')
+   {
+      for (p++, ns = 0, digits = 0; isdigit((unsigned char)*p); p++, digits++)
+      {
+         if (digits < 9)
+            ns = ns*10 + (*p - '0');
+      }
+      for (; digits < 9; digits++)
+         ns *= 10;
+      r->ts.tv_nsec = ns;
+   }
+
+   /* Values */
+   while ((name = strtok_r(p, " \t\r\n", &end)) != NULL)
+   {
+      p = NULL;
+      if ((line = strchr(name, '=')) == NULL)
+         return -2;
+      *line++ = 0;
+
+      if (strcmp(name, "pulses") == 0)
+      {
+         r->pulses = strtoul(line, NULL, 10);
+         continue;
+      }
+      for (v = 0; v < READING_VALUES && strcmp(name, value_names[v]) != 0; v++)
+         ;
+      if (v == READING_VALUES)
+         return -3;
+      r->value[v] = strtod(line, NULL);
+      r->valid |= 1 << v;
+   }
+
+   return (r->valid != 0 || r->pulses > 0) ? 1 : 0;
+}
+
+/**********************************************************
+ * Internal function: replay_read()
+ *
+ * Description:
+ *           Read ahead the next reading of a replay, skipping
+ *           invalid lines and readings out of time order
+ *
+ * Returns:  1 if a reading was read, 0 at end of file
+ *********************************************************/
+static int replay_read(replay_t *rp)
+{
+   char buf[REPLAY_LINE_SIZE];
+   reading_t r;
+   int res;
+
+   while (fgets(buf, sizeof(buf), rp->f) != NULL)
+   {
+      rp->line++;
+      if ((res = replay_parse(buf, &r)) == 0)
+         continue;
+      if (res < 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Invalid line %lu in %s, skipped\n", rp->line, rp->conf.file);
+         continue;
+      }
+      /* The previous reading is kept in next until it is overwritten */
+      if (r.ts.tv_sec < rp->next.ts.tv_sec ||
+          (r.ts.tv_sec == rp->next.ts.tv_sec && r.ts.tv_nsec < rp->next.ts.tv_nsec))
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Line %lu in %s is out of time order, skipped\n", rp->line, rp->conf.file);
+         continue;
+      }
+      rp->next = r;
+      rp->have_next = 1;
+      return 1;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: replay_stop()
+ *
+ * Description:
+ *           Stop a replay and close its file
+ *
+ * Returns:  -
+ *********************************************************/
+static void replay_stop(replay_t *rp)
+{
+   if (rp->timer > 0)
+   {
+      ev_timer_cancel(rp->timer);
+      rp->timer = 0;
+   }
+   if (rp->f != NULL)
+   {
+      fclose(rp->f);
+      rp->f = NULL;
+   }
+   rp->running = 0;
+}
+
+/**********************************************************
+ * Internal function: replay_step()
+ *
+ * Description:
+ *           Passes the readings which are due to the callback
+ *           and waits for the next one (timer callback)
+ *
+ * Returns:  -
+ *********************************************************/
+static void replay_step(void *arg)
+{
+   replay_t *rp = (replay_t*)arg;
+   reading_t batch[REPLAY_BATCH];
+   unsigned long long now = ev_now_ms();
+   unsigned long long due = 0;
+   unsigned long long ms;
+   unsigned int n = 0;
+
+   rp->timer = 0;
+
+   while (rp->have_next && n < REPLAY_BATCH)
+   {
+      batch[n] = rp->next;
+      if (rp->conf.speed > 0)
+      {
+         /* Compress by the speed and shift to the start of the
+          * replay, so the time stamps follow the wall clock */
+         ms = replay_ms(rp->next.ts, rp->first_ts)/rp->conf.speed;
+         due = rp->start_ms + ms;
+         if (due > now)
+            break;
+         batch[n].ts.tv_sec = rp->start_ts.tv_sec + (time_t)(ms/1000);
+         batch[n].ts.tv_nsec = rp->start_ts.tv_nsec + (long)(ms%1000)*1000000L;
+         if (batch[n].ts.tv_nsec >= 1000000000L)
+         {
+            batch[n].ts.tv_sec++;
+            batch[n].ts.tv_nsec -= 1000000000L;
+         }
+      }
+      n++;
+      rp->have_next = 0;
+      replay_read(rp);
+   }
+
+   rp->count += n;
+   if (n > 0)
+      rp->cb(rp->channel, batch, n, rp->arg);
+
+   /* The callback may have stopped the replay */
+   if (!rp->running)
+      return;
+
+   if (!rp->have_next)
+   {
+      syslog(LOG_DAEMON | LOG_INFO, "Replay of %s finished (%lu readings)\n", rp->conf.file, rp->count);
+      replay_stop(rp);
+      return;
+   }
+
+   if (rp->conf.speed == 0 || n == REPLAY_BATCH)
+      due = now;
+   rp->timer = ev_timer_add((unsigned long)(due - now), replay_step, rp);
+}
+
+
+/**********************************************************
+ * Public function: replay_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a replay
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int replay_config(replay_conf_t *rc, const char *name, const char *value)
+{
+   if (!rc->enabled)
+   {
+      rc->enabled = 1;
+      rc->speed = 1;
+   }
+
+   if (strcmp(name, "replay_file") == 0)
+   {
+      snprintf(rc->file, sizeof(rc->file), "%s", value);
+      return 0;
+   }
+   if (strcmp(name, "replay_speed") == 0)
+   {
+      rc->speed = atoi(value);
+      return 0;
+   }
+   return -1;
+}
+
+/**********************************************************
+ * Public function: replay_init()
+ *
+ * Description:
+ *           Start replaying the readings recorded in the
+ *           file as readings of the channel. Needs the
+ *           event loop.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int replay_init(const replay_conf_t *conf, unsigned int channel, reading_cb cb, void *arg)
+{
+   replay_t *rp;
+   int i;
+
+   for (i = 0; i < REPLAY_MAX && replays[i].running; i++)
+      ;
+   if (i == REPLAY_MAX)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Too many replays, max %d\n", REPLAY_MAX);
+      return -1;
+   }
+   rp = &replays[i];
+
+   if (!conf->enabled || strlen(conf->file) == 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Missing config parameter replay_file\n");
+      return -2;
+   }
+
+   memset(rp, 0, sizeof(*rp));
+   rp->conf = *conf;
+   rp->channel = channel;
+   rp->cb = cb;
+   rp->arg = arg;
+   if ((rp->f = fopen(conf->file, "re")) == NULL)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to open %s: %s\n", conf->file, strerror(errno));
+      return -3;
+   }
+   if (!replay_read(rp))
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "No readings in %s\n", conf->file);
+      replay_stop(rp);
+      return 0;
+   }
+
+   rp->first_ts = rp->next.ts;
+   clock_gettime(CLOCK_REALTIME, &rp->start_ts);
+   rp->start_ms = ev_now_ms();
+   if ((rp->timer = ev_timer_add(0, replay_step, rp)) < 0)
+   {
+      rp->timer = 0;
+      replay_stop(rp);
+      return -4;
+   }
+   rp->running = 1;
+
+   if (conf->speed > 0)
+      syslog(LOG_DAEMON | LOG_INFO, "Replaying %s on channel %u at %ux speed\n", conf->file, channel, conf->speed);
+   else
+      syslog(LOG_DAEMON | LOG_INFO, "Replaying %s on channel %u\n", conf->file, channel);
+   return 0;
+}
+
+/**********************************************************
+ * Public function: replay_exit()
+ *
+ * Description:
+ *           Stop all replays and close their files
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int replay_exit(void)
+{
+   int i;
+
+   for (i = 0; i < REPLAY_MAX; i++)
+      replay_stop(&replays[i]);
+   return 0;
+}
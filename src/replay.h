@@ -0,0 +1,76 @@
+/*
+ * Energy Monitor: replay of recorded measurements
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "reading.h"
+
+/* Max number of channels replayed at the same time */
+#define REPLAY_MAX 4
+
+/* Max number of readings passed to the callback at a time */
+#define REPLAY_BATCH 64
+
+/* Max length of the file name */
+#define REPLAY_FILE_SIZE 128
+
+/* Configuration of a replay (channel with "source = replay") */
+typedef struct
+{
+   int enabled;
+   char file[REPLAY_FILE_SIZE];
+   unsigned int speed;            /* time lapse factor, 0 for as fast as possible */
+} replay_conf_t;
+
+/**********************************************************
+ * Public function: replay_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a replay
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int replay_config(replay_conf_t *rc, const char *name, const char *value);
+
+/**********************************************************
+ * Public function: replay_init()
+ *
+ * Description:
+ *           Start replaying the readings recorded in the
+ *           file as readings of the channel. The file has
+ *           one reading per line:
+ *
+ *             <time> <name>=<value> ...
+ *
+ *           with the Unix time in seconds (with up to 9
+ *           decimals) and the names of reading.h or
+ *           "pulses". Lines starting with # are ignored.
+ *
+ *           The readings are replayed speed times faster
+ *           than recorded and time stamped when they are
+ *           passed, so their time distance shrinks by the
+ *           speed (as do the periods of the energy values).
+ *           With speed 0 they are replayed as fast as
+ *           possible with their original time stamps. Needs
+ *           the event loop.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int replay_init(const replay_conf_t *conf, unsigned int channel, reading_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: replay_exit()
+ *
+ * Description:
+ *           Stop all replays and close their files
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int replay_exit(void);
+
+#endif /* __REPLAY_H__ */
@@ -0,0 +1,93 @@
+/*
+ * Energy Monitor: serial port setup
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include "serial.h"
+
+
+/**********************************************************
+ * Public function: serial_open()
+ *
+ * Description:
+ *           Open a serial port in raw non-blocking mode,
+ *           "<tty>[:<baud>[:<mode>]]" with mode 8N1 (default),
+ *           8E1, 8O1, 8N2, 7E1 or 7O1. The baud rate is
+ *           returned in baud, its default is given there.
+ *           A tty which is not a real serial port (e.g. a
+ *           FIFO for testing) is accepted as is.
+ *
+ * Returns:  file descriptor, <0 on error
+ *********************************************************/
+int serial_open(const char *spec, unsigned long *baud)
+{
+   static const struct { unsigned long baud; speed_t speed; } speeds[] =
+   {
+      { 300, B300 }, { 600, B600 }, { 1200, B1200 }, { 2400, B2400 },
+      { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+      { 57600, B57600 }, { 115200, B115200 }
+   };
+   char tty[64];
+   char mode[4] = "8N1";
+   struct termios tio;
+   const char *p;
+   unsigned int i;
+   int fd;
+
+   p = strchr(spec, ':');
+   snprintf(tty, sizeof(tty), "%.*s", p ? (int)(p - spec) : (int)strlen(spec), spec);
+   if (p != NULL)
+   {
+      *baud = strtoul(p+1, NULL, 10);
+      if ((p = strchr(p+1, ':')) != NULL)
+         snprintf(mode, sizeof(mode), "%s", p+1);
+   }
+
+   for (i = 0; i < sizeof(speeds)/sizeof(speeds[0]) && speeds[i].baud != *baud; i++)
+      ;
+   if (i == sizeof(speeds)/sizeof(speeds[0]) || (mode[0] != '8' && mode[0] != '7') ||
+       strchr("NEO", mode[1]) == NULL || (mode[2] != '1' && mode[2] != '2') ||
+       (mode[0] == '7' && mode[1] == 'N'))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid serial device %s\n", spec);
+      return -1;
+   }
+
+   if ((fd = open(tty, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to open %s: %s\n", tty, strerror(errno));
+      return -1;
+   }
+
+   memset(&tio, 0, sizeof(tio));
+   cfmakeraw(&tio);
+   cfsetispeed(&tio, speeds[i].speed);
+   cfsetospeed(&tio, speeds[i].speed);
+   tio.c_cflag |= CLOCAL | CREAD;
+   if (mode[0] == '7')
+      tio.c_cflag = (tio.c_cflag & ~CSIZE) | CS7;
+   if (mode[1] != 'N')
+      tio.c_cflag |= PARENB | ((mode[1] == 'O') ? PARODD : 0);
+   if (mode[2] == '2')
+      tio.c_cflag |= CSTOPB;
+   tio.c_cc[VMIN] = 0;
+   tio.c_cc[VTIME] = 0;
+   if (tcsetattr(fd, TCSANOW, &tio) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Unable to set up %s: %s\n", tty, strerror(errno));
+   }
+   tcflush(fd, TCIOFLUSH);
+
+   return fd;
+}
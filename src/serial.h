@@ -0,0 +1,26 @@
+/*
+ * Energy Monitor: serial port setup
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __SERIAL_H__
+#define __SERIAL_H__
+
+/**********************************************************
+ * Public function: serial_open()
+ *
+ * Description:
+ *           Open a serial port in raw non-blocking mode,
+ *           "<tty>[:<baud>[:<mode>]]" with mode 8N1 (default),
+ *           8E1, 8O1, 8N2, 7E1 or 7O1. The baud rate is
+ *           returned in baud, its default is given there.
+ *           A tty which is not a real serial port (e.g. a
+ *           FIFO for testing) is accepted as is.
+ *
+ * Returns:  file descriptor, <0 on error
+ *********************************************************/
+int serial_open(const char *spec, unsigned long *baud);
+
+#endif /* __SERIAL_H__ */
@@ -22,249 +22,588 @@
 #include <arpa/inet.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 
+#include "evloop.h"
 #include "sockets.h"
 
-// Length of longest transmission allowed at once...
-#define MAXMSG 8192
+// Length of longest formatted message
+#define MAXMSG 512
 
-typedef struct sockaddr_in sockaddr_in;
+// Max number of cached host lookups
+#define SOCK_CACHE_SIZE 8
+
+// Lifetime of cached host lookups (in s)
+#define SOCK_CACHE_TTL 300
+
+// Connection attempt lanes (tried in parallel)
+#define LANE_INET6 0
+#define LANE_INET  1
+
+typedef struct {
+	char host[SOCK_HOST_SIZE];
+	unsigned short int port;
+	time_t expires;
+	int naddrs;
+	struct sockaddr_storage addrs[SOCK_MAX_ADDRS];
+	socklen_t addrlens[SOCK_MAX_ADDRS];
+} sock_cache_t;
+
+typedef struct {
+	sock_conn_t *conn;
+	unsigned int gen;
+	int err;
+	sock_cache_t result;
+} sock_lookup_t;
+
+// Only accessed from the event loop thread
+static sock_cache_t cache[SOCK_CACHE_SIZE];
+
+static void sock_conn_io (int fd, unsigned int events, void *arg);
+static void sock_lookup_done (void *arg);
+static void sock_conn_fail (sock_conn_t *conn, int err);
+static int sock_conn_read (sock_conn_t *conn);
+static int sock_conn_flush (sock_conn_t *conn);
 
 /**
- * Tries to resolve a resolve a hostname.
- * \param name      Pointer to resolves IP-address
- * \param hostname  Hostname or IP-address (as string)
- * \param port      Port number
- * \return  0 on success, -1 on error.
+ * Find a valid cache entry.
+ * \param host  Hostname or IP-address
+ * \param port  Port number
+ * \return  Pointer to entry, NULL if not cached.
  */
-static int
-sock_init_sockaddr (sockaddr_in *name, const char *hostname, unsigned short int port)
+static sock_cache_t *
+sock_cache_find (const char *host, unsigned short int port)
 {
-	struct hostent *hostinfo;
-
-	memset (name, '\0', sizeof (*name));
-	name->sin_family = AF_INET;
-	name->sin_port = htons (port);
-	hostinfo = gethostbyname (hostname);
-	if (hostinfo == NULL) {
-		fprintf(stderr, "sock_init_sockaddr: Unknown host %s.", hostname);
-		return -1;
+	time_t now = time (NULL);
+	int i;
+
+	for (i = 0; i < SOCK_CACHE_SIZE; i++) {
+		if (cache[i].naddrs > 0 && cache[i].port == port &&
+		    cache[i].expires > now && !strcmp (cache[i].host, host))
+			return &cache[i];
 	}
-	name->sin_addr = *(struct in_addr *) hostinfo->h_addr;
+	return NULL;
+}
 
-	return 0;
+/**
+ * Store a lookup result in the cache (replacing the oldest entry).
+ * \param entry  Lookup result
+ */
+static void
+sock_cache_store (const sock_cache_t *entry)
+{
+	int i, oldest = 0;
+
+	for (i = 0; i < SOCK_CACHE_SIZE; i++) {
+		if (cache[i].naddrs == 0 ||
+		    (cache[i].port == entry->port && !strcmp (cache[i].host, entry->host))) {
+			oldest = i;
+			break;
+		}
+		if (cache[i].expires < cache[oldest].expires)
+			oldest = i;
+	}
+	cache[oldest] = *entry;
 }
 
 /**
- * Connect to server.
+ * Drop a host from the cache, e.g. after all its addresses failed.
  * \param host  Hostname or IP-address
  * \param port  Port number
- * \return  socket file descriptor on success, -1 on error
  */
-int
-sock_connect (char *host, unsigned short int port)
+static void
+sock_cache_drop (const char *host, unsigned short int port)
 {
-	struct sockaddr_in servername;
-	int sock;
-	int err = 0;
+	sock_cache_t *entry = sock_cache_find (host, port);
 
-	//fprintf(stderr, "sock_connect: Creating socket");
-	sock = socket (PF_INET, SOCK_STREAM, 0);
-	if (sock < 0) {
-		fprintf(stderr, "sock_connect: Error creating socket");
-		return sock;
-	}
-	//fprintf(stderr, "sock_connect: Created socket (%i)", sock);
+	if (entry)
+		entry->naddrs = 0;
+}
 
-	if (sock_init_sockaddr (&servername, host, port) < 0)
-		return -1;
+/**
+ * Start a non-blocking connect to one address.
+ * \param addr     Socket address
+ * \param addrlen  Length of the socket address
+ * \return  socket file descriptor on success, -1 on error (errno set).
+ */
+static int
+sock_connect_addr (const struct sockaddr *addr, socklen_t addrlen)
+{
+	int sock;
+	int err;
 
-	err = connect (sock, (struct sockaddr *) &servername, sizeof (servername));
-	if (err < 0) {
-		fprintf(stderr, "sock_connect: connect failed");
-		shutdown (sock, SHUT_RDWR);
+	sock = socket (addr->sa_family, SOCK_STREAM, 0);
+	if (sock < 0)
 		return -1;
-	}
 
 	fcntl (sock, F_SETFL, O_NONBLOCK);
+	fcntl (sock, F_SETFD, FD_CLOEXEC);
+
+	if (connect (sock, addr, addrlen) < 0 && errno != EINPROGRESS) {
+		err = errno;
+		close (sock);
+		errno = err;
+		return -1;
+	}
 
 	return sock;
 }
 
 /**
- * Disconnect from server.
- * \param fd  Socket file descriptor
- * \return  0 on success, -1 on error.
+ * Start the next connection attempt of a lane.
+ * Each lane walks through the addresses of one family in order.
+ * \param conn  Pointer to the connection object
+ * \param lane  LANE_INET6 or LANE_INET
+ * \return  0 if an attempt is in progress, -1 if the lane is exhausted.
  */
-int
-sock_close (int fd)
+static int
+sock_conn_try_lane (sock_conn_t *conn, int lane)
 {
-	int err;
+	int family = (lane == LANE_INET6) ? AF_INET6 : AF_INET;
+	int i, fd;
 
-	err = shutdown (fd, SHUT_RDWR);
-	if (!err)
-		close (fd);
+	conn->lane_fd[lane] = -1;
+	while (conn->lane_next[lane] < conn->naddrs) {
+		i = conn->lane_next[lane]++;
+		if (conn->addrs[i].ss_family != family)
+			continue;
 
-	return err;
+		fd = sock_connect_addr ((struct sockaddr *) &conn->addrs[i], conn->addrlens[i]);
+		if (fd < 0) {
+			conn->last_err = errno;
+			continue;
+		}
+		if (ev_add_fd (fd, EV_WRITE, sock_conn_io, conn) < 0) {
+			close (fd);
+			continue;
+		}
+		conn->lane_fd[lane] = fd;
+		return 0;
+	}
+	return -1;
 }
 
+/**
+ * Stop all pending connection attempts.
+ * \param conn  Pointer to the connection object
+ */
+static void
+sock_conn_stop_lanes (sock_conn_t *conn)
+{
+	int lane;
+
+	for (lane = 0; lane < 2; lane++) {
+		if (conn->lane_fd[lane] >= 0) {
+			ev_del_fd (conn->lane_fd[lane]);
+			close (conn->lane_fd[lane]);
+			conn->lane_fd[lane] = -1;
+		}
+	}
+}
 
 /**
- * Send printf-like formatted output.
- * \param fd      Socket file descriptor
- * \param format  Format string
- * \param ...     Arguments to the format string
- * \return  Number of bytes sent.
+ * Start connecting to the resolved addresses. One IPv6 and one IPv4
+ * attempt run in parallel, the first one to succeed wins.
+ * \param conn   Pointer to the connection object
+ * \param entry  Resolved addresses
  */
-int
-sock_printf(int fd, const char *format, .../*args*/ )
+static void
+sock_conn_start (sock_conn_t *conn, const sock_cache_t *entry)
 {
-	char buf[MAXMSG];
-	va_list ap;
-	int size = 0;
+	int ok6, ok4;
+
+	conn->naddrs = entry->naddrs;
+	memcpy (conn->addrs, entry->addrs, sizeof (conn->addrs));
+	memcpy (conn->addrlens, entry->addrlens, sizeof (conn->addrlens));
+	conn->lane_next[LANE_INET6] = 0;
+	conn->lane_next[LANE_INET] = 0;
+	conn->last_err = ECONNREFUSED;
+	conn->state = SOCK_ST_CONNECTING;
+
+	ok6 = sock_conn_try_lane (conn, LANE_INET6);
+	ok4 = sock_conn_try_lane (conn, LANE_INET);
+	if (ok6 < 0 && ok4 < 0) {
+		sock_cache_drop (conn->host, conn->port);
+		sock_conn_fail (conn, conn->last_err);
+	}
+}
 
-	va_start(ap, format);
-	size = vsnprintf(buf, sizeof(buf), format, ap);
-	va_end(ap);
+/**
+ * Resolver thread, runs getaddrinfo() off the event loop.
+ * \param arg  Pointer to the lookup job
+ */
+static void *
+sock_lookup_thread (void *arg)
+{
+	sock_lookup_t *job = (sock_lookup_t *) arg;
+	struct addrinfo hints, *res, *ai;
+	char service[8];
+	int rc;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	snprintf (service, sizeof (service), "%u", job->result.port);
+
+	rc = getaddrinfo (job->result.host, service, &hints, &res);
+	if (rc == 0) {
+		for (ai = res; ai && job->result.naddrs < SOCK_MAX_ADDRS; ai = ai->ai_next) {
+			if (ai->ai_addrlen > sizeof (struct sockaddr_storage))
+				continue;
+			memcpy (&job->result.addrs[job->result.naddrs], ai->ai_addr, ai->ai_addrlen);
+			job->result.addrlens[job->result.naddrs] = ai->ai_addrlen;
+			job->result.naddrs++;
+		}
+		freeaddrinfo (res);
+	}
+	job->err = (job->result.naddrs > 0) ? 0 : EHOSTUNREACH;
+	job->result.expires = time (NULL) + SOCK_CACHE_TTL;
 
-	if (size < 0) {
-		fprintf(stderr, "sock_printf: vsnprintf failed");
-		return -1;
+	if (ev_post (sock_lookup_done, job) < 0)
+		free (job);
+
+	return NULL;
+}
+
+/**
+ * Deliver a lookup result in the event loop thread.
+ * \param arg  Pointer to the lookup job
+ */
+static void
+sock_lookup_done (void *arg)
+{
+	sock_lookup_t *job = (sock_lookup_t *) arg;
+	sock_conn_t *conn = job->conn;
+
+	if (job->err == 0)
+		sock_cache_store (&job->result);
+
+	// ignore results for connections closed or reopened meanwhile
+	if (conn->state == SOCK_ST_RESOLVING && conn->gen == job->gen) {
+		if (job->err)
+			sock_conn_fail (conn, job->err);
+		else
+			sock_conn_start (conn, &job->result);
 	}
-	if (size > sizeof(buf))
-		fprintf(stderr, "sock_printf: vsnprintf truncated message");
 
-	return sock_send_string(fd, buf);
+	free (job);
 }
 
 /**
- * Send lines of text.
+ * Event loop callback of a buffered connection.
  * \param fd      Socket file descriptor
- * \param string  Pointer to the string to send.
- * \return  Number of bytes sent.
+ * \param events  EV_xxx flags
+ * \param arg     Pointer to the connection
  */
-int
-sock_send_string (int fd, char *string)
+static void
+sock_conn_io (int fd, unsigned int events, void *arg)
 {
-	return sock_send(fd, string, strlen(string));
+	sock_conn_t *conn = (sock_conn_t *) arg;
+	socklen_t len = sizeof (int);
+	int lane, err = 0;
+
+	if (conn->state == SOCK_ST_CONNECTING) {
+		// a non-blocking connect attempt has finished
+		lane = (fd == conn->lane_fd[LANE_INET6]) ? LANE_INET6 : LANE_INET;
+		if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			err = errno;
+		if (err) {
+			ev_del_fd (fd);
+			close (fd);
+			conn->last_err = err;
+			if (sock_conn_try_lane (conn, lane) < 0 &&
+			    conn->lane_fd[LANE_INET6] < 0 && conn->lane_fd[LANE_INET] < 0) {
+				sock_cache_drop (conn->host, conn->port);
+				sock_conn_fail (conn, conn->last_err);
+			}
+			return;
+		}
+
+		// the winner takes the connection, the other attempt is dropped
+		conn->lane_fd[lane] = -1;
+		sock_conn_stop_lanes (conn);
+		conn->fd = fd;
+		conn->state = SOCK_ST_CONNECTED;
+		ev_mod_fd (fd, EV_READ | (conn->wlen ? EV_WRITE : 0));
+		conn->on_event (conn, SOCK_EV_CONNECTED, 0, conn->arg);
+		if (conn->fd < 0)
+			return;
+	}
+
+	if (events & (EV_READ | EV_ERROR)) {
+		if (sock_conn_read (conn) < 0)
+			return;
+	}
+
+	if ((events & EV_WRITE) && conn->wlen) {
+		if (sock_conn_flush (conn) < 0)
+			sock_conn_fail (conn, errno);
+	}
 }
 
 /**
- * Receive a line of text.
- * Recv gives only one line per call...
- * \param fd      Socket file descriptor
- * \param dest    Pointer to buffer to store the received data
- * \param maxlen  Number of bytes to read at most (size of buffer)
- * \return  Number of bytes received.
+ * Open a buffered connection to a server.
+ * The host name is resolved by a helper thread (results are cached)
+ * and the connection is set up asynchronously by the event loop,
+ * trying IPv6 and IPv4 addresses in parallel. The callback receives
+ * SOCK_EV_CONNECTED once the connection is established and
+ * SOCK_EV_CLOSED when it fails or is closed by the peer. Received
+ * data is split into lines which are passed to the line callback.
+ * Data sent before the connection is established is queued.
+ * \param conn      Pointer to the connection object
+ * \param host      Hostname or IP-address
+ * \param port      Port number
+ * \param on_line   Callback for received lines
+ * \param on_event  Callback for connection state changes
+ * \param arg       User argument passed to the callbacks
+ * \return  0 on success, -1 on error.
  */
 int
-sock_recv_string (int fd, char *dest, size_t maxlen)
+sock_conn_open (sock_conn_t *conn, const char *host, unsigned short int port,
+		sock_line_cb on_line, sock_event_cb on_event, void *arg)
 {
-	char *ptr = dest;
-	int recvBytes = 0;
+	sock_cache_t *entry;
+	sock_lookup_t *job;
+	pthread_attr_t attr;
+	pthread_t tid;
+	unsigned int gen = conn->gen + 1;
+
+	sock_conn_close (conn);
+	memset (conn, 0, sizeof (*conn));
+	conn->fd = -1;
+	conn->lane_fd[LANE_INET6] = -1;
+	conn->lane_fd[LANE_INET] = -1;
+	conn->gen = gen;
+	conn->port = port;
+	conn->on_line = on_line;
+	conn->on_event = on_event;
+	conn->arg = arg;
+	strncpy (conn->host, host, sizeof (conn->host) - 1);
+
+	if ((entry = sock_cache_find (conn->host, port)) != NULL) {
+		conn->state = SOCK_ST_CONNECTING;
+		sock_conn_start (conn, entry);
+		return 0;
+	}
 
-	if (!dest)
+	if ((job = calloc (1, sizeof (*job))) == NULL)
 		return -1;
-	if (maxlen <= 0)
-		return 0;
+	job->conn = conn;
+	job->gen = gen;
+	strcpy (job->result.host, conn->host);
+	job->result.port = port;
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create (&tid, &attr, sock_lookup_thread, job) != 0) {
+		pthread_attr_destroy (&attr);
+		free (job);
+		return -1;
+	}
+	pthread_attr_destroy (&attr);
+
+	conn->state = SOCK_ST_RESOLVING;
+	return 0;
+}
+
+/**
+ * Switch a buffered connection to raw mode: received data is passed
+ * to the data callback as it arrives instead of being split into
+ * lines. Data which is not consumed is passed again together with
+ * the next data (unless the read buffer is full).
+ * \param conn     Pointer to the connection object
+ * \param on_data  Callback for received data
+ */
+void
+sock_conn_set_raw (sock_conn_t *conn, sock_data_cb on_data)
+{
+	conn->on_data = on_data;
+}
+
+/**
+ * Close a buffered connection (pending output is discarded).
+ * Pending lookups and connection attempts are cancelled.
+ * Does nothing if the connection is already closed.
+ * \param conn  Pointer to the connection object
+ */
+void
+sock_conn_close (sock_conn_t *conn)
+{
+	if (conn->state == SOCK_ST_CLOSED)
+		return;
+
+	if (conn->state == SOCK_ST_CONNECTING)
+		sock_conn_stop_lanes (conn);
+
+	if (conn->fd >= 0) {
+		ev_del_fd (conn->fd);
+		close (conn->fd);
+		conn->fd = -1;
+	}
+	conn->state = SOCK_ST_CLOSED;
+	conn->rlen = 0;
+	conn->wlen = 0;
+}
+
+/**
+ * Close the connection after an error and notify the user.
+ * \param conn  Pointer to the connection object
+ * \param err   errno value (0 if closed by peer)
+ */
+static void
+sock_conn_fail (sock_conn_t *conn, int err)
+{
+	sock_conn_close (conn);
+	conn->on_event (conn, SOCK_EV_CLOSED, err, conn->arg);
+}
+
+/**
+ * Read all available data and pass complete lines to the user.
+ * Overlong lines are truncated to the read buffer size.
+ * \param conn  Pointer to the connection object
+ * \return  0 on success, -1 if the connection was closed.
+ */
+static int
+sock_conn_read (sock_conn_t *conn)
+{
+	char *start, *nl;
+	ssize_t n;
 
 	while (1) {
-		int err = read (fd, ptr, 1);
-		if (err == -1) {
-			if (errno == EAGAIN) {
-				if (recvBytes) {
-					// We've begun to read a string, but no bytes are
-					// available.  Loop.
-					continue;
-				}
+		n = read (conn->fd, conn->rbuf + conn->rlen, sizeof (conn->rbuf) - 1 - conn->rlen);
+		if (n == 0) {
+			sock_conn_fail (conn, 0);
+			return -1;
+		}
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
 				return 0;
-			} else {
-				fprintf(stderr, "sock_recv_string: socket read error");
-				return err;
-			}
-		} else if (err == 0) {
-			return recvBytes;
+			sock_conn_fail (conn, errno);
+			return -1;
+		}
+		conn->rlen += n;
+		conn->rbuf[conn->rlen] = '\0';
+
+		if (conn->on_data != NULL) {
+			// raw mode, keep what the user did not consume
+			size_t used = conn->on_data (conn, (unsigned char *) conn->rbuf, conn->rlen, conn->arg);
+
+			if (conn->fd < 0)
+				return -1;
+			if (used >= conn->rlen || conn->rlen == sizeof (conn->rbuf) - 1)
+				used = conn->rlen;
+			conn->rlen -= used;
+			memmove (conn->rbuf, conn->rbuf + used, conn->rlen);
+			continue;
 		}
 
-		recvBytes++;
-
-		// stop at max. bytes allowed, at NUL or at LF
-		if (recvBytes == maxlen || *ptr == '\0' || *ptr == '\n') {
-			*ptr = '\0';
-			break;
+		// split into lines, the callback may close the connection
+		start = conn->rbuf;
+		while ((nl = memchr (start, '\n', conn->rlen - (start - conn->rbuf))) != NULL) {
+			*nl = '\0';
+			conn->on_line (conn, start, conn->arg);
+			if (conn->fd < 0)
+				return -1;
+			start = nl + 1;
+		}
+		conn->rlen -= start - conn->rbuf;
+		memmove (conn->rbuf, start, conn->rlen);
+
+		if (conn->rlen == sizeof (conn->rbuf) - 1) {
+			// line too long, pass it on in pieces
+			conn->on_line (conn, conn->rbuf, conn->arg);
+			if (conn->fd < 0)
+				return -1;
+			conn->rlen = 0;
 		}
-		ptr++;
 	}
+}
 
-	// Don't return an empty string
-	if (recvBytes == 1 && dest[0] == '\0')
-		return 0;
-
-	if (recvBytes < maxlen - 1)
-		dest[recvBytes] = '\0';
+/**
+ * Write as much buffered output as the socket accepts.
+ * \param conn  Pointer to the connection object
+ * \return  0 on success, -1 on error.
+ */
+static int
+sock_conn_flush (sock_conn_t *conn)
+{
+	ssize_t n;
+
+	while (conn->wlen) {
+		n = send (conn->fd, conn->wbuf, conn->wlen, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		conn->wlen -= n;
+		memmove (conn->wbuf, conn->wbuf + n, conn->wlen);
+	}
 
-	return recvBytes;
+	// only poll for writability while output is pending
+	ev_mod_fd (conn->fd, EV_READ | (conn->wlen ? EV_WRITE : 0));
+	return 0;
 }
 
 /**
- * Send raw data.
- * \param fd    Socket file descriptor
+ * Queue raw data for sending. Either all or nothing is queued.
+ * \param conn  Pointer to the connection object
  * \param src   Buffer holding the data to send
- * \param size  Number of bytes to send at most
- * \return  Number of bytes sent.
+ * \param size  Number of bytes to send
+ * \return  0 on success, -1 if the write buffer is full, -2 on error.
  */
 int
-sock_send (int fd, void *src, size_t size)
+sock_conn_send (sock_conn_t *conn, const void *src, size_t size)
 {
-	int offset = 0;
-
-	if (!src)
+	if (conn->state == SOCK_ST_CLOSED)
+		return -2;
+	if (size > sizeof (conn->wbuf) - conn->wlen)
 		return -1;
 
-	while (offset != size) {
-		// write isn't guaranteed to send the entire string at once,
-		// so we have to sent it in a loop like this
-                int sent = write (fd, ((char *) src) + offset, size - offset);
-		if (sent == -1) {
-			if (errno != EAGAIN) {
-				fprintf(stderr, "sock_send: socket write error");
-				//fprintf(stderr, "Message was: '%.*s'", size-offset, (char *) src);
-				return sent;
-			}
-			continue;
-		} else if (sent == 0) {
-			// when this returns zero, it generally means
-			// we got disconnected
-			return sent + offset;
-		}
+	memcpy (conn->wbuf + conn->wlen, src, size);
+	conn->wlen += size;
 
-		offset += sent;
-	}
+	if (conn->state != SOCK_ST_CONNECTED)
+		return 0;
 
-	return offset;
+	return (sock_conn_flush (conn) < 0) ? -2 : 0;
 }
 
 /**
- * Receive raw data.
- * \param fd      Socket file descriptor
- * \param dest    Pointer to buffer to store the received data
- * \param maxlen  Number of bytes to read at most (size of buffer)
- * \return  Number of bytes received.
+ * Queue printf-like formatted output.
+ * \param conn    Pointer to the connection object
+ * \param format  Format string
+ * \param ...     Arguments to the format string
+ * \return  0 on success, -1 if the write buffer is full, -2 on error.
  */
 int
-sock_recv (int fd, void *dest, size_t maxlen)
+sock_conn_printf (sock_conn_t *conn, const char *format, .../*args*/ )
 {
-	int err;
+	char buf[MAXMSG];
+	va_list ap;
+	int size;
 
-	if (!dest)
-		return -1;
-	if (maxlen <= 0)
-		return 0;
+	va_start (ap, format);
+	size = vsnprintf (buf, sizeof (buf), format, ap);
+	va_end (ap);
 
-	err = read (fd, dest, maxlen);
-	if (err < 0) {
-		return err;
-	}
+	if (size < 0 || size >= sizeof (buf))
+		return -2;
 
-	return err;
+	return sock_conn_send (conn, buf, size);
+}
+
+/**
+ * Number of bytes waiting to be sent.
+ * \param conn  Pointer to the connection object
+ * \return  Number of bytes in the write buffer.
+ */
+size_t
+sock_conn_pending (sock_conn_t *conn)
+{
+	return conn->wlen;
 }
@@ -9,6 +9,9 @@
 # include "config.h"
 #endif
 
+#include <stddef.h>
+#include <sys/socket.h>
+
 #ifndef LCDPORT
 # define LCDPORT 13666
 #endif
@@ -17,19 +20,76 @@
 # define SHUT_RDWR 2
 #endif
 
-/** Connect to server on host, port */
-int sock_connect (char *host, unsigned short int port);
-/** Disconnect from server */
-int sock_close (int fd);
-/** Send printf-like formatted output */
-int sock_printf (int fd, const char *format, .../*args*/);
-/** Send lines of text */
-int sock_send_string (int fd, char *string);
-/** Send raw data */
-int sock_send (int fd, void *src, size_t size);
-/** Receive a line of text */
-int sock_recv_string (int fd, char *dest, size_t maxlen);
-/** Receive raw data */
-int sock_recv (int fd, void *dest, size_t maxlen);
+#ifndef SOCK_RBUF_SIZE
+# define SOCK_RBUF_SIZE 512
+#endif
+
+#ifndef SOCK_WBUF_SIZE
+# define SOCK_WBUF_SIZE 4096
+#endif
+
+#ifndef SOCK_MAX_ADDRS
+# define SOCK_MAX_ADDRS 4
+#endif
+
+#define SOCK_HOST_SIZE 64
+
+/** Connection states */
+#define SOCK_ST_CLOSED     0
+#define SOCK_ST_RESOLVING  1
+#define SOCK_ST_CONNECTING 2
+#define SOCK_ST_CONNECTED  3
+
+/** Connection events passed to sock_event_cb */
+#define SOCK_EV_CONNECTED 1
+#define SOCK_EV_CLOSED    2
+
+typedef struct sock_conn sock_conn_t;
+
+/** Called for each received line (without the newline) */
+typedef void (*sock_line_cb) (sock_conn_t *conn, char *line, void *arg);
+/** Called with the received raw data (instead of lines), returns the number of bytes consumed */
+typedef size_t (*sock_data_cb) (sock_conn_t *conn, const unsigned char *data, size_t len, void *arg);
+/** Called when the connection is established or closed (err is an errno value) */
+typedef void (*sock_event_cb) (sock_conn_t *conn, int event, int err, void *arg);
+
+/** Buffered, non-blocking connection driven by the event loop */
+struct sock_conn {
+	int fd;			/* connected socket, -1 otherwise */
+	int state;
+	unsigned int gen;	/* identifies the current lookup */
+	char host[SOCK_HOST_SIZE];
+	unsigned short int port;
+	/* resolved addresses and parallel IPv6/IPv4 attempts */
+	int naddrs;
+	struct sockaddr_storage addrs[SOCK_MAX_ADDRS];
+	socklen_t addrlens[SOCK_MAX_ADDRS];
+	int lane_fd[2];
+	int lane_next[2];
+	int last_err;
+	char rbuf[SOCK_RBUF_SIZE];
+	size_t rlen;
+	char wbuf[SOCK_WBUF_SIZE];
+	size_t wlen;
+	sock_line_cb on_line;
+	sock_data_cb on_data;
+	sock_event_cb on_event;
+	void *arg;
+};
+
+/** Open buffered connection to server on host, port */
+int sock_conn_open (sock_conn_t *conn, const char *host, unsigned short int port,
+		    sock_line_cb on_line, sock_event_cb on_event, void *arg);
+/** Pass received data unsplit to on_data (binary protocols) */
+void sock_conn_set_raw (sock_conn_t *conn, sock_data_cb on_data);
+/** Close buffered connection */
+void sock_conn_close (sock_conn_t *conn);
+/** Queue raw data */
+int sock_conn_send (sock_conn_t *conn, const void *src, size_t size);
+/** Queue printf-like formatted output */
+int sock_conn_printf (sock_conn_t *conn, const char *format, .../*args*/)
+	__attribute__ ((format (printf, 2, 3)));
+/** Number of bytes waiting to be sent */
+size_t sock_conn_pending (sock_conn_t *conn);
 
 #endif
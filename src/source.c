@@ -0,0 +1,411 @@
+/*
+ * Energy Monitor: input sources of the measurement channels
+ *
+ * Description:
+ *   A channel is one meter whose readings are processed by the daemon.
+ *   Each channel selects the input source delivering its readings:
+ *
+ *   - gpio:   S0 pulses on a GPIO pin
+ *   - replay: readings recorded in a file
+ *   - modbus: a meter on the Modbus RTU/TCP bus
+ *   - serial: the telegrams of a smart meter
+ *
+ *   All sources pass batches of time stamped readings to the same
+ *   callback in the event loop thread, so they can run at the same
+ *   time without further locking. A source serves all channels using
+ *   it (e.g. the meters sharing a Modbus bus), so it is started and
+ *   stopped with the whole channel table.
+ *
+ *   A new kind of meter is added by implementing the source_t
+ *   functions and adding it to the list of sources.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "hal.h"
+#include "source.h"
+
+
+/**********************************************************
+ * Internal function: source_single()
+ *
+ * Description:
+ *           Find the channel of a source which serves only
+ *           one channel (more are rejected by source_check())
+ *
+ * Returns:  index of the channel, <0 if none
+ *********************************************************/
+static int source_single(const source_t *s, const channel_conf_t ch[SOURCE_MAX_CHANNELS])
+{
+   int i;
+
+   for (i = 0; i < SOURCE_MAX_CHANNELS; i++)
+   {
+      if (ch[i].source == s)
+         return i;
+   }
+   return -1;
+}
+
+/**********************************************************
+ * Internal functions: gpio source
+ *
+ * Description:
+ *           S0 pulses on a GPIO pin (one channel)
+ *********************************************************/
+static int gpio_config(source_conf_t *conf, const char *name, const char *value)
+{
+   return pulse_config(&conf->gpio, name, value);
+}
+
+static int gpio_start(const source_t *s, const channel_conf_t ch[SOURCE_MAX_CHANNELS],
+                      reading_cb cb, void *arg)
+{
+   int i;
+
+   if ((i = source_single(s, ch)) < 0)
+      return pulse_exit();
+   return pulse_init(&ch[i].conf.gpio, i+1, cb, arg);
+}
+
+static int gpio_stop(void)
+{
+   return pulse_exit();
+}
+
+static int gpio_wall_clock(const source_conf_t *conf)
+{
+   return !hal_virtual_time();
+}
+
+/**********************************************************
+ * Internal functions: replay source
+ *
+ * Description:
+ *           Readings recorded in a file (REPLAY_MAX channels)
+ *********************************************************/
+static int replay_source_config(source_conf_t *conf, const char *name, const char *value)
+{
+   return replay_config(&conf->replay, name, value);
+}
+
+static int replay_start(const source_t *s, const channel_conf_t ch[SOURCE_MAX_CHANNELS],
+                        reading_cb cb, void *arg)
+{
+   int res = 0;
+   int i;
+
+   replay_exit();
+   for (i = 0; i < SOURCE_MAX_CHANNELS; i++)
+   {
+      if (ch[i].source == s && replay_init(&ch[i].conf.replay, i+1, cb, arg) < 0)
+         res = -1;
+   }
+   return res;
+}
+
+static int replay_stop(void)
+{
+   return replay_exit();
+}
+
+static int replay_wall_clock(const source_conf_t *conf)
+{
+   return conf->replay.speed > 0;
+}
+
+/**********************************************************
+ * Internal functions: modbus source
+ *
+ * Description:
+ *           Meters on the Modbus bus (MODBUS_MAX_METERS
+ *           channels)
+ *********************************************************/
+static int modbus_source_config(source_conf_t *conf, const char *name, const char *value)
+{
+   return modbus_config(&conf->modbus, name, value);
+}
+
+static int modbus_start(const source_t *s, const channel_conf_t ch[SOURCE_MAX_CHANNELS],
+                        reading_cb cb, void *arg)
+{
+   modbus_conf_t meters[MODBUS_MAX_METERS];
+   unsigned int m = 0;
+   int i;
+
+   memset(meters, 0, sizeof(meters));
+   for (i = 0; i < SOURCE_MAX_CHANNELS; i++)
+   {
+      if (ch[i].source != s)
+         continue;
+      if (m == MODBUS_MAX_METERS)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Too many Modbus meters, channel %d is ignored\n", i+1);
+         continue;
+      }
+      meters[m] = ch[i].conf.modbus;
+      meters[m].channel = i+1;
+      m++;
+   }
+   return modbus_init(meters, cb, arg);
+}
+
+static int modbus_stop(void)
+{
+   return modbus_exit();
+}
+
+/**********************************************************
+ * Internal functions: serial source
+ *
+ * Description:
+ *           Telegrams of a smart meter (one channel)
+ *********************************************************/
+static int serial_config(source_conf_t *conf, const char *name, const char *value)
+{
+   return telegram_config(&conf->serial, name, value);
+}
+
+static int serial_start(const source_t *s, const channel_conf_t ch[SOURCE_MAX_CHANNELS],
+                        reading_cb cb, void *arg)
+{
+   int i;
+
+   if ((i = source_single(s, ch)) < 0)
+      return telegram_exit();
+   if (telegram_init(ch[i].conf.serial.device, i+1, cb, arg) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Unable to open %s, retrying in the background\n",
+             ch[i].conf.serial.device);
+      return -1;
+   }
+   return 0;
+}
+
+static int serial_stop(void)
+{
+   return telegram_exit();
+}
+
+static const source_t sources[] =
+{
+   { "gpio",   1,                 gpio_config,          gpio_start,   gpio_stop,   gpio_wall_clock },
+   { "replay", REPLAY_MAX,        replay_source_config, replay_start, replay_stop, replay_wall_clock },
+   { "modbus", MODBUS_MAX_METERS, modbus_source_config, modbus_start, modbus_stop, NULL },
+   { "serial", 1,                 serial_config,        serial_start, serial_stop, NULL },
+};
+
+#define NUM_SOURCES (sizeof(sources)/sizeof(sources[0]))
+
+
+/**********************************************************
+ * Internal function: source_changed()
+ *
+ * Description:
+ *           Check if the channels of a source changed
+ *
+ * Returns:  1 if changed, 0 otherwise
+ *********************************************************/
+static int source_changed(const source_t *s, const channel_conf_t old[SOURCE_MAX_CHANNELS],
+                          const channel_conf_t ch[SOURCE_MAX_CHANNELS])
+{
+   int i;
+
+   for (i = 0; i < SOURCE_MAX_CHANNELS; i++)
+   {
+      if ((old[i].source == s || ch[i].source == s) &&
+          memcmp(&old[i], &ch[i], sizeof(ch[i])) != 0)
+         return 1;
+   }
+   return 0;
+}
+
+
+/**********************************************************
+ * Public function: source_find()
+ *
+ * Description:
+ *           Look up an input source by name ("gpio",
+ *           "replay", "modbus" or "serial")
+ *
+ * Returns:  pointer to the source, NULL if unknown
+ *********************************************************/
+const source_t *source_find(const char *name)
+{
+   unsigned int i;
+
+   for (i = 0; i < NUM_SOURCES; i++)
+   {
+      if (strcmp(sources[i].name, name) == 0)
+         return &sources[i];
+   }
+   return NULL;
+}
+
+/**********************************************************
+ * Public function: source_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a [channelN] section.
+ *           The source must be selected first, with
+ *           "source = <name>", the other parameters are
+ *           passed to it (except feed_counters, whose
+ *           default is up to the caller).
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int source_config(channel_conf_t *ch, const char *name, const char *value)
+{
+   if (strcmp(name, "source") == 0)
+   {
+      if (ch->source != NULL || (ch->source = source_find(value)) == NULL)
+         return -1;
+      return 0;
+   }
+   if (ch->source == NULL)
+      return -2;
+   if (strcmp(name, "feed_counters") == 0)
+   {
+      ch->feed_counters = atoi(value);
+      return 0;
+   }
+   return ch->source->config(&ch->conf, name, value);
+}
+
+/**********************************************************
+ * Public function: source_check()
+ *
+ * Description:
+ *           Check that no source is selected by more
+ *           channels than it can serve (the pulse input and
+ *           the telegram reader serve a single channel).
+ *           The channels in excess are disabled.
+ *
+ * Returns:  0 on success, <0 if channels were disabled
+ *********************************************************/
+int source_check(channel_conf_t ch[SOURCE_MAX_CHANNELS])
+{
+   unsigned int n[NUM_SOURCES];
+   unsigned int i;
+   unsigned int k;
+   int res = 0;
+
+   memset(n, 0, sizeof(n));
+   for (i = 0; i < SOURCE_MAX_CHANNELS; i++)
+   {
+      if (ch[i].source == NULL)
+         continue;
+      k = ch[i].source - sources;
+      if (++n[k] > sources[k].max_channels)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Channel %u disabled: the %s source serves at most %u channel%s\n",
+                i+1, sources[k].name, sources[k].max_channels, (sources[k].max_channels > 1) ? "s" : "");
+         ch[i].source = NULL;
+         res = -1;
+      }
+   }
+   return res;
+}
+
+/**********************************************************
+ * Public function: source_wall_clock()
+ *
+ * Description:
+ *           Check if the readings of the channels feeding
+ *           the counters are time stamped by the wall clock
+ *           (not by a replay at speed 0 or GPIO edges in
+ *           virtual time)
+ *
+ * Returns:  1 if so, 0 otherwise
+ *********************************************************/
+int source_wall_clock(const channel_conf_t ch[SOURCE_MAX_CHANNELS])
+{
+   unsigned int i;
+
+   for (i = 0; i < SOURCE_MAX_CHANNELS; i++)
+   {
+      if (ch[i].source == NULL || !ch[i].feed_counters || ch[i].source->wall_clock == NULL)
+         continue;
+      if (!ch[i].source->wall_clock(&ch[i].conf))
+         return 0;
+   }
+   return 1;
+}
+
+/**********************************************************
+ * Public function: source_init()
+ *
+ * Description:
+ *           Start all input sources, each with the channels
+ *           using it. The readings are passed to the
+ *           callback. Needs the event loop.
+ *
+ * Returns:  0 on success, <0 if a source failed to start
+ *********************************************************/
+int source_init(const channel_conf_t ch[SOURCE_MAX_CHANNELS], reading_cb cb, void *arg)
+{
+   unsigned int i;
+   int res = 0;
+
+   for (i = 0; i < NUM_SOURCES; i++)
+   {
+      if (sources[i].start(&sources[i], ch, cb, arg) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Unable to start the %s input\n", sources[i].name);
+         res = -1;
+      }
+   }
+   return res;
+}
+
+/**********************************************************
+ * Public function: source_reload()
+ *
+ * Description:
+ *           Restart the input sources whose channels changed
+ *           from the old configuration
+ *
+ * Returns:  number of restarted sources
+ *********************************************************/
+int source_reload(const channel_conf_t old[SOURCE_MAX_CHANNELS],
+                  const channel_conf_t ch[SOURCE_MAX_CHANNELS], reading_cb cb, void *arg)
+{
+   unsigned int i;
+   int n = 0;
+
+   for (i = 0; i < NUM_SOURCES; i++)
+   {
+      if (!source_changed(&sources[i], old, ch))
+         continue;
+
+      syslog(LOG_DAEMON | LOG_NOTICE, "Channels of the %s input changed, restarting it\n", sources[i].name);
+      sources[i].stop();
+      if (sources[i].start(&sources[i], ch, cb, arg) < 0)
+         syslog(LOG_DAEMON | LOG_WARNING, "Unable to start the %s input\n", sources[i].name);
+      n++;
+   }
+   return n;
+}
+
+/**********************************************************
+ * Public function: source_exit()
+ *
+ * Description:
+ *           Stop all input sources
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int source_exit(void)
+{
+   unsigned int i;
+
+   for (i = 0; i < NUM_SOURCES; i++)
+      sources[i].stop();
+   return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Energy Monitor: input sources of the measurement channels
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __SOURCE_H__
+#define __SOURCE_H__
+
+#include "reading.h"
+#include "pulse.h"
+#include "replay.h"
+#include "modbus.h"
+#include "telegram.h"
+
+/* Max number of channels ([channel1] ... [channel8]) */
+#define SOURCE_MAX_CHANNELS 8
+
+/* Parameters of a channel, interpreted by its source */
+typedef union
+{
+   pulse_conf_t gpio;
+   replay_conf_t replay;
+   modbus_conf_t modbus;
+   telegram_conf_t serial;
+} source_conf_t;
+
+typedef struct source source_t;
+
+/* Configuration of a channel */
+typedef struct
+{
+   const source_t *source;        /* NULL if the channel is not used */
+   int feed_counters;             /* book the readings to the counters */
+   source_conf_t conf;
+} channel_conf_t;
+
+/* Input source, delivers the readings of all channels using it */
+struct source
+{
+   const char *name;
+   unsigned int max_channels;     /* channels the source can serve */
+   int (*config)(source_conf_t *conf, const char *name, const char *value);
+   int (*start)(const source_t *s, const channel_conf_t ch[SOURCE_MAX_CHANNELS], reading_cb cb, void *arg);
+   int (*stop)(void);
+   int (*wall_clock)(const source_conf_t *conf);  /* NULL if always time stamped now */
+};
+
+/**********************************************************
+ * Public function: source_find()
+ *
+ * Description:
+ *           Look up an input source by name ("gpio",
+ *           "replay", "modbus" or "serial")
+ *
+ * Returns:  pointer to the source, NULL if unknown
+ *********************************************************/
+const source_t *source_find(const char *name);
+
+/**********************************************************
+ * Public function: source_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a [channelN] section.
+ *           The source must be selected first, with
+ *           "source = <name>", the other parameters are
+ *           passed to it (except feed_counters, whose
+ *           default is up to the caller).
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int source_config(channel_conf_t *ch, const char *name, const char *value);
+
+/**********************************************************
+ * Public function: source_check()
+ *
+ * Description:
+ *           Check that no source is selected by more
+ *           channels than it can serve (the pulse input and
+ *           the telegram reader serve a single channel).
+ *           The channels in excess are disabled.
+ *
+ * Returns:  0 on success, <0 if channels were disabled
+ *********************************************************/
+int source_check(channel_conf_t ch[SOURCE_MAX_CHANNELS]);
+
+/**********************************************************
+ * Public function: source_wall_clock()
+ *
+ * Description:
+ *           Check if the readings of the channels feeding
+ *           the counters are time stamped by the wall clock
+ *           (not by a replay at speed 0 or GPIO edges in
+ *           virtual time)
+ *
+ * Returns:  1 if so, 0 otherwise
+ *********************************************************/
+int source_wall_clock(const channel_conf_t ch[SOURCE_MAX_CHANNELS]);
+
+/**********************************************************
+ * Public function: source_init()
+ *
+ * Description:
+ *           Start all input sources, each with the channels
+ *           using it. The readings are passed to the
+ *           callback. Needs the event loop.
+ *
+ * Returns:  0 on success, <0 if a source failed to start
+ *********************************************************/
+int source_init(const channel_conf_t ch[SOURCE_MAX_CHANNELS], reading_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: source_reload()
+ *
+ * Description:
+ *           Restart the input sources whose channels changed
+ *           from the old configuration
+ *
+ * Returns:  number of restarted sources
+ *********************************************************/
+int source_reload(const channel_conf_t old[SOURCE_MAX_CHANNELS],
+                  const channel_conf_t ch[SOURCE_MAX_CHANNELS], reading_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: source_exit()
+ *
+ * Description:
+ *           Stop all input sources
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int source_exit(void);
+
+#endif /* __SOURCE_H__ */
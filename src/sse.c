@@ -0,0 +1,637 @@
+/*
+ * Energy Monitor: live stream of measurements (Server-Sent Events)
+ *
+ * Description:
+ *   Minimal embedded HTTP server which answers GET /events with a
+ *   text/event-stream and pushes every published event to all
+ *   connected clients (e.g. dashboards using EventSource). Other
+ *   paths can be registered as resources, which answer with a JSON
+ *   document created on request.
+ *
+ *   Events are formatted only once into a shared ring buffer. Each
+ *   client keeps its own read position in the ring, so the backlog
+ *   per client is bounded by the ring size. A client which falls
+ *   more than a full ring behind loses the oldest events and
+ *   continues with the most recent ones.
+ *
+ *   All socket handling runs in the event loop thread, publishing
+ *   is possible from any thread.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#define _GNU_SOURCE             /* accept4() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "evloop.h"
+#include "bench.h"
+#include "ratelog.h"
+#include "sse.h"
+
+/* Uncomment this to enable debug mode */
+//#define DEBUG
+
+#ifdef DEBUG
+#define _debug(x, args...)  syslog(LOG_DAEMON | LOG_DEBUG, "" x, ##args)
+#else
+#define _debug(x, args...)
+#endif
+
+/* Max number of connected clients */
+#define SSE_MAX_CLIENTS 32
+
+/* Number of events buffered for slow clients */
+#define SSE_RING_SIZE 64
+
+/* Max size of one formatted event */
+#define SSE_MSG_SIZE 256
+
+/* Max size of the HTTP request header */
+#define SSE_REQ_SIZE 512
+
+/* Max number of resources and max size of a resource document */
+#define SSE_MAX_RESOURCES 4
+#define SSE_DOC_SIZE 4096
+
+/* Interval of keepalive comments (in ms) */
+#define SSE_KEEPALIVE_MS 15000
+
+#define SSE_HTTP_OK \
+   "HTTP/1.1 200 OK\r\n" \
+   "Content-Type: text/event-stream\r\n" \
+   "Cache-Control: no-cache\r\n" \
+   "Connection: keep-alive\r\n" \
+   "Access-Control-Allow-Origin: *\r\n" \
+   "\r\n" \
+   "retry: 2000\n\n"
+
+#define SSE_HTTP_JSON \
+   "HTTP/1.1 200 OK\r\n" \
+   "Content-Type: application/json\r\n" \
+   "Content-Length: %d\r\n" \
+   "Cache-Control: no-cache\r\n" \
+   "Connection: close\r\n" \
+   "Access-Control-Allow-Origin: *\r\n" \
+   "\r\n"
+
+#define SSE_HTTP_NOT_FOUND \
+   "HTTP/1.1 404 Not Found\r\n" \
+   "Content-Length: 0\r\n" \
+   "Connection: close\r\n" \
+   "\r\n"
+
+typedef struct
+{
+   int len;
+   char data[SSE_MSG_SIZE];
+} sse_msg_t;
+
+typedef struct
+{
+   int fd;
+   int streaming;               /* request received, sending events */
+   int closing;                 /* close after output is sent */
+   char req[SSE_REQ_SIZE];
+   int req_len;
+   char msg[SSE_MSG_SIZE];      /* event currently being sent */
+   char *doc;                   /* resource document being sent */
+   char *out;                   /* msg or doc */
+   int out_len;
+   int out_off;
+   unsigned long cursor;        /* sequence number of next event */
+   unsigned long dropped;
+} sse_client_t;
+
+static int listen_fd = -1;
+static int keepalive_timer = 0;
+static sse_client_t clients[SSE_MAX_CLIENTS];
+
+/* Registered resources */
+static struct
+{
+   const char *path;
+   sse_resource_cb cb;
+} resources[SSE_MAX_RESOURCES];
+static int num_resources = 0;
+
+/* Shared event ring, protected by ring_lock */
+static sse_msg_t ring[SSE_RING_SIZE];
+static unsigned long ring_head = 0;
+static int wake_pending = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Events which do not fit into a ring slot */
+static ratelog_t drop_log = RATELOG_INIT("sse_too_long", "SSE events too long", "length", "bytes");
+
+
+/**********************************************************
+ * Internal function: sse_client_close()
+ *
+ * Description:
+ *           Close a client connection and free its slot
+ *
+ * Returns:  -
+ *********************************************************/
+static void sse_client_close(sse_client_t *c)
+{
+   if (c->dropped)
+   {
+      syslog(LOG_DAEMON | LOG_INFO, "SSE client disconnected, %lu events dropped (slow client)\n",
+             c->dropped);
+   }
+   ev_del_fd(c->fd);
+   close(c->fd);
+   free(c->doc);
+   memset(c, 0, sizeof(*c));
+   c->fd = -1;
+}
+
+/**********************************************************
+ * Internal function: sse_client_flush()
+ *
+ * Description:
+ *           Send as much pending data to a client as the
+ *           socket accepts without blocking
+ *
+ * Returns:  -
+ *********************************************************/
+static void sse_client_flush(sse_client_t *c)
+{
+   ssize_t n;
+
+   while (1)
+   {
+      if (c->out_off == c->out_len)
+      {
+         c->out_off = c->out_len = 0;
+
+         if (c->closing)
+         {
+            sse_client_close(c);
+            return;
+         }
+         if (!c->streaming)
+            break;
+
+         /* Fetch next event from the ring, drop oldest if behind */
+         pthread_mutex_lock(&ring_lock);
+         if (c->cursor == ring_head)
+         {
+            pthread_mutex_unlock(&ring_lock);
+            break;
+         }
+         if (ring_head - c->cursor > SSE_RING_SIZE)
+         {
+            c->dropped += ring_head - c->cursor - SSE_RING_SIZE;
+            c->cursor = ring_head - SSE_RING_SIZE;
+         }
+         c->out_len = ring[c->cursor % SSE_RING_SIZE].len;
+         memcpy(c->out, ring[c->cursor % SSE_RING_SIZE].data, c->out_len);
+         c->cursor++;
+         pthread_mutex_unlock(&ring_lock);
+      }
+
+      n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+               MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+         _debug("SSE client write error: %s", strerror(errno));
+         sse_client_close(c);
+         return;
+      }
+      c->out_off += n;
+   }
+
+   /* Only watch for writability while output is pending */
+   ev_mod_fd(c->fd, EV_READ | ((c->out_off < c->out_len) ? EV_WRITE : 0));
+}
+
+/**********************************************************
+ * Internal function: sse_client_request()
+ *
+ * Description:
+ *           Handle a complete HTTP request header
+ *
+ * Returns:  -
+ *********************************************************/
+static void sse_client_request(sse_client_t *c)
+{
+   size_t len;
+   int hdr, n, i;
+
+   c->out = c->msg;
+
+   /* Registered resources */
+   for (i=0; i<num_resources; i++)
+   {
+      len = strlen(resources[i].path);
+      if (!strncmp(c->req, "GET ", 4) && !strncmp(c->req+4, resources[i].path, len) &&
+          (c->req[4+len] == ' ' || c->req[4+len] == '?'))
+         break;
+   }
+   if (i < num_resources && (c->doc = malloc(SSE_DOC_SIZE)) != NULL)
+   {
+      /* Create the document after space for the header, then
+       * put the header right in front of it */
+      n = resources[i].cb(c->doc+256, SSE_DOC_SIZE-256);
+      if (n >= 0)
+      {
+         char header[256];
+
+         hdr = snprintf(header, sizeof(header), SSE_HTTP_JSON, n);
+         memcpy(c->doc+256-hdr, header, hdr);
+         c->out = c->doc+256-hdr;
+         c->out_len = hdr+n;
+         c->out_off = 0;
+         c->closing = 1;
+         return;
+      }
+      syslog(LOG_DAEMON | LOG_WARNING, "Unable to create resource %s\n", resources[i].path);
+      free(c->doc);
+      c->doc = NULL;
+   }
+
+   if (!strncmp(c->req, "GET /events ", 12) ||
+       !strncmp(c->req, "GET /events?", 12) ||
+       !strncmp(c->req, "GET / ", 6))
+   {
+      c->streaming = 1;
+      c->out_len = strlen(SSE_HTTP_OK);
+      memcpy(c->out, SSE_HTTP_OK, c->out_len);
+
+      /* New clients start with the next event */
+      pthread_mutex_lock(&ring_lock);
+      c->cursor = ring_head;
+      pthread_mutex_unlock(&ring_lock);
+      _debug("SSE client connected on fd %d", c->fd);
+   }
+   else
+   {
+      c->closing = 1;
+      c->out_len = strlen(SSE_HTTP_NOT_FOUND);
+      memcpy(c->out, SSE_HTTP_NOT_FOUND, c->out_len);
+   }
+   c->out_off = 0;
+}
+
+/**********************************************************
+ * Internal function: sse_client_cb()
+ *
+ * Description:
+ *           Event loop callback for client connections
+ *
+ * Returns:  -
+ *********************************************************/
+static void sse_client_cb(int fd, unsigned int events, void *arg)
+{
+   sse_client_t *c = (sse_client_t*)arg;
+   char buf[SSE_REQ_SIZE];
+   ssize_t n;
+
+   if (events & EV_READ)
+   {
+      n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+      {
+         sse_client_close(c);
+         return;
+      }
+
+      /* Anything sent after the request header is ignored */
+      if (n > 0 && !c->streaming && !c->closing)
+      {
+         if (c->req_len + n >= SSE_REQ_SIZE)
+         {
+            sse_client_close(c);
+            return;
+         }
+         memcpy(c->req + c->req_len, buf, n);
+         c->req_len += n;
+         c->req[c->req_len] = '\0';
+
+         if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n"))
+            sse_client_request(c);
+      }
+   }
+   else if (events & EV_ERROR)
+   {
+      sse_client_close(c);
+      return;
+   }
+
+   sse_client_flush(c);
+}
+
+/**********************************************************
+ * Internal function: sse_accept_cb()
+ *
+ * Description:
+ *           Event loop callback for the listening socket
+ *
+ * Returns:  -
+ *********************************************************/
+static void sse_accept_cb(int fd, unsigned int events, void *arg)
+{
+   int cfd;
+   int i;
+
+   while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+   {
+      for (i=0; i<SSE_MAX_CLIENTS; i++)
+      {
+         if (clients[i].fd < 0)
+            break;
+      }
+      if (i == SSE_MAX_CLIENTS)
+      {
+         syslog(LOG_DAEMON | LOG_WARNING, "Too many SSE clients, rejecting connection\n");
+         close(cfd);
+         continue;
+      }
+
+      memset(&clients[i], 0, sizeof(clients[i]));
+      clients[i].fd = cfd;
+      if (ev_add_fd(cfd, EV_READ, sse_client_cb, &clients[i]) < 0)
+      {
+         close(cfd);
+         clients[i].fd = -1;
+      }
+   }
+}
+
+/**********************************************************
+ * Internal function: sse_flush_all()
+ *
+ * Description:
+ *           Push new events to all streaming clients
+ *           (runs in the event loop thread)
+ *
+ * Returns:  -
+ *********************************************************/
+static void sse_flush_all(void *arg)
+{
+   int i;
+
+   pthread_mutex_lock(&ring_lock);
+   wake_pending = 0;
+   pthread_mutex_unlock(&ring_lock);
+
+   for (i=0; i<SSE_MAX_CLIENTS; i++)
+   {
+      /* Clients with pending output are flushed on EV_WRITE */
+      if (clients[i].fd >= 0 && clients[i].streaming &&
+          clients[i].out_off == clients[i].out_len)
+      {
+         sse_client_flush(&clients[i]);
+         BENCH_STAGE(BENCH_SSE, NULL);
+      }
+   }
+}
+
+/**********************************************************
+ * Internal function: sse_ring_put()
+ *
+ * Description:
+ *           Format an event into the shared ring and wake up
+ *           the event loop if needed. A NULL event name
+ *           produces a comment line.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int sse_ring_put(const char *event, const char *data)
+{
+   sse_msg_t *m;
+   int wake;
+
+   pthread_mutex_lock(&ring_lock);
+   m = &ring[ring_head % SSE_RING_SIZE];
+   if (event != NULL)
+   {
+      /* Event ids are informational only (no replay on reconnect) */
+      m->len = snprintf(m->data, SSE_MSG_SIZE, "id: %lu\nevent: %s\ndata: %s\n\n",
+                        ring_head, event, data);
+   }
+   else
+   {
+      m->len = snprintf(m->data, SSE_MSG_SIZE, ":%s\n\n", data);
+   }
+   if (m->len <= 0 || m->len >= SSE_MSG_SIZE)
+   {
+      pthread_mutex_unlock(&ring_lock);
+      return -1;
+   }
+   ring_head++;
+   wake = !wake_pending;
+   wake_pending = 1;
+   pthread_mutex_unlock(&ring_lock);
+
+   if (wake && ev_post(sse_flush_all, NULL) < 0)
+   {
+      pthread_mutex_lock(&ring_lock);
+      wake_pending = 0;
+      pthread_mutex_unlock(&ring_lock);
+      return -2;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: sse_keepalive()
+ *
+ * Description:
+ *           Send a comment line periodically so that proxies
+ *           keep the connection open and dead clients are
+ *           detected
+ *
+ * Returns:  -
+ *********************************************************/
+static void sse_keepalive(void *arg)
+{
+   sse_ring_put(NULL, "");
+   keepalive_timer = ev_timer_add(SSE_KEEPALIVE_MS, sse_keepalive, NULL);
+}
+
+
+/**********************************************************
+ * Public function: sse_init()
+ *
+ * Description:
+ *           Start the embedded HTTP server which streams
+ *           measurements to clients on GET /events
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int sse_init(unsigned short port)
+{
+   struct sockaddr_in6 addr6;
+   struct sockaddr_in addr;
+   int on = 1;
+   int off = 0;
+   int i;
+
+   for (i=0; i<SSE_MAX_CLIENTS; i++)
+      clients[i].fd = -1;
+
+   /* Prefer a dual stack IPv6 socket, fall back to IPv4 only */
+   if ((listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) >= 0)
+   {
+      setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+      memset(&addr6, 0, sizeof(addr6));
+      addr6.sin6_family = AF_INET6;
+      addr6.sin6_addr = in6addr_any;
+      addr6.sin6_port = htons(port);
+      if (bind(listen_fd, (struct sockaddr*)&addr6, sizeof(addr6)) < 0)
+      {
+         close(listen_fd);
+         listen_fd = -1;
+      }
+   }
+
+   if (listen_fd < 0)
+   {
+      if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "SSE server: unable to create socket: %s\n", strerror(errno));
+         return -1;
+      }
+      setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      addr.sin_port = htons(port);
+      if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "SSE server: unable to bind port %u: %s\n",
+                port, strerror(errno));
+         close(listen_fd);
+         listen_fd = -1;
+         return -2;
+      }
+   }
+
+   if (listen(listen_fd, 8) < 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "SSE server: unable to listen on port %u: %s\n",
+             port, strerror(errno));
+      close(listen_fd);
+      listen_fd = -1;
+      return -2;
+   }
+
+   if (ev_add_fd(listen_fd, EV_READ, sse_accept_cb, NULL) < 0)
+   {
+      close(listen_fd);
+      listen_fd = -1;
+      return -3;
+   }
+
+   keepalive_timer = ev_timer_add(SSE_KEEPALIVE_MS, sse_keepalive, NULL);
+   ratelog_register(&drop_log);
+
+   syslog(LOG_DAEMON | LOG_INFO, "SSE server listening on port %u\n", port);
+   return 0;
+}
+
+/**********************************************************
+ * Public function: sse_resource()
+ *
+ * Description:
+ *           Serve a JSON document on GET path (e.g.
+ *           "/profile"), created by the callback for each
+ *           request
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int sse_resource(const char *path, sse_resource_cb cb)
+{
+   if (num_resources == SSE_MAX_RESOURCES || path == NULL || path[0] != '/')
+   {
+      return -1;
+   }
+
+   resources[num_resources].path = path;
+   resources[num_resources].cb = cb;
+   num_resources++;
+   return 0;
+}
+
+/**********************************************************
+ * Public function: sse_exit()
+ *
+ * Description:
+ *           Close all client connections and the server
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int sse_exit(void)
+{
+   int i;
+
+   if (listen_fd < 0)
+      return -1;
+
+   ev_timer_cancel(keepalive_timer);
+   for (i=0; i<SSE_MAX_CLIENTS; i++)
+   {
+      if (clients[i].fd >= 0)
+         sse_client_close(&clients[i]);
+   }
+   ev_del_fd(listen_fd);
+   close(listen_fd);
+   listen_fd = -1;
+   return 0;
+}
+
+/**********************************************************
+ * Public function: sse_publish()
+ *
+ * Description:
+ *           Queue an event (name and printf-like formatted
+ *           data) for all connected clients. May be called
+ *           from any thread, never blocks on clients.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int sse_publish(const char *event, const char *format, ...)
+{
+   char data[SSE_MSG_SIZE];
+   va_list ap;
+   int len;
+   int rc;
+
+   /* Nothing to do if the server is disabled */
+   if (listen_fd < 0)
+      return -1;
+
+   va_start(ap, format);
+   len = vsnprintf(data, sizeof(data), format, ap);
+   va_end(ap);
+   if (len >= 0 && len < sizeof(data))
+   {
+      if ((rc = sse_ring_put(event, data)) != -1)
+         return rc;
+   }
+
+   /* The data (or the data with the event id and name) is too long */
+   if (ratelog_event(&drop_log, len))
+      syslog(LOG_DAEMON | LOG_WARNING, "SSE event %s too long (%d bytes), dropped\n", event, len);
+   return -2;
+}
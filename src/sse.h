@@ -0,0 +1,63 @@
+/*
+ * Energy Monitor: live stream of measurements (Server-Sent Events)
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __SSE_H__
+#define __SSE_H__
+
+#include <stddef.h>
+
+/* Callback which writes the JSON document of a resource into buf,
+ * returns its length or <0 on error (runs in the event loop thread) */
+typedef int (*sse_resource_cb)(char *buf, size_t size);
+
+/**********************************************************
+ * Public function: sse_init()
+ *
+ * Description:
+ *           Start the embedded HTTP server which streams
+ *           measurements to clients on GET /events
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int sse_init(unsigned short port);
+
+/**********************************************************
+ * Public function: sse_exit()
+ *
+ * Description:
+ *           Close all client connections and the server
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int sse_exit(void);
+
+/**********************************************************
+ * Public function: sse_publish()
+ *
+ * Description:
+ *           Queue an event (name and printf-like formatted
+ *           data) for all connected clients. May be called
+ *           from any thread, never blocks on clients.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int sse_publish(const char *event, const char *format, ...)
+   __attribute__ ((format (printf, 2, 3)));
+
+/**********************************************************
+ * Public function: sse_resource()
+ *
+ * Description:
+ *           Serve a JSON document on GET path (e.g.
+ *           "/profile"), created by the callback for each
+ *           request
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int sse_resource(const char *path, sse_resource_cb cb);
+
+#endif /* __SSE_H__ */
@@ -0,0 +1,218 @@
+/*
+ * Energy Monitor: counters and latencies of the processing stages
+ *
+ * Description:
+ *   To find out where data gets lost or late (input, filters, LCD or
+ *   upload), each channel counts the edges seen, the readings of its
+ *   source, the pulses (or readings of meters) accepted and the
+ *   rejections per reason, and the latencies along the processing
+ *   are collected in histograms with log2 buckets (in us, hist.c).
+ *
+ *   The latency of an output is the time from the first update of
+ *   the counters it did not send yet, so it includes its refresh or
+ *   update rate.
+ *
+ *   All values are updated with atomic operations of the native word
+ *   size, cheap enough to be always on. The latencies use 32 bit us
+ *   time stamps, so they must be below 71 minutes.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "source.h"
+#include "hist.h"
+#include "stats.h"
+
+static const char *counter_names[STATS_COUNTERS] =
+{
+   "edges", "readings", "accepted", "glitch", "length", "max_power"
+};
+
+static const char *hist_names[STATS_HISTS] =
+{
+   "edge_process", "process_lcd", "process_upload", "http"
+};
+
+static unsigned long counters[SOURCE_MAX_CHANNELS][STATS_COUNTERS];
+static hist_t hists[STATS_HISTS];
+
+/* Time stamp (us) of the first update not sent by the output, 0 if none */
+static unsigned long pending[STATS_HISTS];
+
+
+/**********************************************************
+ * Internal function: stats_now()
+ *
+ * Description:
+ *           Current time of the monotonic clock
+ *
+ * Returns:  time (in us, modulo the word size, never 0)
+ *********************************************************/
+static unsigned long stats_now(void)
+{
+   struct timespec ts;
+   unsigned long us;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   us = (unsigned long)ts.tv_sec*1000000UL + ts.tv_nsec/1000;
+   return us ? us : 1;
+}
+
+
+/**********************************************************
+ * Public function: stats_count()
+ *
+ * Description:
+ *           Add n to a counter of the channel (0 based).
+ *           Lock free, may be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_count(unsigned int ch, unsigned int counter, unsigned long n)
+{
+   if (ch < SOURCE_MAX_CHANNELS && counter < STATS_COUNTERS)
+      __atomic_fetch_add(&counters[ch][counter], n, __ATOMIC_RELAXED);
+}
+
+/**********************************************************
+ * Public function: stats_time()
+ *
+ * Description:
+ *           Add a latency (in us) to the histogram. Lock
+ *           free, may be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_time(unsigned int hist, unsigned long us)
+{
+   if (hist < STATS_HISTS)
+      hist_add(&hists[hist], us);
+}
+
+/**********************************************************
+ * Public function: stats_since()
+ *
+ * Description:
+ *           Add the latency from ts (CLOCK_REALTIME) until
+ *           now to the histogram
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_since(unsigned int hist, const struct timespec *ts)
+{
+   struct timespec now;
+   long long us;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+   us = (long long)(now.tv_sec - ts->tv_sec)*1000000 + (now.tv_nsec - ts->tv_nsec)/1000;
+
+   /* Readings stamped in the future (e.g. by a replay) count as 0 */
+   stats_time(hist, (us > 0) ? (unsigned long)us : 0);
+}
+
+/**********************************************************
+ * Public function: stats_processed()
+ *
+ * Description:
+ *           The counters were updated, the outputs start
+ *           waiting unless they still wait for a previous
+ *           update
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_processed(void)
+{
+   unsigned long now = stats_now();
+   unsigned long none;
+   unsigned int i;
+
+   for (i = 0; i < STATS_HISTS; i++)
+   {
+      none = 0;
+      if (STATS_OUTPUTS & (1 << i))
+         __atomic_compare_exchange_n(&pending[i], &none, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+   }
+}
+
+/**********************************************************
+ * Public function: stats_output()
+ *
+ * Description:
+ *           An output (STATS_PROCESS_LCD or _UPLOAD) sent
+ *           the data, add the time it waited since the
+ *           counters were updated
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_output(unsigned int hist)
+{
+   unsigned long since;
+
+   if (hist >= STATS_HISTS)
+      return;
+   since = __atomic_exchange_n(&pending[hist], 0, __ATOMIC_RELAXED);
+   if (since != 0)
+      stats_time(hist, stats_now() - since);
+}
+
+/**********************************************************
+ * Public function: stats_json()
+ *
+ * Description:
+ *           Format the counters of the channels which saw
+ *           any input and the latencies as JSON members
+ *           "channels" and "latency_us"
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int stats_json(char *buf, size_t size)
+{
+   unsigned long value[STATS_COUNTERS];
+   unsigned long any;
+   hist_t h;
+   int n;
+   unsigned int ch;
+   unsigned int i;
+   size_t len;
+   int first = 1;
+
+   len = snprintf(buf, size, "\"channels\":[");
+   for (ch = 0; ch < SOURCE_MAX_CHANNELS && len < size; ch++)
+   {
+      for (i = 0, any = 0; i < STATS_COUNTERS; i++)
+      {
+         value[i] = __atomic_load_n(&counters[ch][i], __ATOMIC_RELAXED);
+         any |= value[i];
+      }
+      if (!any)
+         continue;
+
+      len += snprintf(buf+len, size-len, "%s{\"channel\":%u", first ? "" : ",", ch+1);
+      for (i = 0; i < STATS_COUNTERS && len < size; i++)
+         len += snprintf(buf+len, size-len, ",\"%s\":%lu", counter_names[i], value[i]);
+      if (len < size)
+         len += snprintf(buf+len, size-len, "}");
+      first = 0;
+   }
+
+   if (len < size)
+      len += snprintf(buf+len, size-len, "],\"latency_us\":{");
+   for (i = 0; i < STATS_HISTS && len < size; i++)
+   {
+      len += snprintf(buf+len, size-len, "%s\"%s\":{", i ? "," : "", hist_names[i]);
+      hist_copy(&h, &hists[i]);
+      if (len >= size || (n = hist_json(buf+len, size-len, &h)) < 0)
+         return -1;
+      len += n;
+      if (len < size)
+         len += snprintf(buf+len, size-len, "}");
+   }
+   if (len < size)
+      len += snprintf(buf+len, size-len, "}");
+
+   return (len < size) ? (int)len : -1;
+}
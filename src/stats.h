@@ -0,0 +1,108 @@
+/*
+ * Energy Monitor: counters and latencies of the processing stages
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <time.h>
+
+/* Counters per channel */
+enum
+{
+   STATS_EDGES,         /* edges seen on the input (GPIO) */
+   STATS_READINGS,      /* readings delivered by the source */
+   STATS_ACCEPTED,      /* pulses, or readings without pulses, booked to the counters */
+   STATS_GLITCH,        /* pulses rejected as too close */
+   STATS_LENGTH,        /* pulses rejected for their length */
+   STATS_MAX_POWER,     /* pulses or readings rejected above max_power */
+   STATS_COUNTERS
+};
+
+/* Latencies */
+enum
+{
+   STATS_EDGE_PROCESS,  /* edge (or reading) to counters updated */
+   STATS_PROCESS_LCD,   /* counters updated to frame sent to the LCD */
+   STATS_PROCESS_UPLOAD,/* counters updated to data sent to EmonCMS */
+   STATS_HTTP,          /* round trip of the EmonCMS request */
+   STATS_HISTS
+};
+
+/* Outputs waiting for updated counters */
+#define STATS_OUTPUTS ((1 << STATS_PROCESS_LCD) | (1 << STATS_PROCESS_UPLOAD))
+
+/**********************************************************
+ * Public function: stats_count()
+ *
+ * Description:
+ *           Add n to a counter of the channel (0 based).
+ *           Lock free, may be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_count(unsigned int ch, unsigned int counter, unsigned long n);
+
+/**********************************************************
+ * Public function: stats_time()
+ *
+ * Description:
+ *           Add a latency (in us) to the histogram. Lock
+ *           free, may be called from any thread.
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_time(unsigned int hist, unsigned long us);
+
+/**********************************************************
+ * Public function: stats_since()
+ *
+ * Description:
+ *           Add the latency from ts (CLOCK_REALTIME) until
+ *           now to the histogram
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_since(unsigned int hist, const struct timespec *ts);
+
+/**********************************************************
+ * Public function: stats_processed()
+ *
+ * Description:
+ *           The counters were updated, the outputs start
+ *           waiting unless they still wait for a previous
+ *           update
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_processed(void);
+
+/**********************************************************
+ * Public function: stats_output()
+ *
+ * Description:
+ *           An output (STATS_PROCESS_LCD or _UPLOAD) sent
+ *           the data, add the time it waited since the
+ *           counters were updated
+ *
+ * Returns:  -
+ *********************************************************/
+void stats_output(unsigned int hist);
+
+/**********************************************************
+ * Public function: stats_json()
+ *
+ * Description:
+ *           Format the counters of the channels which saw
+ *           any input and the latencies as JSON members
+ *           "channels" and "latency_us"
+ *
+ * Returns:  length of the text, <0 on error
+ *********************************************************/
+int stats_json(char *buf, size_t size);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,298 @@
+/*
+ * Energy Monitor: appliance on/off detection
+ *
+ * Description:
+ *   Detects step changes of the power (a big load switching on or off)
+ *   with a two-sided CUSUM test on the power of the pulse intervals.
+ *   For a minimum step d the drift is d/2 and the decision threshold is
+ *   sensitivity*d:
+ *
+ *     g+ = max(0, g+ + (x - level - d/2))    (step up)
+ *     g- = max(0, g- + (level - x - d/2))    (step down)
+ *
+ *   When g+ or g- exceeds the threshold, the new level is estimated as
+ *   the mean of the samples since the sum last left zero, and the step
+ *   size is the difference to the old level. The detector then restarts
+ *   from the new level. Everything is kept in a few running sums per
+ *   channel, so memory and time per pulse are constant.
+ *
+ *   Events are logged, streamed as "appliance" event to the SSE clients
+ *   and appended to a history file. Like the pulses (pulse.c), the
+ *   events are queued under a lock and written by the event loop
+ *   thread, woken up with ev_post() once per batch.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "evloop.h"
+#include "sse.h"
+#include "source.h"
+#include "steps.h"
+
+/* Max number of samples averaged for the reference level */
+#define STEPS_LEVEL_SAMPLES 32
+
+/* Number of events buffered for the history file */
+#define STEPS_RING_SIZE 16
+
+#define HISTORY_SIZE 128
+
+typedef struct
+{
+   struct timespec ts;
+   unsigned int channel;
+   int step;
+   unsigned int power;
+} step_event_t;
+
+/* Detector state of a channel */
+typedef struct
+{
+   int have_level;
+   double level;
+   unsigned int level_n;
+   double g_up;
+   double g_down;
+   double sum_up;
+   double sum_down;
+   unsigned int n_up;
+   unsigned int n_down;
+} steps_state_t;
+
+static double step_min = 0;
+static double threshold = 0;
+static char history[HISTORY_SIZE] = "";
+
+static steps_state_t state[SOURCE_MAX_CHANNELS];
+
+/* Protects the events waiting to be written to the history file */
+static pthread_mutex_t steps_lock = PTHREAD_MUTEX_INITIALIZER;
+static step_event_t queue[STEPS_RING_SIZE];
+static unsigned int queued = 0;
+static int flush_posted = 0;
+
+
+/**********************************************************
+ * Internal function: steps_flush()
+ *
+ * Description:
+ *           Append the buffered events to the history file
+ *           (in the event loop thread)
+ *
+ * Returns:  -
+ *********************************************************/
+static void steps_flush(void *arg)
+{
+   step_event_t batch[STEPS_RING_SIZE];
+   FILE *f = NULL;
+   unsigned int n;
+   unsigned int i;
+
+   pthread_mutex_lock(&steps_lock);
+   n = queued;
+   memcpy(batch, queue, n*sizeof(batch[0]));
+   queued = 0;
+   flush_posted = 0;
+   pthread_mutex_unlock(&steps_lock);
+
+   if (n == 0 || history[0] == '\0')
+      return;
+
+   if ((f = fopen(history, "ae")) == NULL)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to open appliance history %s: %s\n", history, strerror(errno));
+      return;
+   }
+
+   for (i = 0; i < n; i++)
+   {
+      fprintf(f, "%ld %s %d %u %u\n", (long)batch[i].ts.tv_sec, (batch[i].step > 0) ? "on" : "off",
+              abs(batch[i].step), batch[i].power, batch[i].channel);
+   }
+
+   fclose(f);
+}
+
+/**********************************************************
+ * Internal function: steps_event()
+ *
+ * Description:
+ *           Signal a detected step on a channel (0 based)
+ *
+ * Returns:  -
+ *********************************************************/
+static void steps_event(unsigned int ch, struct timespec ts, int step, unsigned int power)
+{
+   syslog(LOG_DAEMON | LOG_INFO, "Channel %u: appliance switched %s (%+d W, now %u W)\n",
+          ch+1, (step > 0) ? "on" : "off", step, power);
+
+   sse_publish("appliance", "{\"time\":%ld.%03ld,\"channel\":%u,\"state\":\"%s\",\"step\":%d,\"power\":%u}",
+               (long)ts.tv_sec, ts.tv_nsec/1000000, ch+1, (step > 0) ? "on" : "off", step, power);
+
+   /* Queue the event for the history file, dropped if the writer is
+    * too far behind */
+   pthread_mutex_lock(&steps_lock);
+   if (queued < STEPS_RING_SIZE)
+   {
+      queue[queued].ts = ts;
+      queue[queued].channel = ch+1;
+      queue[queued].step = step;
+      queue[queued].power = power;
+      queued++;
+   }
+   if (!flush_posted && ev_post(steps_flush, NULL) == 0)
+      flush_posted = 1;
+   pthread_mutex_unlock(&steps_lock);
+}
+
+/**********************************************************
+ * Internal function: steps_restart()
+ *
+ * Description:
+ *           Restart the detector of a channel at the given
+ *           level
+ *
+ * Returns:  -
+ *********************************************************/
+static void steps_restart(steps_state_t *s, double x)
+{
+   s->have_level = 1;
+   s->level = x;
+   s->level_n = 1;
+   s->g_up = 0;
+   s->g_down = 0;
+   s->sum_up = 0;
+   s->sum_down = 0;
+   s->n_up = 0;
+   s->n_down = 0;
+}
+
+
+/**********************************************************
+ * Public function: steps_init()
+ *
+ * Description:
+ *           Set up (or change) the step detector. Steps of
+ *           at least step_min W are detected, a step_min of
+ *           0 disables the detector. Higher sensitivity
+ *           values need more evidence (fewer false events,
+ *           longer delay). Events are appended to the
+ *           optional history file.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int steps_init(unsigned int min, unsigned int sensitivity, const char *hist)
+{
+   if (sensitivity == 0)
+      sensitivity = STEPS_SENSITIVITY;
+
+   step_min = min;
+   threshold = (double)min*sensitivity;
+   memset(state, 0, sizeof(state));
+
+   if (hist != NULL)
+   {
+      strncpy(history, hist, HISTORY_SIZE-1);
+      history[HISTORY_SIZE-1] = '\0';
+   }
+   else
+   {
+      history[0] = '\0';
+   }
+
+   return 0;
+}
+
+/**********************************************************
+ * Public function: steps_update()
+ *
+ * Description:
+ *           Feed the power of a pulse interval of a channel
+ *           (0 based) into its detector. Not reentrant, the
+ *           caller has to serialize calls.
+ *
+ * Returns:  +1 on a detected on step, -1 on an off step,
+ *           0 otherwise
+ *********************************************************/
+int steps_update(unsigned int ch, struct timespec ts, unsigned int power)
+{
+   steps_state_t *s;
+   double x = power;
+   double drift = step_min/2;
+   double new_level;
+   int step;
+
+   if (step_min == 0 || ch >= SOURCE_MAX_CHANNELS)
+      return 0;
+
+   s = &state[ch];
+   if (!s->have_level)
+   {
+      steps_restart(s, x);
+      return 0;
+   }
+
+   /* Accumulate the evidence for a step up and down */
+   s->g_up += x - s->level - drift;
+   if (s->g_up <= 0)
+   {
+      s->g_up = 0;
+      s->sum_up = 0;
+      s->n_up = 0;
+   }
+   else
+   {
+      s->sum_up += x;
+      s->n_up++;
+   }
+
+   s->g_down += s->level - x - drift;
+   if (s->g_down <= 0)
+   {
+      s->g_down = 0;
+      s->sum_down = 0;
+      s->n_down = 0;
+   }
+   else
+   {
+      s->sum_down += x;
+      s->n_down++;
+   }
+
+   if (s->g_up > threshold)
+   {
+      new_level = s->sum_up/s->n_up;
+      step = (int)(new_level - s->level + 0.5);
+      steps_restart(s, new_level);
+      steps_event(ch, ts, step, power);
+      return 1;
+   }
+   if (s->g_down > threshold)
+   {
+      new_level = s->sum_down/s->n_down;
+      step = (int)(new_level - s->level - 0.5);
+      steps_restart(s, new_level);
+      steps_event(ch, ts, step, power);
+      return -1;
+   }
+
+   /* No step, refine the reference level (running mean, limited
+    * window so slow drifts are followed) */
+   if (s->g_up == 0 && s->g_down == 0)
+   {
+      if (s->level_n < STEPS_LEVEL_SAMPLES)
+         s->level_n++;
+      s->level += (x - s->level)/s->level_n;
+   }
+
+   return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Energy Monitor: appliance on/off detection
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __STEPS_H__
+#define __STEPS_H__
+
+#include <time.h>
+
+/* Default sensitivity (decision threshold in multiples of step_min) */
+#define STEPS_SENSITIVITY 4
+
+/**********************************************************
+ * Public function: steps_init()
+ *
+ * Description:
+ *           Set up (or change) the step detector. Steps of
+ *           at least step_min W are detected, a step_min of
+ *           0 disables the detector. Higher sensitivity
+ *           values need more evidence (fewer false events,
+ *           longer delay). Events are appended to the
+ *           optional history file.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int steps_init(unsigned int step_min, unsigned int sensitivity, const char *history);
+
+/**********************************************************
+ * Public function: steps_update()
+ *
+ * Description:
+ *           Feed the power of a pulse interval of a channel
+ *           (0 based) into its detector. Not reentrant, the
+ *           caller has to serialize calls.
+ *
+ * Returns:  +1 on a detected on step, -1 on an off step,
+ *           0 otherwise
+ *********************************************************/
+int steps_update(unsigned int ch, struct timespec ts, unsigned int power);
+
+#endif /* __STEPS_H__ */
@@ -0,0 +1,369 @@
+/*
+ * Energy Monitor: time-of-use tariff
+ *
+ * Description:
+ *   The tariff schedule from the configuration file is compiled at load
+ *   time into a sorted list of switch points for each of the 12x7 day
+ *   types (month and weekday), so seasons and weekends are handled by a
+ *   direct table lookup. If a day has no switch point at 00:00, the
+ *   register of its last switch point is active before the first one.
+ *
+ *   The lookup caches the interval between two switch points, so each
+ *   pulse is booked to its register with a single comparison. The table
+ *   is only consulted again when a switch point is passed.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "period.h"
+#include "tariff.h"
+
+static tariff_t tariff;
+
+/* Cached switch period */
+static time_t cache_start = 0;
+static time_t cache_end = 0;
+static int cache_reg = -1;
+
+
+/**********************************************************
+ * Internal function: parse_set()
+ *
+ * Description:
+ *           Parse a list of values or ranges, e.g. "1-3,12",
+ *           "mon-fri" or "*", into a bit mask. Names are
+ *           matched against the given table, numbers are
+ *           taken as 1-based.
+ *
+ * Returns:  bit mask, 0 on error
+ *********************************************************/
+static unsigned int parse_set(const char *s, int max, const char *const names[])
+{
+   unsigned int mask = 0;
+   char buf[64];
+   char *tok, *save, *dash;
+   int from, to, i;
+
+   if (strcmp(s, "*") == 0)
+      return (1u << max) - 1;
+
+   strncpy(buf, s, sizeof(buf)-1);
+   buf[sizeof(buf)-1] = '\0';
+
+   for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+   {
+      int val[2] = { -1, -1 };
+      char *part[2];
+
+      part[0] = tok;
+      part[1] = NULL;
+      if ((dash = strchr(tok, '-')) != NULL)
+      {
+         *dash = '\0';
+         part[1] = dash+1;
+      }
+
+      for (i = 0; i < 2 && part[i] != NULL; i++)
+      {
+         int n;
+
+         if (names != NULL)
+         {
+            for (n = 0; n < max; n++)
+            {
+               if (strcasecmp(part[i], names[n]) == 0)
+                  val[i] = n;
+            }
+         }
+         else if ((n = atoi(part[i])) >= 1 && n <= max)
+         {
+            val[i] = n-1;
+         }
+         if (val[i] < 0)
+            return 0;
+      }
+
+      from = val[0];
+      to = (part[1] != NULL) ? val[1] : val[0];
+
+      /* Ranges may wrap, e.g. "nov-feb" or "sat-sun" */
+      for (i = from; ; i = (i+1) % max)
+      {
+         mask |= 1u << i;
+         if (i == to)
+            break;
+      }
+   }
+   return mask;
+}
+
+/**********************************************************
+ * Internal function: add_point()
+ *
+ * Description:
+ *           Insert a switch point into the sorted list of
+ *           a day type, replacing one at the same time
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int add_point(tariff_t *t, int mon, int wday, unsigned short minute, unsigned char reg)
+{
+   tariff_point_t *p = t->points[mon][wday];
+   int n = t->num_points[mon][wday];
+   int i;
+
+   for (i = 0; i < n; i++)
+   {
+      if (p[i].minute == minute)
+      {
+         p[i].reg = reg;
+         return 0;
+      }
+   }
+   if (n >= TARIFF_MAX_POINTS)
+      return -1;
+
+   for (i = n; i > 0 && p[i-1].minute > minute; i--)
+      p[i] = p[i-1];
+   p[i].minute = minute;
+   p[i].reg = reg;
+   t->num_points[mon][wday]++;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: at_minute()
+ *
+ * Description:
+ *           Compute the time of a minute of the day
+ *           containing t
+ *
+ * Returns:  time
+ *********************************************************/
+static time_t at_minute(time_t t, unsigned int minute)
+{
+   struct tm tm;
+
+   localtime_r(&t, &tm);
+   tm.tm_hour = minute / 60;
+   tm.tm_min = minute % 60;
+   tm.tm_sec = 0;
+   tm.tm_isdst = -1;
+   return mktime(&tm);
+}
+
+
+/**********************************************************
+ * Public function: tariff_config()
+ *
+ * Description:
+ *           Parse a name=value pair of the [tariff] section
+ *           and add it to the compiled schedule:
+ *             register = <name> <price per kWh>
+ *             switch   = <months> <weekdays> <hh:mm> <register>
+ *           e.g. "switch = 1-12 mon-fri 08:00 peak"
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int tariff_config(tariff_t *t, const char *name, const char *value)
+{
+   /* Weekdays in struct tm order */
+   static const char *const wdays[7] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+
+   if (strcmp(name, "register") == 0)
+   {
+      char rname[TARIFF_NAME_SIZE];
+      double price;
+
+      if (t->num_regs >= TARIFF_MAX_REGS ||
+          sscanf(value, "%15s %lf", rname, &price) != 2 ||
+          tariff_find(t, rname) >= 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Invalid tariff register: %s\n", value);
+         return -1;
+      }
+      strcpy(t->name[t->num_regs], rname);
+      t->price[t->num_regs] = price;
+      t->num_regs++;
+   }
+   else if (strcmp(name, "switch") == 0)
+   {
+      char months[64], days[64], rname[TARIFF_NAME_SIZE];
+      unsigned int hh, mm, mon_mask, wday_mask;
+      int reg;
+      int mon, wday;
+
+      if (sscanf(value, "%63s %63s %u:%u %15s", months, days, &hh, &mm, rname) != 5 ||
+          hh > 23 || mm > 59)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Invalid tariff switch point: %s\n", value);
+         return -1;
+      }
+      reg = tariff_find(t, rname);
+      mon_mask = parse_set(months, 12, NULL);
+      wday_mask = parse_set(days, 7, wdays);
+      if (reg < 0 || mon_mask == 0 || wday_mask == 0)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Invalid tariff switch point: %s\n", value);
+         return -1;
+      }
+
+      for (mon = 0; mon < 12; mon++)
+      {
+         for (wday = 0; wday < 7; wday++)
+         {
+            if ((mon_mask & (1u << mon)) && (wday_mask & (1u << wday)))
+            {
+               if (add_point(t, mon, wday, hh*60+mm, reg) < 0)
+               {
+                  syslog(LOG_DAEMON | LOG_ERR, "Too many tariff switch points per day: %s\n", value);
+                  return -1;
+               }
+            }
+         }
+      }
+   }
+   else
+   {
+      return -1;
+   }
+
+   return 0;
+}
+
+/**********************************************************
+ * Public function: tariff_init()
+ *
+ * Description:
+ *           Activate a tariff schedule
+ *
+ * Returns:  number of registers
+ *********************************************************/
+int tariff_init(const tariff_t *t)
+{
+   tariff = *t;
+   cache_start = 0;
+   cache_end = 0;
+   cache_reg = -1;
+
+   return tariff.num_regs;
+}
+
+/**********************************************************
+ * Public function: tariff_lookup()
+ *
+ * Description:
+ *           Find the register which is active at time t.
+ *           The active switch period is cached, so this is
+ *           a single comparison for most calls. Not
+ *           reentrant, the caller has to serialize calls.
+ *
+ * Returns:  register index, <0 if no tariff is configured
+ *********************************************************/
+int tariff_lookup(time_t t)
+{
+   const tariff_point_t *p;
+   struct tm tm;
+   unsigned int minute;
+   int n, i;
+
+   if (t >= cache_start && t < cache_end)
+      return cache_reg;
+
+   if (tariff.num_regs == 0)
+      return -1;
+
+   localtime_r(&t, &tm);
+   minute = tm.tm_hour*60 + tm.tm_min;
+   p = tariff.points[tm.tm_mon][tm.tm_wday];
+   n = tariff.num_points[tm.tm_mon][tm.tm_wday];
+
+   if (n == 0)
+   {
+      /* No switch points, first register for the whole day */
+      cache_reg = 0;
+      cache_start = period_day_start(t, 0);
+      cache_end = period_day_start(t, 1);
+      return cache_reg;
+   }
+
+   /* Find the last switch point at or before t */
+   for (i = n-1; i >= 0 && p[i].minute > minute; i--)
+      ;
+
+   if (i < 0)
+   {
+      cache_reg = p[n-1].reg;
+      cache_start = period_day_start(t, 0);
+   }
+   else
+   {
+      cache_reg = p[i].reg;
+      cache_start = at_minute(t, p[i].minute);
+   }
+   cache_end = (i+1 < n) ? at_minute(t, p[i+1].minute) : period_day_start(t, 1);
+
+   /* Switch point skipped by DST, don't cache */
+   if (cache_end <= t)
+      cache_end = cache_start;
+
+   return cache_reg;
+}
+
+/**********************************************************
+ * Public function: tariff_price()
+ *
+ * Description:
+ *           Get the price of a register
+ *
+ * Returns:  price per kWh
+ *********************************************************/
+double tariff_price(int reg)
+{
+   if (reg < 0 || reg >= (int)tariff.num_regs)
+      return 0;
+   return tariff.price[reg];
+}
+
+/**********************************************************
+ * Public function: tariff_name()
+ *
+ * Description:
+ *           Get the name of a register
+ *
+ * Returns:  register name
+ *********************************************************/
+const char *tariff_name(int reg)
+{
+   if (reg < 0 || reg >= (int)tariff.num_regs)
+      return "";
+   return tariff.name[reg];
+}
+
+/**********************************************************
+ * Public function: tariff_find()
+ *
+ * Description:
+ *           Find a register of a schedule by its name
+ *
+ * Returns:  register index, <0 if there is no such register
+ *********************************************************/
+int tariff_find(const tariff_t *t, const char *name)
+{
+   unsigned int i;
+
+   for (i = 0; i < t->num_regs; i++)
+   {
+      if (strcmp(t->name[i], name) == 0)
+         return i;
+   }
+   return -1;
+}
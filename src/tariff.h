@@ -0,0 +1,106 @@
+/*
+ * Energy Monitor: time-of-use tariff
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __TARIFF_H__
+#define __TARIFF_H__
+
+#include <time.h>
+
+/* Max number of tariff registers (T1 ... T4) */
+#define TARIFF_MAX_REGS 4
+
+/* Max number of switch points per day */
+#define TARIFF_MAX_POINTS 8
+
+#define TARIFF_NAME_SIZE 16
+
+/* Switch point: register reg is active from minute of the day on */
+typedef struct
+{
+   unsigned short minute;
+   unsigned char reg;
+} tariff_point_t;
+
+/* Tariff schedule, compiled into a table of switch points
+ * for each day type (month and weekday) */
+typedef struct
+{
+   unsigned int num_regs;
+   char name[TARIFF_MAX_REGS][TARIFF_NAME_SIZE];
+   double price[TARIFF_MAX_REGS];     /* per kWh */
+   unsigned char num_points[12][7];
+   tariff_point_t points[12][7][TARIFF_MAX_POINTS];
+} tariff_t;
+
+/**********************************************************
+ * Public function: tariff_config()
+ *
+ * Description:
+ *           Parse a name=value pair of the [tariff] section
+ *           and add it to the compiled schedule:
+ *             register = <name> <price per kWh>
+ *             switch   = <months> <weekdays> <hh:mm> <register>
+ *           e.g. "switch = 1-12 mon-fri 08:00 peak"
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int tariff_config(tariff_t *t, const char *name, const char *value);
+
+/**********************************************************
+ * Public function: tariff_init()
+ *
+ * Description:
+ *           Activate a tariff schedule
+ *
+ * Returns:  number of registers
+ *********************************************************/
+int tariff_init(const tariff_t *t);
+
+/**********************************************************
+ * Public function: tariff_lookup()
+ *
+ * Description:
+ *           Find the register which is active at time t.
+ *           The active switch period is cached, so this is
+ *           a single comparison for most calls. Not
+ *           reentrant, the caller has to serialize calls.
+ *
+ * Returns:  register index, <0 if no tariff is configured
+ *********************************************************/
+int tariff_lookup(time_t t);
+
+/**********************************************************
+ * Public function: tariff_price()
+ *
+ * Description:
+ *           Get the price of a register
+ *
+ * Returns:  price per kWh
+ *********************************************************/
+double tariff_price(int reg);
+
+/**********************************************************
+ * Public function: tariff_name()
+ *
+ * Description:
+ *           Get the name of a register
+ *
+ * Returns:  register name
+ *********************************************************/
+const char *tariff_name(int reg);
+
+/**********************************************************
+ * Public function: tariff_find()
+ *
+ * Description:
+ *           Find a register of a schedule by its name
+ *
+ * Returns:  register index, <0 if there is no such register
+ *********************************************************/
+int tariff_find(const tariff_t *t, const char *name);
+
+#endif /* __TARIFF_H__ */
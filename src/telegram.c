@@ -0,0 +1,874 @@
+/*
+ * Energy Monitor: smart meter telegram reader (SML, DSMR, IEC 62056-21)
+ *
+ * Description:
+ *   Reads the telegrams which electronic meters push on their optical
+ *   or serial (P1) port. The bytes are parsed in place as they are
+ *   read, without buffering the telegram, and the checksum is updated
+ *   with every byte. The register values are collected while the
+ *   telegram arrives and passed on the moment its checksum is found
+ *   valid:
+ *
+ *   - SML (German meters, binary): frames between the escape sequences
+ *     1b1b1b1b 01010101 and 1b1b1b1b 1a <fill> <crc>, CRC-16/X.25 over
+ *     the whole frame. The TLV encoded messages are walked with a small
+ *     list stack, values are taken from the list entries of 7 elements
+ *     which start with an OBIS code.
+ *   - DSMR / IEC 62056-21 (text): "/ident" up to "!", one OBIS register
+ *     per line, like 1-0:1.8.1(001234.567*kWh). DSMR 4/5 append a
+ *     CRC-16/ARC over "/" ... "!", IEC 62056-21 mode C a BCC after ETX,
+ *     DSMR 2.2 and IEC mode D no checksum at all.
+ *
+ *   Only the current text line (up to TG_LINE_SIZE characters) is kept.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "evloop.h"
+#include "serial.h"
+#include "telegram.h"
+
+/* Max length of a text line (longer lines are skipped) */
+#define TG_LINE_SIZE 128
+
+/* Max nesting of SML lists */
+#define TG_SML_DEPTH 16
+
+/* Reopen backoff limits (in ms) */
+#define TG_BACKOFF_MIN 1000
+#define TG_BACKOFF_MAX 60000
+
+#define TG_STX 0x02
+#define TG_ETX 0x03
+
+/* CRC polynomials (reflected) */
+#define TG_CRC_ARC 0xA001
+#define TG_CRC_X25 0x8408
+
+/* SML start escape sequence */
+#define TG_SML_START 0x1B1B1B1B01010101ULL
+
+/* SML TLV types */
+#define SML_OCTETS  0
+#define SML_INT     5
+#define SML_UINT    6
+#define SML_LIST    7
+
+/* SML units */
+#define SML_UNIT_W  27
+#define SML_UNIT_WH 30
+
+typedef enum
+{
+   TG_IDLE,
+   TG_TEXT,          /* "/" ... "!" */
+   TG_TEXT_CRC,      /* checksum after "!" */
+   TG_TEXT_ETX,      /* ETX after "!" (IEC mode C) */
+   TG_TEXT_BCC,      /* BCC after ETX */
+   TG_SML
+} tg_state_t;
+
+/* An open SML list */
+typedef struct
+{
+   unsigned int left;           /* elements still to come */
+   unsigned int idx;            /* index of the next element */
+   int entry;                   /* list of 7, may be a value list entry */
+   unsigned char obis[6];
+   int obis_ok;
+   int unit;
+   int scaler;
+   int64_t value;
+   int value_ok;
+} tg_list_t;
+
+static int running = 0;
+static char device_spec[TELEGRAM_DEVICE_SIZE];
+static int fd = -1;
+static unsigned int channel = 0;
+static reading_cb callback = NULL;
+static void *callback_arg = NULL;
+static unsigned long backoff = TG_BACKOFF_MIN;
+static int reopen_timer = 0;
+
+/* Parser state */
+static tg_state_t state = TG_IDLE;
+static uint64_t sync_window = 0;
+static uint16_t crc;
+static reading_t frame;
+static double tariff_import;
+static double tariff_export;
+static int tariffs;
+
+/* Text telegrams */
+static char line[TG_LINE_SIZE];
+static size_t line_len;
+static int line_skip;
+static int stx_seen;
+static unsigned char bcc;
+static unsigned int crc_digits;
+static uint16_t crc_rx;
+
+/* SML frames */
+static unsigned int esc_n;
+static unsigned char cmd[4];
+static unsigned int cmd_n;
+static tg_list_t stack[TG_SML_DEPTH];
+static int depth;
+static int sml_error;
+static unsigned int tl_type;
+static unsigned int tl_len;
+static unsigned int tl_bytes;
+static int tl_more;
+static unsigned int data_left;
+static unsigned int data_n;
+static uint64_t data_val;
+
+static void telegram_reopen(void *arg);
+
+
+/**********************************************************
+ * Internal function: tg_crc16()
+ *
+ * Description:
+ *           Update a reflected CRC-16 with one byte
+ *
+ * Returns:  updated CRC
+ *********************************************************/
+static uint16_t tg_crc16(uint16_t c, unsigned char b, uint16_t poly)
+{
+   int i;
+
+   c ^= b;
+   for (i = 0; i < 8; i++)
+      c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+   return c;
+}
+
+/**********************************************************
+ * Internal function: tg_reset()
+ *
+ * Description:
+ *           Start collecting the values of a new frame
+ *
+ * Returns:  -
+ *********************************************************/
+static void tg_reset(tg_state_t s)
+{
+   state = s;
+   memset(&frame, 0, sizeof(frame));
+   tariff_import = 0;
+   tariff_export = 0;
+   tariffs = 0;
+}
+
+/**********************************************************
+ * Internal function: tg_store()
+ *
+ * Description:
+ *           Keep the value of an electricity register
+ *           (OBIS 1-b:c.d.e) in W or Wh
+ *
+ * Returns:  -
+ *********************************************************/
+static void tg_store(unsigned int c, unsigned int d, unsigned int e, double v)
+{
+   int value = -1;
+
+   if (d == 7 && e == 0)
+   {
+      switch (c)
+      {
+         case 1:              /* DSMR: power delivered */
+         case 16:             /* SML: sum active power (net) */
+            value = READING_POWER;
+            break;
+         case 21: case 36:
+            value = READING_POWER_L1;
+            break;
+         case 41: case 56:
+            value = READING_POWER_L2;
+            break;
+         case 61: case 76:
+            value = READING_POWER_L3;
+            break;
+      }
+   }
+   else if (d == 8 && (c == 1 || c == 2))
+   {
+      if (e > 0)
+      {
+         /* Tariff registers, summed if there is no total */
+         if (c == 1)
+            tariff_import += v;
+         else
+            tariff_export += v;
+         tariffs |= c;
+         return;
+      }
+      value = (c == 1) ? READING_IMPORT : READING_EXPORT;
+   }
+
+   if (value >= 0)
+   {
+      frame.value[value] = v;
+      frame.valid |= 1 << value;
+   }
+}
+
+/**********************************************************
+ * Internal function: tg_publish()
+ *
+ * Description:
+ *           Pass the values of a valid frame on
+ *
+ * Returns:  -
+ *********************************************************/
+static void tg_publish(void)
+{
+   if ((tariffs & 1) && !(frame.valid & (1 << READING_IMPORT)))
+   {
+      frame.value[READING_IMPORT] = tariff_import;
+      frame.valid |= 1 << READING_IMPORT;
+   }
+   if ((tariffs & 2) && !(frame.valid & (1 << READING_EXPORT)))
+   {
+      frame.value[READING_EXPORT] = tariff_export;
+      frame.valid |= 1 << READING_EXPORT;
+   }
+
+   if (frame.valid && callback != NULL)
+   {
+      clock_gettime(CLOCK_REALTIME, &frame.ts);
+      callback(channel, &frame, 1, callback_arg);
+   }
+}
+
+/**********************************************************
+ * Internal function: tg_line()
+ *
+ * Description:
+ *           Parse a line of a text telegram,
+ *           "a-b:c.d.e(value*unit)"
+ *
+ * Returns:  -
+ *********************************************************/
+static void tg_line(void)
+{
+   unsigned int a, b, c, d, e;
+   char *p, *q;
+   double v;
+
+   line[line_len] = 0;
+   if (line_skip || sscanf(line, "%u-%u:%u.%u.%u", &a, &b, &c, &d, &e) != 5 || a != 1)
+      return;
+   if ((p = strchr(line, '(')) == NULL)
+      return;
+
+   v = strtod(p+1, &q);
+   if (q == p+1 || *q != '*')
+      return;
+   q++;
+   if (strncmp(q, "kW", 2) == 0)
+      v *= 1000;
+   else if (*q != 'W')
+      return;
+
+   tg_store(c, d, e, v);
+}
+
+/**********************************************************
+ * Internal function: tg_text_byte()
+ *
+ * Description:
+ *           Parse a byte of a text telegram
+ *
+ * Returns:  -
+ *********************************************************/
+static void tg_text_byte(unsigned char b)
+{
+   switch (state)
+   {
+      case TG_TEXT:
+         if (b == '/')
+         {
+            /* Start of the next telegram, the current one is incomplete */
+            tg_reset(TG_TEXT);
+            crc = 0;
+            line_len = 0;
+            line_skip = 0;
+            stx_seen = 0;
+         }
+         if (stx_seen)
+            bcc ^= b;
+         if (b == TG_STX)
+         {
+            stx_seen = 1;
+            bcc = 0;
+            return;
+         }
+         crc = tg_crc16(crc, b, TG_CRC_ARC);
+         if (b == '!' || b == '\r' || b == '\n')
+         {
+            if (line_len > 0)
+               tg_line();
+            line_len = 0;
+            line_skip = 0;
+            if (b == '!')
+            {
+               state = TG_TEXT_CRC;
+               crc_digits = 0;
+               crc_rx = 0;
+            }
+         }
+         else if (line_len < TG_LINE_SIZE-1)
+         {
+            line[line_len++] = b;
+         }
+         else
+         {
+            line_skip = 1;
+         }
+         break;
+
+      case TG_TEXT_CRC:
+         if (stx_seen)
+            bcc ^= b;
+         if (isxdigit(b) && crc_digits < 4)
+         {
+            crc_rx = (crc_rx << 4) | (isdigit(b) ? b - '0' : toupper(b) - 'A' + 10);
+            crc_digits++;
+         }
+         else if (b == '\n' && crc_digits == 4)
+         {
+            if (crc_rx == crc)
+               tg_publish();
+            else
+               syslog(LOG_DAEMON | LOG_WARNING, "Telegram CRC error (%04X, expected %04X)\n", crc_rx, crc);
+            state = TG_IDLE;
+         }
+         else if (b == '\n' && crc_digits == 0)
+         {
+            /* No CRC, IEC mode C has a BCC after ETX */
+            if (stx_seen)
+            {
+               state = TG_TEXT_ETX;
+            }
+            else
+            {
+               tg_publish();
+               state = TG_IDLE;
+            }
+         }
+         else if (b != '\r')
+         {
+            state = TG_IDLE;
+         }
+         break;
+
+      case TG_TEXT_ETX:
+         bcc ^= b;
+         if (b == TG_ETX)
+            state = TG_TEXT_BCC;
+         else if (b != '\r' && b != '\n')
+            state = TG_IDLE;
+         break;
+
+      case TG_TEXT_BCC:
+         if (b == bcc)
+            tg_publish();
+         else
+            syslog(LOG_DAEMON | LOG_WARNING, "Telegram BCC error (%02X, expected %02X)\n", b, bcc);
+         state = TG_IDLE;
+         break;
+
+      default:
+         break;
+   }
+}
+
+/**********************************************************
+ * Internal function: sml_entry()
+ *
+ * Description:
+ *           Store the value of a complete value list entry
+ *           (objName, status, valTime, unit, scaler, value,
+ *           valueSignature)
+ *
+ * Returns:  -
+ *********************************************************/
+static void sml_entry(const tg_list_t *l)
+{
+   double v;
+
+   if (!l->obis_ok || !l->value_ok || l->obis[0] != 1)
+      return;
+   if (!((l->obis[3] == 7 && l->unit == SML_UNIT_W) || (l->obis[3] == 8 && l->unit == SML_UNIT_WH)))
+      return;
+
+   v = l->value*pow(10, l->scaler);
+   tg_store(l->obis[2], l->obis[3], l->obis[4], v);
+}
+
+/**********************************************************
+ * Internal function: sml_element()
+ *
+ * Description:
+ *           Handle a complete element of the current list.
+ *           A complete list is an element of its parent.
+ *
+ * Returns:  -
+ *********************************************************/
+static void sml_element(unsigned int type)
+{
+   tg_list_t *l;
+   int i;
+
+   if (depth == 0)
+      return;
+   l = &stack[depth-1];
+
+   if (l->entry)
+   {
+      switch (l->idx)
+      {
+         case 0:
+            l->obis_ok = (type == SML_OCTETS && data_n == 6);
+            for (i = 0; i < 6 && l->obis_ok; i++)
+               l->obis[i] = data_val >> (8*(5-i));
+            break;
+         case 3:
+            if (type == SML_UINT && data_n == 1)
+               l->unit = data_val;
+            break;
+         case 4:
+            if (type == SML_INT && data_n == 1)
+               l->scaler = (int8_t)data_val;
+            break;
+         case 5:
+            if ((type == SML_INT || type == SML_UINT) && data_n >= 1 && data_n <= 8)
+            {
+               l->value = (int64_t)data_val;
+               if (type == SML_INT && data_n < 8 && (data_val >> (8*data_n-1)) & 1)
+                  l->value -= (int64_t)1 << (8*data_n);
+               l->value_ok = 1;
+            }
+            break;
+      }
+   }
+
+   l->idx++;
+   if (--l->left == 0)
+   {
+      depth--;
+      if (l->entry)
+         sml_entry(l);
+      sml_element(SML_LIST);
+   }
+}
+
+/**********************************************************
+ * Internal function: sml_tl_done()
+ *
+ * Description:
+ *           Handle a complete type-length field
+ *
+ * Returns:  -
+ *********************************************************/
+static void sml_tl_done(void)
+{
+   tg_list_t *l;
+
+   data_n = 0;
+   data_val = 0;
+
+   if (tl_type == SML_LIST)
+   {
+      if (tl_len == 0)
+      {
+         sml_element(SML_LIST);
+         return;
+      }
+      if (depth == TG_SML_DEPTH)
+      {
+         sml_error = 1;
+         return;
+      }
+      l = &stack[depth++];
+      memset(l, 0, sizeof(*l));
+      l->left = tl_len;
+      l->entry = (tl_len == 7);
+      l->unit = -1;
+      return;
+   }
+
+   if (tl_len < tl_bytes)
+   {
+      sml_error = 1;
+      return;
+   }
+   data_left = tl_len - tl_bytes;
+   if (data_left == 0)
+      sml_element(tl_type);
+}
+
+/**********************************************************
+ * Internal function: sml_tlv_byte()
+ *
+ * Description:
+ *           Parse a byte of the SML messages
+ *
+ * Returns:  -
+ *********************************************************/
+static void sml_tlv_byte(unsigned char b)
+{
+   if (sml_error)
+      return;
+
+   if (data_left > 0)
+   {
+      if (data_n < 8)
+         data_val = (data_val << 8) | b;
+      data_n++;
+      if (--data_left == 0)
+         sml_element(tl_type);
+      return;
+   }
+
+   if (tl_more)
+   {
+      /* Further length nibbles */
+      tl_len = (tl_len << 4) | (b & 0x0F);
+      tl_bytes++;
+      tl_more = b & 0x80;
+      if (!tl_more)
+         sml_tl_done();
+      return;
+   }
+
+   if (b == 0x00)
+   {
+      /* End of message (or fill byte between messages) */
+      data_n = 0;
+      sml_element(SML_OCTETS);
+      return;
+   }
+
+   tl_type = (b >> 4) & 0x07;
+   tl_len = b & 0x0F;
+   tl_bytes = 1;
+   tl_more = b & 0x80;
+   if (!tl_more)
+      sml_tl_done();
+}
+
+/**********************************************************
+ * Internal function: sml_start()
+ *
+ * Description:
+ *           Start parsing an SML frame after its start
+ *           escape sequence
+ *
+ * Returns:  -
+ *********************************************************/
+static void sml_start(void)
+{
+   int i;
+
+   tg_reset(TG_SML);
+   crc = 0xFFFF;
+   for (i = 0; i < 4; i++)
+      crc = tg_crc16(crc, 0x1B, TG_CRC_X25);
+   for (i = 0; i < 4; i++)
+      crc = tg_crc16(crc, 0x01, TG_CRC_X25);
+   esc_n = 0;
+   cmd_n = 0;
+   depth = 0;
+   sml_error = 0;
+   tl_more = 0;
+   data_left = 0;
+}
+
+/**********************************************************
+ * Internal function: sml_byte()
+ *
+ * Description:
+ *           Parse a byte of an SML frame, handling the
+ *           escape sequences
+ *
+ * Returns:  -
+ *********************************************************/
+static void sml_byte(unsigned char b)
+{
+   uint16_t crc_frame;
+   int i;
+
+   if (esc_n == 4)
+   {
+      /* Escape command, the CRC itself is not part of the CRC */
+      cmd[cmd_n++] = b;
+      if (!(cmd[0] == 0x1A && cmd_n > 2))
+         crc = tg_crc16(crc, b, TG_CRC_X25);
+      if (cmd_n < 4)
+         return;
+      esc_n = 0;
+      cmd_n = 0;
+
+      if (cmd[0] == 0x1B && cmd[1] == 0x1B && cmd[2] == 0x1B && cmd[3] == 0x1B)
+      {
+         /* Escaped data */
+         for (i = 0; i < 4; i++)
+            sml_tlv_byte(0x1B);
+      }
+      else if (cmd[0] == 0x1A)
+      {
+         crc_frame = cmd[2] | (cmd[3] << 8);
+         crc ^= 0xFFFF;
+         if (crc_frame != crc)
+            syslog(LOG_DAEMON | LOG_WARNING, "SML CRC error (%04X, expected %04X)\n", crc_frame, crc);
+         else if (sml_error)
+            syslog(LOG_DAEMON | LOG_WARNING, "SML frame not understood\n");
+         else
+            tg_publish();
+         state = TG_IDLE;
+      }
+      else if (cmd[0] == 0x01 && cmd[1] == 0x01 && cmd[2] == 0x01 && cmd[3] == 0x01)
+      {
+         /* Start of the next frame, the current one is incomplete */
+         sml_start();
+      }
+      else
+      {
+         state = TG_IDLE;
+      }
+      return;
+   }
+
+   crc = tg_crc16(crc, b, TG_CRC_X25);
+   if (b == 0x1B)
+   {
+      esc_n++;
+      return;
+   }
+   for (; esc_n > 0; esc_n--)
+      sml_tlv_byte(0x1B);
+   sml_tlv_byte(b);
+}
+
+/**********************************************************
+ * Internal function: tg_byte()
+ *
+ * Description:
+ *           Parse a received byte
+ *
+ * Returns:  -
+ *********************************************************/
+static void tg_byte(unsigned char b)
+{
+   if (state == TG_SML)
+   {
+      sml_byte(b);
+      return;
+   }
+   if (state != TG_IDLE)
+   {
+      tg_text_byte(b);
+      return;
+   }
+
+   /* Wait for the start of a telegram */
+   sync_window = (sync_window << 8) | b;
+   if (sync_window == TG_SML_START)
+   {
+      sml_start();
+   }
+   else if (b == '/')
+   {
+      tg_reset(TG_TEXT);
+      tg_text_byte(b);
+   }
+}
+
+/**********************************************************
+ * Internal function: telegram_read()
+ *
+ * Description:
+ *           Event loop callback of the serial port
+ *
+ * Returns:  -
+ *********************************************************/
+static void telegram_read(int rfd, unsigned int events, void *arg)
+{
+   unsigned char buf[512];
+   ssize_t n, i;
+
+   n = read(fd, buf, sizeof(buf));
+   if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+   if (n <= 0)
+   {
+      /* Serial adapter removed, try to open it again */
+      syslog(LOG_DAEMON | LOG_WARNING, "Telegram device %s failed: %s\n", device_spec,
+             (n < 0) ? strerror(errno) : "hangup");
+      ev_del_fd(fd);
+      close(fd);
+      fd = -1;
+      state = TG_IDLE;
+      reopen_timer = ev_timer_add(backoff, telegram_reopen, NULL);
+      backoff = (backoff*2 > TG_BACKOFF_MAX) ? TG_BACKOFF_MAX : backoff*2;
+      return;
+   }
+
+   for (i = 0; i < n; i++)
+      tg_byte(buf[i]);
+}
+
+/**********************************************************
+ * Internal function: telegram_open()
+ *
+ * Description:
+ *           Open the serial port
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int telegram_open(void)
+{
+   unsigned long baud = TELEGRAM_BAUD;
+
+   if ((fd = serial_open(device_spec, &baud)) < 0)
+      return -1;
+
+   if (ev_add_fd(fd, EV_READ, telegram_read, NULL) < 0)
+   {
+      close(fd);
+      fd = -1;
+      return -1;
+   }
+
+   state = TG_IDLE;
+   sync_window = 0;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: telegram_reopen()
+ *
+ * Description:
+ *           Timer callback which opens the serial port again
+ *
+ * Returns:  -
+ *********************************************************/
+static void telegram_reopen(void *arg)
+{
+   reopen_timer = 0;
+
+   if (telegram_open() == 0)
+   {
+      syslog(LOG_DAEMON | LOG_INFO, "Telegram device %s opened\n", device_spec);
+      backoff = TG_BACKOFF_MIN;
+      return;
+   }
+
+   reopen_timer = ev_timer_add(backoff, telegram_reopen, NULL);
+   backoff = (backoff*2 > TG_BACKOFF_MAX) ? TG_BACKOFF_MAX : backoff*2;
+}
+
+
+/**********************************************************
+ * Public function: telegram_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a meter
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int telegram_config(telegram_conf_t *tc, const char *name, const char *value)
+{
+   if (strcmp(name, "serial_device") == 0)
+   {
+      snprintf(tc->device, sizeof(tc->device), "%s", value);
+      return 0;
+   }
+   return -1;
+}
+
+/**********************************************************
+ * Public function: telegram_init()
+ *
+ * Description:
+ *           Start reading the telegrams sent by a meter on
+ *           the serial device "<tty>[:<baud>[:<mode>]]", e.g.
+ *           "/dev/ttyUSB0:115200:8N1" for DSMR 5 or
+ *           "/dev/ttyUSB0:9600:7E1" for IEC 62056-21. SML
+ *           and text telegrams are detected automatically.
+ *           The values of each valid telegram are passed to
+ *           the callback as reading of the channel. Needs the
+ *           event loop.
+ *
+ * Returns:  0 on success (or no device), <0 otherwise
+ *********************************************************/
+int telegram_init(const char *device, unsigned int ch, reading_cb cb, void *arg)
+{
+   telegram_exit();
+
+   if (device == NULL || strlen(device) == 0)
+      return 0;
+
+   snprintf(device_spec, sizeof(device_spec), "%s", device);
+   channel = ch;
+   callback = cb;
+   callback_arg = arg;
+   backoff = TG_BACKOFF_MIN;
+   running = 1;
+
+   if (telegram_open() < 0)
+   {
+      /* The adapter may be plugged in later */
+      reopen_timer = ev_timer_add(backoff, telegram_reopen, NULL);
+      return -1;
+   }
+
+   syslog(LOG_DAEMON | LOG_INFO, "Reading meter telegrams from %s\n", device_spec);
+   return 0;
+}
+
+/**********************************************************
+ * Public function: telegram_exit()
+ *
+ * Description:
+ *           Stop reading and close the device
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int telegram_exit(void)
+{
+   if (!running)
+      return 0;
+   running = 0;
+
+   if (reopen_timer > 0)
+   {
+      ev_timer_cancel(reopen_timer);
+      reopen_timer = 0;
+   }
+   if (fd >= 0)
+   {
+      ev_del_fd(fd);
+      close(fd);
+      fd = -1;
+   }
+   state = TG_IDLE;
+   return 0;
+}
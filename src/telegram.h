@@ -0,0 +1,62 @@
+/*
+ * Energy Monitor: smart meter telegram reader (SML, DSMR, IEC 62056-21)
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __TELEGRAM_H__
+#define __TELEGRAM_H__
+
+#include "reading.h"
+
+/* Default baud rate of the serial port */
+#define TELEGRAM_BAUD 9600
+
+/* Max length of the device */
+#define TELEGRAM_DEVICE_SIZE 128
+
+/* Configuration of the meter (channel with "source = serial") */
+typedef struct
+{
+   char device[TELEGRAM_DEVICE_SIZE];
+} telegram_conf_t;
+
+/**********************************************************
+ * Public function: telegram_config()
+ *
+ * Description:
+ *           Parse a name=value pair of a meter
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int telegram_config(telegram_conf_t *tc, const char *name, const char *value);
+
+/**********************************************************
+ * Public function: telegram_init()
+ *
+ * Description:
+ *           Start reading the telegrams sent by a meter on
+ *           the serial device "<tty>[:<baud>[:<mode>]]", e.g.
+ *           "/dev/ttyUSB0:115200:8N1" for DSMR 5 or
+ *           "/dev/ttyUSB0:9600:7E1" for IEC 62056-21. SML
+ *           and text telegrams are detected automatically.
+ *           The values of each valid telegram are passed to
+ *           the callback as reading of the channel. Needs the
+ *           event loop.
+ *
+ * Returns:  0 on success (or no device), <0 otherwise
+ *********************************************************/
+int telegram_init(const char *device, unsigned int channel, reading_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: telegram_exit()
+ *
+ * Description:
+ *           Stop reading and close the device
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int telegram_exit(void);
+
+#endif /* __TELEGRAM_H__ */
@@ -0,0 +1,363 @@
+/*
+ * Energy Monitor: 1-Wire temperature sensors
+ *
+ * Description:
+ *   Samples DS18B20 (and compatible) sensors via the w1_therm sysfs
+ *   interface without blocking the event loop. A read of w1_slave
+ *   waits for the conversion (750 ms per sensor), so each bus master
+ *   is sampled by a helper thread which posts the readings back to
+ *   the event loop:
+ *
+ *   - Sensors on different bus masters are sampled in parallel.
+ *   - If the master supports bulk conversion (therm_bulk_read), all
+ *     sensors of a bus convert at the same time and are read right
+ *     after a single conversion time.
+ *   - Otherwise the sensors of a bus convert one after the other, as
+ *     the bus is shared.
+ *
+ *   The directory can be changed to a fake sysfs tree for testing,
+ *   either with w1_bus_masterN directories holding the sensors or
+ *   with the sensors directly in it.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "evloop.h"
+#include "temp.h"
+
+#define TEMP_PATH_SIZE 256
+
+/* Size of a bus directory and of a file path below w1_dir */
+#define TEMP_BUS_SIZE (TEMP_PATH_SIZE+32)
+#define TEMP_FILE_SIZE (TEMP_BUS_SIZE+TEMP_ID_SIZE+16)
+
+/* Delay of the first sample after start (in ms) */
+#define TEMP_START_DELAY 1000
+
+/* A sampling job of one bus, run by a helper thread */
+typedef struct
+{
+   unsigned int gen;
+   int bus;                         /* 0 for sensors directly in w1_dir */
+   char dir[TEMP_BUS_SIZE];
+   temp_sample_t sample;
+} temp_job_t;
+
+/* Family codes of the thermometers supported by w1_therm */
+static const char *families[] = { "10-", "22-", "28-", "3b-", "42-" };
+
+static int running = 0;
+static unsigned int gen = 0;
+static char w1_dir[TEMP_PATH_SIZE];
+static unsigned long interval_ms = 0;
+static int timer = 0;
+static int busy[TEMP_MAX_BUSES+1];
+static int dir_missing = 0;
+static temp_cb callback = NULL;
+static void *callback_arg = NULL;
+
+
+/**********************************************************
+ * Internal function: temp_family()
+ *
+ * Description:
+ *           Check if a device name is a thermometer
+ *
+ * Returns:  1 if it is a thermometer, 0 otherwise
+ *********************************************************/
+static int temp_family(const char *name)
+{
+   unsigned int i;
+
+   for (i = 0; i < sizeof(families)/sizeof(families[0]); i++)
+   {
+      if (strncmp(name, families[i], 3) == 0)
+         return 1;
+   }
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: temp_read()
+ *
+ * Description:
+ *           Read a sensor, blocking until its conversion is
+ *           done. The first line of w1_slave holds the CRC
+ *           check result, the second the temperature in
+ *           1/1000 degree Celsius.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+static int temp_read(const char *dir, const char *id, double *celsius)
+{
+   char path[TEMP_FILE_SIZE];
+   char buf[128];
+   char *eol;
+   char *t;
+   size_t len;
+   long mc;
+   FILE *f;
+
+   snprintf(path, sizeof(path), "%s/%s/w1_slave", dir, id);
+   if ((f = fopen(path, "re")) == NULL)
+      return -1;
+   len = fread(buf, 1, sizeof(buf)-1, f);
+   fclose(f);
+   buf[len] = 0;
+
+   /* CRC of the scratchpad must be valid */
+   if ((eol = strchr(buf, '\n')) == NULL)
+      return -2;
+   *eol = 0;
+   if (strstr(buf, "YES") == NULL || (t = strstr(eol+1, "t=")) == NULL)
+      return -2;
+
+   /* 85 degree is the power-on value, no conversion took place */
+   mc = strtol(t+2, NULL, 10);
+   if (mc == 85000)
+      return -3;
+
+   *celsius = mc/1000.0;
+   return 0;
+}
+
+/**********************************************************
+ * Internal function: temp_done()
+ *
+ * Description:
+ *           Passes the readings of a bus to the callback
+ *           (in the event loop thread)
+ *
+ * Returns:  -
+ *********************************************************/
+static void temp_done(void *arg)
+{
+   temp_job_t *job = (temp_job_t*)arg;
+
+   /* Jobs started before temp_exit() are discarded */
+   if (job->gen == gen)
+   {
+      busy[job->bus] = 0;
+      if (running && job->sample.count > 0 && callback != NULL)
+         callback(&job->sample, callback_arg);
+   }
+   free(job);
+}
+
+/**********************************************************
+ * Internal function: temp_thread()
+ *
+ * Description:
+ *           Samples all sensors of a bus and passes the job
+ *           to the event loop
+ *
+ * Returns:  NULL
+ *********************************************************/
+static void *temp_thread(void *arg)
+{
+   temp_job_t *job = (temp_job_t*)arg;
+   temp_sample_t *s = &job->sample;
+   char path[TEMP_FILE_SIZE];
+   struct timespec delay;
+   struct dirent *e;
+   DIR *d;
+   int fd;
+
+   /* Convert all sensors of the bus at once if supported */
+   snprintf(path, sizeof(path), "%s/therm_bulk_read", job->dir);
+   if ((fd = open(path, O_WRONLY | O_CLOEXEC)) >= 0)
+   {
+      if (write(fd, "trigger\n", 8) == 8)
+      {
+         delay.tv_sec = TEMP_CONVERSION_MS/1000;
+         delay.tv_nsec = (TEMP_CONVERSION_MS%1000)*1000000L;
+         nanosleep(&delay, NULL);
+      }
+      close(fd);
+   }
+
+   if ((d = opendir(job->dir)) != NULL)
+   {
+      while ((e = readdir(d)) != NULL && s->count < TEMP_MAX_SENSORS)
+      {
+         if (!temp_family(e->d_name) || strlen(e->d_name) >= TEMP_ID_SIZE)
+            continue;
+
+         strcpy(s->reading[s->count].id, e->d_name);
+
+         /* Retry once on a CRC error */
+         if (temp_read(job->dir, e->d_name, &s->reading[s->count].celsius) == 0 ||
+             temp_read(job->dir, e->d_name, &s->reading[s->count].celsius) == 0)
+         {
+            s->reading[s->count].valid = 1;
+         }
+         s->count++;
+      }
+      closedir(d);
+   }
+
+   /* Retry while the queue is full (e.g. during a pulse storm), the
+    * bus stays busy until the job is done */
+   clock_gettime(CLOCK_REALTIME, &s->ts);
+   while (ev_post(temp_done, job) < 0)
+      usleep(10000);
+
+   return NULL;
+}
+
+/**********************************************************
+ * Internal function: temp_start()
+ *
+ * Description:
+ *           Start sampling a bus, unless its previous sample
+ *           is still in progress
+ *
+ * Returns:  -
+ *********************************************************/
+static void temp_start(int bus, const char *dir)
+{
+   pthread_attr_t attr;
+   pthread_t tid;
+   temp_job_t *job;
+
+   if (busy[bus])
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "1-Wire bus %s still busy, sample skipped\n", dir);
+      return;
+   }
+
+   if ((job = calloc(1, sizeof(*job))) == NULL)
+      return;
+   job->gen = gen;
+   job->bus = bus;
+   snprintf(job->dir, sizeof(job->dir), "%s", dir);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if (pthread_create(&tid, &attr, temp_thread, job) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_WARNING, "Unable to sample 1-Wire bus %s\n", dir);
+      free(job);
+   }
+   else
+   {
+      busy[bus] = 1;
+   }
+   pthread_attr_destroy(&attr);
+}
+
+/**********************************************************
+ * Internal function: temp_cycle()
+ *
+ * Description:
+ *           Start sampling all bus masters (timer callback)
+ *
+ * Returns:  -
+ *********************************************************/
+static void temp_cycle(void *arg)
+{
+   char dir[TEMP_BUS_SIZE];
+   struct dirent *e;
+   int masters = 0;
+   int bus;
+   DIR *d;
+
+   timer = ev_timer_add(interval_ms, temp_cycle, NULL);
+
+   if ((d = opendir(w1_dir)) == NULL)
+   {
+      if (!dir_missing)
+         syslog(LOG_DAEMON | LOG_WARNING, "Cannot open 1-Wire directory %s\n", w1_dir);
+      dir_missing = 1;
+      return;
+   }
+   dir_missing = 0;
+
+   while ((e = readdir(d)) != NULL)
+   {
+      if (strncmp(e->d_name, "w1_bus_master", 13) != 0)
+         continue;
+
+      masters++;
+      bus = atoi(e->d_name+13);
+      if (bus >= 1 && bus <= TEMP_MAX_BUSES)
+      {
+         snprintf(dir, sizeof(dir), "%s/%.24s", w1_dir, e->d_name);
+         temp_start(bus, dir);
+      }
+   }
+   closedir(d);
+
+   /* Sensors directly in the directory */
+   if (masters == 0)
+      temp_start(0, w1_dir);
+}
+
+
+/**********************************************************
+ * Public function: temp_init()
+ *
+ * Description:
+ *           Start sampling all temperature sensors found in
+ *           w1_dir (NULL for the default) every interval
+ *           seconds. Needs the event loop.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int temp_init(const char *dir, unsigned int interval, temp_cb cb, void *arg)
+{
+   temp_exit();
+
+   if (interval == 0)
+      return 0;
+
+   snprintf(w1_dir, sizeof(w1_dir), "%s", (dir != NULL && strlen(dir) > 0) ? dir : TEMP_W1_DIR);
+   interval_ms = interval*1000UL;
+   callback = cb;
+   callback_arg = arg;
+   memset(busy, 0, sizeof(busy));
+   dir_missing = 0;
+
+   if ((timer = ev_timer_add(TEMP_START_DELAY, temp_cycle, NULL)) < 0)
+   {
+      timer = 0;
+      return -1;
+   }
+   running = 1;
+
+   syslog(LOG_DAEMON | LOG_INFO, "Sampling 1-Wire temperature sensors in %s every %u s\n", w1_dir, interval);
+   return 0;
+}
+
+/**********************************************************
+ * Public function: temp_exit()
+ *
+ * Description:
+ *           Stop sampling, readings still in progress are
+ *           discarded
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int temp_exit(void)
+{
+   running = 0;
+   gen++;
+
+   if (timer > 0)
+   {
+      ev_timer_cancel(timer);
+      timer = 0;
+   }
+   return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Energy Monitor: 1-Wire temperature sensors
+ *
+ * Author: Ondrej Wisniewski
+ *
+ */
+
+#ifndef __TEMP_H__
+#define __TEMP_H__
+
+#include <time.h>
+
+/* Max number of sensors (all buses) */
+#define TEMP_MAX_SENSORS 8
+
+/* Max number of 1-Wire bus masters */
+#define TEMP_MAX_BUSES 4
+
+/* Default sysfs directory of the 1-Wire devices */
+#define TEMP_W1_DIR "/sys/bus/w1/devices"
+
+/* Conversion time of a DS18B20 at 12 bit resolution (in ms) */
+#define TEMP_CONVERSION_MS 750
+
+#define TEMP_ID_SIZE 24
+#define TEMP_NAME_SIZE 32
+
+/* Name of a sensor ("sensor = <id> <name>") */
+typedef struct
+{
+   char id[TEMP_ID_SIZE];
+   char name[TEMP_NAME_SIZE];
+} temp_sensor_t;
+
+/* Readings of the sensors of one bus */
+typedef struct
+{
+   struct timespec ts;
+   unsigned int count;
+   struct
+   {
+      char id[TEMP_ID_SIZE];
+      int valid;
+      double celsius;
+   } reading[TEMP_MAX_SENSORS];
+} temp_sample_t;
+
+/* Called in the event loop thread for each sampled bus */
+typedef void (*temp_cb)(const temp_sample_t *sample, void *arg);
+
+/**********************************************************
+ * Public function: temp_init()
+ *
+ * Description:
+ *           Start sampling all temperature sensors found in
+ *           w1_dir (NULL for the default) every interval
+ *           seconds. Needs the event loop.
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int temp_init(const char *w1_dir, unsigned int interval, temp_cb cb, void *arg);
+
+/**********************************************************
+ * Public function: temp_exit()
+ *
+ * Description:
+ *           Stop sampling, readings still in progress are
+ *           discarded
+ *
+ * Returns:  0 on success, <0 otherwise
+ *********************************************************/
+int temp_exit(void);
+
+#endif /* __TEMP_H__ */
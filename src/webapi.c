@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <time.h>
@@ -22,6 +23,9 @@
 #include <curl/curl.h>
 
 #include "webapi.h"
+#include "bench.h"
+#include "flight.h"
+#include "stats.h"
 
 /* Uncomment this to enable debug mode */
 //#define DEBUG
@@ -34,6 +38,10 @@
 
 #define API_TIMEOUT 20
 
+/* Size of the request URL, fits all fields with the base URI, the
+ * API key and the sensor names URL-encoded at their max length */
+#define API_URL_SIZE 4096
+
 #ifdef DEBUG
 #define _debug(x, args...)  syslog(LOG_DAEMON | LOG_DEBUG, "" x, ##args)
 #else
@@ -61,6 +69,37 @@ static size_t curl_writefunc(void *buffer, size_t size, size_t nmemb, void *user
 }
 
 
+/**********************************************************
+ * Internal Function: url_append()
+ *
+ * Description:
+ *           Append formatted text to the URL at *len. If it
+ *           does not fit, *len is set to the buffer size so
+ *           that all further appends fail as well.
+ *
+ * Returns:  0 on success, <0 if the URL is too long
+ *********************************************************/
+static int url_append(char *url, size_t *len, const char *format, ...)
+{
+   va_list ap;
+   int n;
+
+   if (*len >= API_URL_SIZE)
+      return -1;
+
+   va_start(ap, format);
+   n = vsnprintf(url + *len, API_URL_SIZE - *len, format, ap);
+   va_end(ap);
+
+   if (n < 0 || (size_t)n >= API_URL_SIZE - *len)
+   {
+      *len = API_URL_SIZE;
+      return -1;
+   }
+   *len += n;
+   return 0;
+}
+
 /**********************************************************
  * Internal function: emoncms_send_thread()
  * 
@@ -72,15 +111,21 @@ static size_t curl_writefunc(void *buffer, size_t size, size_t nmemb, void *user
  *********************************************************/
 static void *emoncms_send_thread(void* arg)
 {
-   char urlbuf[128];
-   char params[128];
-   char json[64];
+   char urlbuf[API_URL_SIZE];
    char response[1024];
+   char *key;
+   char *name;
+   size_t len;
    CURL* ch;
    time_t start, now, delay;
+   struct timespec sent, done;
+   const char *base_uri;
+   double cost_day, cost_month;
+   unsigned int i;
    int  rc;
    
    emon_data_t* data = (emon_data_t*)arg;
+   base_uri = data->api_base_uri;
 
    /* Detach thread to free resources after it returns */
    pthread_detach(pthread_self());
@@ -91,7 +136,7 @@ static void *emoncms_send_thread(void* arg)
    start = time(NULL);
 
    /* API key parameter check */
-   if (data->api_key == NULL)
+   if (data->api_key[0] == '\0')
    {
       /* Cannot continue without API key */
       syslog(LOG_DAEMON | LOG_WARNING, "Cannot perform Web API request: API key missing");
@@ -99,10 +144,10 @@ static void *emoncms_send_thread(void* arg)
    else
    {   
       /* Base URI parameter check */
-      if (data->api_base_uri == NULL)
+      if (data->api_base_uri[0] == '\0')
       {
          /* Use default URI */
-         data->api_base_uri = (char *)EMONCMS_API_BASE_URI;
+         base_uri = EMONCMS_API_BASE_URI;
       }
       
       /* Node number parameter check */
@@ -117,73 +162,151 @@ static void *emoncms_send_thread(void* arg)
       ch = curl_easy_init();
       
       /* Define parameters for WebAPI request to EmonCMS */
-      snprintf(urlbuf, sizeof(urlbuf), "%s/%s", data->api_base_uri, EMONCMS_API_INPUT_URI);
-      snprintf(params, sizeof(params), "?apikey=%s&node=%d&json=",
-               data->api_key, data->node_number);
-      
+      len = 0;
+      if ((key = curl_easy_escape(ch, data->api_key, 0)) != NULL)
+      {
+         url_append(urlbuf, &len, "%s/%s?apikey=%s&node=%d&json={",
+                    base_uri, EMONCMS_API_INPUT_URI, key, data->node_number);
+         curl_free(key);
+      }
+      else
+      {
+         len = sizeof(urlbuf);
+      }
+
       /* Build json data from input */
-      sprintf(json, "{");
-      strcat(params, json);
-      if (data->inst_power) 
+      if (data->inst_power)
+      {
+         url_append(urlbuf, &len, "power:%u,", data->inst_power);
+      }
+      if (data->energy_day)
+      {
+         url_append(urlbuf, &len, "energy_day:%u,", data->energy_day);
+      }
+      if (data->energy_month)
+      {
+         url_append(urlbuf, &len, "energy_month:%u,", data->energy_month);
+      }
+      if (data->energy_total)
       {
-         snprintf(json, sizeof(json), "power:%u,", data->inst_power);
-         strcat(params, json);
+         url_append(urlbuf, &len, "energy_total:%llu,", data->energy_total);
       }
-      if (data->energy_day) 
+      if (data->energy_month_proj)
       {
-         snprintf(json, sizeof(json), "energy_day:%u,", data->energy_day);
-         strcat(params, json);
-      }      
-      if (data->energy_month) 
+         url_append(urlbuf, &len, "energy_day_proj:%u,energy_month_proj:%u,",
+                    data->energy_day_proj, data->energy_month_proj);
+      }
+      if (data->num_regs)
+      {
+         /* Energy and cost per tariff register */
+         cost_day = 0;
+         cost_month = 0;
+         for (i=0; i<data->num_regs && i<TARIFF_MAX_REGS; i++)
+         {
+            url_append(urlbuf, &len, "energy_day_t%u:%u,energy_month_t%u:%u,",
+                       i+1, data->energy_day_reg[i], i+1, data->energy_month_reg[i]);
+            cost_day += data->cost_day_reg[i];
+            cost_month += data->cost_month_reg[i];
+         }
+         url_append(urlbuf, &len, "cost_day:%.2f,cost_month:%.2f,", cost_day, cost_month);
+      }
+      if (data->power_p95_day)
+      {
+         /* Baseload and peak power quantiles */
+         url_append(urlbuf, &len, "power_p5_day:%u,power_p95_day:%u,",
+                    data->power_p5_day, data->power_p95_day);
+         url_append(urlbuf, &len, "power_p5_month:%u,power_p95_month:%u,",
+                    data->power_p5_month, data->power_p95_month);
+      }
+      if (data->num_phases)
+      {
+         /* Power per phase (Modbus meters) */
+         for (i=0; i<data->num_phases && i<3; i++)
+         {
+            url_append(urlbuf, &len, "power_l%u:%u,", i+1, data->power_phase[i]);
+         }
+      }
+      if (data->energy_export)
+      {
+         url_append(urlbuf, &len, "energy_export:%llu,", data->energy_export);
+      }
+      for (i=0; i<data->num_temps && i<TEMP_MAX_SENSORS; i++)
+      {
+         /* The sensor names are chosen by the user */
+         if ((name = curl_easy_escape(ch, data->temp_name[i], 0)) == NULL)
+         {
+            len = sizeof(urlbuf);
+            break;
+         }
+         url_append(urlbuf, &len, "temp_%s:%.2f,", name, data->temp[i]);
+         curl_free(name);
+      }
+      if (len > 0 && len < sizeof(urlbuf) && urlbuf[len-1] == ',')
+         len--; // delete trailing ','
+      url_append(urlbuf, &len, "}");
+
+      if (len >= sizeof(urlbuf))
       {
-         snprintf(json, sizeof(json), "energy_month:%u,", data->energy_month);
-         strcat(params, json);
+         syslog(LOG_DAEMON | LOG_ERR, "Web API request does not fit in %u bytes, not sent\n",
+                (unsigned int)sizeof(urlbuf));
       }
-      sprintf(json, "}");
-      params[strlen(params)-1] = 0; // delete trailing ','
-      strcat(params, json);
-      strcat(urlbuf, params);
-      _debug("Sending request: %s", urlbuf);
+      else
+      {
+         _debug("Sending request: %s", urlbuf);
       
-      /* Pass needed paramters to Curl */
-      curl_easy_setopt(ch, CURLOPT_URL, urlbuf);
-      curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, curl_writefunc);
-      curl_easy_setopt(ch, CURLOPT_WRITEDATA, &response);
-      curl_easy_setopt(ch, CURLOPT_TIMEOUT, API_TIMEOUT);
-      //curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
+         /* Pass needed paramters to Curl */
+         curl_easy_setopt(ch, CURLOPT_URL, urlbuf);
+         curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, curl_writefunc);
+         curl_easy_setopt(ch, CURLOPT_WRITEDATA, &response);
+         curl_easy_setopt(ch, CURLOPT_TIMEOUT, API_TIMEOUT);
+         //curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
       
-      response[0] = 0;
+         response[0] = 0;
       
-      /* Send WebAPI request */
-      rc = curl_easy_perform(ch);
+         /* Send WebAPI request */
+         clock_gettime(CLOCK_MONOTONIC, &sent);
+         rc = curl_easy_perform(ch);
+         clock_gettime(CLOCK_MONOTONIC, &done);
+         stats_time(STATS_HTTP, (done.tv_sec - sent.tv_sec)*1000000 + (done.tv_nsec - sent.tv_nsec)/1000);
+         flight_record(FLIGHT_UPLOAD, 0, rc);
       
-      if (rc == 0)
-      {
-         if (strlen(response))
-         {   
-            _debug("Received response (%d chars): %s", (int)strlen(response), response);
-            if (!strcmp(response, EMONCMS_API_RESPONSE_OK))
-            {
-               /* Data was successfully sent, clear struct */
-               data->inst_power = 0;
-               data->energy_day = 0;
-               data->energy_month = 0;
+         if (rc == 0)
+         {
+            BENCH_STAGE(BENCH_WEBAPI, NULL);
+            stats_output(STATS_PROCESS_UPLOAD);
+            if (strlen(response))
+            {   
+               _debug("Received response (%d chars): %s", (int)strlen(response), response);
+               if (!strcmp(response, EMONCMS_API_RESPONSE_OK))
+               {
+                  /* Data was successfully sent, clear struct */
+                  data->inst_power = 0;
+                  data->energy_day = 0;
+                  data->energy_month = 0;
+                  data->energy_total = 0;
+                  data->energy_month_proj = 0;
+                  data->num_regs = 0;
+                  data->power_p95_day = 0;
+                  data->num_phases = 0;
+                  data->energy_export = 0;
+                  data->num_temps = 0;
+               }
+               else
+               {
+                  syslog(LOG_DAEMON | LOG_WARNING, "Unexpected response to Web API request");
+               }
             }
             else
             {
-               syslog(LOG_DAEMON | LOG_WARNING, "Unexpected response to Web API request");
+               syslog(LOG_DAEMON | LOG_WARNING, "Empty response to Web API request");
             }
          }
          else
          {
-            syslog(LOG_DAEMON | LOG_WARNING, "Empty response to Web API request");
+            syslog(LOG_DAEMON | LOG_WARNING, "Error performing Web API request: return code=%d", rc);
          }
       }
-      else
-      {
-         syslog(LOG_DAEMON | LOG_WARNING, "Error performing Web API request: return code=%d", rc);
-      }
-      
+
       /* Cleanup */
       curl_easy_cleanup(ch);
       curl_global_cleanup();
@@ -15,6 +15,12 @@
 #ifndef __WEBAPI_H__
 #define __WEBAPI_H__
 
+#include "tariff.h"
+#include "temp.h"
+
+/* Max length of the base URI and the API key */
+#define WEBAPI_STR_SIZE 256
+
 /* 
  * Struct holding the necessary data to perform the 
  * WebAPI request to EmonCMS 
@@ -24,8 +30,26 @@ typedef struct
    unsigned int inst_power;
    unsigned int energy_day;
    unsigned int energy_month;
-   const char*  api_base_uri;
-   const char*  api_key;
+   unsigned long long energy_total;
+   unsigned int energy_day_proj;
+   unsigned int energy_month_proj;
+   unsigned int num_regs;
+   unsigned int energy_day_reg[TARIFF_MAX_REGS];
+   unsigned int energy_month_reg[TARIFF_MAX_REGS];
+   double       cost_day_reg[TARIFF_MAX_REGS];
+   double       cost_month_reg[TARIFF_MAX_REGS];
+   unsigned int power_p5_day;
+   unsigned int power_p95_day;
+   unsigned int power_p5_month;
+   unsigned int power_p95_month;
+   unsigned int num_phases;
+   unsigned int power_phase[3];
+   unsigned long long energy_export;
+   unsigned int num_temps;
+   char         temp_name[TEMP_MAX_SENSORS][TEMP_NAME_SIZE];
+   double       temp[TEMP_MAX_SENSORS];
+   char         api_base_uri[WEBAPI_STR_SIZE];
+   char         api_key[WEBAPI_STR_SIZE];
    unsigned int api_update_rate;
    unsigned int node_number;
 } emon_data_t;